@@ -23,10 +23,12 @@
 
 #include "idle-connection.h"
 
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 
 #include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
 #define IDLE_DEBUG_FLAG IDLE_DEBUG_CONNECTION
@@ -36,15 +38,39 @@
 #include "idle-handles.h"
 #include "idle-im-manager.h"
 #include "idle-muc-manager.h"
+#include "idle-roomlist-channel.h"
 #include "idle-roomlist-manager.h"
 #include "idle-parser.h"
+#include "idle-presence.h"
 #include "idle-server-connection.h"
+#include "idle-statistics.h"
 #include "server-tls-manager.h"
 
 #include "extensions/extensions.h"    /* IRCCommand */
 
+/* We PING the server once it has been quiet for the keepalive interval, and give up on it if the answer takes much longer than answers
+ * usually do, though never less than KEEPALIVE_MIN_TIMEOUT, nor more than the interval. However slow it is to answer, more than
+ * MISSED_KEEPALIVES_BEFORE_DISCONNECTING intervals without an answer is too long.
+ */
 #define DEFAULT_KEEPALIVE_INTERVAL 30 /* sec */
+#define KEEPALIVE_MIN_TIMEOUT 5 /* sec */
 #define MISSED_KEEPALIVES_BEFORE_DISCONNECTING 3
+#define DEFAULT_CONTACT_INFO_TTL 300 /* sec */
+#define DEFAULT_ROOM_LIST_TTL 300 /* sec */
+#define DEFAULT_CONTACT_INFO_CACHE_SIZE 500
+
+/* We stop reading from the server while more than INGEST_HIGH_WATERMARK bytes are waiting to go out on D-Bus, or more than
+ * max-pending-messages messages are waiting to be acknowledged, and carry on once they are down to the low watermarks. */
+#define INGEST_HIGH_WATERMARK (1024 * 1024)
+#define INGEST_LOW_WATERMARK (256 * 1024)
+#define INGEST_POLL_INTERVAL 100 /* ms */
+
+/* With auto-reconnect on, how long we wait before each attempt to get back to the server after losing it, doubling every time up to the
+ * maximum, and how many attempts we make before giving up and reporting the connection as lost.
+ */
+#define RECONNECT_INITIAL_DELAY 1 /* sec */
+#define RECONNECT_MAX_DELAY 60 /* sec */
+#define RECONNECT_MAX_ATTEMPTS 10
 
 /* From RFC 2813 :
  * This in essence means that the client may send one (1) message every
@@ -54,9 +80,64 @@
 #define MSG_QUEUE_TIMEOUT 2
 static gboolean flush_queue_faster = FALSE;
 
+/* User messages waiting out a reconnect: at most this many are kept, and any older than this when we are back are dropped */
+#define MSG_QUEUE_MAX_HELD 100
+#define MSG_QUEUE_MAX_AGE 120 /* sec */
+
 #define SERVER_CMD_MIN_PRIORITY 0
 #define SERVER_CMD_NORMAL_PRIORITY G_MAXUINT/2
 #define SERVER_CMD_MAX_PRIORITY G_MAXUINT
+/* keepalives go ahead of what the user says, so the lag they measure is the server's and not our own queue's */
+#define SERVER_CMD_KEEPALIVE_PRIORITY (SERVER_CMD_NORMAL_PRIORITY + 1)
+
+#define DEFAULT_MAX_QUEUED_MESSAGES 1000
+#define DEFAULT_MAX_QUEUED_BYTES (256 * 1024)
+
+/* Where a line comes from, which decides how much of the queue it may take up. Orthogonal to its priority, which decides when it goes
+ * out. */
+typedef enum {
+	/* everything sent with idle_connection_send(): the handshake, PONGs, keepalives, replies to requests, and joins, parts and other
+	 * channel changes which must go out for our state to stay in step with the server's */
+	QUEUE_LANE_PROTOCOL,
+	/* messages, and changes such as topics where only the latest matters, sent with idle_connection_send_user_message() */
+	QUEUE_LANE_USER,
+	/* raw commands from IRC_Command1 */
+	QUEUE_LANE_BULK,
+	/* replies we make of our own accord, such as to CTCP VERSION */
+	QUEUE_LANE_AUTOMATIC,
+	/* queries nobody is waiting on */
+	QUEUE_LANE_BACKGROUND,
+	NUM_QUEUE_LANES
+} IdleQueueLane;
+
+/* How much of max-queued-messages and max-queued-bytes each lane may take up, in percent, in all and for any one target. The protocol
+ * lane is never limited. When the queue as a whole is full, automatic replies are dropped to make room for other lines. */
+static const struct {
+	guint share;
+	guint target_share;
+} queue_lane_limits[NUM_QUEUE_LANES] = {
+	[QUEUE_LANE_PROTOCOL] = {0, 0},
+	[QUEUE_LANE_USER] = {100, 100},
+	[QUEUE_LANE_BULK] = {50, 25},
+	[QUEUE_LANE_AUTOMATIC] = {10, 1},
+	[QUEUE_LANE_BACKGROUND] = {50, 50},
+};
+
+/* How much of the queue a lane, or one target's lines within a lane, take up */
+typedef struct {
+	guint messages;
+	gsize bytes;
+} IdleQueueUsage;
+
+/* IRCv3 capabilities we ask the server to enable, if it offers them. */
+static const gchar * const wanted_capabilities[] = {
+	"account-notify",
+	"away-notify",
+	"batch",
+	"draft/multiline",
+	"extended-join",
+	NULL
+};
 
 static void _free_alias_pair(gpointer data, gpointer user_data)
 {
@@ -72,15 +153,33 @@ G_DEFINE_TYPE_WITH_CODE(IdleConnection, idle_connection, TP_TYPE_BASE_CONNECTION
 		G_IMPLEMENT_INTERFACE(TP_TYPE_SVC_CONNECTION_INTERFACE_CONTACT_INFO, idle_contact_info_iface_init);
 		G_IMPLEMENT_INTERFACE(TP_TYPE_SVC_CONNECTION_INTERFACE_RENAMING, _renaming_iface_init);
 		G_IMPLEMENT_INTERFACE(TP_TYPE_SVC_CONNECTION_INTERFACE_CONTACTS, tp_contacts_mixin_iface_init);
+		G_IMPLEMENT_INTERFACE(TP_TYPE_SVC_CONNECTION_INTERFACE_SIMPLE_PRESENCE, tp_presence_mixin_simple_presence_iface_init);
 		G_IMPLEMENT_INTERFACE(IDLE_TYPE_SVC_CONNECTION_INTERFACE_IRC_COMMAND1, irc_command_iface_init);
+		G_IMPLEMENT_INTERFACE(IDLE_TYPE_SVC_CONNECTION_INTERFACE_STATISTICS1, NULL);
 );
 
 typedef struct _IdleOutputPendingMsg IdleOutputPendingMsg;
 
 struct _IdleOutputPendingMsg {
 	gchar *message;
+	/* if set, @message points into it rather than being ours */
+	GBytes *buffer;
+	gsize length;
 	guint priority;
 	guint64 id;
+	IdleQueueLane lane;
+	/* the first parameter of the command in lower case, if it has one */
+	gchar *target;
+
+	/* set for lines queued with idle_connection_send_user_message() */
+	gboolean user;
+	gint64 queued;
+	/* set for our keepalive PING, whose round trip is timed from when it is written */
+	gboolean ping;
+	gchar *dedup_key;
+	IdleConnectionMessageDroppedFunc dropped;
+	gpointer user_data;
+	GDestroyNotify destroy;
 };
 
 /* Steals @message. */
@@ -93,8 +192,19 @@ idle_output_pending_msg_new (
 	static guint64 last_id = 0;
 
 	msg->message = message;
+	msg->buffer = NULL;
+	msg->length = strlen(message);
 	msg->priority = priority;
 	msg->id = last_id++;
+	msg->lane = QUEUE_LANE_PROTOCOL;
+	msg->target = NULL;
+	msg->user = FALSE;
+	msg->queued = g_get_monotonic_time();
+	msg->ping = FALSE;
+	msg->dedup_key = NULL;
+	msg->dropped = NULL;
+	msg->user_data = NULL;
+	msg->destroy = NULL;
 
 	return msg;
 }
@@ -103,7 +213,17 @@ static void idle_output_pending_msg_free(IdleOutputPendingMsg *msg) {
 	if (!msg)
 		return;
 
-	g_free(msg->message);
+	if (msg->destroy)
+		msg->destroy(msg->user_data);
+
+	g_free(msg->dedup_key);
+	g_free(msg->target);
+
+	if (msg->buffer != NULL)
+		g_bytes_unref(msg->buffer);
+	else
+		g_free(msg->message);
+
 	g_slice_free(IdleOutputPendingMsg, msg);
 }
 
@@ -112,11 +232,11 @@ static gint pending_msg_compare(gconstpointer a, gconstpointer b, gpointer unuse
 
 	if (msg1->priority == msg2->priority) {
 		/* prefer the message with the lower id */
-		return (msg1->id - msg2->id);
+		return msg1->id < msg2->id ? -1 : msg1->id > msg2->id;
 	}
 
-	/* prefer the message with the higher priority */
-	return (msg2->priority - msg1->priority);
+	/* prefer the message with the higher priority; the difference of two priorities doesn't fit in a gint */
+	return msg1->priority > msg2->priority ? -1 : 1;
 }
 
 enum {
@@ -131,9 +251,28 @@ enum {
 	PROP_QUITMESSAGE,
 	PROP_USE_SSL,
 	PROP_PASSWORD_PROMPT,
+	PROP_CONTACT_INFO_TTL,
+	PROP_CONTACT_INFO_CACHE_SIZE,
+	PROP_AUTO_JOIN,
+	PROP_AUTO_RECONNECT,
+	PROP_FALLBACK_SERVERS,
+	PROP_CERTIFICATE_STORE,
+	PROP_MAX_PENDING_MESSAGES,
+	PROP_MAX_QUEUED_MESSAGES,
+	PROP_MAX_QUEUED_BYTES,
+	PROP_FORMATTED_MESSAGES,
+	PROP_ROOM_LIST_TTL,
 	LAST_PROPERTY_ENUM
 };
 
+/* signal enum */
+enum {
+	RECONNECTED,
+	LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = {0};
+
 struct _IdleConnectionPrivate {
 	/*
 	 * network connection
@@ -153,6 +292,21 @@ struct _IdleConnectionPrivate {
 	 */
 	gint64 ping_time;
 
+	/* whether our PING is still waiting in the queue */
+	gboolean ping_queued;
+
+	/* When we last heard anything at all from the server */
+	gint64 last_received;
+
+	/* received messages not yet acknowledged by a client */
+	guint pending_messages;
+
+	/* whether we have stopped reading from the server until our clients catch up, since when, and the GSource id checking whether
+	 * they have */
+	gboolean reading_paused;
+	gint64 reading_paused_at;
+	guint reading_poll;
+
 	/* IRC connection properties */
 	char *nickname;
 	char *server;
@@ -161,10 +315,25 @@ struct _IdleConnectionPrivate {
 	char *realname;
 	char *username;
 	char *charset;
+	/* from UTF-8 to charset, opened when first needed; (GIConv) -1 if charset is UTF-8 or unknown, and we send UTF-8 as it is */
+	GIConv hton_iconv;
+	gboolean hton_iconv_opened;
 	guint keepalive_interval;
 	char *quit_message;
 	gboolean use_ssl;
 	gboolean password_prompt;
+	guint contact_info_ttl;
+	guint contact_info_cache_size;
+	gchar **auto_join;
+	gboolean auto_reconnect;
+	/* whether received messages with formatting also get it as HTML */
+	gboolean formatted_messages;
+	guint room_list_ttl;
+	gchar **fallback_servers;
+	gchar *certificate_store;
+	guint max_pending_messages;
+	guint max_queued_messages;
+	guint max_queued_bytes;
 
 	/* the string used by the a server as a prefix to any messages we send that
 	 * it relays to other users.  We need to know this so we can keep our sent
@@ -175,6 +344,17 @@ struct _IdleConnectionPrivate {
 	/* output message queue */
 	GQueue *msg_queue;
 
+	/* what each lane, and each target within it, has in the queue, kept up to date by _queue_push() and _queue_remove() so that
+	 * checking for room doesn't mean walking the queue */
+	IdleQueueUsage lane_usage[NUM_QUEUE_LANES];
+	GHashTable *target_usage[NUM_QUEUE_LANES];
+	/* queued lines with a dedup key: key (borrowed from the line) => GList link in msg_queue */
+	GHashTable *dedup_links;
+	/* the last queued line at each priority: GUINT_TO_POINTER(priority) => GList link in msg_queue */
+	GHashTable *priority_tails;
+	/* how many of the queued lines are user messages */
+	guint user_messages;
+
 	/* has it submitted a message for sending and waiting for acknowledgement */
 	gboolean msg_sending;
 
@@ -206,6 +386,31 @@ struct _IdleConnectionPrivate {
 
 	/* TpHandle -> owned gchar * */
 	GHashTable *aliases;
+
+	/* IRCv3 capabilities the server has acknowledged; owned gchar * -> owned gchar * value, or NULL if none */
+	GHashTable *capabilities;
+
+	/* those of wanted_capabilities the server has offered so far, likewise */
+	GHashTable *offered_capabilities;
+
+	/* RPL_ISUPPORT tokens; owned gchar * -> owned gchar * value, "" if none */
+	GHashTable *isupport;
+
+	/* TRUE between sending CAP LS and sending CAP END */
+	gboolean cap_negotiating;
+
+	/* TRUE from losing the server while connected until we have registered with it again; the connection stays CONNECTED throughout */
+	gboolean reconnecting;
+	guint reconnect_attempts;
+	guint reconnect_timeout;
+
+	/* TRUE after reconnecting until the user messages held across it have been let through behind the rejoins */
+	gboolean replaying;
+	/* monotonic time we last registered again; user messages queued before it have waited out the reconnect */
+	gint64 reconnected_at;
+
+	/* IRCCommand1.Subscribe() callers; owned unique name -> owned GStrv of commands */
+	GHashTable *irc_subscriptions;
 };
 
 static void _iface_create_handle_repos(TpBaseConnection *self, TpHandleRepoIface **repos);
@@ -215,14 +420,15 @@ static void _iface_disconnected(TpBaseConnection *self);
 static void _iface_shut_down(TpBaseConnection *self);
 static gboolean _iface_start_connecting(TpBaseConnection *self, GError **error);
 
+static IdleParserHandlerResult _cap_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _error_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _erroneous_nickname_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _nick_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _nickname_in_use_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
+static IdleParserHandlerResult _isupport_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _ping_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _pong_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _unknown_command_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
-static IdleParserHandlerResult _version_privmsg_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _welcome_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _whois_user_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 
@@ -239,6 +445,10 @@ static gchar *idle_connection_ntoh(IdleConnection *obj, const gchar *input);
 static void idle_connection_add_queue_timeout (IdleConnection *self);
 static void idle_connection_clear_queue_timeout (IdleConnection *self);
 
+static gchar *_encode_line(IdleConnection *conn, const gchar *msg);
+static void _start_sending(IdleConnection *conn);
+static GList *_queue_push(IdleConnection *conn, IdleOutputPendingMsg *msg);
+static IdleOutputPendingMsg *_queue_remove(IdleConnection *conn, GList *link);
 static void _send_with_priority(IdleConnection *conn, const gchar *msg, guint priority);
 static void conn_aliasing_fill_contact_attributes (
     GObject *obj,
@@ -247,23 +457,46 @@ static void conn_aliasing_fill_contact_attributes (
 
 static void idle_connection_init(IdleConnection *obj) {
 	IdleConnectionPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (obj, IDLE_TYPE_CONNECTION, IdleConnectionPrivate);
+	guint i;
 
 	obj->priv = priv;
 	priv->sconn_connected = FALSE;
+	priv->hton_iconv = (GIConv) -1;
 	priv->msg_queue = g_queue_new();
+
+	for (i = 0; i < NUM_QUEUE_LANES; i++)
+		priv->target_usage[i] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	priv->dedup_links = g_hash_table_new(g_str_hash, g_str_equal);
+	priv->priority_tails = g_hash_table_new(NULL, NULL);
 	priv->aliases = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+	priv->capabilities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->offered_capabilities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->isupport = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->irc_subscriptions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_strfreev);
 
 	tp_contacts_mixin_init ((GObject *) obj, G_STRUCT_OFFSET (IdleConnection, contacts));
 	tp_base_connection_register_with_contacts_mixin ((TpBaseConnection *) obj);
 }
 
+static void _subscribed_line_cb (IdleParser *parser, const gchar *command,
+    const gchar *line, gpointer user_data);
+static void _subscriber_owner_changed_cb (TpDBusDaemon *dbus,
+    const gchar *name, const gchar *new_owner, gpointer user_data);
+
 static void
 idle_connection_constructed (GObject *object)
 {
   IdleConnection *self = IDLE_CONNECTION (object);
 
   self->parser = g_object_new (IDLE_TYPE_PARSER, "connection", self, NULL);
+  g_signal_connect (self->parser, "subscribed-line",
+      G_CALLBACK (_subscribed_line_cb), self);
   idle_contact_info_init (self);
+  idle_roomlist_cache_init (self);
+  idle_ctcp_init (self);
+  idle_presence_init (self);
+  idle_statistics_init (self);
   tp_contacts_mixin_add_contact_attributes_iface (object,
       TP_IFACE_CONNECTION_INTERFACE_ALIASING,
       conn_aliasing_fill_contact_attributes);
@@ -306,6 +539,12 @@ static void idle_connection_set_property(GObject *obj, guint prop_id, const GVal
 		case PROP_CHARSET:
 			g_free(priv->charset);
 			priv->charset = g_value_dup_string(value);
+
+			if (priv->hton_iconv != (GIConv) -1)
+				g_iconv_close(priv->hton_iconv);
+
+			priv->hton_iconv = (GIConv) -1;
+			priv->hton_iconv_opened = FALSE;
 			break;
 
 		case PROP_KEEPALIVE_INTERVAL:
@@ -325,6 +564,53 @@ static void idle_connection_set_property(GObject *obj, guint prop_id, const GVal
 			priv->password_prompt = g_value_get_boolean(value);
 			break;
 
+		case PROP_CONTACT_INFO_TTL:
+			priv->contact_info_ttl = g_value_get_uint(value);
+			break;
+
+		case PROP_CONTACT_INFO_CACHE_SIZE:
+			priv->contact_info_cache_size = g_value_get_uint(value);
+			break;
+
+		case PROP_AUTO_JOIN:
+			g_strfreev(priv->auto_join);
+			priv->auto_join = g_value_dup_boxed(value);
+			break;
+
+		case PROP_FALLBACK_SERVERS:
+			g_strfreev(priv->fallback_servers);
+			priv->fallback_servers = g_value_dup_boxed(value);
+			break;
+
+		case PROP_CERTIFICATE_STORE:
+			g_free(priv->certificate_store);
+			priv->certificate_store = g_value_dup_string(value);
+			break;
+
+		case PROP_MAX_PENDING_MESSAGES:
+			priv->max_pending_messages = g_value_get_uint(value);
+			break;
+
+		case PROP_MAX_QUEUED_MESSAGES:
+			priv->max_queued_messages = g_value_get_uint(value);
+			break;
+
+		case PROP_MAX_QUEUED_BYTES:
+			priv->max_queued_bytes = g_value_get_uint(value);
+			break;
+
+		case PROP_AUTO_RECONNECT:
+			priv->auto_reconnect = g_value_get_boolean(value);
+			break;
+
+		case PROP_FORMATTED_MESSAGES:
+			priv->formatted_messages = g_value_get_boolean(value);
+			break;
+
+		case PROP_ROOM_LIST_TTL:
+			priv->room_list_ttl = g_value_get_uint(value);
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
 			break;
@@ -380,6 +666,50 @@ static void idle_connection_get_property(GObject *obj, guint prop_id, GValue *va
 			g_value_set_boolean(value, priv->password_prompt);
 			break;
 
+		case PROP_CONTACT_INFO_TTL:
+			g_value_set_uint(value, priv->contact_info_ttl);
+			break;
+
+		case PROP_CONTACT_INFO_CACHE_SIZE:
+			g_value_set_uint(value, priv->contact_info_cache_size);
+			break;
+
+		case PROP_AUTO_JOIN:
+			g_value_set_boxed(value, priv->auto_join);
+			break;
+
+		case PROP_FALLBACK_SERVERS:
+			g_value_set_boxed(value, priv->fallback_servers);
+			break;
+
+		case PROP_CERTIFICATE_STORE:
+			g_value_set_string(value, priv->certificate_store);
+			break;
+
+		case PROP_MAX_PENDING_MESSAGES:
+			g_value_set_uint(value, priv->max_pending_messages);
+			break;
+
+		case PROP_MAX_QUEUED_MESSAGES:
+			g_value_set_uint(value, priv->max_queued_messages);
+			break;
+
+		case PROP_MAX_QUEUED_BYTES:
+			g_value_set_uint(value, priv->max_queued_bytes);
+			break;
+
+		case PROP_AUTO_RECONNECT:
+			g_value_set_boolean(value, priv->auto_reconnect);
+			break;
+
+		case PROP_FORMATTED_MESSAGES:
+			g_value_set_boolean(value, priv->formatted_messages);
+			break;
+
+		case PROP_ROOM_LIST_TTL:
+			g_value_set_uint(value, priv->room_list_ttl);
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
 			break;
@@ -403,6 +733,16 @@ static void idle_connection_dispose (GObject *object) {
 	if (priv->msg_queue_timeout)
 		g_source_remove(priv->msg_queue_timeout);
 
+	if (priv->reconnect_timeout) {
+		g_source_remove(priv->reconnect_timeout);
+		priv->reconnect_timeout = 0;
+	}
+
+	if (priv->reading_poll) {
+		g_source_remove(priv->reading_poll);
+		priv->reading_poll = 0;
+	}
+
 	if (priv->conn != NULL) {
 		g_object_unref(priv->conn);
 		priv->conn = NULL;
@@ -416,9 +756,24 @@ static void idle_connection_dispose (GObject *object) {
 	if (priv->queued_aliases)
 		g_ptr_array_free(priv->queued_aliases, TRUE);
 
+	if (priv->irc_subscriptions != NULL) {
+		TpDBusDaemon *dbus = tp_base_connection_get_dbus_daemon(TP_BASE_CONNECTION(self));
+		GHashTableIter iter;
+		gpointer sender;
+
+		g_hash_table_iter_init(&iter, priv->irc_subscriptions);
+		while (g_hash_table_iter_next(&iter, &sender, NULL))
+			tp_dbus_daemon_cancel_name_owner_watch(dbus, sender, _subscriber_owner_changed_cb, self);
+
+		tp_clear_pointer(&priv->irc_subscriptions, g_hash_table_unref);
+	}
+
 	g_object_unref(self->parser);
 
 	tp_clear_pointer (&priv->aliases, g_hash_table_unref);
+	tp_clear_pointer (&priv->capabilities, g_hash_table_unref);
+	tp_clear_pointer (&priv->offered_capabilities, g_hash_table_unref);
+	tp_clear_pointer (&priv->isupport, g_hash_table_unref);
 
 	if (G_OBJECT_CLASS(idle_connection_parent_class)->dispose)
 		G_OBJECT_CLASS(idle_connection_parent_class)->dispose (object);
@@ -428,8 +783,13 @@ static void idle_connection_finalize (GObject *object) {
 	IdleConnection *self = IDLE_CONNECTION (object);
 	IdleConnectionPrivate *priv = self->priv;
 	IdleOutputPendingMsg *msg;
+	guint i;
 
 	idle_contact_info_finalize(object);
+	idle_roomlist_cache_finalize(object);
+	idle_ctcp_finalize(object);
+	idle_presence_finalize(object);
+	idle_statistics_finalize(object);
 
 	g_free(priv->nickname);
 	g_free(priv->server);
@@ -437,8 +797,21 @@ static void idle_connection_finalize (GObject *object) {
 	g_free(priv->realname);
 	g_free(priv->username);
 	g_free(priv->charset);
+
+	if (priv->hton_iconv != (GIConv) -1)
+		g_iconv_close(priv->hton_iconv);
+
 	g_free(priv->relay_prefix);
 	g_free(priv->quit_message);
+	g_strfreev(priv->auto_join);
+	g_strfreev(priv->fallback_servers);
+	g_free(priv->certificate_store);
+
+	for (i = 0; i < NUM_QUEUE_LANES; i++)
+		g_hash_table_unref(priv->target_usage[i]);
+
+	g_hash_table_unref(priv->dedup_links);
+	g_hash_table_unref(priv->priority_tails);
 
 	while ((msg = g_queue_pop_head(priv->msg_queue)) != NULL)
 		idle_output_pending_msg_free(msg);
@@ -455,6 +828,8 @@ static const gchar * interfaces_always_present[] = {
 	TP_IFACE_CONNECTION_INTERFACE_RENAMING,
 	TP_IFACE_CONNECTION_INTERFACE_REQUESTS,
 	TP_IFACE_CONNECTION_INTERFACE_CONTACTS,
+	TP_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
+	IDLE_IFACE_CONNECTION_INTERFACE_STATISTICS1,
 	NULL};
 
 const gchar * const *idle_connection_get_implemented_interfaces (void) {
@@ -533,8 +908,45 @@ static void idle_connection_class_init(IdleConnectionClass *klass) {
 	param_spec = g_param_spec_boolean("password-prompt", "Password prompt", "Whether the connection should pop up a SASL channel if no password is given", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
 	g_object_class_install_property(object_class, PROP_PASSWORD_PROMPT, param_spec);
 
+	param_spec = g_param_spec_uint("contact-info-ttl", "Contact info TTL", "Seconds for which contact info is cached, or 0 to disable caching", 0, G_MAXUINT, DEFAULT_CONTACT_INFO_TTL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_CONTACT_INFO_TTL, param_spec);
+
+	param_spec = g_param_spec_uint("contact-info-cache-size", "Contact info cache size", "Maximum number of contacts whose info from WHOIS is cached, and separately of those whose info was only seen in passing", 0, G_MAXUINT, DEFAULT_CONTACT_INFO_CACHE_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_CONTACT_INFO_CACHE_SIZE, param_spec);
+
+	param_spec = g_param_spec_boxed("auto-join", "Auto-join channels", "Channels to join once connected, each optionally followed by a space and its key", G_TYPE_STRV, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+	g_object_class_install_property(object_class, PROP_AUTO_JOIN, param_spec);
+
+	param_spec = g_param_spec_boolean("auto-reconnect", "Auto-reconnect", "Whether to reconnect and rejoin channels by itself if the connection to the server is lost, rather than disconnecting", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_AUTO_RECONNECT, param_spec);
+
+	param_spec = g_param_spec_boxed("fallback-servers", "Fallback servers", "Other servers of the same network, as \"host\" or \"host:port\", tried alongside the main one if it is slow to answer", G_TYPE_STRV, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+	g_object_class_install_property(object_class, PROP_FALLBACK_SERVERS, param_spec);
+
+	param_spec = g_param_spec_string("certificate-store", "Certificate store", "File in which to remember the fingerprints of server certificates the user has accepted, so they are not asked about them again; if unset, they are only remembered until the connection manager exits", NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+	g_object_class_install_property(object_class, PROP_CERTIFICATE_STORE, param_spec);
+
+	param_spec = g_param_spec_uint("max-pending-messages", "Maximum pending messages", "Number of unacknowledged messages at which to stop reading from the server, or 0 for no limit", 0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_MAX_PENDING_MESSAGES, param_spec);
+
+	param_spec = g_param_spec_uint("max-queued-messages", "Maximum queued messages", "Number of lines waiting to be sent at which to refuse or shed more, or 0 for no limit", 0, G_MAXUINT, DEFAULT_MAX_QUEUED_MESSAGES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_MAX_QUEUED_MESSAGES, param_spec);
+
+	param_spec = g_param_spec_uint("max-queued-bytes", "Maximum queued bytes", "Size of the lines waiting to be sent at which to refuse or shed more, or 0 for no limit", 0, G_MAXUINT, DEFAULT_MAX_QUEUED_BYTES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_MAX_QUEUED_BYTES, param_spec);
+
+	param_spec = g_param_spec_boolean("formatted-messages", "Formatted messages", "Whether received messages with colours, bold and so on should have them as a text/html part, as well as the plain text", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_FORMATTED_MESSAGES, param_spec);
+
+	param_spec = g_param_spec_uint("room-list-ttl", "Room list TTL", "Seconds for which the rooms listed by the server are kept, to answer later listings with, or 0 to always ask the server", 0, G_MAXUINT, DEFAULT_ROOM_LIST_TTL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+	g_object_class_install_property(object_class, PROP_ROOM_LIST_TTL, param_spec);
+
+	signals[RECONNECTED] = g_signal_new("reconnected", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
 	tp_contacts_mixin_class_init (object_class, G_STRUCT_OFFSET (IdleConnectionClass, contacts));
 	idle_contact_info_class_init(klass);
+	idle_presence_class_init(klass);
+	idle_statistics_class_init(klass);
 
 	/* This is a hack to make the test suite run in finite time. */
 	if (!tp_str_empty (g_getenv ("IDLE_HTFU")))
@@ -635,6 +1047,14 @@ static void _iface_shut_down(TpBaseConnection *base) {
 	if (priv->quitting)
 		return;
 
+	/* we lost the server and are waiting to try it again */
+	if (priv->reconnect_timeout != 0) {
+		g_source_remove(priv->reconnect_timeout);
+		priv->reconnect_timeout = 0;
+		g_idle_add(_finish_shutdown_idle_func, self);
+		return;
+	}
+
 	/* we never got around to actually creating the connection
 	 * iface object because we were still trying to connect, so
 	 * don't try to send any traffic down it */
@@ -732,7 +1152,11 @@ static void _connection_connect_ready(GObject *source_object, GAsyncResult *res,
 
 	if (!idle_server_connection_connect_finish(sconn, res, &error)) {
 		IDLE_DEBUG("idle_server_connection_connect failed: %s", error->message);
-		_connection_disconnect_with_gerror(conn, TP_CONNECTION_STATUS_REASON_NETWORK_ERROR, "debug-message", error);
+
+		/* sconn_disconnected_cb has already scheduled the next attempt */
+		if (!priv->reconnecting)
+			_connection_disconnect_with_gerror(conn, TP_CONNECTION_STATUS_REASON_NETWORK_ERROR, "debug-message", error);
+
 		g_error_free(error);
 		return;
 	}
@@ -741,10 +1165,18 @@ static void _connection_connect_ready(GObject *source_object, GAsyncResult *res,
 
 	g_signal_connect(sconn, "received", (GCallback)(sconn_received_cb), conn);
 
+	/* our handlers are still there from the first time round */
+	if (priv->reconnecting) {
+		irc_handshakes(conn);
+		return;
+	}
+
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_CMD_ERROR, _error_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_CAP, _cap_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_ERRONEOUSNICKNAME, _erroneous_nickname_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_NICKNAMEINUSE, _nickname_in_use_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_WELCOME, _welcome_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_ISUPPORT, _isupport_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_WHOISUSER, _whois_user_handler, conn);
 
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_CMD_PING, _ping_handler, conn);
@@ -752,7 +1184,6 @@ static void _connection_connect_ready(GObject *source_object, GAsyncResult *res,
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_UNKNOWNCOMMAND, _unknown_command_handler, conn);
 
 	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_PREFIXCMD_NICK, _nick_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
-	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_PRIVMSG_USER, _version_privmsg_handler, conn);
 
 	irc_handshakes(conn);
 }
@@ -780,6 +1211,7 @@ static void _start_connecting_continue(IdleConnection *conn) {
 	sconn = g_object_new(IDLE_TYPE_SERVER_CONNECTION,
             "host", priv->server,
             "port", priv->port,
+            "fallback-servers", priv->fallback_servers,
             "tls-manager", priv->tls_manager,
             NULL);
 	if (priv->use_ssl)
@@ -788,12 +1220,116 @@ static void _start_connecting_continue(IdleConnection *conn) {
 	g_signal_connect(sconn, "disconnected", (GCallback)(sconn_disconnected_cb), conn);
 
 	priv->conn = sconn;
+	idle_statistics_set_server_connection(conn, sconn);
 	g_warn_if_fail (priv->connect_cancellable == NULL);
 	priv->connect_cancellable = g_cancellable_new ();
 	idle_server_connection_connect_async(sconn, priv->connect_cancellable, _connection_connect_ready, conn);
 }
 
 static gboolean keepalive_timeout_cb(gpointer user_data);
+static void _check_ingest_backlog(IdleConnection *conn);
+static void _resume_reading(IdleConnection *conn);
+
+static gboolean _reconnect_timeout_cb(gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleConnectionPrivate *priv = conn->priv;
+
+	priv->reconnect_timeout = 0;
+	priv->reconnect_attempts++;
+
+	IDLE_DEBUG("reconnecting to %s:%u, attempt %u", priv->server, priv->port, priv->reconnect_attempts);
+
+	g_signal_handlers_disconnect_by_func(priv->conn, sconn_disconnected_cb, conn);
+	g_signal_handlers_disconnect_by_func(priv->conn, sconn_received_cb, conn);
+	g_clear_object(&priv->conn);
+	g_clear_object(&priv->connect_cancellable);
+
+	_start_connecting_continue(conn);
+
+	return FALSE;
+}
+
+/* Low-priority lines are queries about the state of the old connection, which get asked again once we are back */
+static void _drop_low_priority_messages(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *msg;
+
+	while ((msg = g_queue_peek_tail(priv->msg_queue)) != NULL && msg->priority == SERVER_CMD_MIN_PRIORITY)
+		idle_output_pending_msg_free(_queue_remove(conn, priv->msg_queue->tail));
+}
+
+/* A PING still queued for the old connection would otherwise go out with the handshake of the new one */
+static void _drop_queued_ping(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	GList *l;
+
+	if (!priv->ping_queued)
+		return;
+
+	for (l = priv->msg_queue->head; l != NULL; l = l->next) {
+		IdleOutputPendingMsg *msg = l->data;
+
+		if (msg->ping) {
+			idle_output_pending_msg_free(_queue_remove(conn, l));
+			break;
+		}
+	}
+
+	priv->ping_queued = FALSE;
+}
+
+/* Called when we lose the server, or fail to reach it again. Returns FALSE if the connection should be reported as lost instead. */
+static gboolean _schedule_reconnect(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	guint delay;
+
+	if (!priv->auto_reconnect || priv->quitting)
+		return FALSE;
+
+	if (tp_base_connection_get_status(TP_BASE_CONNECTION(conn)) != TP_CONNECTION_STATUS_CONNECTED)
+		return FALSE;
+
+	if (priv->reconnect_attempts >= RECONNECT_MAX_ATTEMPTS) {
+		IDLE_DEBUG("giving up after %u attempts to reconnect", priv->reconnect_attempts);
+		priv->reconnecting = FALSE;
+		return FALSE;
+	}
+
+	if (!priv->reconnecting) {
+		IDLE_DEBUG("lost the server; keeping our channels while we reconnect");
+
+		priv->reconnecting = TRUE;
+		priv->reconnect_attempts = 0;
+
+		/* the queue is held until we have registered again, and anything in flight is lost with the old socket */
+		idle_connection_clear_queue_timeout(conn);
+		priv->msg_sending = FALSE;
+		_drop_low_priority_messages(conn);
+		_drop_queued_ping(conn);
+
+		if (priv->keepalive_timeout) {
+			g_source_remove(priv->keepalive_timeout);
+			priv->keepalive_timeout = 0;
+		}
+
+		priv->ping_time = 0;
+		priv->cap_negotiating = FALSE;
+		g_hash_table_remove_all(priv->capabilities);
+		g_hash_table_remove_all(priv->offered_capabilities);
+		g_hash_table_remove_all(priv->isupport);
+		idle_parser_reset(conn->parser);
+		idle_presence_disconnected(conn);
+	}
+
+	delay = MIN(RECONNECT_INITIAL_DELAY << MIN(priv->reconnect_attempts, 16), RECONNECT_MAX_DELAY);
+
+	if (flush_queue_faster)
+		priv->reconnect_timeout = g_timeout_add(delay, _reconnect_timeout_cb, conn);
+	else
+		priv->reconnect_timeout = g_timeout_add_seconds(delay, _reconnect_timeout_cb, conn);
+
+	return TRUE;
+}
 
 static void sconn_disconnected_cb(IdleServerConnection *sconn, IdleServerConnectionStateReason reason, IdleConnection *conn) {
 	IdleConnectionPrivate *priv = conn->priv;
@@ -805,6 +1341,8 @@ static void sconn_disconnected_cb(IdleServerConnection *sconn, IdleServerConnect
 		priv->force_disconnect_id = 0;
 	}
 
+	_resume_reading(conn);
+
 	switch (reason) {
 		case SERVER_CONNECTION_STATE_REASON_ERROR:
 			tp_reason = TP_CONNECTION_STATUS_REASON_NETWORK_ERROR;
@@ -823,56 +1361,206 @@ static void sconn_disconnected_cb(IdleServerConnection *sconn, IdleServerConnect
 		tp_reason = TP_CONNECTION_STATUS_REASON_REQUESTED;
 
 	priv->sconn_connected = FALSE;
+
+	if (tp_reason == TP_CONNECTION_STATUS_REASON_NETWORK_ERROR && _schedule_reconnect(conn))
+		return;
+
 	connection_disconnect_cb(conn, tp_reason);
 }
 
 static void sconn_received_cb(IdleServerConnection *sconn, gchar *raw_msg, IdleConnection *conn) {
 	gchar *converted = idle_connection_ntoh(conn, raw_msg);
+
+	conn->priv->last_received = g_get_monotonic_time();
+
+	idle_statistics_received(conn, raw_msg);
 	idle_parser_receive(conn->parser, converted);
 
 	g_free(converted);
+
+	_check_ingest_backlog(conn);
+}
+
+/* How long to give the server to answer a PING: the retransmission timeout of RFC 6298, computed from the round trips seen so far */
+static gint64 _ping_timeout(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	gint64 interval = (gint64) priv->keepalive_interval * G_USEC_PER_SEC;
+	gint64 srtt, rttvar;
+
+	if (!idle_statistics_get_smoothed_lag(conn, &srtt, &rttvar))
+		return interval;
+
+	return MIN(MAX(srtt + 4 * rttvar, KEEPALIVE_MIN_TIMEOUT * G_USEC_PER_SEC), interval);
+}
+
+static void _schedule_keepalive(IdleConnection *conn, gint64 when) {
+	IdleConnectionPrivate *priv = conn->priv;
+	gint64 delay = MAX(when - g_get_monotonic_time(), 0);
+
+	if (priv->keepalive_timeout != 0)
+		g_source_remove(priv->keepalive_timeout);
+
+	priv->keepalive_timeout = g_timeout_add((guint) MIN(delay / 1000, G_MAXUINT), keepalive_timeout_cb, conn);
+}
+
+static void _start_keepalive(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+
+	if (priv->keepalive_interval == 0)
+		return;
+
+	priv->last_received = g_get_monotonic_time();
+	_schedule_keepalive(conn, priv->last_received + (gint64) priv->keepalive_interval * G_USEC_PER_SEC);
+}
+
+static gboolean _ingest_over_high_watermark(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	DBusConnection *bus = dbus_g_connection_get_connection(tp_proxy_get_dbus_connection(tp_base_connection_get_dbus_daemon(TP_BASE_CONNECTION(conn))));
+
+	return dbus_connection_get_outgoing_size(bus) >= INGEST_HIGH_WATERMARK ||
+		(priv->max_pending_messages != 0 && priv->pending_messages >= priv->max_pending_messages);
+}
+
+static gboolean _ingest_under_low_watermark(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	DBusConnection *bus = dbus_g_connection_get_connection(tp_proxy_get_dbus_connection(tp_base_connection_get_dbus_daemon(TP_BASE_CONNECTION(conn))));
+
+	return dbus_connection_get_outgoing_size(bus) <= INGEST_LOW_WATERMARK &&
+		(priv->max_pending_messages == 0 || priv->pending_messages <= priv->max_pending_messages * 3 / 4);
+}
+
+static void _resume_reading(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+
+	if (!priv->reading_paused)
+		return;
+
+	priv->reading_paused = FALSE;
+
+	if (priv->reading_poll != 0) {
+		g_source_remove(priv->reading_poll);
+		priv->reading_poll = 0;
+	}
+
+	IDLE_DEBUG("clients caught up, reading from the server again");
+	idle_statistics_reading_resumed(conn, g_get_monotonic_time() - priv->reading_paused_at);
+
+	if (priv->conn != NULL)
+		idle_server_connection_set_reading_paused(priv->conn, FALSE);
+
+	/* the server has not been quiet, we just have not been listening */
+	if (priv->keepalive_timeout != 0)
+		_start_keepalive(conn);
+}
+
+/* D-Bus tells us nothing when its queue drains, so we look */
+static gboolean _reading_poll_cb(gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleConnectionPrivate *priv = conn->priv;
+
+	if (!_ingest_under_low_watermark(conn))
+		return TRUE;
+
+	priv->reading_poll = 0;
+	_resume_reading(conn);
+	return FALSE;
+}
+
+static void _check_ingest_backlog(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+
+	if (priv->reading_paused) {
+		if (_ingest_under_low_watermark(conn))
+			_resume_reading(conn);
+
+		return;
+	}
+
+	if (priv->conn == NULL || !priv->sconn_connected || !_ingest_over_high_watermark(conn))
+		return;
+
+	IDLE_DEBUG("clients are falling behind (%u messages unacknowledged), not reading from the server until they catch up", priv->pending_messages);
+
+	priv->reading_paused = TRUE;
+	priv->reading_paused_at = g_get_monotonic_time();
+	priv->reading_poll = g_timeout_add(INGEST_POLL_INTERVAL, _reading_poll_cb, conn);
+	idle_server_connection_set_reading_paused(priv->conn, TRUE);
+	idle_statistics_reading_paused(conn);
+}
+
+void idle_connection_pending_messages_added(IdleConnection *conn, guint count) {
+	conn->priv->pending_messages += count;
+}
+
+void idle_connection_pending_messages_removed(IdleConnection *conn, guint count) {
+	IdleConnectionPrivate *priv = conn->priv;
+
+	priv->pending_messages -= MIN(count, priv->pending_messages);
+
+	if (priv->reading_paused)
+		_check_ingest_backlog(conn);
 }
 
+/* Traffic from the server shows the link is alive, so we only PING once it has gone quiet, and then expect an answer about as fast as
+ * the server usually gives one, rather than waiting out several intervals. */
 static gboolean keepalive_timeout_cb(gpointer user_data) {
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
 	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *msg;
 	gchar cmd[IRC_MSG_MAXLEN + 1];
+	gint64 interval = (gint64) priv->keepalive_interval * G_USEC_PER_SEC;
 	gint64 now;
 
+	priv->keepalive_timeout = 0;
+
 	if (!priv->sconn_connected ||
-	    priv->quitting) {
-		priv->keepalive_timeout = 0;
+	    priv->quitting)
 		return FALSE;
-	}
 
-	now = g_get_real_time();
+	now = g_get_monotonic_time();
+
+	/* whatever the server has said is waiting for us to read it */
+	if (priv->reading_paused) {
+		_schedule_keepalive(conn, now + interval);
+		return FALSE;
+	}
 
 	if (priv->ping_time != 0) {
-		gint64 seconds_since_ping = (now - priv->ping_time) / G_USEC_PER_SEC;
-		gint64 grace_period = priv->keepalive_interval * MISSED_KEEPALIVES_BEFORE_DISCONNECTING;
+		/* anything else from the server means it is alive but slow, so give it as long again */
+		gint64 deadline = MIN(MAX(priv->ping_time, priv->last_received) + _ping_timeout(conn),
+			priv->ping_time + interval * MISSED_KEEPALIVES_BEFORE_DISCONNECTING);
 
-		if (seconds_since_ping > grace_period) {
-			IDLE_DEBUG("haven't heard from the server in %" G_GINT64_FORMAT " seconds "
-				"(more than %u keepalive intervals)",
-				seconds_since_ping, MISSED_KEEPALIVES_BEFORE_DISCONNECTING);
+		if (now >= deadline) {
+			IDLE_DEBUG("no answer to our PING after %" G_GINT64_FORMAT " ms", (now - priv->ping_time) / 1000);
 
 			idle_server_connection_force_disconnect(priv->conn);
 			return FALSE;
 		}
 
-		return TRUE;
+		_schedule_keepalive(conn, deadline);
+		return FALSE;
 	}
 
-	if (priv->msg_queue->length > 0) {
-		/* No point in sending a PING if we're sending data anyway. */
-		return TRUE;
+	if (now - priv->last_received < interval) {
+		_schedule_keepalive(conn, priv->last_received + interval);
+		return FALSE;
+	}
+
+	/* the PING we queued is stuck behind a write that has not finished */
+	if (priv->ping_queued) {
+		_schedule_keepalive(conn, now + interval);
+		return FALSE;
 	}
 
-	priv->ping_time = now;
-	g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "PING %" G_GINT64_FORMAT, priv->ping_time);
-	_send_with_priority(conn, cmd, SERVER_CMD_MIN_PRIORITY);
+	g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "PING %" G_GINT64_FORMAT, now);
+	msg = idle_output_pending_msg_new(_encode_line(conn, cmd), SERVER_CMD_KEEPALIVE_PRIORITY);
+	msg->ping = TRUE;
+	priv->ping_queued = TRUE;
+	_queue_push(conn, msg);
+	_start_sending(conn);
 
-	return TRUE;
+	_schedule_keepalive(conn, now + _ping_timeout(conn));
+	return FALSE;
 }
 
 static void _msg_queue_timeout_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
@@ -881,6 +1569,12 @@ static void _msg_queue_timeout_ready(GObject *source_object, GAsyncResult *res,
 	IdleConnectionPrivate *priv = conn->priv;
 	GError *error = NULL;
 
+	/* a write to the socket we lost: we stopped waiting for it then, and may be sending on the new one already */
+	if (sconn != priv->conn) {
+		idle_server_connection_send_finish(sconn, res, NULL);
+		return;
+	}
+
 	priv->msg_sending = FALSE;
 
 	if (!idle_server_connection_send_finish(sconn, res, &error)) {
@@ -892,17 +1586,89 @@ static void _msg_queue_timeout_ready(GObject *source_object, GAsyncResult *res,
 	priv->last_msg_sent = time(NULL);
 }
 
-static gboolean msg_queue_timeout_cb(gpointer user_data) {
-	IdleConnection *conn = IDLE_CONNECTION(user_data);
-	IdleConnectionPrivate *priv = conn->priv;
-	IdleOutputPendingMsg *output_msg;
-
-	IDLE_DEBUG("called");
+static void _drop_pending_msg(IdleConnection *conn, IdleOutputPendingMsg *msg) {
+	IDLE_DEBUG("dropping %.*s", (int) strcspn(msg->message, "\r\n"), msg->message);
 
-	if (!priv->sconn_connected) {
-		IDLE_DEBUG("connection was not connected!");
+	if (msg->dropped != NULL)
+		msg->dropped(conn, msg->user_data);
 
-		priv->msg_queue_timeout = 0;
+	idle_output_pending_msg_free(msg);
+}
+
+/* Takes the next line to send off the queue, or returns NULL if there is nothing we can send yet */
+static IdleOutputPendingMsg *_next_pending_msg(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *msg;
+	GList *l;
+
+	/* While registering again after reconnecting, only the handshake goes out; whatever was queued before waits for it */
+	if (priv->reconnecting) {
+		msg = g_queue_peek_head(priv->msg_queue);
+
+		if (msg == NULL || msg->priority <= SERVER_CMD_NORMAL_PRIORITY)
+			return NULL;
+
+		return _queue_remove(conn, priv->msg_queue->head);
+	}
+
+	/* Then the rejoins go ahead of what the user said while we were away, so it reaches the channels it was meant for */
+	if (priv->replaying) {
+		for (l = priv->msg_queue->head; l != NULL; l = l->next) {
+			msg = l->data;
+
+			if (msg->priority < SERVER_CMD_NORMAL_PRIORITY)
+				break;
+
+			if (!msg->user)
+				return _queue_remove(conn, l);
+		}
+
+		IDLE_DEBUG("rejoined; sending what was held across the reconnect");
+		priv->replaying = FALSE;
+	}
+
+	while (priv->msg_queue->head != NULL) {
+		msg = _queue_remove(conn, priv->msg_queue->head);
+
+		if (msg->user && msg->queued < priv->reconnected_at &&
+		    g_get_monotonic_time() - msg->queued > (gint64) MSG_QUEUE_MAX_AGE * G_USEC_PER_SEC) {
+			_drop_pending_msg(conn, msg);
+			continue;
+		}
+
+		return msg;
+	}
+
+	return NULL;
+}
+
+/* Drops everything the user asked us to send that has not gone out yet */
+static void _drop_user_messages(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	GList *l = priv->msg_queue->head;
+
+	while (l != NULL) {
+		GList *next = l->next;
+		IdleOutputPendingMsg *msg = l->data;
+
+		if (msg->user)
+			_drop_pending_msg(conn, _queue_remove(conn, l));
+
+		l = next;
+	}
+}
+
+static gboolean msg_queue_timeout_cb(gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *output_msg;
+
+	IDLE_DEBUG("called");
+
+	if (!priv->sconn_connected) {
+		IDLE_DEBUG("connection was not connected!");
+
+		priv->msg_queue_timeout = 0;
 
 		return FALSE;
 	}
@@ -910,15 +1676,21 @@ static gboolean msg_queue_timeout_cb(gpointer user_data) {
 	if (priv->msg_sending)
 		return TRUE;
 
-	output_msg = g_queue_pop_head(priv->msg_queue);
+	output_msg = _next_pending_msg(conn);
 
 	if (output_msg == NULL) {
 		priv->msg_queue_timeout = 0;
 		return FALSE;
 	}
 
+	if (output_msg->ping) {
+		priv->ping_queued = FALSE;
+		priv->ping_time = g_get_monotonic_time();
+	}
+
 	priv->msg_sending = TRUE;
 	idle_server_connection_send_async(priv->conn, output_msg->message, NULL, _msg_queue_timeout_ready, conn);
+	idle_statistics_sent(conn, output_msg->queued);
 	idle_output_pending_msg_free (output_msg);
 
 	return TRUE;
@@ -961,10 +1733,9 @@ idle_connection_clear_queue_timeout (IdleConnection *self)
 }
 
 /**
- * Queue a IRC command for sending, clipping it to IRC_MSG_MAXLEN bytes and appending the required <CR><LF> to it
+ * Clip an IRC command to IRC_MSG_MAXLEN bytes, append the required <CR><LF> to it and convert it to the connection's charset
  */
-static void _send_with_priority(IdleConnection *conn, const gchar *msg, guint priority) {
-	IdleConnectionPrivate *priv = conn->priv;
+static gchar *_encode_line(IdleConnection *conn, const gchar *msg) {
 	gchar cmd[IRC_MSG_MAXLEN + 3];
 	int len;
 	gchar *converted;
@@ -991,16 +1762,349 @@ static void _send_with_priority(IdleConnection *conn, const gchar *msg, guint pr
 		converted = g_strdup(cmd);
 	}
 
-	g_queue_insert_sorted(priv->msg_queue,
-		idle_output_pending_msg_new(converted, priority),
-		pending_msg_compare, NULL);
+	return converted;
+}
+
+/* Called with a line newly added to the queue */
+static void _start_sending(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	guint queue_length = g_queue_get_length(priv->msg_queue);
+
 	idle_connection_add_queue_timeout (conn);
+
+	/* if nothing could go out straight away, flood control is holding the line back */
+	idle_statistics_queued(conn, queue_length,
+		priv->sconn_connected && !priv->reconnecting && g_queue_get_length(priv->msg_queue) == queue_length);
+}
+
+static gchar *_line_target(const gchar *line) {
+	const gchar *target;
+
+	/* "BATCH +<reference> <type> <target>": look past the reference and type */
+	if (g_str_has_prefix(line, "BATCH ")) {
+		line = strchr(line + strlen("BATCH "), ' ');
+
+		if (line == NULL || (line = strchr(line + 1, ' ')) == NULL)
+			return NULL;
+	}
+
+	target = strchr(line, ' ');
+
+	if (target == NULL || target[1] == ':' || target[1] == '\0')
+		return NULL;
+
+	target++;
+	return g_ascii_strdown(target, strcspn(target, " \r\n"));
+}
+
+static guint _lane_limit(guint limit, guint share) {
+	return limit == 0 ? G_MAXUINT : MAX((guint) ((guint64) limit * share / 100), 1);
+}
+
+static void _queue_usage_add(IdleQueueUsage *usage, IdleOutputPendingMsg *msg, gint sign) {
+	usage->messages += sign;
+	usage->bytes += sign * (gssize) msg->length;
+}
+
+/* As g_queue_insert_sorted(). A new line sorts after everything queued at its priority or above, and there are only ever a few
+ * priorities in the queue, so finding its place doesn't mean walking the lines queued at lower priorities. Returns the link @msg ended up
+ * in. */
+static GList *_queue_push(IdleConnection *conn, IdleOutputPendingMsg *msg) {
+	IdleConnectionPrivate *priv = conn->priv;
+	GQueue *queue = priv->msg_queue;
+	GHashTableIter iter;
+	gpointer key, value;
+	GList *l = NULL;
+
+	g_hash_table_iter_init(&iter, priv->priority_tails);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (GPOINTER_TO_UINT(key) >= msg->priority &&
+		    (l == NULL || GPOINTER_TO_UINT(key) < ((IdleOutputPendingMsg *) l->data)->priority))
+			l = value;
+	}
+
+	/* only a line put back after being taken off the queue can belong before others at its priority */
+	while (l != NULL && pending_msg_compare(l->data, msg, NULL) > 0)
+		l = l->prev;
+
+	if (l == NULL) {
+		g_queue_push_head(queue, msg);
+		l = queue->head;
+	} else {
+		g_queue_insert_after(queue, l, msg);
+		l = l->next;
+	}
+
+	if (l->next == NULL || ((IdleOutputPendingMsg *) l->next->data)->priority != msg->priority)
+		g_hash_table_insert(priv->priority_tails, GUINT_TO_POINTER(msg->priority), l);
+
+	_queue_usage_add(&priv->lane_usage[msg->lane], msg, 1);
+
+	if (msg->target != NULL) {
+		IdleQueueUsage *usage = g_hash_table_lookup(priv->target_usage[msg->lane], msg->target);
+
+		if (usage == NULL) {
+			usage = g_new0(IdleQueueUsage, 1);
+			g_hash_table_insert(priv->target_usage[msg->lane], g_strdup(msg->target), usage);
+		}
+
+		_queue_usage_add(usage, msg, 1);
+	}
+
+	if (msg->dedup_key != NULL)
+		g_hash_table_insert(priv->dedup_links, msg->dedup_key, l);
+
+	if (msg->user)
+		priv->user_messages++;
+
+	return l;
+}
+
+/* Takes the line in @link off the queue, and returns it */
+static IdleOutputPendingMsg *_queue_remove(IdleConnection *conn, GList *link) {
+	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *msg = link->data;
+
+	if (g_hash_table_lookup(priv->priority_tails, GUINT_TO_POINTER(msg->priority)) == link) {
+		if (link->prev != NULL && ((IdleOutputPendingMsg *) link->prev->data)->priority == msg->priority)
+			g_hash_table_insert(priv->priority_tails, GUINT_TO_POINTER(msg->priority), link->prev);
+		else
+			g_hash_table_remove(priv->priority_tails, GUINT_TO_POINTER(msg->priority));
+	}
+
+	g_queue_delete_link(priv->msg_queue, link);
+
+	_queue_usage_add(&priv->lane_usage[msg->lane], msg, -1);
+
+	if (msg->target != NULL) {
+		IdleQueueUsage *usage = g_hash_table_lookup(priv->target_usage[msg->lane], msg->target);
+
+		_queue_usage_add(usage, msg, -1);
+
+		if (usage->messages == 0)
+			g_hash_table_remove(priv->target_usage[msg->lane], msg->target);
+	}
+
+	if (msg->dedup_key != NULL && g_hash_table_lookup(priv->dedup_links, msg->dedup_key) == link)
+		g_hash_table_remove(priv->dedup_links, msg->dedup_key);
+
+	if (msg->user)
+		priv->user_messages--;
+
+	return msg;
+}
+
+/* Whether the queue has room for @msg, dropping automatic replies to make some if need be */
+static gboolean _queue_has_room(IdleConnection *conn, IdleOutputPendingMsg *msg) {
+	IdleConnectionPrivate *priv = conn->priv;
+	const IdleQueueUsage *lane = &priv->lane_usage[msg->lane];
+	const IdleQueueUsage *target = NULL;
+	IdleQueueUsage total = {0, 0};
+	IdleQueueUsage none = {0, 0};
+	GList *shed = NULL;
+	GList *l;
+	guint i;
+
+	if (msg->lane == QUEUE_LANE_PROTOCOL)
+		return TRUE;
+
+	if (msg->target != NULL)
+		target = g_hash_table_lookup(priv->target_usage[msg->lane], msg->target);
+
+	if (target == NULL)
+		target = &none;
+
+	for (i = 0; i < NUM_QUEUE_LANES; i++) {
+		if (i == QUEUE_LANE_PROTOCOL)
+			continue;
+
+		total.messages += priv->lane_usage[i].messages;
+		total.bytes += priv->lane_usage[i].bytes;
+	}
+
+	if (lane->messages + 1 > _lane_limit(priv->max_queued_messages, queue_lane_limits[msg->lane].share) ||
+	    lane->bytes + msg->length > _lane_limit(priv->max_queued_bytes, queue_lane_limits[msg->lane].share) ||
+	    target->messages + 1 > _lane_limit(priv->max_queued_messages, queue_lane_limits[msg->lane].target_share) ||
+	    target->bytes + msg->length > _lane_limit(priv->max_queued_bytes, queue_lane_limits[msg->lane].target_share))
+		return FALSE;
+
+	/* shed the oldest automatic replies first */
+	for (l = priv->msg_queue->head; l != NULL &&
+	     (total.messages + 1 > _lane_limit(priv->max_queued_messages, 100) || total.bytes + msg->length > _lane_limit(priv->max_queued_bytes, 100)); l = l->next) {
+		IdleOutputPendingMsg *queued = l->data;
+
+		if (msg->lane == QUEUE_LANE_AUTOMATIC)
+			break;
+
+		if (queued->lane != QUEUE_LANE_AUTOMATIC)
+			continue;
+
+		shed = g_list_prepend(shed, l);
+		_queue_usage_add(&total, queued, -1);
+	}
+
+	if (total.messages + 1 > _lane_limit(priv->max_queued_messages, 100) || total.bytes + msg->length > _lane_limit(priv->max_queued_bytes, 100)) {
+		g_list_free(shed);
+		return FALSE;
+	}
+
+	for (l = shed; l != NULL; l = l->next) {
+		_drop_pending_msg(conn, _queue_remove(conn, l->data));
+		idle_statistics_dropped(conn);
+	}
+
+	g_list_free(shed);
+	return TRUE;
+}
+
+/* Queues @msg, which was encoded from @line, unless its lane is full, in which case it is dropped and FALSE returned */
+static gboolean _queue_line(IdleConnection *conn, IdleOutputPendingMsg *msg, const gchar *line, IdleQueueLane lane) {
+	msg->lane = lane;
+	msg->target = _line_target(line);
+
+	if (!_queue_has_room(conn, msg)) {
+		IDLE_DEBUG("the queue is full");
+		_drop_pending_msg(conn, msg);
+		idle_statistics_dropped(conn);
+		return FALSE;
+	}
+
+	_queue_push(conn, msg);
+	return TRUE;
+}
+
+/**
+ * Queue a IRC command for sending
+ */
+static void _send_with_priority(IdleConnection *conn, const gchar *msg, guint priority) {
+	_queue_push(conn, idle_output_pending_msg_new(_encode_line(conn, msg), priority));
+	_start_sending(conn);
 }
 
 void idle_connection_send(IdleConnection *conn, const gchar *msg) {
 	_send_with_priority(conn, msg, SERVER_CMD_NORMAL_PRIORITY);
 }
 
+/* For replies we make of our own accord, which go out after everything else and are the first to go if the queue fills up. Returns FALSE
+ * if the line was not queued, either for want of room or because one with the same @dedup_key is still waiting. */
+gboolean idle_connection_send_automatic(IdleConnection *conn, const gchar *msg, const gchar *dedup_key) {
+	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *output_msg;
+
+	if (dedup_key != NULL && g_hash_table_lookup(priv->dedup_links, dedup_key) != NULL)
+		return FALSE;
+
+	output_msg = idle_output_pending_msg_new(_encode_line(conn, msg), SERVER_CMD_MIN_PRIORITY);
+	output_msg->dedup_key = g_strdup(dedup_key);
+
+	if (!_queue_line(conn, output_msg, msg, QUEUE_LANE_AUTOMATIC))
+		return FALSE;
+
+	_start_sending(conn);
+	return TRUE;
+}
+
+/* Keeps at most MSG_QUEUE_MAX_HELD user messages while we are away from the server, dropping the oldest */
+static void _limit_held_messages(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	GList *oldest = NULL;
+	GList *l;
+
+	if (priv->user_messages <= MSG_QUEUE_MAX_HELD)
+		return;
+
+	for (l = priv->msg_queue->head; l != NULL; l = l->next) {
+		IdleOutputPendingMsg *msg = l->data;
+
+		if (msg->user && (oldest == NULL || msg->id < ((IdleOutputPendingMsg *) oldest->data)->id))
+			oldest = l;
+	}
+
+	_drop_pending_msg(conn, _queue_remove(conn, oldest));
+}
+
+static void _send_user_msg(IdleConnection *conn, IdleOutputPendingMsg *output_msg, const gchar *dedup_key, IdleConnectionMessageDroppedFunc dropped, gpointer user_data, GDestroyNotify destroy) {
+	IdleConnectionPrivate *priv = conn->priv;
+	IdleOutputPendingMsg *superseded = NULL;
+	GList *link = NULL;
+
+	output_msg->user = TRUE;
+	output_msg->dedup_key = g_strdup(dedup_key);
+	output_msg->dropped = dropped;
+	output_msg->user_data = user_data;
+	output_msg->destroy = destroy;
+
+	if (dedup_key != NULL)
+		link = g_hash_table_lookup(priv->dedup_links, dedup_key);
+
+	if (link != NULL)
+		superseded = _queue_remove(conn, link);
+
+	/* if the new change doesn't fit either, the one it would have superseded goes out after all */
+	if (!_queue_line(conn, output_msg, output_msg->message, QUEUE_LANE_USER)) {
+		if (superseded != NULL)
+			_queue_push(conn, superseded);
+
+		return;
+	}
+
+	if (superseded != NULL) {
+		IDLE_DEBUG("%s supersedes a change still queued", dedup_key);
+		idle_output_pending_msg_free(superseded);
+	}
+
+	if (priv->reconnecting)
+		_limit_held_messages(conn);
+
+	_start_sending(conn);
+}
+
+/* For things the user asked to send, such as messages and channel changes. These are kept across a reconnect and sent once we are back
+ * in our channels, unless they wait too long or too many pile up; @dropped is called for any line that never goes out. A line queued
+ * with the same @dedup_key as one still waiting replaces it.
+ */
+void idle_connection_send_user_message(IdleConnection *conn, const gchar *msg, const gchar *dedup_key, IdleConnectionMessageDroppedFunc dropped, gpointer user_data, GDestroyNotify destroy) {
+	_send_user_msg(conn, idle_output_pending_msg_new(_encode_line(conn, msg), SERVER_CMD_NORMAL_PRIORITY), dedup_key, dropped, user_data, destroy);
+}
+
+/* As idle_connection_send_user_message(), for a line which is already encoded for the server, CR/LF and all: the NUL-terminated one at
+ * @offset in @buffer. The line is sent from @buffer, rather than copied out of it. */
+void idle_connection_send_user_line(IdleConnection *conn, GBytes *buffer, gsize offset, IdleConnectionMessageDroppedFunc dropped, gpointer user_data, GDestroyNotify destroy) {
+	IdleOutputPendingMsg *output_msg = idle_output_pending_msg_new((gchar *) g_bytes_get_data(buffer, NULL) + offset, SERVER_CMD_NORMAL_PRIORITY);
+
+	output_msg->buffer = g_bytes_ref(buffer);
+	_send_user_msg(conn, output_msg, NULL, dropped, user_data, destroy);
+}
+
+/* For bulk queries nobody is waiting on: these only go out once everything else in the queue has been sent, and are not sent at all if
+ * too many are waiting already, in which case FALSE is returned. */
+gboolean idle_connection_send_low_priority(IdleConnection *conn, const gchar *msg) {
+	if (!_queue_line(conn, idle_output_pending_msg_new(_encode_line(conn, msg), SERVER_CMD_MIN_PRIORITY), msg, QUEUE_LANE_BACKGROUND))
+		return FALSE;
+
+	_start_sending(conn);
+	return TRUE;
+}
+
+guint idle_connection_get_queue_length(IdleConnection *conn) {
+	return g_queue_get_length(conn->priv->msg_queue);
+}
+
+gboolean idle_connection_has_capability(IdleConnection *conn, const gchar *capability) {
+	return g_hash_table_lookup_extended(conn->priv->capabilities, capability, NULL, NULL);
+}
+
+/* Returns the value the server gave along with @capability when offering it, or NULL if there was none or it is not enabled. */
+const gchar *idle_connection_get_capability_value(IdleConnection *conn, const gchar *capability) {
+	return g_hash_table_lookup(conn->priv->capabilities, capability);
+}
+
+/* Returns the value of the RPL_ISUPPORT token @key, "" if the server advertised it without a value, or NULL if it did not advertise it. */
+const gchar *idle_connection_get_isupport(IdleConnection *conn, const gchar *key) {
+	return g_hash_table_lookup(conn->priv->isupport, key);
+}
+
 gsize
 idle_connection_get_max_message_length(IdleConnection *conn)
 {
@@ -1021,6 +2125,111 @@ idle_connection_get_max_message_length(IdleConnection *conn)
 	return IRC_MSG_MAXLEN - 100;
 }
 
+gboolean idle_connection_get_formatted_messages(IdleConnection *conn) {
+	return conn->priv->formatted_messages;
+}
+
+static void _end_cap_negotiation(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+
+	if (!priv->cap_negotiating)
+		return;
+
+	priv->cap_negotiating = FALSE;
+	_send_with_priority(conn, "CAP END", SERVER_CMD_NORMAL_PRIORITY + 1);
+}
+
+static void _request_capabilities(IdleConnection *conn) {
+	IdleConnectionPrivate *priv = conn->priv;
+	GString *req = g_string_new("CAP REQ :");
+	gsize empty_len = req->len;
+	guint i;
+
+	for (i = 0; wanted_capabilities[i] != NULL; i++) {
+		const gchar *cap = wanted_capabilities[i];
+
+		if (!g_hash_table_lookup_extended(priv->offered_capabilities, cap, NULL, NULL))
+			continue;
+
+		/* multiline messages are sent as batches */
+		if (!tp_strdiff(cap, "draft/multiline") && !g_hash_table_lookup_extended(priv->offered_capabilities, "batch", NULL, NULL))
+			continue;
+
+		if (req->len > empty_len)
+			g_string_append_c(req, ' ');
+
+		g_string_append(req, cap);
+	}
+
+	if (req->len > empty_len)
+		_send_with_priority(conn, req->str, SERVER_CMD_NORMAL_PRIORITY + 1);
+	else
+		_end_cap_negotiation(conn);
+
+	g_string_free(req, TRUE);
+}
+
+static IdleParserHandlerResult _cap_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleConnectionPrivate *priv = conn->priv;
+	const gchar *subcommand = g_value_get_string(g_value_array_get_nth(args, 0));
+	gboolean more = FALSE;
+	guint first = 1;
+	guint i;
+
+	/* CAP LS 302 may go on over several lines, all but the last with a "*" before the list */
+	if (args->n_values > 2 && !tp_strdiff(g_value_get_string(g_value_array_get_nth(args, 1)), "*")) {
+		more = TRUE;
+		first = 2;
+	}
+
+	for (i = first; i < args->n_values; i++) {
+		const gchar *cap = g_value_get_string(g_value_array_get_nth(args, i));
+		gchar *name, *eq;
+
+		if (i == first && cap[0] == ':')
+			cap++;
+
+		if (cap[0] == '\0')
+			continue;
+
+		if (!g_ascii_strcasecmp(subcommand, "LS")) {
+			/* CAP LS 302 may append "=<value>" to each capability */
+			name = g_strdup(cap);
+			eq = strchr(name, '=');
+
+			if (eq != NULL)
+				*eq++ = '\0';
+
+			if (tp_strv_contains((const gchar * const *) wanted_capabilities, name))
+				g_hash_table_insert(priv->offered_capabilities, name, g_strdup(eq));
+			else
+				g_free(name);
+		} else if (!g_ascii_strcasecmp(subcommand, "ACK")) {
+			if (cap[0] == '-') {
+				g_hash_table_remove(priv->capabilities, cap + 1);
+			} else {
+				IDLE_DEBUG("capability %s enabled", cap);
+				g_hash_table_insert(priv->capabilities, g_strdup(cap), g_strdup(g_hash_table_lookup(priv->offered_capabilities, cap)));
+			}
+		} else if (!g_ascii_strcasecmp(subcommand, "NAK")) {
+			IDLE_DEBUG("server refused capability %s", cap);
+		} else if (!g_ascii_strcasecmp(subcommand, "DEL")) {
+			IDLE_DEBUG("capability %s withdrawn", cap);
+			g_hash_table_remove(priv->capabilities, cap);
+		}
+	}
+
+	if (!g_ascii_strcasecmp(subcommand, "LS")) {
+		if (!more)
+			_request_capabilities(conn);
+	} else if (!g_ascii_strcasecmp(subcommand, "ACK") || !g_ascii_strcasecmp(subcommand, "NAK")) {
+		_end_cap_negotiation(conn);
+	}
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
 static IdleParserHandlerResult _error_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
 	TpConnectionStatus status = tp_base_connection_get_status (TP_BASE_CONNECTION (conn));
@@ -1038,6 +2247,12 @@ static IdleParserHandlerResult _error_handler(IdleParser *parser, IdleParserMess
 			break;
 
 		case TP_CONNECTION_STATUS_CONNECTED:
+			/* the server is about to close the link; let that trigger a reconnect */
+			if (conn->priv->auto_reconnect) {
+				IDLE_DEBUG("server closing the link: %s", g_value_get_string(g_value_array_get_nth(args, 0)));
+				return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+			}
+
 			reason = TP_CONNECTION_STATUS_REASON_NETWORK_ERROR;
 			error = TP_ERROR_NETWORK_ERROR;
 			break;
@@ -1096,9 +2311,53 @@ static IdleParserHandlerResult _nick_handler(IdleParser *parser, IdleParserMessa
 
 static IdleParserHandlerResult _nickname_in_use_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleConnectionPrivate *priv = conn->priv;
 
-	if (tp_base_connection_get_status (TP_BASE_CONNECTION (conn)) == TP_CONNECTION_STATUS_CONNECTING)
+	if (tp_base_connection_get_status (TP_BASE_CONNECTION (conn)) == TP_CONNECTION_STATUS_CONNECTING) {
 		connection_connect_cb(conn, FALSE, TP_CONNECTION_STATUS_REASON_NAME_IN_USE);
+	} else if (priv->reconnecting && priv->sconn_connected) {
+		/* Most likely our old connection, which the server hasn't noticed is dead yet. Rather than coming back under another nick, which
+		 * every channel would see as somebody else, try again once it has timed out. */
+		IDLE_DEBUG("our nick is still in use; trying again later");
+		idle_server_connection_force_disconnect(priv->conn);
+	}
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+static IdleParserHandlerResult _isupport_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleConnectionPrivate *priv = conn->priv;
+	guint i;
+
+	for (i = 0; i < args->n_values; i++) {
+		const gchar *token = g_value_get_string(g_value_array_get_nth(args, i));
+		const gchar *eq = strchr(token, '=');
+		gchar *key = (eq != NULL) ? g_strndup(token, eq - token) : g_strdup(token);
+		const gchar *p;
+		gboolean valid = (key[0] != '\0');
+
+		/* Tokens are upper-case; this also skips the words of the trailing "are supported by this server" */
+		for (p = (key[0] == '-') ? key + 1 : key; *p != '\0'; p++) {
+			if (!g_ascii_isupper(*p) && !g_ascii_isdigit(*p)) {
+				valid = FALSE;
+				break;
+			}
+		}
+
+		if (!valid) {
+			g_free(key);
+			continue;
+		}
+
+		if (key[0] == '-') {
+			g_hash_table_remove(priv->isupport, key + 1);
+			g_free(key);
+		} else {
+			IDLE_DEBUG("server supports %s", token);
+			g_hash_table_insert(priv->isupport, key, g_strdup((eq != NULL) ? eq + 1 : ""));
+		}
+	}
 
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
@@ -1117,9 +2376,9 @@ static IdleParserHandlerResult _pong_handler(IdleParser *parser, IdleParserMessa
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
 	IdleConnectionPrivate *priv = conn->priv;
 
-	/* We could compare ping_time to g_get_real_time() and give some indication
-	 * of lag, if we were feeling enthusiastic.
-	 */
+	if (priv->ping_time != 0)
+		idle_statistics_lag(conn, g_get_monotonic_time() - priv->ping_time);
+
 	priv->ping_time = 0;
 
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
@@ -1132,8 +2391,12 @@ static IdleParserHandlerResult _unknown_command_handler(IdleParser *parser, Idle
 
 	if (!tp_strdiff(command, "PING")) {
 		IDLE_DEBUG("PING not supported, disabling keepalive.");
-		g_source_remove(priv->keepalive_timeout);
-		priv->keepalive_timeout = 0;
+
+		if (priv->keepalive_timeout != 0) {
+			g_source_remove(priv->keepalive_timeout);
+			priv->keepalive_timeout = 0;
+		}
+
 		priv->ping_time = 0;
 
 		return IDLE_PARSER_HANDLER_RESULT_HANDLED;
@@ -1142,27 +2405,6 @@ static IdleParserHandlerResult _unknown_command_handler(IdleParser *parser, Idle
 	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 }
 
-static IdleParserHandlerResult _version_privmsg_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
-	IdleConnection *conn = IDLE_CONNECTION(user_data);
-	const gchar *msg = g_value_get_string(g_value_array_get_nth(args, 2));
-	TpHandle handle;
-	const gchar *nick;
-	gchar *reply;
-
-	if (g_ascii_strcasecmp(msg, "\001VERSION\001"))
-		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
-
-	handle = g_value_get_uint(g_value_array_get_nth(args, 0));
-	nick = tp_handle_inspect(tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT), handle);
-	reply = g_strdup_printf("VERSION telepathy-idle %s Telepathy IM/VoIP Framework http://telepathy.freedesktop.org", VERSION);
-
-	idle_ctcp_notice(nick, reply, conn);
-
-	g_free(reply);
-
-	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
-}
-
 static IdleParserHandlerResult _welcome_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
 	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
@@ -1208,16 +2450,22 @@ static void irc_handshakes(IdleConnection *conn) {
 
 	priv = conn->priv;
 
+	/* Servers which don't know about capability negotiation just ignore this;
+	 * those which do hold off registration until we send CAP END. */
+	priv->cap_negotiating = TRUE;
+	_send_with_priority(conn, "CAP LS 302", SERVER_CMD_NORMAL_PRIORITY + 1);
+
 	if ((priv->password != NULL) && (priv->password[0] != '\0')) {
 		g_snprintf(msg, IRC_MSG_MAXLEN + 1, "PASS %s", priv->password);
 		_send_with_priority(conn, msg, SERVER_CMD_NORMAL_PRIORITY + 1);
 	}
 
+	/* Ahead of anything still queued from before a reconnect, which has to wait until we're registered */
 	g_snprintf(msg, IRC_MSG_MAXLEN + 1, "NICK %s", priv->nickname);
-	idle_connection_send(conn, msg);
+	_send_with_priority(conn, msg, SERVER_CMD_NORMAL_PRIORITY + 1);
 
 	g_snprintf(msg, IRC_MSG_MAXLEN + 1, "USER %s %u * :%s", priv->username, 8, priv->realname);
-	idle_connection_send(conn, msg);
+	_send_with_priority(conn, msg, SERVER_CMD_NORMAL_PRIORITY + 1);
 
 	/* gather some information about ourselves */
 	g_snprintf(msg, IRC_MSG_MAXLEN + 1, "WHOIS %s", priv->nickname);
@@ -1238,11 +2486,28 @@ static void connection_connect_cb(IdleConnection *conn, gboolean success, TpConn
 	TpBaseConnection *base = TP_BASE_CONNECTION(conn);
 	IdleConnectionPrivate *priv = conn->priv;
 
-	if (success) {
+	if (success)
+		idle_statistics_connected(conn, priv->reconnecting);
+
+	if (success && priv->reconnecting) {
+		IDLE_DEBUG("reconnected after %u attempts", priv->reconnect_attempts);
+
+		priv->reconnecting = FALSE;
+		priv->reconnect_attempts = 0;
+		priv->replaying = TRUE;
+		priv->reconnected_at = g_get_monotonic_time();
+
+		_start_keepalive(conn);
+
+		idle_presence_reconnected(conn);
+		g_signal_emit(conn, signals[RECONNECTED], 0);
+
+		if (g_queue_get_length(priv->msg_queue) > 0)
+			idle_connection_add_queue_timeout (conn);
+	} else if (success) {
 		tp_base_connection_change_status(base, TP_CONNECTION_STATUS_CONNECTED, TP_CONNECTION_STATUS_REASON_REQUESTED);
 
-		if (priv->keepalive_interval != 0 && priv->keepalive_timeout == 0)
-			priv->keepalive_timeout = g_timeout_add_seconds(priv->keepalive_interval, keepalive_timeout_cb, conn);
+		_start_keepalive(conn);
 
 		if (g_queue_get_length(priv->msg_queue) > 0) {
 			IDLE_DEBUG("we had messages in queue, start unloading them now");
@@ -1256,12 +2521,17 @@ static void connection_connect_cb(IdleConnection *conn, gboolean success, TpConn
 static void connection_disconnect_cb(IdleConnection *conn, TpConnectionStatusReason reason) {
 	TpBaseConnection *base = TP_BASE_CONNECTION(conn);
 
+	/* let the channels report what never went out before they are closed */
+	_drop_user_messages(conn);
+
 	if (tp_base_connection_get_status (base) == TP_CONNECTION_STATUS_DISCONNECTED)
 		g_idle_add(_finish_shutdown_idle_func, base);
 	else
 		tp_base_connection_change_status(base, TP_CONNECTION_STATUS_DISCONNECTED, reason);
 
 	idle_connection_clear_queue_timeout (conn);
+	idle_presence_disconnected (conn);
+	idle_statistics_disconnected (conn);
 }
 
 static void
@@ -1461,28 +2731,184 @@ static void idle_connection_set_aliases(TpSvcConnectionInterfaceAliasing *iface,
 		tp_svc_connection_interface_aliasing_return_from_set_aliases(context);
 }
 
+/* A NULL @conn, as the unit tests use, sends UTF-8 as it is */
+static GIConv _hton_iconv(IdleConnection *conn) {
+	IdleConnectionPrivate *priv;
+
+	if (conn == NULL)
+		return (GIConv) -1;
+
+	priv = conn->priv;
+
+	if (!priv->hton_iconv_opened) {
+		priv->hton_iconv_opened = TRUE;
+
+		if (priv->charset != NULL && g_ascii_strcasecmp(priv->charset, "UTF-8") && g_ascii_strcasecmp(priv->charset, "UTF8")) {
+			priv->hton_iconv = g_iconv_open(priv->charset, "UTF-8");
+
+			if (priv->hton_iconv == (GIConv) -1)
+				IDLE_DEBUG("can't convert to %s, sending UTF-8", priv->charset);
+		}
+	}
+
+	return priv->hton_iconv;
+}
+
+/* Appends the first @len bytes of @utf8 to @out in the connection's charset. Leaves @out as it was and returns FALSE if they can't be
+ * converted. */
+gboolean idle_connection_hton_append(IdleConnection *conn, const gchar *utf8, gsize len, GString *out) {
+	GIConv cd = _hton_iconv(conn);
+	gsize start = out->len;
+	gsize used = out->len;
+	gchar *inbuf = (gchar *) utf8;
+	gsize inleft = len;
+	gchar *outbuf;
+	gsize outleft;
+
+	if (cd == (GIConv) -1) {
+		g_string_append_len(out, utf8, len);
+		return TRUE;
+	}
+
+	/* back to the initial shift state, in case the last conversion failed half way */
+	g_iconv(cd, NULL, NULL, NULL, NULL);
+
+	/* the input, then the closing shift sequence; either may need more room than we guessed */
+	for (;;) {
+		gsize ret;
+
+		g_string_set_size(out, used + inleft + 16);
+		outbuf = out->str + used;
+		outleft = out->len - used;
+
+		if (inbuf != NULL)
+			ret = g_iconv(cd, &inbuf, &inleft, &outbuf, &outleft);
+		else
+			ret = g_iconv(cd, NULL, NULL, &outbuf, &outleft);
+
+		used = outbuf - out->str;
+
+		if (ret == (gsize) -1) {
+			if (errno == E2BIG)
+				continue;
+
+			IDLE_DEBUG("g_iconv failed: %s", g_strerror(errno));
+			g_string_truncate(out, start);
+			return FALSE;
+		}
+
+		if (inbuf == NULL)
+			break;
+
+		inbuf = NULL;
+	}
+
+	g_string_truncate(out, used);
+	return TRUE;
+}
+
+/* The number of bytes at the start of @utf8 which make up whole characters and fit in @max_bytes */
+static gsize _utf8_clip(const gchar *utf8, gsize len, gsize max_bytes) {
+	const gchar *p;
+
+	if (len <= max_bytes)
+		return len;
+
+	p = utf8 + max_bytes;
+	while (p > utf8 && (*p & 0xc0) == 0x80)
+		p--;
+
+	return p - utf8;
+}
+
+static gboolean _hton_convert_max(GIConv cd, const gchar *utf8, gsize len, gsize max_bytes, GString *out, gsize *consumed) {
+	gsize start = out->len;
+	gsize reserve = 0;
+
+	for (;;) {
+		gchar *inbuf = (gchar *) utf8;
+		gsize inleft = len;
+		gchar *outbuf;
+		gsize outleft, converted, total;
+
+		g_iconv(cd, NULL, NULL, NULL, NULL);
+
+		/* with room to spare for the closing shift sequence */
+		g_string_set_size(out, start + max_bytes + 16);
+		outbuf = out->str + start;
+		outleft = max_bytes - reserve;
+
+		/* running out of room, or into a character cut in half at the end, just means we stop there */
+		if (g_iconv(cd, &inbuf, &inleft, &outbuf, &outleft) == (gsize) -1 && errno != E2BIG && errno != EINVAL)
+			return FALSE;
+
+		converted = outbuf - (out->str + start);
+		outleft = out->len - (outbuf - out->str);
+
+		if (g_iconv(cd, NULL, NULL, &outbuf, &outleft) == (gsize) -1)
+			return FALSE;
+
+		total = outbuf - (out->str + start);
+
+		/* if the closing shift sequence didn't fit as well, try again leaving room for it, and a byte more each time, as a shorter
+		 * conversion may end in a different shift state */
+		if (total > max_bytes) {
+			reserve = MAX(reserve + 1, total - converted);
+
+			if (reserve < max_bytes)
+				continue;
+
+			/* not even the shift sequence on its own fits */
+			total = 0;
+			inbuf = (gchar *) utf8;
+		}
+
+		g_string_truncate(out, start + total);
+		*consumed = inbuf - utf8;
+		return TRUE;
+	}
+}
+
+/* Appends as much of the first @len bytes of @utf8 to @out, in the connection's charset, as fits in @max_bytes, stopping between two
+ * characters. Falls back to UTF-8 as it is if they can't be converted. Returns how many bytes of @utf8 made it. */
+gsize idle_connection_hton_append_max(IdleConnection *conn, const gchar *utf8, gsize len, gsize max_bytes, GString *out) {
+	GIConv cd = _hton_iconv(conn);
+	gsize start = out->len;
+	gsize consumed;
+
+	if (cd != (GIConv) -1) {
+		if (_hton_convert_max(cd, utf8, len, max_bytes, out, &consumed))
+			return consumed;
+
+		IDLE_DEBUG("g_iconv failed: %s", g_strerror(errno));
+		g_string_truncate(out, start);
+	}
+
+	consumed = _utf8_clip(utf8, len, max_bytes);
+	g_string_append_len(out, utf8, consumed);
+	return consumed;
+}
+
 static gboolean idle_connection_hton(IdleConnection *obj, const gchar *input, gchar **output, GError **_error) {
-	IdleConnectionPrivate *priv = obj->priv;
-	GError *error = NULL;
-	gsize bytes_written;
-	gchar *ret;
+	GString *ret;
 
 	if (input == NULL) {
 		*output = NULL;
 		return TRUE;
 	}
 
-	ret = g_convert(input, -1, priv->charset, "UTF-8", NULL, &bytes_written, &error);
+	ret = g_string_sized_new(strlen(input) + 1);
 
-	if (ret == NULL) {
-		IDLE_DEBUG("g_convert failed: %s", error->message);
-		g_set_error(_error, TP_ERROR, TP_ERROR_NOT_AVAILABLE, "character set conversion failed: %s", error->message);
-		g_error_free(error);
+	if (!idle_connection_hton_append(obj, input, strlen(input), ret)) {
+		gint saved_errno = errno;
+
+		g_set_error(_error, TP_ERROR, TP_ERROR_NOT_AVAILABLE, "character set conversion failed: %s", g_strerror(saved_errno));
+		g_string_free(ret, TRUE);
 		*output = NULL;
 		return FALSE;
 	}
 
-	*output = ret;
+	*output = g_string_free(ret, FALSE);
 	return TRUE;
 }
 
@@ -1585,6 +3011,7 @@ typedef struct
 
 static const IrcCommandCheck commands[] = {
     { "INVITE", "Use the Group API on room channels" },
+    { "ISON", "Use the SimplePresence API on contacts" },
     { "JOIN", "Use the Group API on room channels" },
     { "KICK", "Use the Group API on room channels" },
     { "PART", "Use the Group API on room channels" },
@@ -1601,24 +3028,42 @@ check_irc_command (IdleConnection *self,
     const gchar *full_command,
     GError **error)
 {
-  gchar **splitted;
+  gsize len = strcspn (full_command, " ");
   guint i;
 
-  splitted = g_strsplit (full_command, " ", 0);
-
   for (i = 0; commands[i].command != NULL; i++)
     {
-      if (g_ascii_strcasecmp (splitted[0], commands[i].command) == 0)
+      if (strlen (commands[i].command) == len &&
+          g_ascii_strncasecmp (full_command, commands[i].command, len) == 0)
         {
           g_set_error_literal (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
               commands[i].error_msg);
-
-          g_strfreev (splitted);
           return FALSE;
         }
     }
 
-  g_strfreev (splitted);
+  return TRUE;
+}
+
+/* Queues @command for idle_connection_irc_command_send() and
+ * idle_connection_irc_command_send_many(), but doesn't start sending */
+static gboolean
+queue_irc_command (IdleConnection *self,
+    const gchar *command,
+    GError **error)
+{
+  if (!check_irc_command (self, command, error))
+    return FALSE;
+
+  if (!_queue_line (self, idle_output_pending_msg_new (
+          _encode_line (self, command), SERVER_CMD_NORMAL_PRIORITY),
+          command, QUEUE_LANE_BULK))
+    {
+      g_set_error_literal (error, TP_ERROR, TP_ERROR_SERVICE_BUSY,
+          "Too many commands are waiting to be sent already");
+      return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -1630,18 +3075,152 @@ idle_connection_irc_command_send (IdleSvcConnectionInterfaceIRCCommand1 *iface,
   IdleConnection *self = IDLE_CONNECTION(iface);
   GError *error = NULL;
 
-  if (!check_irc_command (self, command, &error))
+  if (!queue_irc_command (self, command, &error))
     {
       dbus_g_method_return_error (context, error);
       g_error_free (error);
       return;
     }
 
-  _send_with_priority (self, command, SERVER_CMD_NORMAL_PRIORITY);
-
+  _start_sending (self);
   dbus_g_method_return (context);
 }
 
+static void
+idle_connection_irc_command_send_many (IdleSvcConnectionInterfaceIRCCommand1 *iface,
+    const gchar **commands,
+    DBusGMethodInvocation *context)
+{
+  IdleConnection *self = IDLE_CONNECTION(iface);
+  GPtrArray *errors = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) tp_value_array_free);
+  guint i;
+
+  for (i = 0; commands[i] != NULL; i++)
+    {
+      GError *error = NULL;
+
+      if (!queue_irc_command (self, commands[i], &error))
+        {
+          g_ptr_array_add (errors, tp_value_array_build (3,
+              G_TYPE_UINT, i,
+              G_TYPE_STRING, tp_error_get_dbus_name (error->code),
+              G_TYPE_STRING, error->message,
+              G_TYPE_INVALID));
+          g_error_free (error);
+        }
+    }
+
+  _start_sending (self);
+  idle_svc_connection_interface_irc_command1_return_from_send_many (context,
+      errors);
+  g_ptr_array_unref (errors);
+}
+
+/* Tells the parser about every command somebody has subscribed to */
+static void
+update_irc_subscriptions (IdleConnection *self)
+{
+  GPtrArray *all = g_ptr_array_new ();
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, self->priv->irc_subscriptions);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      gchar **commands;
+
+      for (commands = value; *commands != NULL; commands++)
+        g_ptr_array_add (all, *commands);
+    }
+
+  g_ptr_array_add (all, NULL);
+  idle_parser_set_subscriptions (self->parser,
+      (const gchar * const *) all->pdata);
+  g_ptr_array_free (all, TRUE);
+}
+
+static void
+_subscriber_owner_changed_cb (TpDBusDaemon *dbus,
+    const gchar *name,
+    const gchar *new_owner,
+    gpointer user_data)
+{
+  IdleConnection *self = IDLE_CONNECTION (user_data);
+
+  if (!tp_str_empty (new_owner))
+    return;
+
+  /* The subscriber has left the bus, so its subscription goes too */
+  tp_dbus_daemon_cancel_name_owner_watch (dbus, name,
+      _subscriber_owner_changed_cb, self);
+  g_hash_table_remove (self->priv->irc_subscriptions, name);
+  update_irc_subscriptions (self);
+}
+
+static void
+_subscribed_line_cb (IdleParser *parser,
+    const gchar *command,
+    const gchar *line,
+    gpointer user_data)
+{
+  idle_svc_connection_interface_irc_command1_emit_received (user_data,
+      command, line);
+}
+
+static void
+idle_connection_irc_command_subscribe (IdleSvcConnectionInterfaceIRCCommand1 *iface,
+    const gchar **commands,
+    DBusGMethodInvocation *context)
+{
+  IdleConnection *self = IDLE_CONNECTION(iface);
+  IdleConnectionPrivate *priv = self->priv;
+  TpDBusDaemon *dbus = tp_base_connection_get_dbus_daemon (
+      TP_BASE_CONNECTION (self));
+  gchar *sender;
+  gboolean subscribed;
+  guint i;
+
+  for (i = 0; commands[i] != NULL; i++)
+    {
+      if (commands[i][0] == '\0' || strchr (commands[i], ' ') != NULL)
+        {
+          GError error = { TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+              "Commands must be single words" };
+
+          dbus_g_method_return_error (context, &error);
+          return;
+        }
+    }
+
+  sender = dbus_g_method_get_sender (context);
+  subscribed = g_hash_table_lookup (priv->irc_subscriptions, sender) != NULL;
+
+  if (commands[0] == NULL)
+    {
+      if (subscribed)
+        {
+          tp_dbus_daemon_cancel_name_owner_watch (dbus, sender,
+              _subscriber_owner_changed_cb, self);
+          g_hash_table_remove (priv->irc_subscriptions, sender);
+        }
+
+      g_free (sender);
+    }
+  else
+    {
+      if (!subscribed)
+        tp_dbus_daemon_watch_name_owner (dbus, sender,
+            _subscriber_owner_changed_cb, self, NULL);
+
+      g_hash_table_insert (priv->irc_subscriptions, sender,
+          g_strdupv ((gchar **) commands));
+    }
+
+  update_irc_subscriptions (self);
+  idle_svc_connection_interface_irc_command1_return_from_subscribe (context);
+}
+
 static void irc_command_iface_init(gpointer g_iface,
     gpointer iface_data)
 {
@@ -1650,5 +3229,7 @@ static void irc_command_iface_init(gpointer g_iface,
 #define IMPLEMENT(x) idle_svc_connection_interface_irc_command1_implement_##x (\
 		klass, idle_connection_irc_command_##x)
 	IMPLEMENT(send);
+	IMPLEMENT(send_many);
+	IMPLEMENT(subscribe);
 #undef IMPLEMENT
 }
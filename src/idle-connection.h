@@ -33,17 +33,32 @@ G_BEGIN_DECLS
 typedef struct _IdleConnection IdleConnection;
 typedef struct _IdleConnectionClass IdleConnectionClass;
 typedef struct _IdleConnectionPrivate IdleConnectionPrivate;
+typedef struct _IdleContactInfoCache IdleContactInfoCache;
+typedef struct _IdleCTCPResponder IdleCTCPResponder;
+typedef struct _IdlePresenceTracker IdlePresenceTracker;
+typedef struct _IdleRoomlistCache IdleRoomlistCache;
+typedef struct _IdleStatistics IdleStatistics;
+
+/* Called if a line queued with idle_connection_send_user_message() is dropped rather than sent */
+typedef void (*IdleConnectionMessageDroppedFunc)(IdleConnection *conn, gpointer user_data);
 
 struct _IdleConnectionClass {
 	TpBaseConnectionClass parent_class;
 	TpContactsMixinClass contacts;
+	TpPresenceMixinClass presence;
 };
 
 struct _IdleConnection {
 	TpBaseConnection parent;
 	TpContactsMixin contacts;
+	TpPresenceMixin presence;
 	IdleParser *parser;
 	GQueue *contact_info_requests;
+	IdleContactInfoCache *contact_info_cache;
+	IdleCTCPResponder *ctcp_responder;
+	IdlePresenceTracker *presence_tracker;
+	IdleRoomlistCache *roomlist_cache;
+	IdleStatistics *statistics;
 	IdleConnectionPrivate *priv;
 };
 
@@ -66,7 +81,20 @@ GType idle_connection_get_type(void);
 void idle_connection_canon_nick_receive(IdleConnection *conn, TpHandle handle, const gchar *canon_nick);
 void idle_connection_emit_queued_aliases_changed(IdleConnection *conn);
 void idle_connection_send(IdleConnection *conn, const gchar *msg);
+gboolean idle_connection_send_low_priority(IdleConnection *conn, const gchar *msg);
+gboolean idle_connection_send_automatic(IdleConnection *conn, const gchar *msg, const gchar *dedup_key);
+guint idle_connection_get_queue_length(IdleConnection *conn);
+void idle_connection_pending_messages_added(IdleConnection *conn, guint count);
+void idle_connection_pending_messages_removed(IdleConnection *conn, guint count);
+void idle_connection_send_user_message(IdleConnection *conn, const gchar *msg, const gchar *dedup_key, IdleConnectionMessageDroppedFunc dropped, gpointer user_data, GDestroyNotify destroy);
+void idle_connection_send_user_line(IdleConnection *conn, GBytes *buffer, gsize offset, IdleConnectionMessageDroppedFunc dropped, gpointer user_data, GDestroyNotify destroy);
+gboolean idle_connection_hton_append(IdleConnection *conn, const gchar *utf8, gsize len, GString *out);
+gsize idle_connection_hton_append_max(IdleConnection *conn, const gchar *utf8, gsize len, gsize max_bytes, GString *out);
+gboolean idle_connection_has_capability(IdleConnection *conn, const gchar *capability);
+const gchar *idle_connection_get_capability_value(IdleConnection *conn, const gchar *capability);
+const gchar *idle_connection_get_isupport(IdleConnection *conn, const gchar *key);
 gsize idle_connection_get_max_message_length(IdleConnection *conn);
+gboolean idle_connection_get_formatted_messages(IdleConnection *conn);
 const gchar * const *idle_connection_get_implemented_interfaces (void);
 
 G_END_DECLS
@@ -20,6 +20,8 @@
 #include "config.h"
 #include "idle-contact-info.h"
 
+#include <string.h>
+
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
 #define IDLE_DEBUG_FLAG IDLE_DEBUG_CONNECTION
@@ -27,17 +29,53 @@
 #include "idle-muc-channel.h"
 #include "idle-parser.h"
 
+/* How many WHOIS queries we allow to be outstanding at the same time, and how
+ * long we wait for one to be answered before giving up on it. The timeout also
+ * has to cover the time the query spends in the outgoing flood queue.
+ */
+#define CONTACT_INFO_MAX_PENDING_REQUESTS 5
+#define CONTACT_INFO_REQUEST_TIMEOUT 60
+
 typedef struct _ContactInfoRequest ContactInfoRequest;
 
 struct _ContactInfoRequest {
+	IdleConnection *conn;
 	guint handle;
 	const gchar *nick;
 	gboolean is_away;
 	gboolean is_operator;
 	gboolean is_reg_nick;
 	gboolean is_secure;
+	gboolean is_sent;
+	guint timeout_id;
 	GPtrArray *contact_info;
-	DBusGMethodInvocation *context;
+	GSList *contexts;
+};
+
+struct _IdleContactInfoCache {
+	/* TpHandle -> ContactInfoCacheEntry */
+	GHashTable *entries;
+	/* complete ContactInfoCacheEntry, least recently used first */
+	GQueue *lru;
+	/* partial ContactInfoCacheEntry, the same way; kept apart and capped separately, so that a WHO of a big channel can't push out what
+	 * we got from WHOIS
+	 */
+	GQueue *partial_lru;
+	guint ttl;
+	guint max_size;
+};
+
+typedef struct _ContactInfoCacheEntry ContactInfoCacheEntry;
+
+struct _ContactInfoCacheEntry {
+	TpHandle handle;
+	GPtrArray *contact_info;
+	/* TRUE if contact_info came from a complete WHOIS reply, rather than being pieced together from what the server told us in passing;
+	 * incomplete entries carry an x-partial field saying so
+	 */
+	gboolean is_complete;
+	gint64 expires;
+	GList *lru_link;
 };
 
 /*
@@ -57,15 +95,176 @@ static void _insert_contact_field(GPtrArray *contact_info, const gchar *field_na
 		G_TYPE_INVALID));
 }
 
+static void _remove_contact_field(GPtrArray *contact_info, const gchar *field_name) {
+	guint i = 0;
+
+	while (i < contact_info->len) {
+		GValueArray *field = g_ptr_array_index(contact_info, i);
+
+		if (!tp_strdiff(g_value_get_string(g_value_array_get_nth(field, 0)), field_name)) {
+			g_ptr_array_remove_index(contact_info, i);
+			g_value_array_free(field);
+		} else {
+			i++;
+		}
+	}
+}
+
+static void _replace_contact_field(GPtrArray *contact_info, const gchar *field_name, const gchar * const *field_params, const gchar * const *field_values) {
+	_remove_contact_field(contact_info, field_name);
+	_insert_contact_field(contact_info, field_name, field_params, field_values);
+}
+
+static void _replace_presence_fields(GPtrArray *contact_info, TpConnectionPresenceType type, const gchar *status, const gchar *msg) {
+	const gchar *field_values[2] = {NULL, NULL};
+
+	field_values[0] = g_strdup_printf("%d", type);
+	_replace_contact_field(contact_info, "x-presence-type", NULL, field_values);
+	g_free((gpointer) field_values[0]);
+
+	field_values[0] = status;
+	_replace_contact_field(contact_info, "x-presence-status-identifier", NULL, field_values);
+
+	field_values[0] = msg;
+	_replace_contact_field(contact_info, "x-presence-status-message", NULL, field_values);
+}
+
+static void _replace_account_fields(GPtrArray *contact_info, const gchar *account) {
+	const gchar *field_values[2] = {NULL, NULL};
+
+	/* extended-join and account-notify use "*" to mean "not logged in" */
+	if (!tp_strdiff(account, "*")) {
+		_remove_contact_field(contact_info, "nickname");
+		field_values[0] = "false";
+	} else {
+		field_values[0] = account;
+		_replace_contact_field(contact_info, "nickname", NULL, field_values);
+		field_values[0] = "true";
+	}
+
+	_replace_contact_field(contact_info, "x-irc-registered-nick", NULL, field_values);
+}
+
+static void _cache_entry_free(gpointer data) {
+	ContactInfoCacheEntry *entry = data;
+
+	g_boxed_free(TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST, entry->contact_info);
+	g_slice_free(ContactInfoCacheEntry, entry);
+}
+
+static GQueue * _cache_entry_queue(IdleContactInfoCache *cache, ContactInfoCacheEntry *entry) {
+	return entry->is_complete ? cache->lru : cache->partial_lru;
+}
+
+static void _cache_remove(IdleConnection *conn, TpHandle handle) {
+	IdleContactInfoCache *cache = conn->contact_info_cache;
+	ContactInfoCacheEntry *entry = g_hash_table_lookup(cache->entries, GUINT_TO_POINTER(handle));
+
+	if (entry == NULL)
+		return;
+
+	g_queue_delete_link(_cache_entry_queue(cache, entry), entry->lru_link);
+	g_hash_table_remove(cache->entries, GUINT_TO_POINTER(handle));
+}
+
+/* Returns the unexpired cache entry for @handle, if any, and marks it as recently used. */
+static ContactInfoCacheEntry * _cache_lookup(IdleConnection *conn, TpHandle handle) {
+	IdleContactInfoCache *cache = conn->contact_info_cache;
+	ContactInfoCacheEntry *entry = g_hash_table_lookup(cache->entries, GUINT_TO_POINTER(handle));
+
+	if (entry == NULL)
+		return NULL;
+
+	if (g_get_monotonic_time() >= entry->expires) {
+		_cache_remove(conn, handle);
+		return NULL;
+	}
+
+	g_queue_unlink(_cache_entry_queue(cache, entry), entry->lru_link);
+	g_queue_push_tail_link(_cache_entry_queue(cache, entry), entry->lru_link);
+
+	return entry;
+}
+
+static void _cache_make_room(IdleConnection *conn, GQueue *queue) {
+	while (g_queue_get_length(queue) >= conn->contact_info_cache->max_size) {
+		ContactInfoCacheEntry *oldest = g_queue_peek_head(queue);
+
+		_cache_remove(conn, oldest->handle);
+	}
+}
+
+/* Returns the cache entry for @handle, creating an empty one if needed, or NULL if caching is disabled. */
+static ContactInfoCacheEntry * _cache_ensure(IdleConnection *conn, TpHandle handle) {
+	static const gchar *partial_values[2] = {"true", NULL};
+	IdleContactInfoCache *cache = conn->contact_info_cache;
+	ContactInfoCacheEntry *entry;
+
+	if (cache->ttl == 0 || cache->max_size == 0)
+		return NULL;
+
+	entry = _cache_lookup(conn, handle);
+	if (entry != NULL)
+		return entry;
+
+	_cache_make_room(conn, cache->partial_lru);
+
+	entry = g_slice_new0(ContactInfoCacheEntry);
+	entry->handle = handle;
+	entry->contact_info = dbus_g_type_specialized_construct(TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST);
+	_insert_contact_field(entry->contact_info, "x-partial", NULL, partial_values);
+	entry->is_complete = FALSE;
+	entry->expires = g_get_monotonic_time() + (gint64) cache->ttl * G_USEC_PER_SEC;
+
+	g_queue_push_tail(cache->partial_lru, entry);
+	entry->lru_link = g_queue_peek_tail_link(cache->partial_lru);
+	g_hash_table_insert(cache->entries, GUINT_TO_POINTER(handle), entry);
+
+	return entry;
+}
+
+static void _cache_store_request(IdleConnection *conn, ContactInfoRequest *request) {
+	ContactInfoCacheEntry *entry = _cache_ensure(conn, request->handle);
+
+	if (entry == NULL)
+		return;
+
+	if (!entry->is_complete) {
+		IdleContactInfoCache *cache = conn->contact_info_cache;
+
+		g_queue_unlink(cache->partial_lru, entry->lru_link);
+		_cache_make_room(conn, cache->lru);
+		g_queue_push_tail_link(cache->lru, entry->lru_link);
+		entry->is_complete = TRUE;
+	}
+
+	g_boxed_free(TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST, entry->contact_info);
+	entry->contact_info = g_boxed_copy(TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST, request->contact_info);
+	entry->expires = g_get_monotonic_time() + (gint64) conn->contact_info_cache->ttl * G_USEC_PER_SEC;
+}
+
+static ContactInfoRequest * _find_request(IdleConnection *conn, TpHandle handle, gboolean sent_only) {
+	GList *l;
+
+	for (l = g_queue_peek_head_link(conn->contact_info_requests); l != NULL; l = l->next) {
+		ContactInfoRequest *request = l->data;
+
+		if (sent_only && !request->is_sent)
+			continue;
+
+		if (request->handle == handle)
+			return request;
+	}
+
+	return NULL;
+}
+
 static ContactInfoRequest * _get_matching_request(IdleConnection *conn, GValueArray *args) {
 	ContactInfoRequest *request;
 	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
 
-	if (g_queue_is_empty(conn->contact_info_requests))
-		return NULL;
-
-	request = g_queue_peek_head(conn->contact_info_requests);
-	if (request->handle != handle)
+	request = _find_request(conn, handle, TRUE);
+	if (request == NULL)
 		return NULL;
 
 	if (request->contact_info == NULL)
@@ -74,59 +273,123 @@ static ContactInfoRequest * _get_matching_request(IdleConnection *conn, GValueAr
 	return request;
 }
 
-static void _send_request_contact_info(IdleConnection *conn, ContactInfoRequest *request) {
-	gchar cmd[IRC_MSG_MAXLEN + 1];
-
-	g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "WHOIS %s %s", request->nick, request->nick);
-	idle_connection_send(conn, cmd);
-}
-
-static void _dequeue_request_contact_info(IdleConnection *conn) {
-	ContactInfoRequest *request = g_queue_pop_head(conn->contact_info_requests);
+static void _free_request_contact_info(ContactInfoRequest *request) {
+	if (request->timeout_id != 0)
+		g_source_remove(request->timeout_id);
 
 	if (request->contact_info != NULL)
 		g_boxed_free(TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST, request->contact_info);
 
+	g_slist_free(request->contexts);
 	g_slice_free(ContactInfoRequest, request);
+}
 
-	if (g_queue_is_empty(conn->contact_info_requests))
-		return;
+static void _send_request_contact_info(IdleConnection *conn, ContactInfoRequest *request);
+
+static void _send_pending_requests_contact_info(IdleConnection *conn) {
+	GList *l;
+	guint n_sent = 0;
+
+	for (l = g_queue_peek_head_link(conn->contact_info_requests); l != NULL; l = l->next) {
+		ContactInfoRequest *request = l->data;
+
+		if (n_sent >= CONTACT_INFO_MAX_PENDING_REQUESTS)
+			break;
+
+		if (!request->is_sent)
+			_send_request_contact_info(conn, request);
+
+		n_sent++;
+	}
+}
 
-	request = g_queue_peek_head(conn->contact_info_requests);
-	_send_request_contact_info(conn, request);
+static void _dequeue_request_contact_info(IdleConnection *conn, ContactInfoRequest *request) {
+	g_queue_remove(conn->contact_info_requests, request);
+	_free_request_contact_info(request);
+
+	_send_pending_requests_contact_info(conn);
+}
+
+static void _fail_request_contact_info(IdleConnection *conn, ContactInfoRequest *request, const GError *error) {
+	GSList *l;
+
+	for (l = request->contexts; l != NULL; l = l->next)
+		dbus_g_method_return_error(l->data, error);
+
+	_dequeue_request_contact_info(conn, request);
+}
+
+static gboolean _request_contact_info_timeout_cb(gpointer user_data) {
+	ContactInfoRequest *request = user_data;
+	GError *error;
+
+	IDLE_DEBUG("WHOIS for %s timed out", request->nick);
+
+	request->timeout_id = 0;
+
+	error = g_error_new(TP_ERROR, TP_ERROR_NOT_AVAILABLE, "Timed out waiting for information about '%s'", request->nick);
+	_fail_request_contact_info(request->conn, request, error);
+	g_error_free(error);
+
+	return FALSE;
+}
+
+static void _send_request_contact_info(IdleConnection *conn, ContactInfoRequest *request) {
+	gchar cmd[IRC_MSG_MAXLEN + 1];
+
+	g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "WHOIS %s %s", request->nick, request->nick);
+	idle_connection_send(conn, cmd);
+
+	request->is_sent = TRUE;
+	request->timeout_id = g_timeout_add_seconds(CONTACT_INFO_REQUEST_TIMEOUT, _request_contact_info_timeout_cb, request);
 }
 
 static void _queue_request_contact_info(IdleConnection *conn, guint handle, const gchar *nick, DBusGMethodInvocation *context) {
 	ContactInfoRequest *request;
 
+	/* If somebody has already asked about this contact, piggy-back on that query instead of issuing a second WHOIS whose replies would be
+	 * indistinguishable from the first one's.
+	 */
+	request = _find_request(conn, handle, FALSE);
+	if (request != NULL) {
+		request->contexts = g_slist_append(request->contexts, context);
+		return;
+	}
+
 	request = g_slice_new0(ContactInfoRequest);
+	request->conn = conn;
 	request->handle = handle;
 	request->nick = nick;
 	request->is_away = FALSE;
 	request->is_operator = FALSE;
 	request->is_reg_nick = FALSE;
 	request->is_secure = FALSE;
+	request->is_sent = FALSE;
+	request->timeout_id = 0;
 	request->contact_info = NULL;
-	request->context = context;
-
-	if (g_queue_is_empty(conn->contact_info_requests))
-		_send_request_contact_info(conn, request);
+	request->contexts = g_slist_append(NULL, context);
 
 	g_queue_push_tail(conn->contact_info_requests, request);
+	_send_pending_requests_contact_info(conn);
 }
 
-static void _return_from_request_contact_info(IdleConnection *conn) {
-	ContactInfoRequest *request = g_queue_peek_head(conn->contact_info_requests);
+static void _return_from_request_contact_info(IdleConnection *conn, ContactInfoRequest *request) {
+	GSList *l;
+
+	_cache_store_request(conn, request);
+
+	for (l = request->contexts; l != NULL; l = l->next)
+		tp_svc_connection_interface_contact_info_return_from_request_contact_info(l->data, request->contact_info);
 
-	tp_svc_connection_interface_contact_info_return_from_request_contact_info(request->context, request->contact_info);
 	tp_svc_connection_interface_contact_info_emit_contact_info_changed(conn, request->handle, request->contact_info);
-	_dequeue_request_contact_info(conn);
+	_dequeue_request_contact_info(conn, request);
 }
 
 static void idle_connection_request_contact_info(TpSvcConnectionInterfaceContactInfo *iface, guint contact, DBusGMethodInvocation *context) {
 	IdleConnection *self = IDLE_CONNECTION(iface);
 	TpBaseConnection *base = TP_BASE_CONNECTION(self);
 	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(base, TP_HANDLE_TYPE_CONTACT);
+	ContactInfoCacheEntry *entry;
 	const gchar *nick;
 	GError *error = NULL;
 
@@ -138,31 +401,60 @@ static void idle_connection_request_contact_info(TpSvcConnectionInterfaceContact
 		return;
 	}
 
+	entry = _cache_lookup(self, contact);
+	if (entry != NULL && entry->is_complete) {
+		IDLE_DEBUG("Returning cached contact info for handle: %u", contact);
+		tp_svc_connection_interface_contact_info_return_from_request_contact_info(context, entry->contact_info);
+		return;
+	}
+
 	nick = tp_handle_inspect(contact_handles, contact);
 
 	IDLE_DEBUG ("Queued contact info request for handle: %u (%s)", contact, nick);
 	_queue_request_contact_info(self, contact, nick, context);
 }
 
+static void idle_connection_get_contact_info(TpSvcConnectionInterfaceContactInfo *iface, const GArray *contacts, DBusGMethodInvocation *context) {
+	IdleConnection *self = IDLE_CONNECTION(iface);
+	TpBaseConnection *base = TP_BASE_CONNECTION(self);
+	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(base, TP_HANDLE_TYPE_CONTACT);
+	GHashTable *ret;
+	GError *error = NULL;
+	guint i;
+
+	TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED(base, context);
+
+	if (!tp_handles_are_valid(contact_handles, contacts, FALSE, &error)) {
+		dbus_g_method_return_error(context, error);
+		g_error_free(error);
+		return;
+	}
+
+	/* Like the spec says, this only ever returns what we already know, partial or not; use RequestContactInfo to ask the server. */
+	ret = g_hash_table_new(NULL, NULL);
+
+	for (i = 0; i < contacts->len; i++) {
+		TpHandle handle = g_array_index(contacts, TpHandle, i);
+		ContactInfoCacheEntry *entry = _cache_lookup(self, handle);
+
+		if (entry != NULL)
+			g_hash_table_insert(ret, GUINT_TO_POINTER(handle), entry->contact_info);
+	}
+
+	tp_svc_connection_interface_contact_info_return_from_get_contact_info(context, ret);
+	g_hash_table_unref(ret);
+}
+
 static IdleParserHandlerResult _away_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
 	ContactInfoRequest *request = _get_matching_request(conn, args);
 	const gchar *msg;
-	const gchar *field_values[2] = {NULL, NULL};
 
 	if (request == NULL)
 		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 
-	field_values[0] = g_strdup_printf("%d", TP_CONNECTION_PRESENCE_TYPE_AWAY);
-	_insert_contact_field(request->contact_info, "x-presence-type", NULL, field_values);
-	g_free((gpointer) field_values[0]);
-
-	field_values[0] = "away";
-	_insert_contact_field(request->contact_info, "x-presence-status-identifier", NULL, field_values);
-
 	msg = g_value_get_string(g_value_array_get_nth(args, 1));
-	field_values[0] = msg;
-	_insert_contact_field(request->contact_info, "x-presence-status-message", NULL, field_values);
+	_replace_presence_fields(request->contact_info, TP_CONNECTION_PRESENCE_TYPE_AWAY, "away", msg);
 
 	request->is_away = TRUE;
 
@@ -177,17 +469,8 @@ static IdleParserHandlerResult _end_of_whois_handler(IdleParser *parser, IdlePar
 	if (request == NULL)
 		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 
-	if (request->is_away == FALSE) {
-		field_values[0] = g_strdup_printf("%d", TP_CONNECTION_PRESENCE_TYPE_AVAILABLE);
-		_insert_contact_field(request->contact_info, "x-presence-type", NULL, field_values);
-		g_free((gpointer) field_values[0]);
-
-		field_values[0] = "available";
-		_insert_contact_field(request->contact_info, "x-presence-status-identifier", NULL, field_values);
-
-		field_values[0] = "";
-		_insert_contact_field(request->contact_info, "x-presence-status-message", NULL, field_values);
-	}
+	if (request->is_away == FALSE)
+		_replace_presence_fields(request->contact_info, TP_CONNECTION_PRESENCE_TYPE_AVAILABLE, "available", "");
 
 	field_values[0] = (request->is_operator) ? "true" : "false";
 	_insert_contact_field(request->contact_info, "x-irc-operator", NULL, field_values);
@@ -198,7 +481,7 @@ static IdleParserHandlerResult _end_of_whois_handler(IdleParser *parser, IdlePar
 	field_values[0] = (request->is_secure) ? "true" : "false";
 	_insert_contact_field(request->contact_info, "x-irc-secure-connection", NULL, field_values);
 
-	_return_from_request_contact_info(conn);
+	_return_from_request_contact_info(conn, request);
 	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 }
 
@@ -234,11 +517,9 @@ static IdleParserHandlerResult _no_such_server_handler(IdleParser *parser, IdleP
 		goto cleanup;
 
 	error = g_error_new(TP_ERROR, TP_ERROR_DOES_NOT_EXIST, "User '%s' unknown; they may have disconnected", server);
-	dbus_g_method_return_error(request->context, error);
+	_fail_request_contact_info(conn, request, error);
 	g_error_free(error);
 
-	_dequeue_request_contact_info(conn);
-
 cleanup:
 	g_value_array_free(norm_args);
 	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
@@ -246,33 +527,36 @@ cleanup:
 
 static IdleParserHandlerResult _try_again_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleConnection *conn = IDLE_CONNECTION(user_data);
-	ContactInfoRequest *request;
+	ContactInfoRequest *request = NULL;
+	GList *l;
 	const gchar *command;
 	const gchar *msg;
 	GError *error = NULL;
 
 	/* The RPL_TRYAGAIN message does not contain the nick for which the request was issued, but only the type of the message, which in this case is
-	 * WHOIS. So we assume that the last WHOIS request that we had issued has resulted in this RPL_TRYAGAIN. This is fine as long nobody else is
-	 * issuing a WHOIS because we issue a new request only after the earlier one was successfully completed or resulted in an error.
+	 * WHOIS. Since the server answers queries in the order it received them, we assume that the oldest WHOIS request that is still outstanding has
+	 * resulted in this RPL_TRYAGAIN. The others are left alone; they will either be answered or time out on their own.
 	 */
 
-	if (g_queue_is_empty(conn->contact_info_requests))
-		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
-
 	command = g_value_get_string(g_value_array_get_nth(args, 0));
 	if (g_ascii_strcasecmp(command, "WHOIS"))
 		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 
-	request = g_queue_peek_head(conn->contact_info_requests);
+	for (l = g_queue_peek_head_link(conn->contact_info_requests); l != NULL; l = l->next) {
+		request = l->data;
+		if (request->is_sent)
+			break;
+	}
+
+	if (l == NULL)
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 
 	msg = g_value_get_string(g_value_array_get_nth(args, 1));
 
 	error = g_error_new_literal(TP_ERROR, TP_ERROR_SERVICE_BUSY, msg);
-	dbus_g_method_return_error(request->context, error);
+	_fail_request_contact_info(conn, request, error);
 	g_error_free(error);
 
-	_dequeue_request_contact_info(conn);
-
 	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 }
 
@@ -453,6 +737,119 @@ static IdleParserHandlerResult _whois_user_handler(IdleParser *parser, IdleParse
 	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 }
 
+static void _cache_changed(IdleConnection *conn, ContactInfoCacheEntry *entry) {
+	/* Don't flood the bus with signals for every member of every channel we join; only contacts somebody has explicitly asked about are
+	 * interesting enough to push updates for.
+	 */
+	if (entry->is_complete)
+		tp_svc_connection_interface_contact_info_emit_contact_info_changed(conn, entry->handle, entry->contact_info);
+}
+
+static IdleParserHandlerResult _account_notify_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	const gchar *account = g_value_get_string(g_value_array_get_nth(args, 1));
+	ContactInfoCacheEntry *entry = _cache_ensure(conn, handle);
+
+	if (entry == NULL)
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	_replace_account_fields(entry->contact_info, account);
+	_cache_changed(conn, entry);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _away_notify_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	ContactInfoCacheEntry *entry = _cache_ensure(conn, handle);
+
+	if (entry == NULL)
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	/* AWAY with a message means the contact went away; a bare AWAY means they came back */
+	if (args->n_values > 1)
+		_replace_presence_fields(entry->contact_info, TP_CONNECTION_PRESENCE_TYPE_AWAY, "away", g_value_get_string(g_value_array_get_nth(args, 1)));
+	else
+		_replace_presence_fields(entry->contact_info, TP_CONNECTION_PRESENCE_TYPE_AVAILABLE, "available", "");
+
+	_cache_changed(conn, entry);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _extended_join_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	const gchar *account = g_value_get_string(g_value_array_get_nth(args, 2));
+	const gchar *realname = g_value_get_string(g_value_array_get_nth(args, 3));
+	const gchar *field_values[2] = {realname, NULL};
+	ContactInfoCacheEntry *entry;
+
+	if (!idle_connection_has_capability(conn, "extended-join"))
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	entry = _cache_ensure(conn, handle);
+	if (entry == NULL)
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	_replace_contact_field(entry->contact_info, "fn", NULL, field_values);
+	_replace_account_fields(entry->contact_info, account);
+	_cache_changed(conn, entry);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+/*
+ * idle_contact_info_update_from_who:
+ * @flags: the H|G[*][@+] flags field of a WHO reply
+ * @account: the services account name from a WHOX reply, "0" if the contact is not logged in, or NULL if the reply did not include it
+ * @realname: the contact's real name
+ */
+void idle_contact_info_update_from_who(IdleConnection *conn, TpHandle handle, const gchar *flags, const gchar *account, const gchar *realname) {
+	ContactInfoCacheEntry *entry = _cache_ensure(conn, handle);
+	const gchar *field_values[2] = {NULL, NULL};
+
+	if (entry == NULL)
+		return;
+
+	field_values[0] = realname;
+	_replace_contact_field(entry->contact_info, "fn", NULL, field_values);
+
+	if (account != NULL)
+		_replace_account_fields(entry->contact_info, !tp_strdiff(account, "0") ? "*" : account);
+
+	/* WHO only tells us whether the contact is away, not why */
+	if (flags[0] == 'G')
+		_replace_presence_fields(entry->contact_info, TP_CONNECTION_PRESENCE_TYPE_AWAY, "away", "");
+	else
+		_replace_presence_fields(entry->contact_info, TP_CONNECTION_PRESENCE_TYPE_AVAILABLE, "available", "");
+
+	field_values[0] = (strchr(flags, '*') != NULL) ? "true" : "false";
+	_replace_contact_field(entry->contact_info, "x-irc-operator", NULL, field_values);
+
+	_cache_changed(conn, entry);
+}
+
+static IdleParserHandlerResult _nick_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle old_handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+
+	_cache_remove(conn, old_handle);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _quit_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+
+	_cache_remove(conn, handle);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
 static void idle_contact_info_properties_getter(GObject *object, GQuark interface, GQuark name, GValue *value, gpointer getter_data) {
 	GQuark q_supported_fields = g_quark_from_static_string("SupportedFields");
 
@@ -467,7 +864,7 @@ static void idle_contact_info_properties_getter(GObject *object, GQuark interfac
 }
 
 static void _contact_info_requests_foreach_free(gpointer data, gpointer user_data) {
-	g_slice_free(ContactInfoRequest, data);
+	_free_request_contact_info(data);
 }
 
 void idle_contact_info_finalize (GObject *object) {
@@ -475,6 +872,11 @@ void idle_contact_info_finalize (GObject *object) {
 
 	g_queue_foreach(conn->contact_info_requests, _contact_info_requests_foreach_free, NULL);
 	g_queue_free(conn->contact_info_requests);
+
+	g_hash_table_unref(conn->contact_info_cache->entries);
+	g_queue_free(conn->contact_info_cache->lru);
+	g_queue_free(conn->contact_info_cache->partial_lru);
+	g_slice_free(IdleContactInfoCache, conn->contact_info_cache);
 }
 
 void idle_contact_info_class_init (IdleConnectionClass *klass) {
@@ -499,19 +901,39 @@ idle_contact_info_fill_contact_attributes (
     const GArray *contacts,
     GHashTable *attributes_hash)
 {
-  /* We don't cache contact info, so we just never put /info into the
-   * attributes hash. This is spec-compliant: we don't implement
-   * GetContactInfo, and the spec says the attribute should be the same as the
-   * value returned by that method (or omitted if unknown). This function
-   * exists at all to make ContactInfo show up in ContactAttributeInterfaces
-   * (otherwise tp-glib might be justified in falling back to
-   * GetContactInfo(), which we know will fail).
+  IdleConnection *conn = IDLE_CONNECTION (obj);
+  guint i;
+
+  /* The spec says the attribute should be the same as the value returned by
+   * GetContactInfo, so only contacts we have cached info for get one.
    */
+  for (i = 0; i < contacts->len; i++)
+    {
+      TpHandle handle = g_array_index (contacts, TpHandle, i);
+      ContactInfoCacheEntry *entry = _cache_lookup (conn, handle);
+
+      if (entry == NULL)
+        continue;
+
+      tp_contacts_mixin_set_contact_attribute (attributes_hash,
+          handle, TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO"/info",
+          tp_g_value_slice_new_boxed (TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST,
+              entry->contact_info));
+    }
 }
 
 void idle_contact_info_init (IdleConnection *conn) {
 	conn->contact_info_requests = g_queue_new();
 
+	conn->contact_info_cache = g_slice_new0(IdleContactInfoCache);
+	conn->contact_info_cache->entries = g_hash_table_new_full(NULL, NULL, NULL, _cache_entry_free);
+	conn->contact_info_cache->lru = g_queue_new();
+	conn->contact_info_cache->partial_lru = g_queue_new();
+	g_object_get(conn,
+		"contact-info-ttl", &conn->contact_info_cache->ttl,
+		"contact-info-cache-size", &conn->contact_info_cache->max_size,
+		NULL);
+
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_WHOISUSER, _whois_user_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_WHOISCHANNELS, _whois_channels_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_WHOISSERVER, _whois_server_handler, conn);
@@ -527,6 +949,12 @@ void idle_contact_info_init (IdleConnection *conn) {
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_NOSUCHSERVER, _no_such_server_handler, conn);
 	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_TRYAGAIN, _try_again_handler, conn);
 
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_ACCOUNT, _account_notify_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_AWAY, _away_notify_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_JOIN_EXTENDED, _extended_join_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_NICK, _nick_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_PREFIXCMD_QUIT, _quit_handler, conn);
+
 	tp_contacts_mixin_add_contact_attributes_iface ((GObject *) conn,
 		TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
 		idle_contact_info_fill_contact_attributes);
@@ -537,6 +965,7 @@ void idle_contact_info_iface_init(gpointer g_iface, gpointer iface_data) {
 
 #define IMPLEMENT(x) tp_svc_connection_interface_contact_info_implement_##x (\
 		klass, idle_connection_##x)
+	IMPLEMENT(get_contact_info);
 	IMPLEMENT(request_contact_info);
 #undef IMPLEMENT
 }
@@ -26,9 +26,183 @@
 #include <stdio.h>
 #include <string.h>
 
-static const gchar *_ctcp_send(const gchar *send_cmd, const gchar *target, const gchar *ctcp, IdleConnection *conn) {
-	gchar buf[IRC_MSG_MAXLEN + 1] = {'\0'};
-	int out_index = snprintf(buf, IRC_MSG_MAXLEN, "%s %s :\001", send_cmd, target);
+#define IDLE_DEBUG_FLAG IDLE_DEBUG_CONNECTION
+#include "idle-debug.h"
+
+/* Replies to CTCP queries come out of two token buckets, one shared and one per sender, so that a flood of queries cannot become a
+ * flood of replies: up to BURST replies at once, then one every INTERVAL. Senders whose bucket is full again are forgotten once we are
+ * tracking more than CTCP_MAX_SENDERS. */
+#define CTCP_GLOBAL_BURST 5
+#define CTCP_GLOBAL_INTERVAL 2 /* sec */
+#define CTCP_SENDER_BURST 2
+#define CTCP_SENDER_INTERVAL 15 /* sec */
+#define CTCP_MAX_SENDERS 256
+
+struct _IdleCTCPResponder {
+	/* when each bucket will be full again, in monotonic time: the shared one, and the senders' by handle */
+	gint64 global_full_at;
+	GHashTable *senders;
+};
+
+static gchar *_version_reply(const gchar *args) {
+	return g_strdup_printf("VERSION telepathy-idle %s Telepathy IM/VoIP Framework http://telepathy.freedesktop.org", VERSION);
+}
+
+static gchar *_ping_reply(const gchar *args) {
+	return args != NULL ? g_strdup_printf("PING %s", args) : g_strdup("PING");
+}
+
+static gchar *_time_reply(const gchar *args) {
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *time = g_date_time_format(now, "%a %b %d %H:%M:%S %Y");
+	gchar *ret = g_strdup_printf("TIME %s", time);
+
+	g_free(time);
+	g_date_time_unref(now);
+	return ret;
+}
+
+static gchar *_clientinfo_reply(const gchar *args);
+
+/* The queries we answer, and how. ACTION is not a query, and is left to the text channels. */
+static const struct {
+	const gchar *command;
+	gchar *(*reply)(const gchar *args);
+} ctcp_queries[] = {
+	{"CLIENTINFO", _clientinfo_reply},
+	{"PING", _ping_reply},
+	{"TIME", _time_reply},
+	{"VERSION", _version_reply},
+	{NULL, NULL}
+};
+
+static gchar *_clientinfo_reply(const gchar *args) {
+	GString *ret = g_string_new("CLIENTINFO ACTION");
+	guint i;
+
+	for (i = 0; ctcp_queries[i].command != NULL; i++)
+		g_string_append_printf(ret, " %s", ctcp_queries[i].command);
+
+	return g_string_free(ret, FALSE);
+}
+
+static gboolean _bucket_has_token(gint64 full_at, gint64 now, guint burst, guint interval) {
+	return MAX(full_at, now) + interval * G_USEC_PER_SEC - now <= (gint64) burst * interval * G_USEC_PER_SEC;
+}
+
+static gint64 _bucket_take_token(gint64 full_at, gint64 now, guint interval) {
+	return MAX(full_at, now) + interval * G_USEC_PER_SEC;
+}
+
+static void _forget_idle_senders(IdleCTCPResponder *responder, gint64 now) {
+	GHashTableIter iter;
+	gpointer value;
+
+	if (g_hash_table_size(responder->senders) < CTCP_MAX_SENDERS)
+		return;
+
+	g_hash_table_iter_init(&iter, responder->senders);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		if (*(gint64 *) value <= now)
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
+static gsize _ctcp_frame(gchar *buf, const gchar *send_cmd, const gchar *target, const gchar *ctcp, const gchar **rest);
+
+static IdleParserHandlerResult _ctcp_query_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdleCTCPResponder *responder = conn->ctcp_responder;
+	const gchar *msg = g_value_get_string(g_value_array_get_nth(args, 2));
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	gchar buf[IRC_MSG_MAXLEN + 1];
+	gchar *command, *query_args, *reply, *dedup_key;
+	const gchar *nick;
+	gint64 *sender_full_at;
+	gint64 now;
+	gsize len;
+	guint i;
+
+	if (msg[0] != '\001')
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	len = strcspn(msg + 1, "\001");
+	command = g_strndup(msg + 1, len);
+	query_args = strchr(command, ' ');
+
+	if (query_args != NULL)
+		*query_args++ = '\0';
+
+	for (i = 0; ctcp_queries[i].command != NULL; i++) {
+		if (!g_ascii_strcasecmp(command, ctcp_queries[i].command))
+			break;
+	}
+
+	if (ctcp_queries[i].command == NULL) {
+		g_free(command);
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+	}
+
+	now = g_get_monotonic_time();
+	sender_full_at = g_hash_table_lookup(responder->senders, GUINT_TO_POINTER(handle));
+
+	if (!_bucket_has_token(responder->global_full_at, now, CTCP_GLOBAL_BURST, CTCP_GLOBAL_INTERVAL) ||
+	    (sender_full_at != NULL && !_bucket_has_token(*sender_full_at, now, CTCP_SENDER_BURST, CTCP_SENDER_INTERVAL))) {
+		IDLE_DEBUG("not answering CTCP %s: too many queries", ctcp_queries[i].command);
+		g_free(command);
+		return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+	}
+
+	nick = tp_handle_inspect(tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT), handle);
+	reply = ctcp_queries[i].reply(query_args);
+	_ctcp_frame(buf, "NOTICE", nick, reply, NULL);
+
+	/* a sender asking the same again before we have answered gets one answer */
+	dedup_key = g_strdup_printf("CTCP %u %s", handle, ctcp_queries[i].command);
+
+	if (idle_connection_send_automatic(conn, buf, dedup_key)) {
+		responder->global_full_at = _bucket_take_token(responder->global_full_at, now, CTCP_GLOBAL_INTERVAL);
+
+		if (sender_full_at == NULL) {
+			_forget_idle_senders(responder, now);
+			sender_full_at = g_new0(gint64, 1);
+			g_hash_table_insert(responder->senders, GUINT_TO_POINTER(handle), sender_full_at);
+		}
+
+		*sender_full_at = _bucket_take_token(*sender_full_at, now, CTCP_SENDER_INTERVAL);
+	}
+
+	g_free(dedup_key);
+	g_free(reply);
+	g_free(command);
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+void idle_ctcp_init(IdleConnection *conn) {
+	IdleCTCPResponder *responder = g_slice_new0(IdleCTCPResponder);
+
+	responder->senders = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	conn->ctcp_responder = responder;
+
+	/* ahead of the text channels, which would otherwise ignore the queries */
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_PREFIXCMD_PRIVMSG_USER, _ctcp_query_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+}
+
+void idle_ctcp_finalize(GObject *object) {
+	IdleConnection *conn = IDLE_CONNECTION(object);
+	IdleCTCPResponder *responder = conn->ctcp_responder;
+
+	g_hash_table_unref(responder->senders);
+	g_slice_free(IdleCTCPResponder, responder);
+}
+
+/* Frames @ctcp into @buf as far as it fits, setting @rest to the first char which did not fit, or NULL */
+static gsize _ctcp_frame(gchar *buf, const gchar *send_cmd, const gchar *target, const gchar *ctcp, const gchar **rest) {
+	int out_index;
+
+	memset(buf, '\0', IRC_MSG_MAXLEN + 1);
+	out_index = snprintf(buf, IRC_MSG_MAXLEN, "%s %s :\001", send_cmd, target);
 
 	const gchar *iter;
 	for (iter = ctcp; *iter != '\0'; iter++) {
@@ -66,14 +240,22 @@ static const gchar *_ctcp_send(const gchar *send_cmd, const gchar *target, const
 out:
 
 	buf[out_index++] = '\001';
-	buf[out_index++] = '\000';
+	buf[out_index] = '\000';
 
+	if (rest != NULL)
+		*rest = *iter == '\0' ? NULL : iter;
+
+	return out_index;
+}
+
+static const gchar *_ctcp_send(const gchar *send_cmd, const gchar *target, const gchar *ctcp, IdleConnection *conn) {
+	gchar buf[IRC_MSG_MAXLEN + 1];
+	const gchar *rest;
+
+	_ctcp_frame(buf, send_cmd, target, ctcp, &rest);
 	idle_connection_send(conn, buf);
 
-	if (*iter == '\0')
-		return NULL;
-	else
-		return iter;
+	return rest;
 }
 
 const gchar *idle_ctcp_privmsg(const gchar *target, const gchar *ctcp, IdleConnection *conn) {
@@ -84,52 +266,309 @@ const gchar *idle_ctcp_notice(const gchar *target, const gchar *ctcp, IdleConnec
 	return _ctcp_send("NOTICE", target, ctcp, conn);
 }
 
-gchar *idle_ctcp_kill_blingbling(const gchar *msg) {
-	gchar *killed, *killed_iter;
+/* The formatting codes we strip, as a bit for each byte below 0x20 */
+#define BLINGBLING_CODES ((1u << 0x02) | (1u << 0x03) | (1u << 0x0f) | (1u << 0x11) | (1u << 0x12) | (1u << 0x16) | (1u << 0x1d) | (1u << 0x1f))
+#define IS_BLINGBLING(c) ((guchar) (c) < 0x20 && (BLINGBLING_CODES & (1u << (guchar) (c))) != 0)
+
+/* A byte with just the low bit set in every position of a word */
+#define WORD_ONES ((gsize) -1 / 0xff)
+
+/* The first formatting code in the @len bytes at @msg, or NULL. Most messages have none, so we look at a word at a time for any byte
+ * below 0x20, and only go byte by byte through words which have one. */
+static const gchar *_find_blingbling(const gchar *msg, gsize len) {
+	const gchar *iter = msg;
+	const gchar *end = msg + len;
+
+	while (iter < end) {
+		const gchar *word_end;
+
+		if ((gsize) (end - iter) >= sizeof(gsize)) {
+			gsize word;
+
+			memcpy(&word, iter, sizeof(gsize));
+
+			/* sets the high bit of (at least) the first byte below 0x20, and of none if there are none */
+			if (((word - WORD_ONES * 0x20) & ~word & (WORD_ONES * 0x80)) == 0) {
+				iter += sizeof(gsize);
+				continue;
+			}
+
+			word_end = iter + sizeof(gsize);
+		} else {
+			word_end = end;
+		}
+
+		for (; iter < word_end; iter++) {
+			if (IS_BLINGBLING(*iter))
+				return iter;
+		}
+	}
+
+	return NULL;
+}
+
+/* Skips the formatting code at @iter, and any arguments it has */
+static const gchar *_skip_blingbling(const gchar *iter) {
+	if (*iter++ != '\x03') /* ^C */
+		return iter;
+
+	/* Color codes are 1-2 digits */
+	if (isdigit(*iter))
+		iter++;
+	if (isdigit(*iter))
+		iter++;
+
+	if (*iter == ',') {
+		iter++;
+
+		if (isdigit(*iter))
+			iter++;
+		if (isdigit(*iter))
+			iter++;
+	}
+
+	return iter;
+}
+
+gchar *idle_ctcp_kill_blingbling_in_place(gchar *msg) {
+	gchar *end = msg + strlen(msg);
+	gchar *killed_iter = (gchar *) _find_blingbling(msg, end - msg);
+	const gchar *iter = killed_iter;
+
+	if (killed_iter == NULL)
+		return msg;
+
+	/* move each run of plain text between formatting codes down over them */
+	while (iter < end) {
+		const gchar *next;
+
+		iter = _skip_blingbling(iter);
+		next = _find_blingbling(iter, end - iter);
+
+		if (next == NULL)
+			next = end;
+
+		memmove(killed_iter, iter, next - iter);
+		killed_iter += next - iter;
+		iter = next;
+	}
+
+	*killed_iter = '\0';
+	return msg;
+}
 
+const gchar *idle_ctcp_kill_blingbling_borrow(const gchar *msg, gchar **copy) {
+	*copy = NULL;
+
+	if (msg == NULL || _find_blingbling(msg, strlen(msg)) == NULL)
+		return msg;
+
+	*copy = idle_ctcp_kill_blingbling_in_place(g_strdup(msg));
+	return *copy;
+}
+
+gchar *idle_ctcp_kill_blingbling(const gchar *msg) {
 	if (msg == NULL)
 		return NULL;
 
-	killed = g_malloc0(strlen(msg) + 1);
-	killed_iter = killed;
+	return idle_ctcp_kill_blingbling_in_place(g_strdup(msg));
+}
 
-	for (const gchar *iter = msg; *iter != '\0';) {
-		switch (*iter) {
-			case '\x03': /* ^C */
+/* The 16 colours every client agrees on; the rest are left as they are */
+static const gchar * const mirc_colours[] = {
+	"#ffffff", "#000000", "#00007f", "#009300", "#ff0000", "#7f0000", "#9c009c", "#fc7f00",
+	"#ffff00", "#00fc00", "#009393", "#00ffff", "#0000fc", "#ff00ff", "#7f7f7f", "#d2d2d2",
+};
+
+typedef struct {
+	gboolean bold;
+	gboolean italic;
+	gboolean underline;
+	gboolean monospace;
+	gboolean reverse;
+	/* -1 for the default */
+	gint fg;
+	gint bg;
+} IdleCTCPFormat;
+
+static gint _parse_colour(const gchar **iter) {
+	gint colour;
+
+	/* Color codes are 1-2 digits */
+	if (!isdigit(**iter))
+		return -1;
+
+	colour = *(*iter)++ - '0';
+
+	if (isdigit(**iter))
+		colour = colour * 10 + (*(*iter)++ - '0');
+
+	return colour;
+}
+
+/* As _skip_blingbling(), but noting what the code does to @format */
+static const gchar *_apply_blingbling(const gchar *iter, IdleCTCPFormat *format) {
+	gint fg, bg = -1;
+
+	switch (*iter++) {
+		case '\x02':
+			format->bold = !format->bold;
+			break;
+
+		case '\x1d':
+			format->italic = !format->italic;
+			break;
+
+		case '\x1f':
+			format->underline = !format->underline;
+			break;
+
+		case '\x11':
+			format->monospace = !format->monospace;
+			break;
+
+		case '\x16':
+			format->reverse = !format->reverse;
+			break;
+
+		case '\x0f':
+			memset(format, 0, sizeof(IdleCTCPFormat));
+			format->fg = format->bg = -1;
+			break;
+
+		case '\x03':
+			fg = _parse_colour(&iter);
+
+			if (*iter == ',') {
 				iter++;
+				bg = _parse_colour(&iter);
+			}
+
+			/* on its own, ^C goes back to the default colours */
+			if (fg == -1 && bg == -1) {
+				format->fg = format->bg = -1;
+				break;
+			}
 
-				/* Color codes are 1-2 digits */
-                                if (isdigit(*iter))
-					iter++;
-                                if (isdigit(*iter))
-					iter++;
+			if (fg != -1)
+				format->fg = fg;
+			if (bg != -1)
+				format->bg = bg;
+			break;
+	}
 
-				if (*iter == ',') {
-					iter++;
+	return iter;
+}
 
-	                                if (isdigit(*iter))
-						iter++;
-	                                if (isdigit(*iter))
-						iter++;
-				}
+static void _append_style(GString *html, gboolean *first, const gchar *property, const gchar *value) {
+	g_string_append_printf(html, "%s%s: %s", *first ? "" : "; ", property, value);
+	*first = FALSE;
+}
+
+/* Opens a span for text in @format, unless it is the default */
+static gboolean _open_span(GString *html, const IdleCTCPFormat *format) {
+	gsize start = html->len;
+	gint fg = format->reverse ? format->bg : format->fg;
+	gint bg = format->reverse ? format->fg : format->bg;
+	gboolean first = TRUE;
+
+	g_string_append(html, "<span style=\"");
+
+	if (format->bold)
+		_append_style(html, &first, "font-weight", "bold");
+	if (format->italic)
+		_append_style(html, &first, "font-style", "italic");
+	if (format->underline)
+		_append_style(html, &first, "text-decoration", "underline");
+	if (format->monospace)
+		_append_style(html, &first, "font-family", "monospace");
+	if (fg >= 0 && fg < (gint) G_N_ELEMENTS(mirc_colours))
+		_append_style(html, &first, "color", mirc_colours[fg]);
+	if (bg >= 0 && bg < (gint) G_N_ELEMENTS(mirc_colours))
+		_append_style(html, &first, "background-color", mirc_colours[bg]);
+
+	if (first) {
+		g_string_truncate(html, start);
+		return FALSE;
+	}
+
+	g_string_append(html, "\">");
+	return TRUE;
+}
+
+static void _append_escaped(GString *html, const gchar *text, gsize len) {
+	for (const gchar *iter = text; iter < text + len; iter++) {
+		switch (*iter) {
+			case '&':
+				g_string_append(html, "&amp;");
 				break;
 
-			case '\x02':
-			case '\x0f':
-			case '\x11':
-			case '\x12':
-			case '\x16':
-			case '\x1d':
-			case '\x1f':
-				iter++;
+			case '<':
+				g_string_append(html, "&lt;");
+				break;
+
+			case '>':
+				g_string_append(html, "&gt;");
+				break;
+
+			case '"':
+				g_string_append(html, "&quot;");
 				break;
 
 			default:
-				*killed_iter++ = *iter++;
+				/* other control characters have no place in markup */
+				if ((guchar) *iter >= 0x20 || *iter == '\t')
+					g_string_append_c(html, *iter);
 		}
 	}
+}
+
+gchar *idle_ctcp_blingbling_to_html(const gchar *msg) {
+	IdleCTCPFormat format = { FALSE, FALSE, FALSE, FALSE, FALSE, -1, -1 };
+	const gchar *end, *iter, *next;
+	gboolean open = FALSE;
+	GString *html;
+
+	if (msg == NULL)
+		return NULL;
+
+	end = msg + strlen(msg);
+	next = _find_blingbling(msg, end - msg);
+
+	if (next == NULL)
+		return NULL;
+
+	html = g_string_sized_new(2 * (end - msg));
+	iter = msg;
+
+	for (;;) {
+		/* the text up to the next code is all in the same format */
+		if (next > iter) {
+			if (!open)
+				open = _open_span(html, &format);
+
+			_append_escaped(html, iter, next - iter);
+		}
+
+		if (next == end)
+			break;
+
+		if (open) {
+			g_string_append(html, "</span>");
+			open = FALSE;
+		}
+
+		iter = _apply_blingbling(next, &format);
+		next = _find_blingbling(iter, end - iter);
+
+		if (next == NULL)
+			next = end;
+	}
+
+	if (open)
+		g_string_append(html, "</span>");
 
-	return killed;
+	return g_string_free(html, FALSE);
 }
 
 gchar **idle_ctcp_decode(const gchar *msg) {
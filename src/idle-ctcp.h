@@ -35,6 +35,11 @@ G_BEGIN_DECLS
 const gchar *idle_ctcp_privmsg(const gchar *target, const gchar *ctcp, IdleConnection *conn);
 const gchar *idle_ctcp_notice(const gchar *target, const gchar *ctcp, IdleConnection *conn);
 
+/* Answer CTCP queries sent to us, within a budget */
+
+void idle_ctcp_init(IdleConnection *conn);
+void idle_ctcp_finalize(GObject *object);
+
 /* Remove formatting blingbling (colors, bold, ...) from a text message
  *
  * The return value is a newly allocated string otherwise identical to msg but with formatting tokens removed.
@@ -43,6 +48,23 @@ const gchar *idle_ctcp_notice(const gchar *target, const gchar *ctcp, IdleConnec
 
 gchar *idle_ctcp_kill_blingbling(const gchar *msg);
 
+/* As idle_ctcp_kill_blingbling(), but in msg itself, which is returned */
+
+gchar *idle_ctcp_kill_blingbling_in_place(gchar *msg);
+
+/* As idle_ctcp_kill_blingbling(), but without copying msg unless it has formatting to remove
+ *
+ * The return value is msg itself if there is none, or else a new string which is also stored in *copy for the caller to free with
+ * g_free(); *copy is set to NULL otherwise. */
+
+const gchar *idle_ctcp_kill_blingbling_borrow(const gchar *msg, gchar **copy);
+
+/* Turn formatting blingbling into HTML: the text of msg, with spans styled as its formatting tokens say
+ *
+ * The return value is NULL if msg has no formatting, and otherwise a newly allocated string. Free with g_free(). */
+
+gchar *idle_ctcp_blingbling_to_html(const gchar *msg);
+
 /* De-escape, deframe and tokenize a CTCP message
  *
  * The return value will be a dynamically allocated array of pointers to dynamically allocated strings which represent the tokens.
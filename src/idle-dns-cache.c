@@ -0,0 +1,262 @@
+/*
+ * This file is part of telepathy-idle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "idle-dns-cache.h"
+
+#define IDLE_DEBUG_FLAG IDLE_DEBUG_NETWORK
+#include "idle-debug.h"
+
+/* One lookup per host name for the whole process, however many connections want it at once; the answer is kept for the next (re)connect.
+ * getaddrinfo() does not tell us the records' TTLs, so answers are kept for a fixed time: long enough to cover a burst of reconnects,
+ * short enough that a server moving is soon noticed.
+ */
+#define DNS_CACHE_TTL 60 /* sec */
+#define DNS_CACHE_NEGATIVE_TTL 10 /* sec */
+#define DNS_CACHE_MAX_ENTRIES 64
+
+typedef struct {
+	gchar *hostname;
+	/* owned GInetAddresses, or NULL with error set if there are none */
+	GList *addresses;
+	GError *error;
+	/* monotonic time the answer goes stale, or 0 while the lookup is running */
+	gint64 expires;
+	/* DnsWaiters for the lookup that is running */
+	GList *waiters;
+} DnsEntry;
+
+typedef struct {
+	DnsEntry *entry;
+	GSimpleAsyncResult *result;
+	GCancellable *cancellable;
+	gulong cancelled_id;
+} DnsWaiter;
+
+/* owned lower-case host name -> owned DnsEntry; like the rest of Idle, only touched from the main thread */
+static GHashTable *cache = NULL;
+
+static void _entry_free(gpointer data) {
+	DnsEntry *entry = data;
+
+	g_assert(entry->waiters == NULL);
+
+	g_free(entry->hostname);
+	g_resolver_free_addresses(entry->addresses);
+	g_clear_error(&entry->error);
+	g_slice_free(DnsEntry, entry);
+}
+
+static GList *_copy_addresses(GList *addresses) {
+	GList *copy = g_list_copy(addresses);
+
+	g_list_foreach(copy, (GFunc) g_object_ref, NULL);
+	return copy;
+}
+
+static void _set_result(GSimpleAsyncResult *result, DnsEntry *entry) {
+	if (entry->error != NULL)
+		g_simple_async_result_set_from_error(result, entry->error);
+	else
+		g_simple_async_result_set_op_res_gpointer(result, _copy_addresses(entry->addresses), (GDestroyNotify) g_resolver_free_addresses);
+}
+
+static void _waiter_free(DnsWaiter *waiter) {
+	if (waiter->cancelled_id != 0)
+		g_signal_handler_disconnect(waiter->cancellable, waiter->cancelled_id);
+
+	if (waiter->cancellable != NULL)
+		g_object_unref(waiter->cancellable);
+
+	g_object_unref(waiter->result);
+	g_slice_free(DnsWaiter, waiter);
+}
+
+/* Only this caller gives up; the lookup carries on for the others, and for the cache */
+static void _waiter_cancelled_cb(GCancellable *cancellable, gpointer user_data) {
+	DnsWaiter *waiter = user_data;
+
+	waiter->entry->waiters = g_list_remove(waiter->entry->waiters, waiter);
+
+	g_simple_async_result_set_error(waiter->result, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation was cancelled");
+	g_simple_async_result_complete_in_idle(waiter->result);
+	_waiter_free(waiter);
+}
+
+static void _lookup_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+	DnsEntry *entry = user_data;
+	GError *error = NULL;
+	GList *waiters;
+	GList *l;
+
+	entry->addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source_object), res, &error);
+
+	if (entry->addresses != NULL) {
+		entry->expires = g_get_monotonic_time() + (gint64) DNS_CACHE_TTL * G_USEC_PER_SEC;
+	} else if (g_error_matches(error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND)) {
+		IDLE_DEBUG("%s: %s", entry->hostname, error->message);
+		entry->error = error;
+		entry->expires = g_get_monotonic_time() + (gint64) DNS_CACHE_NEGATIVE_TTL * G_USEC_PER_SEC;
+	} else {
+		/* a temporary failure says nothing about the next attempt */
+		IDLE_DEBUG("%s: %s; not caching that", entry->hostname, error->message);
+		entry->error = error;
+		entry->expires = g_get_monotonic_time();
+	}
+
+	waiters = entry->waiters;
+	entry->waiters = NULL;
+
+	/* Hand out every answer before running any callbacks, as those may invalidate the entry, or cancel a sibling waiter that
+	 * _waiter_cancelled_cb would then free from under us; so they stop listening for that first */
+	for (l = waiters; l != NULL; l = l->next) {
+		DnsWaiter *waiter = l->data;
+
+		if (waiter->cancelled_id != 0) {
+			g_signal_handler_disconnect(waiter->cancellable, waiter->cancelled_id);
+			waiter->cancelled_id = 0;
+		}
+
+		_set_result(waiter->result, entry);
+	}
+
+	for (l = waiters; l != NULL; l = l->next) {
+		DnsWaiter *waiter = l->data;
+
+		g_simple_async_result_complete(waiter->result);
+		_waiter_free(waiter);
+	}
+
+	g_list_free(waiters);
+}
+
+static gboolean _entry_is_stale(DnsEntry *entry, gint64 now) {
+	return entry->expires != 0 && now >= entry->expires;
+}
+
+static void _make_room(void) {
+	gint64 now = g_get_monotonic_time();
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		if (_entry_is_stale(value, now))
+			g_hash_table_iter_remove(&iter);
+	}
+
+	/* Then any finished lookup; with so many servers about, it hardly matters which */
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_size(cache) >= DNS_CACHE_MAX_ENTRIES && g_hash_table_iter_next(&iter, NULL, &value)) {
+		if (((DnsEntry *) value)->expires != 0)
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
+void idle_dns_cache_lookup_async(const gchar *hostname, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	GSimpleAsyncResult *result = g_simple_async_result_new(NULL, callback, user_data, idle_dns_cache_lookup_async);
+	gchar *key = g_ascii_strdown(hostname, -1);
+	DnsEntry *entry;
+	DnsWaiter *waiter;
+
+	if (cache == NULL)
+		cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _entry_free);
+
+	entry = g_hash_table_lookup(cache, key);
+
+	if (entry != NULL && _entry_is_stale(entry, g_get_monotonic_time())) {
+		g_hash_table_remove(cache, key);
+		entry = NULL;
+	}
+
+	if (entry != NULL && entry->expires != 0) {
+		IDLE_DEBUG("%s: answering from the cache", key);
+		_set_result(result, entry);
+		g_simple_async_result_complete_in_idle(result);
+		g_object_unref(result);
+		g_free(key);
+		return;
+	}
+
+	if (g_cancellable_is_cancelled(cancellable)) {
+		g_simple_async_result_set_error(result, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation was cancelled");
+		g_simple_async_result_complete_in_idle(result);
+		g_object_unref(result);
+		g_free(key);
+		return;
+	}
+
+	if (entry == NULL) {
+		GResolver *resolver = g_resolver_get_default();
+
+		if (g_hash_table_size(cache) >= DNS_CACHE_MAX_ENTRIES)
+			_make_room();
+
+		IDLE_DEBUG("looking up %s", key);
+
+		entry = g_slice_new0(DnsEntry);
+		entry->hostname = key;
+		key = NULL;
+		g_hash_table_insert(cache, entry->hostname, entry);
+
+		g_resolver_lookup_by_name_async(resolver, entry->hostname, NULL, _lookup_ready, entry);
+		g_object_unref(resolver);
+	} else {
+		IDLE_DEBUG("%s: waiting for the lookup already running", key);
+	}
+
+	waiter = g_slice_new0(DnsWaiter);
+	waiter->entry = entry;
+	waiter->result = result;
+	entry->waiters = g_list_append(entry->waiters, waiter);
+
+	if (cancellable != NULL) {
+		waiter->cancellable = g_object_ref(cancellable);
+		waiter->cancelled_id = g_signal_connect(cancellable, "cancelled", G_CALLBACK(_waiter_cancelled_cb), waiter);
+	}
+
+	g_free(key);
+}
+
+/* Returns a list of owned GInetAddresses, to be freed with g_resolver_free_addresses() */
+GList *idle_dns_cache_lookup_finish(GAsyncResult *result, GError **error) {
+	GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT(result);
+
+	g_return_val_if_fail(g_simple_async_result_is_valid(result, NULL, idle_dns_cache_lookup_async), NULL);
+
+	if (g_simple_async_result_propagate_error(simple, error))
+		return NULL;
+
+	return _copy_addresses(g_simple_async_result_get_op_res_gpointer(simple));
+}
+
+/* For when the addresses turned out to be no good, so the next lookup asks again */
+void idle_dns_cache_invalidate(const gchar *hostname) {
+	gchar *key;
+	DnsEntry *entry;
+
+	if (cache == NULL)
+		return;
+
+	key = g_ascii_strdown(hostname, -1);
+	entry = g_hash_table_lookup(cache, key);
+
+	if (entry != NULL && entry->expires != 0)
+		g_hash_table_remove(cache, key);
+
+	g_free(key);
+}
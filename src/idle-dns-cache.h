@@ -0,0 +1,31 @@
+/*
+ * This file is part of telepathy-idle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __IDLE_DNS_CACHE_H__
+#define __IDLE_DNS_CACHE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void idle_dns_cache_lookup_async(const gchar *hostname, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GList *idle_dns_cache_lookup_finish(GAsyncResult *result, GError **error);
+void idle_dns_cache_invalidate(const gchar *hostname);
+
+G_END_DECLS
+
+#endif /* #ifndef __IDLE_DNS_CACHE_H__ */
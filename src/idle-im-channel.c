@@ -35,6 +35,7 @@ static void _destroyable_iface_init(gpointer, gpointer);
 static GPtrArray *idle_im_channel_get_interfaces (TpBaseChannel *channel);
 static void idle_im_channel_close (TpBaseChannel *base);
 static void idle_im_channel_send (GObject *obj, TpMessage *message, TpMessageSendingFlags flags);
+static void idle_im_channel_dispose (GObject *object);
 static void idle_im_channel_finalize (GObject *object);
 
 G_DEFINE_TYPE_WITH_CODE(IdleIMChannel, idle_im_channel, TP_TYPE_BASE_CHANNEL,
@@ -77,6 +78,7 @@ idle_im_channel_constructed (GObject *obj)
       G_N_ELEMENTS (types), types, 0,
       TP_DELIVERY_REPORTING_SUPPORT_FLAG_RECEIVE_FAILURES,
       supported_content_types);
+  idle_text_watch_pending (obj);
 }
 
 static void
@@ -113,6 +115,7 @@ idle_im_channel_class_init (IdleIMChannelClass *idle_im_channel_class)
   g_type_class_add_private (idle_im_channel_class, sizeof (IdleIMChannelPrivate));
 
   object_class->constructed = idle_im_channel_constructed;
+  object_class->dispose = idle_im_channel_dispose;
   object_class->finalize = idle_im_channel_finalize;
 
   base_class->channel_type = TP_IFACE_CHANNEL_TYPE_TEXT;
@@ -125,6 +128,14 @@ idle_im_channel_class_init (IdleIMChannelClass *idle_im_channel_class)
   tp_message_mixin_init_dbus_properties (object_class);
 }
 
+static void
+idle_im_channel_dispose (GObject *object)
+{
+  idle_text_forget_pending (object);
+
+  G_OBJECT_CLASS(idle_im_channel_parent_class)->dispose (object);
+}
+
 static void
 idle_im_channel_finalize (GObject *object)
 {
@@ -138,11 +149,13 @@ idle_im_channel_receive (
     IdleIMChannel *chan,
     TpChannelTextMessageType type,
     TpHandle sender,
-    const gchar *text)
+    const gchar *text,
+    const gchar *html)
 {
   TpBaseConnection *base_conn = tp_base_channel_get_connection (TP_BASE_CHANNEL (chan));
 
-  return idle_text_received (G_OBJECT (chan), base_conn, type, text, sender);
+  return idle_text_received (G_OBJECT (chan), base_conn, type, text, html,
+      sender);
 }
 
 static void
@@ -213,6 +226,7 @@ idle_im_channel_destroy (
   IDLE_DEBUG ("called on %p with %spending messages", obj,
       tp_message_mixin_has_pending_messages (obj, NULL) ? "" : "no ");
 
+  idle_text_forget_pending (obj);
   tp_message_mixin_clear (obj);
   tp_base_channel_destroyed (chan);
 
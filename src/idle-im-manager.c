@@ -161,13 +161,15 @@ static IdleParserHandlerResult _notice_privmsg_handler(IdleParser *parser, IdleP
 	TpHandle handle = (TpHandle) g_value_get_uint(g_value_array_get_nth(args, 0));
 	IdleIMChannel *chan;
 	TpChannelTextMessageType type;
-	gchar *body;
+	const gchar *body;
+	gchar *copy;
+	gchar *html = NULL;
 
 	if (code == IDLE_PARSER_PREFIXCMD_NOTICE_USER) {
 		type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NOTICE;
-		body = idle_ctcp_kill_blingbling(g_value_get_string(g_value_array_get_nth(args, 2)));
+		body = idle_text_strip_formatting(g_value_get_string(g_value_array_get_nth(args, 2)), &copy, idle_connection_get_formatted_messages(priv->conn) ? &html : NULL);
 	} else {
-		gboolean decoded = idle_text_decode(g_value_get_string(g_value_array_get_nth(args, 2)), &type, &body);
+		gboolean decoded = idle_text_decode(g_value_get_string(g_value_array_get_nth(args, 2)), &type, &body, &copy, idle_connection_get_formatted_messages(priv->conn) ? &html : NULL);
 		if (!decoded)
 			return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 	}
@@ -176,15 +178,18 @@ static IdleParserHandlerResult _notice_privmsg_handler(IdleParser *parser, IdleP
 
 	if (!priv->channels) {
 		IDLE_DEBUG("Channels hash table missing, ignoring...");
+		g_free(copy);
+		g_free(html);
 		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 	}
 
 	if (!(chan = g_hash_table_lookup(priv->channels, GUINT_TO_POINTER(handle))))
 		chan = _im_manager_new_channel(manager, handle, handle, NULL);
 
-	idle_im_channel_receive(chan, type, handle, body);
+	idle_im_channel_receive(chan, type, handle, body, html);
 
-	g_free(body);
+	g_free(copy);
+	g_free(html);
 
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
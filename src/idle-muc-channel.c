@@ -164,6 +164,9 @@ struct _IdleMUCChannelPrivate {
 
 	gboolean join_ready;
 
+	/* TRUE from rejoining after a reconnect until the NAMES list that tells us who is still here */
+	gboolean rejoining;
+
 	gboolean dispose_has_run;
 };
 
@@ -225,6 +228,7 @@ idle_muc_channel_constructed (GObject *obj)
 			G_N_ELEMENTS (types), types, 0,
 			TP_DELIVERY_REPORTING_SUPPORT_FLAG_RECEIVE_FAILURES,
 			supported_content_types);
+	idle_text_watch_pending(obj);
 
 	if (tp_base_channel_is_requested (base)) {
 		/* Add ourself to 'remote-pending' while we are joining the channel */
@@ -422,6 +426,7 @@ void idle_muc_channel_dispose (GObject *object) {
 
 	priv->dispose_has_run = TRUE;
 
+	idle_text_forget_pending(object);
         tp_clear_object (&priv->room_config);
 
 	if (G_OBJECT_CLASS (idle_muc_channel_parent_class)->dispose)
@@ -699,10 +704,10 @@ static void change_password_flags(IdleMUCChannel *obj, guint flag, gboolean stat
 	}
 }
 
-gboolean idle_muc_channel_receive(IdleMUCChannel *chan, TpChannelTextMessageType type, TpHandle sender, const gchar *text) {
+gboolean idle_muc_channel_receive(IdleMUCChannel *chan, TpChannelTextMessageType type, TpHandle sender, const gchar *text, const gchar *html) {
 	TpBaseConnection *base_conn = tp_base_channel_get_connection (TP_BASE_CHANNEL (chan));
 
-	return idle_text_received (G_OBJECT (chan), base_conn, type, text, sender);
+	return idle_text_received (G_OBJECT (chan), base_conn, type, text, html, sender);
 }
 
 static void
@@ -861,12 +866,59 @@ void idle_muc_channel_namereply_end(IdleMUCChannel *chan) {
 
 	idle_connection_emit_queued_aliases_changed(IDLE_CONNECTION (base_conn));
 
-	tp_group_mixin_change_members((GObject *) chan, NULL, tp_handle_set_peek(priv->namereply_set), NULL, NULL, NULL, 0, TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
+	if (priv->rejoining) {
+		/* Everybody we still had from before is in the new list unless they left while we were away, so this only signals the difference */
+		TpIntset *departed = tp_intset_difference(tp_handle_set_peek(chan->group.members), tp_handle_set_peek(priv->namereply_set));
+
+		priv->rejoining = FALSE;
+		tp_group_mixin_change_members((GObject *) chan, NULL, tp_handle_set_peek(priv->namereply_set), departed, NULL, NULL, 0, TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
+		tp_intset_destroy(departed);
+	} else {
+		tp_group_mixin_change_members((GObject *) chan, NULL, tp_handle_set_peek(priv->namereply_set), NULL, NULL, NULL, 0, TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
+	}
 
 	tp_handle_set_destroy(priv->namereply_set);
 	priv->namereply_set = NULL;
 }
 
+/* Called for each RPL_WHOREPLY/RPL_WHOSPCRPL about this channel, with the H|G[*][@+] flags field */
+void idle_muc_channel_whoreply(IdleMUCChannel *chan, TpHandle handle, const gchar *flags) {
+	TpBaseConnection *base_conn = tp_base_channel_get_connection (TP_BASE_CHANNEL (chan));
+
+	if (handle == tp_base_connection_get_self_handle (base_conn)) {
+		guint remove = MODE_FLAG_OPERATOR_PRIVILEGE | MODE_FLAG_VOICE_PRIVILEGE | MODE_FLAG_HALFOP_PRIVILEGE;
+		guint add = 0;
+
+		for (; *flags != '\0'; flags++) {
+			switch (*flags) {
+				case '@':
+				case '&':
+					add |= MODE_FLAG_OPERATOR_PRIVILEGE;
+					break;
+
+				case '+':
+					add |= MODE_FLAG_VOICE_PRIVILEGE;
+					break;
+
+				default:
+					break;
+			}
+		}
+
+		remove &= ~add;
+		change_mode_state(chan, add, remove);
+	}
+
+	/* NAMES has normally told us about everybody already; this only catches people it missed */
+	if (!tp_handle_set_is_member(chan->group.members, handle)) {
+		TpIntset *set = tp_intset_new();
+
+		tp_intset_add(set, handle);
+		tp_group_mixin_change_members((GObject *) chan, NULL, set, NULL, NULL, NULL, 0, TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
+		tp_intset_destroy(set);
+	}
+}
+
 static guint _modechar_to_modeflag(gchar modechar) {
 	switch (modechar) {
 		case 'o':
@@ -1095,7 +1147,22 @@ idle_muc_channel_topic_unset (
   idle_muc_channel_topic_full (self, 0, G_MAXINT64, "");
 }
 
+/* We were in the channel before reconnecting, but can't get back in */
+static void _rejoin_failed(IdleMUCChannel *chan, TpChannelGroupChangeReason reason) {
+	TpBaseConnection *base_conn = tp_base_channel_get_connection (TP_BASE_CHANNEL (chan));
+
+	IDLE_DEBUG("couldn't rejoin %s", chan->priv->channel_name);
+
+	chan->priv->rejoining = FALSE;
+	_network_member_left(chan, tp_base_connection_get_self_handle (base_conn), 0, NULL, reason);
+}
+
 void idle_muc_channel_badchannelkey(IdleMUCChannel *chan) {
+	if (chan->priv->rejoining) {
+		_rejoin_failed(chan, TP_CHANNEL_GROUP_CHANGE_REASON_ERROR);
+		return;
+	}
+
 	change_state(chan, MUC_STATE_NEED_PASSWORD);
 }
 
@@ -1107,7 +1174,9 @@ void idle_muc_channel_join_error(IdleMUCChannel *chan, IdleMUCChannelJoinError e
 
 	priv = chan->priv;
 
-	if (!priv->join_ready) {
+	if (priv->rejoining) {
+		_rejoin_failed(chan, (err == MUC_CHANNEL_JOIN_ERROR_BANNED) ? TP_CHANNEL_GROUP_CHANGE_REASON_BANNED : TP_CHANNEL_GROUP_CHANGE_REASON_ERROR);
+	} else if (!priv->join_ready) {
 		priv->join_ready = TRUE;
 
 		g_signal_emit(chan, signals[JOIN_READY], 0, err);
@@ -1116,6 +1185,28 @@ void idle_muc_channel_join_error(IdleMUCChannel *chan, IdleMUCChannelJoinError e
 	}
 }
 
+/* Called once we have reconnected to the server. Returns TRUE if we were in the channel, or on our way in, and so should join it again. */
+gboolean idle_muc_channel_prepare_rejoin(IdleMUCChannel *chan) {
+	IdleMUCChannelPrivate *priv = chan->priv;
+	TpBaseConnection *base_conn = tp_base_channel_get_connection (TP_BASE_CHANNEL (chan));
+
+	if (priv->state == MUC_STATE_JOINED) {
+		priv->rejoining = TRUE;
+		return TRUE;
+	}
+
+	/* Invitations we haven't accepted stay that way */
+	return !priv->join_ready && priv->state < MUC_STATE_NEED_PASSWORD &&
+		!tp_handle_set_is_member(chan->group.local_pending, tp_base_connection_get_self_handle (base_conn));
+}
+
+/* The key we last saw set on the channel, if any */
+const gchar *idle_muc_channel_get_key(IdleMUCChannel *chan) {
+	IdleMUCChannelPrivate *priv = chan->priv;
+
+	return (priv->mode_state.flags & MODE_FLAG_KEY) ? priv->mode_state.key : NULL;
+}
+
 void idle_muc_channel_rename(IdleMUCChannel *chan, TpHandle old_handle, TpHandle new_handle) {
 	TpIntset *add = tp_intset_new();
 	TpIntset *remove = tp_intset_new();
@@ -1163,10 +1254,6 @@ static void send_join_request(IdleMUCChannel *obj, const gchar *password) {
 	send_command (obj, cmd);
 }
 
-void idle_muc_channel_join_attempt(IdleMUCChannel *obj) {
-	send_join_request(obj, NULL);
-}
-
 static gboolean send_invite_request(IdleMUCChannel *obj, TpHandle handle, GError **error) {
 	IdleMUCChannelPrivate *priv;
 	TpBaseChannel *base = TP_BASE_CHANNEL (obj);
@@ -1451,11 +1538,17 @@ idle_muc_channel_set_subject (
     }
   else
     {
+      TpBaseConnection *base_conn = tp_base_channel_get_connection (
+          TP_BASE_CHANNEL (self));
       gchar cmd[IRC_MSG_MAXLEN + 2];
+      gchar *key = g_strdup_printf ("TOPIC %s", priv->channel_name);
 
       g_snprintf (cmd, IRC_MSG_MAXLEN + 2, "TOPIC %s :%s", priv->channel_name,
           subject);
-      send_command (self, cmd);
+      /* only the latest topic matters if several are waiting to go out */
+      idle_connection_send_user_message (IDLE_CONNECTION (base_conn), cmd,
+          key, NULL, NULL, NULL);
+      g_free (key);
       /* FIXME: don't return till we get a reply */
       tp_svc_channel_interface_subject_return_from_set_subject (context);
     }
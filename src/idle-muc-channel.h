@@ -75,24 +75,26 @@ GType idle_muc_channel_get_type(void);
 IdleMUCChannel *idle_muc_channel_new(IdleConnection *conn, TpHandle handle, TpHandle initiator, gboolean requested);
 
 void idle_muc_channel_badchannelkey(IdleMUCChannel *chan);
+const gchar *idle_muc_channel_get_key(IdleMUCChannel *chan);
 void idle_muc_channel_invited(IdleMUCChannel *chan, TpHandle inviter);
 gboolean idle_muc_channel_is_modechar(char c);
 gboolean idle_muc_channel_is_typechar(char c);
 void idle_muc_channel_join(IdleMUCChannel *chan, TpHandle joiner);
-void idle_muc_channel_join_attempt(IdleMUCChannel *chan);
 void idle_muc_channel_join_error(IdleMUCChannel *chan, IdleMUCChannelJoinError err);
 void idle_muc_channel_kick(IdleMUCChannel *chan, TpHandle kicked, TpHandle kicker, const gchar *message);
 void idle_muc_channel_mode(IdleMUCChannel *chan, GValueArray *args);
 void idle_muc_channel_namereply(IdleMUCChannel *chan, GValueArray *args);
 void idle_muc_channel_namereply_end(IdleMUCChannel *chan);
 void idle_muc_channel_part(IdleMUCChannel *chan, TpHandle leaver, const gchar *message);
+gboolean idle_muc_channel_prepare_rejoin(IdleMUCChannel *chan);
 void idle_muc_channel_quit(IdleMUCChannel *chan, TpHandle handle, const gchar *message);
-gboolean idle_muc_channel_receive(IdleMUCChannel *chan, TpChannelTextMessageType type, TpHandle sender, const gchar *msg);
+gboolean idle_muc_channel_receive(IdleMUCChannel *chan, TpChannelTextMessageType type, TpHandle sender, const gchar *msg, const gchar *html);
 void idle_muc_channel_rename(IdleMUCChannel *chan, TpHandle old_handle, TpHandle new_handle);
 void idle_muc_channel_topic(IdleMUCChannel *chan, const gchar *topic);
 void idle_muc_channel_topic_full(IdleMUCChannel *chan, const TpHandle handle, const gint64 timestamp, const gchar *topic);
 void idle_muc_channel_topic_touch(IdleMUCChannel *chan, const TpHandle handle, const gint64 timestamp);
 void idle_muc_channel_topic_unset(IdleMUCChannel *chan);
+void idle_muc_channel_whoreply(IdleMUCChannel *chan, TpHandle handle, const gchar *flags);
 
 gboolean idle_muc_channel_is_ready(IdleMUCChannel *chan);
 
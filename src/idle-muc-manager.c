@@ -22,6 +22,8 @@
 
 #include "idle-muc-manager.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <telepathy-glib/telepathy-glib.h>
@@ -29,6 +31,7 @@
 
 #define IDLE_DEBUG_FLAG IDLE_DEBUG_MUC
 #include "idle-connection.h"
+#include "idle-contact-info.h"
 #include "idle-ctcp.h"
 #include "idle-debug.h"
 #include "idle-muc-channel.h"
@@ -38,6 +41,16 @@
 static void _muc_manager_iface_init(gpointer, gpointer);
 static GObject* _muc_manager_constructor(GType type, guint n_props, GObjectConstructParam *props);
 
+/* Marks the WHOX replies to the queries we send after joining a channel. WHOX replies don't say which channel they are about, but the
+ * server answers queries in order, so the channel is whichever one is at the head of who_queue.
+ */
+#define WHOX_TOKEN "152"
+
+/* How long we wait for more channels to join before sending the JOINs we have, so that joining a whole list of channels takes a few lines
+ * rather than one (flood-limited) line per channel.
+ */
+#define JOIN_BATCH_WINDOW 100 /* ms */
+
 G_DEFINE_TYPE_WITH_CODE(IdleMUCManager, idle_muc_manager, G_TYPE_OBJECT,
 		G_IMPLEMENT_INTERFACE(TP_TYPE_CHANNEL_MANAGER, _muc_manager_iface_init));
 
@@ -56,7 +69,15 @@ struct _IdleMUCManagerPrivate {
 	 * request tokens. */
 	GHashTable *queued_requests;
 
+	/* Room handles of the channels we have sent WHO for and not yet had RPL_ENDOFWHO, oldest first */
+	GQueue *who_queue;
+
+	/* PendingJoins waiting for join_batch_id to send them */
+	GQueue *pending_joins;
+	guint join_batch_id;
+
 	gulong status_changed_id;
+	gulong reconnected_id;
 	gboolean dispose_has_run;
 };
 
@@ -67,6 +88,9 @@ static IdleParserHandlerResult _numeric_namereply_handler(IdleParser *parser, Id
 static IdleParserHandlerResult _numeric_namereply_end_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _numeric_topic_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _numeric_topic_stamp_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
+static IdleParserHandlerResult _numeric_endofwho_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
+static IdleParserHandlerResult _numeric_whoreply_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
+static IdleParserHandlerResult _numeric_whospcrpl_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 
 static IdleParserHandlerResult _invite_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _join_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
@@ -79,6 +103,7 @@ static IdleParserHandlerResult _quit_handler(IdleParser *parser, IdleParserMessa
 static IdleParserHandlerResult _topic_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 
 static void connection_status_changed_cb (IdleConnection *conn, guint status, guint reason, IdleMUCManager *self);
+static void connection_reconnected_cb (IdleConnection *conn, IdleMUCManager *self);
 static void _muc_manager_close_all(IdleMUCManager *manager);
 static void _muc_manager_add_handlers(IdleMUCManager *manager);
 
@@ -127,6 +152,9 @@ _muc_manager_constructor(GType type, guint n_props, GObjectConstructParam *props
 	priv->status_changed_id =
 		g_signal_connect (priv->conn, "status-changed",
 						  (GCallback) connection_status_changed_cb, obj);
+	priv->reconnected_id =
+		g_signal_connect (priv->conn, "reconnected",
+						  (GCallback) connection_reconnected_cb, obj);
 
 	return obj;
 }
@@ -136,6 +164,8 @@ static void idle_muc_manager_init(IdleMUCManager *obj) {
 
 	priv->channels = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
 	priv->queued_requests = g_hash_table_new(NULL, NULL);
+	priv->who_queue = g_queue_new();
+	priv->pending_joins = g_queue_new();
 }
 
 static void idle_muc_manager_get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec) {
@@ -292,6 +322,27 @@ static IdleParserHandlerResult _invite_handler(IdleParser *parser, IdleParserMes
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
 
+/* Fetches the account, real name and away state of everybody in the channel with a single query, rather than leaving clients to WHOIS each
+ * member. It goes out at the lowest priority, so it never holds up anything the user is waiting for.
+ */
+static void _send_who_request(IdleMUCManager *manager, TpHandle room_handle) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	TpHandleRepoIface *room_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(priv->conn), TP_HANDLE_TYPE_ROOM);
+	const gchar *channel_name = tp_handle_inspect(room_handles, room_handle);
+	gchar cmd[IRC_MSG_MAXLEN + 1];
+
+	if (idle_connection_get_isupport(priv->conn, "WHOX") != NULL)
+		g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "WHO %s %%tnuhraf," WHOX_TOKEN, channel_name);
+	else
+		g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "WHO %s", channel_name);
+
+	/* the replies are matched to the queue in order, so it only gets what actually went out */
+	if (idle_connection_send_low_priority(priv->conn, cmd))
+		g_queue_push_tail(priv->who_queue, GUINT_TO_POINTER(room_handle));
+	else
+		IDLE_DEBUG("no room to ask who is in %s", channel_name);
+}
+
 static IdleParserHandlerResult _join_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleMUCManager *manager = IDLE_MUC_MANAGER(user_data);
 	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
@@ -316,6 +367,9 @@ static IdleParserHandlerResult _join_handler(IdleParser *parser, IdleParserMessa
 
 	idle_muc_channel_join(chan, joiner_handle);
 
+	if (joiner_handle == tp_base_connection_get_self_handle(TP_BASE_CONNECTION(priv->conn)))
+		_send_who_request(manager, room_handle);
+
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
 
@@ -376,6 +430,79 @@ static IdleParserHandlerResult _numeric_namereply_end_handler(IdleParser *parser
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
 
+static void _who_reply(IdleMUCManager *manager, TpHandle room_handle, TpHandle handle, const gchar *flags, const gchar *account, const gchar *realname) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	IdleMUCChannel *chan;
+
+	idle_contact_info_update_from_who(priv->conn, handle, flags, account, realname);
+
+	if (!priv->channels) {
+		IDLE_DEBUG("Channels hash table missing, ignoring...");
+		return;
+	}
+
+	chan = g_hash_table_lookup(priv->channels, GUINT_TO_POINTER(room_handle));
+
+	if (chan)
+		idle_muc_channel_whoreply(chan, handle, flags);
+}
+
+/* TRUE if replies about @room_handle are answering the query at the head of who_queue, rather than one somebody else sent */
+static gboolean _who_is_ours(IdleMUCManager *manager, TpHandle room_handle) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+
+	return !g_queue_is_empty(priv->who_queue) && GPOINTER_TO_UINT(g_queue_peek_head(priv->who_queue)) == room_handle;
+}
+
+static IdleParserHandlerResult _numeric_whoreply_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	TpHandle room_handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 4));
+	const gchar *flags = g_value_get_string(g_value_array_get_nth(args, 5));
+	const gchar *trailing = g_value_get_string(g_value_array_get_nth(args, 6));
+	const gchar *realname = strchr(trailing, ' ');
+
+	if (!_who_is_ours(IDLE_MUC_MANAGER(user_data), room_handle))
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	/* The trailing parameter is "<hopcount> <real name>" */
+	realname = (realname != NULL) ? realname + 1 : "";
+
+	_who_reply(IDLE_MUC_MANAGER(user_data), room_handle, handle, flags, NULL, realname);
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+static IdleParserHandlerResult _numeric_whospcrpl_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(user_data);
+	const gchar *token = g_value_get_string(g_value_array_get_nth(args, 0));
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 3));
+	const gchar *flags = g_value_get_string(g_value_array_get_nth(args, 4));
+	const gchar *account = g_value_get_string(g_value_array_get_nth(args, 5));
+	const gchar *realname = (args->n_values > 6) ? g_value_get_string(g_value_array_get_nth(args, 6)) : "";
+
+	if (tp_strdiff(token, WHOX_TOKEN) || g_queue_is_empty(priv->who_queue))
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	_who_reply(IDLE_MUC_MANAGER(user_data), GPOINTER_TO_UINT(g_queue_peek_head(priv->who_queue)), handle, flags, account, realname);
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+static IdleParserHandlerResult _numeric_endofwho_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(user_data);
+	TpHandle room_handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+
+	idle_connection_emit_queued_aliases_changed(priv->conn);
+
+	/* The end of a WHO somebody else sent, through IRCCommand or the like */
+	if (!_who_is_ours(IDLE_MUC_MANAGER(user_data), room_handle))
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	g_queue_pop_head(priv->who_queue);
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
 static IdleParserHandlerResult _mode_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
 	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(user_data);
 	TpHandle room_handle = g_value_get_uint(g_value_array_get_nth(args, 0));
@@ -427,7 +554,9 @@ static IdleParserHandlerResult _notice_privmsg_handler(IdleParser *parser, IdleP
 	TpHandle room_handle = (TpHandle) g_value_get_uint(g_value_array_get_nth(args, 1));
 	IdleMUCChannel *chan;
 	TpChannelTextMessageType type;
-	gchar *body;
+	const gchar *body;
+	gchar *copy;
+	gchar *html = NULL;
 
 	if (!priv->channels) {
 		IDLE_DEBUG("Channels hash table missing, ignoring...");
@@ -443,17 +572,18 @@ static IdleParserHandlerResult _notice_privmsg_handler(IdleParser *parser, IdleP
 
 	if (code == IDLE_PARSER_PREFIXCMD_NOTICE_CHANNEL) {
 		type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NOTICE;
-		body = idle_ctcp_kill_blingbling(g_value_get_string(g_value_array_get_nth(args, 2)));
+		body = idle_text_strip_formatting(g_value_get_string(g_value_array_get_nth(args, 2)), &copy, idle_connection_get_formatted_messages(priv->conn) ? &html : NULL);
 	} else {
-		gboolean decoded = idle_text_decode(g_value_get_string(g_value_array_get_nth(args, 2)), &type, &body);
+		gboolean decoded = idle_text_decode(g_value_get_string(g_value_array_get_nth(args, 2)), &type, &body, &copy, idle_connection_get_formatted_messages(priv->conn) ? &html : NULL);
 		if (!decoded)
 			return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
 	}
 
 	if (chan)
-		idle_muc_channel_receive(chan, type, sender_handle, body);
+		idle_muc_channel_receive(chan, type, sender_handle, body, html);
 
-	g_free(body);
+	g_free(copy);
+	g_free(html);
 
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
@@ -528,6 +658,183 @@ static IdleParserHandlerResult _topic_handler(IdleParser *parser, IdleParserMess
 	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
 
+typedef struct {
+	TpHandle room_handle;
+	gchar *key;
+} PendingJoin;
+
+static void _pending_join_free(gpointer data, gpointer user_data) {
+	PendingJoin *join = data;
+
+	g_free(join->key);
+	g_slice_free(PendingJoin, join);
+}
+
+/* Returns the most channels the server lets us put in one JOIN, or 0 if it doesn't say */
+static guint _get_join_target_limit(IdleMUCManager *manager) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	const gchar *targmax = idle_connection_get_isupport(priv->conn, "TARGMAX");
+	gchar **limits;
+	gchar **limit;
+	guint ret = 0;
+
+	if (targmax == NULL)
+		return 0;
+
+	/* TARGMAX=PRIVMSG:4,JOIN:,... where an empty limit means there isn't one */
+	limits = g_strsplit(targmax, ",", -1);
+
+	for (limit = limits; *limit != NULL; limit++) {
+		if (g_ascii_strncasecmp(*limit, "JOIN:", 5) == 0) {
+			ret = strtoul(*limit + 5, NULL, 10);
+			break;
+		}
+	}
+
+	g_strfreev(limits);
+
+	return ret;
+}
+
+static void _send_join_line(IdleMUCManager *manager, GString *channels, GString *keys) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	gchar *cmd;
+
+	if (keys->len > 0)
+		cmd = g_strdup_printf("JOIN %s %s", channels->str, keys->str);
+	else
+		cmd = g_strdup_printf("JOIN %s", channels->str);
+
+	idle_connection_send(priv->conn, cmd);
+	g_free(cmd);
+
+	g_string_truncate(channels, 0);
+	g_string_truncate(keys, 0);
+}
+
+static gboolean _send_pending_joins(gpointer user_data) {
+	IdleMUCManager *manager = IDLE_MUC_MANAGER(user_data);
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	TpHandleRepoIface *room_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(priv->conn), TP_HANDLE_TYPE_ROOM);
+	guint max_targets = _get_join_target_limit(manager);
+	GString *channels = g_string_new(NULL);
+	GString *keys = g_string_new(NULL);
+	GList *keyed = NULL;
+	GList *unkeyed = NULL;
+	GList *joins;
+	GList *l;
+	PendingJoin *join;
+	guint n_targets = 0;
+
+	priv->join_batch_id = 0;
+
+	/* Keys go with the channels at the start of the list, so put the channels that have one first */
+	while ((join = g_queue_pop_head(priv->pending_joins)) != NULL) {
+		if (join->key != NULL)
+			keyed = g_list_prepend(keyed, join);
+		else
+			unkeyed = g_list_prepend(unkeyed, join);
+	}
+
+	joins = g_list_concat(g_list_reverse(keyed), g_list_reverse(unkeyed));
+
+	for (l = joins; l != NULL; l = l->next) {
+		const gchar *name;
+		gsize length;
+
+		join = l->data;
+
+		/* Somebody may have given up on the channel while it was waiting */
+		if (priv->channels == NULL || g_hash_table_lookup(priv->channels, GUINT_TO_POINTER(join->room_handle)) == NULL)
+			continue;
+
+		name = tp_handle_inspect(room_handles, join->room_handle);
+
+		/* "JOIN " channels[,name] [keys[,key]] */
+		length = 5 + channels->len + (channels->len > 0 ? 1 : 0) + strlen(name);
+		if (keys->len > 0 || join->key != NULL)
+			length += 1 + keys->len + (keys->len > 0 ? 1 : 0) + (join->key != NULL ? strlen(join->key) : 0);
+
+		if (n_targets > 0 && (length > IRC_MSG_MAXLEN || (max_targets != 0 && n_targets >= max_targets))) {
+			_send_join_line(manager, channels, keys);
+			n_targets = 0;
+		}
+
+		if (channels->len > 0)
+			g_string_append_c(channels, ',');
+		g_string_append(channels, name);
+
+		if (join->key != NULL) {
+			if (keys->len > 0)
+				g_string_append_c(keys, ',');
+			g_string_append(keys, join->key);
+		}
+
+		n_targets++;
+	}
+
+	if (n_targets > 0)
+		_send_join_line(manager, channels, keys);
+
+	g_list_foreach(joins, _pending_join_free, NULL);
+	g_list_free(joins);
+	g_string_free(channels, TRUE);
+	g_string_free(keys, TRUE);
+
+	return FALSE;
+}
+
+static void _queue_join(IdleMUCManager *manager, TpHandle room_handle, const gchar *key) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	PendingJoin *join = g_slice_new0(PendingJoin);
+
+	join->room_handle = room_handle;
+	join->key = g_strdup(key);
+	g_queue_push_tail(priv->pending_joins, join);
+
+	if (priv->join_batch_id == 0)
+		priv->join_batch_id = g_timeout_add(JOIN_BATCH_WINDOW, _send_pending_joins, manager);
+}
+
+static void _muc_manager_auto_join(IdleMUCManager *manager) {
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
+	TpHandleRepoIface *room_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(priv->conn), TP_HANDLE_TYPE_ROOM);
+	gchar **auto_join = NULL;
+	gchar **entry;
+
+	g_object_get(priv->conn, "auto-join", &auto_join, NULL);
+
+	if (auto_join == NULL)
+		return;
+
+	for (entry = auto_join; *entry != NULL; entry++) {
+		gchar **name_and_key = g_strsplit(g_strstrip(*entry), " ", 2);
+		gchar *key = (name_and_key[0] != NULL) ? name_and_key[1] : NULL;
+		TpHandle handle = 0;
+		GError *error = NULL;
+
+		if (name_and_key[0] != NULL)
+			handle = tp_handle_ensure(room_handles, name_and_key[0], NULL, &error);
+
+		if (handle == 0) {
+			IDLE_DEBUG("not auto-joining '%s': %s", *entry, (error != NULL) ? error->message : "no channel name");
+			g_clear_error(&error);
+		} else if (g_hash_table_lookup(priv->channels, GUINT_TO_POINTER(handle)) == NULL) {
+			/* Like channels a bouncer puts us in, these aren't anybody's request; they get announced once we're in */
+			_muc_manager_new_channel(manager, handle, 0, FALSE);
+
+			if (key != NULL)
+				g_strstrip(key);
+
+			_queue_join(manager, handle, tp_str_empty(key) ? NULL : key);
+		}
+
+		g_strfreev(name_and_key);
+	}
+
+	g_strfreev(auto_join);
+}
+
 static void _muc_manager_close_all(IdleMUCManager *manager)
 {
 	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(manager);
@@ -537,6 +844,24 @@ static void _muc_manager_close_all(IdleMUCManager *manager)
 		priv->status_changed_id = 0;
 	}
 
+	if (priv->reconnected_id != 0) {
+		g_signal_handler_disconnect (priv->conn, priv->reconnected_id);
+		priv->reconnected_id = 0;
+	}
+
+	if (priv->who_queue)
+		g_queue_clear(priv->who_queue);
+
+	if (priv->join_batch_id != 0) {
+		g_source_remove(priv->join_batch_id);
+		priv->join_batch_id = 0;
+	}
+
+	if (priv->pending_joins) {
+		g_queue_foreach(priv->pending_joins, _pending_join_free, NULL);
+		g_queue_clear(priv->pending_joins);
+	}
+
 	if (!priv->channels) {
 		IDLE_DEBUG("Channels already closed, ignoring...");
 		return;
@@ -556,6 +881,7 @@ connection_status_changed_cb (IdleConnection *conn,
 	{
 		case TP_CONNECTION_STATUS_CONNECTED:
 			_muc_manager_add_handlers(self);
+			_muc_manager_auto_join(self);
 			break;
 		case TP_CONNECTION_STATUS_DISCONNECTED:
 			idle_parser_remove_handlers_by_data(priv->conn->parser, self);
@@ -564,6 +890,43 @@ connection_status_changed_cb (IdleConnection *conn,
 	}
 }
 
+/* The channels are still here from before we lost the server; all we need to do is get back into them, as few lines as that takes */
+static void
+connection_reconnected_cb (IdleConnection *conn,
+						   IdleMUCManager *self)
+{
+	IdleMUCManagerPrivate *priv = IDLE_MUC_MANAGER_GET_PRIVATE(self);
+	GHashTableIter iter;
+	gpointer key, value;
+	GList *l;
+
+	if (!priv->channels)
+		return;
+
+	/* whatever we were waiting to hear back about went with the old connection */
+	g_queue_clear(priv->who_queue);
+
+	g_hash_table_iter_init(&iter, priv->channels);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		TpHandle handle = GPOINTER_TO_UINT(key);
+		gboolean pending = FALSE;
+
+		if (!idle_muc_channel_prepare_rejoin(value))
+			continue;
+
+		for (l = g_queue_peek_head_link(priv->pending_joins); l != NULL && !pending; l = l->next)
+			pending = (((PendingJoin *) l->data)->room_handle == handle);
+
+		if (!pending)
+			_queue_join(self, handle, idle_muc_channel_get_key(value));
+	}
+
+	/* Send them now rather than after the batching window, so they are queued ahead of the messages held while we were away */
+	if (priv->join_batch_id != 0) {
+		g_source_remove(priv->join_batch_id);
+		_send_pending_joins(self);
+	}
+}
 
 static void _muc_manager_add_handlers(IdleMUCManager *manager)
 {
@@ -571,6 +934,7 @@ static void _muc_manager_add_handlers(IdleMUCManager *manager)
 
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_BADCHANNELKEY, _numeric_error_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_BANNEDFROMCHAN, _numeric_error_handler, manager);
+	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_ENDOFWHO, _numeric_endofwho_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_CHANNELISFULL, _numeric_error_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_INVITEONLYCHAN, _numeric_error_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_MODEREPLY, _mode_handler, manager);
@@ -578,6 +942,8 @@ static void _muc_manager_add_handlers(IdleMUCManager *manager)
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_NAMEREPLY_END, _numeric_namereply_end_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_TOPIC, _numeric_topic_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_TOPIC_STAMP, _numeric_topic_stamp_handler, manager);
+	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_WHOREPLY, _numeric_whoreply_handler, manager);
+	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_NUMERIC_WHOSPCRPL, _numeric_whospcrpl_handler, manager);
 
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_PREFIXCMD_INVITE, _invite_handler, manager);
 	idle_parser_add_handler(priv->conn->parser, IDLE_PARSER_PREFIXCMD_JOIN, _join_handler, manager);
@@ -833,7 +1199,7 @@ _muc_manager_request (
     {
       channel = _muc_manager_new_channel (self, handle,
           tp_base_connection_get_self_handle (base_conn), TRUE);
-      idle_muc_channel_join_attempt (channel);
+      _queue_join (self, handle, NULL);
     }
 
   associate_request (self, channel, request_token);
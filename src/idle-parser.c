@@ -43,6 +43,7 @@ G_DEFINE_TYPE(IdleParser, idle_parser, G_TYPE_OBJECT);
 /* signals */
 enum {
 	SIGNAL_MSG_SPLIT = 0,
+	SIGNAL_SUBSCRIBED_LINE,
 	LAST_SIGNAL_ENUM
 };
 
@@ -76,8 +77,12 @@ static const MessageSpec message_specs[] = {
 	{"ERROR", "I:", IDLE_PARSER_CMD_ERROR},
 	{"PING", "Is", IDLE_PARSER_CMD_PING},
 
+	{"ACCOUNT", "cIs", IDLE_PARSER_PREFIXCMD_ACCOUNT},
+	{"AWAY", "cI.", IDLE_PARSER_PREFIXCMD_AWAY},
+	{"CAP", "IIIvs", IDLE_PARSER_PREFIXCMD_CAP},
 	{"INVITE", "cIcr", IDLE_PARSER_PREFIXCMD_INVITE},
 	{"JOIN", "cIr", IDLE_PARSER_PREFIXCMD_JOIN},
+	{"JOIN", "cIrs:", IDLE_PARSER_PREFIXCMD_JOIN_EXTENDED},
 	{"KICK", "cIrc.", IDLE_PARSER_PREFIXCMD_KICK},
 	{"MODE", "IIrvs", IDLE_PARSER_PREFIXCMD_MODE_CHANNEL},
 	{"MODE", "IIcvs", IDLE_PARSER_PREFIXCMD_MODE_USER},
@@ -96,9 +101,15 @@ static const MessageSpec message_specs[] = {
 	{"474", "IIIr", IDLE_PARSER_NUMERIC_BANNEDFROMCHAN},
 	{"404", "IIIr", IDLE_PARSER_NUMERIC_CANNOTSENDTOCHAN},
 	{"471", "IIIr", IDLE_PARSER_NUMERIC_CHANNELISFULL},
+	{"315", "IIIr", IDLE_PARSER_NUMERIC_ENDOFWHO},
 	{"318", "IIIc", IDLE_PARSER_NUMERIC_ENDOFWHOIS},
 	{"432", "III", IDLE_PARSER_NUMERIC_ERRONEOUSNICKNAME},
 	{"473", "IIIr", IDLE_PARSER_NUMERIC_INVITEONLYCHAN},
+	{"303", "III.", IDLE_PARSER_NUMERIC_ISON},
+	{"005", "IIIvs", IDLE_PARSER_NUMERIC_ISUPPORT},
+	{"734", "IIIds.", IDLE_PARSER_NUMERIC_MONLISTFULL},
+	{"731", "III:", IDLE_PARSER_NUMERIC_MONOFFLINE},
+	{"730", "III:", IDLE_PARSER_NUMERIC_MONONLINE},
 	{"324", "IIIrvs", IDLE_PARSER_NUMERIC_MODEREPLY},
 	{"353", "IIIIrvC", IDLE_PARSER_NUMERIC_NAMEREPLY},
 	{"366", "IIIr", IDLE_PARSER_NUMERIC_NAMEREPLY_END},
@@ -111,6 +122,8 @@ static const MessageSpec message_specs[] = {
 	{"263", "IIIs:", IDLE_PARSER_NUMERIC_TRYAGAIN},
 	{"305", "III", IDLE_PARSER_NUMERIC_UNAWAY},
 	{"001", "IIc", IDLE_PARSER_NUMERIC_WELCOME},
+	{"352", "IIIrssscs:", IDLE_PARSER_NUMERIC_WHOREPLY},
+	{"354", "IIIssscss.", IDLE_PARSER_NUMERIC_WHOSPCRPL},
 	{"319", "IIIc.", IDLE_PARSER_NUMERIC_WHOISCHANNELS},
 	{"378", "IIIc:", IDLE_PARSER_NUMERIC_WHOISHOST},
 	{"330", "IIIcs:", IDLE_PARSER_NUMERIC_WHOISLOGGEDIN},
@@ -120,7 +133,7 @@ static const MessageSpec message_specs[] = {
 	{"312", "IIIcs:", IDLE_PARSER_NUMERIC_WHOISSERVER},
 	{"311", "IIIcssI:", IDLE_PARSER_NUMERIC_WHOISUSER},
 	{"317", "IIIcd", IDLE_PARSER_NUMERIC_WHOISIDLE},
-	{"322", "IIIrd.", IDLE_PARSER_NUMERIC_LIST},
+	{"322", "IIIsd.", IDLE_PARSER_NUMERIC_LIST},
 	{"323", "I", IDLE_PARSER_NUMERIC_LISTEND},
 	{"421", "IIIs:", IDLE_PARSER_NUMERIC_UNKNOWNCOMMAND},
 
@@ -154,6 +167,9 @@ struct _IdleParserPrivate {
 
 	/* message handlers */
 	GSList *handlers[IDLE_PARSER_LAST_MESSAGE_CODE];
+
+	/* upper-case commands whose lines are passed on whole as "subscribed-line"; NULL if there are none */
+	GHashTable *subscriptions;
 };
 
 static void idle_parser_init(IdleParser *obj) {
@@ -191,6 +207,9 @@ static void idle_parser_finalize(GObject *obj) {
 
 		g_slist_free(priv->handlers[i]);
 	}
+
+	if (priv->subscriptions != NULL)
+		g_hash_table_unref(priv->subscriptions);
 }
 
 static void idle_parser_class_init(IdleParserClass *klass) {
@@ -206,10 +225,12 @@ static void idle_parser_class_init(IdleParserClass *klass) {
 	g_object_class_install_property(object_class, PROP_CONNECTION, g_param_spec_object("connection", "IdleConnection object", "The IdleConnection object of which handle repos this IdleParser object uses", IDLE_TYPE_CONNECTION, G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_NICK | G_PARAM_STATIC_BLURB));
 
 	signals[SIGNAL_MSG_SPLIT] = g_signal_new("msg-split", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED, 0, NULL, NULL, g_cclosure_marshal_VOID__STRING, G_TYPE_NONE, 1, G_TYPE_STRING);
+	signals[SIGNAL_SUBSCRIBED_LINE] = g_signal_new("subscribed-line", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_generic, G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_STRING);
 }
 
 static void _parse_message(IdleParser *parser, const gchar *split_msg);
 static void _parse_and_forward_one(IdleParser *parser, gchar **tokens, IdleParserMessageCode code, const gchar *format);
+static void _forward_subscribed(IdleParser *parser, gchar **tokens, gboolean prefixed, const gchar *line);
 static gboolean _parse_atom(IdleParser *parser, GValueArray *arr, char atom, const gchar *token, TpHandleSet *contact_reffed, TpHandleSet *room_reffed);
 
 #ifndef HAVE_STRNLEN
@@ -270,11 +291,39 @@ void idle_parser_receive(IdleParser *parser, const gchar *msg) {
 		memset(priv->split_buf, '\0', IRC_MSG_MAXLEN + 3);
 }
 
+/* Forgets any partial line left over from a connection that has gone away */
+void idle_parser_reset(IdleParser *parser) {
+	IdleParserPrivate *priv = IDLE_PARSER_GET_PRIVATE(parser);
+
+	memset(priv->split_buf, '\0', IRC_MSG_MAXLEN + 3);
+}
+
 void idle_parser_add_handler(IdleParser *parser, IdleParserMessageCode code, IdleParserMessageHandler handler, gpointer user_data) {
 	idle_parser_add_handler_with_priority(parser, code, handler, user_data, IDLE_PARSER_HANDLER_PRIORITY_DEFAULT);
 	return;
 }
 
+/* Replaces the commands whose lines are emitted whole as "subscribed-line"; NULL or an empty list stops them */
+void idle_parser_set_subscriptions(IdleParser *parser, const gchar * const *commands) {
+	IdleParserPrivate *priv = IDLE_PARSER_GET_PRIVATE(parser);
+
+	if (priv->subscriptions != NULL) {
+		g_hash_table_unref(priv->subscriptions);
+		priv->subscriptions = NULL;
+	}
+
+	if (commands == NULL || commands[0] == NULL)
+		return;
+
+	priv->subscriptions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (; *commands != NULL; commands++) {
+		gchar *command = g_ascii_strup(*commands, -1);
+
+		g_hash_table_insert(priv->subscriptions, command, command);
+	}
+}
+
 static gint _message_handler_closure_priority_compare(gconstpointer a, gconstpointer b) {
 	const MessageHandlerClosure *_a = a, *_b = b;
 
@@ -348,7 +397,25 @@ static void _free_tokens(gchar **tokens) {
 }
 
 static void _parse_message(IdleParser *parser, const gchar *split_msg) {
-	gchar **tokens = _tokenize(split_msg);
+	IdleParserPrivate *priv = IDLE_PARSER_GET_PRIVATE(parser);
+	const gchar *line = split_msg;
+	gchar **tokens;
+
+	/* Tags, such as those on lines in a batch, are ignored: each line is handled on its own */
+	if (split_msg[0] == '@') {
+		split_msg = strchr(split_msg, ' ');
+
+		if (split_msg == NULL)
+			return;
+
+		while (*split_msg == ' ')
+			split_msg++;
+
+		if (*split_msg == '\0')
+			return;
+	}
+
+	tokens = _tokenize(split_msg);
 	IDLE_DEBUG("parsing \"%s\"", split_msg);
 
 	for (int i = 0; i < IDLE_PARSER_LAST_MESSAGE_CODE; i++) {
@@ -363,9 +430,28 @@ static void _parse_message(IdleParser *parser, const gchar *split_msg) {
 		}
 	}
 
+	if (priv->subscriptions != NULL)
+		_forward_subscribed(parser, tokens, split_msg[0] == ':', line);
+
 	_free_tokens(tokens);
 }
 
+static void _forward_subscribed(IdleParser *parser, gchar **tokens, gboolean prefixed, const gchar *line) {
+	IdleParserPrivate *priv = IDLE_PARSER_GET_PRIVATE(parser);
+	const gchar *command = prefixed ? tokens[2] : tokens[0];
+	gchar *upper;
+
+	if (command == NULL)
+		return;
+
+	upper = g_ascii_strup(command, -1);
+
+	if (g_hash_table_contains(priv->subscriptions, upper))
+		g_signal_emit(parser, signals[SIGNAL_SUBSCRIBED_LINE], 0, upper, line);
+
+	g_free(upper);
+}
+
 static void _parse_and_forward_one(IdleParser *parser, gchar **tokens, IdleParserMessageCode code, const gchar *format) {
 	IdleParserPrivate *priv = IDLE_PARSER_GET_PRIVATE(parser);
 	GValueArray *args = g_value_array_new(3);
@@ -51,8 +51,12 @@ typedef enum {
 
 	IDLE_PARSER_LAST_NON_PREFIX_CMD = IDLE_PARSER_CMD_PING,
 
+	IDLE_PARSER_PREFIXCMD_ACCOUNT,
+	IDLE_PARSER_PREFIXCMD_AWAY,
+	IDLE_PARSER_PREFIXCMD_CAP,
 	IDLE_PARSER_PREFIXCMD_INVITE,
 	IDLE_PARSER_PREFIXCMD_JOIN,
+	IDLE_PARSER_PREFIXCMD_JOIN_EXTENDED,
 	IDLE_PARSER_PREFIXCMD_KICK,
 	IDLE_PARSER_PREFIXCMD_MODE_CHANNEL,
 	IDLE_PARSER_PREFIXCMD_MODE_USER,
@@ -71,9 +75,15 @@ typedef enum {
 	IDLE_PARSER_NUMERIC_BANNEDFROMCHAN,
 	IDLE_PARSER_NUMERIC_CANNOTSENDTOCHAN,
 	IDLE_PARSER_NUMERIC_CHANNELISFULL,
+	IDLE_PARSER_NUMERIC_ENDOFWHO,
 	IDLE_PARSER_NUMERIC_ENDOFWHOIS,
 	IDLE_PARSER_NUMERIC_ERRONEOUSNICKNAME,
 	IDLE_PARSER_NUMERIC_INVITEONLYCHAN,
+	IDLE_PARSER_NUMERIC_ISON,
+	IDLE_PARSER_NUMERIC_ISUPPORT,
+	IDLE_PARSER_NUMERIC_MONLISTFULL,
+	IDLE_PARSER_NUMERIC_MONOFFLINE,
+	IDLE_PARSER_NUMERIC_MONONLINE,
 	IDLE_PARSER_NUMERIC_MODEREPLY,
 	IDLE_PARSER_NUMERIC_NAMEREPLY,
 	IDLE_PARSER_NUMERIC_NAMEREPLY_END,
@@ -86,6 +96,8 @@ typedef enum {
 	IDLE_PARSER_NUMERIC_TRYAGAIN,
 	IDLE_PARSER_NUMERIC_UNAWAY,
 	IDLE_PARSER_NUMERIC_WELCOME,
+	IDLE_PARSER_NUMERIC_WHOREPLY,
+	IDLE_PARSER_NUMERIC_WHOSPCRPL,
 	IDLE_PARSER_NUMERIC_WHOISCHANNELS,
 	IDLE_PARSER_NUMERIC_WHOISHOST,
 	IDLE_PARSER_NUMERIC_WHOISLOGGEDIN,
@@ -131,9 +143,11 @@ typedef IdleParserHandlerResult (*IdleParserMessageHandler)(IdleParser *parser,
 GType idle_parser_get_type(void);
 
 void idle_parser_receive(IdleParser *parser, const gchar *raw_msg);
+void idle_parser_reset(IdleParser *parser);
 void idle_parser_add_handler(IdleParser *parser, IdleParserMessageCode code, IdleParserMessageHandler handler, gpointer user_data);
 void idle_parser_add_handler_with_priority(IdleParser *parser, IdleParserMessageCode code, IdleParserMessageHandler handler, gpointer user_data, IdleParserHandlerPriority priority);
 void idle_parser_remove_handlers_by_data(IdleParser *parser, gpointer user_data);
+void idle_parser_set_subscriptions(IdleParser *parser, const gchar * const *commands);
 
 G_END_DECLS
 
@@ -0,0 +1,694 @@
+/*
+ * This file is part of telepathy-idle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "idle-presence.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <telepathy-glib/telepathy-glib-dbus.h>
+
+#define IDLE_DEBUG_FLAG IDLE_DEBUG_CONNECTION
+#include "idle-debug.h"
+#include "idle-parser.h"
+
+/* Contacts are watched with MONITOR where the server supports it, and polled with ISON otherwise (or once the server's MONITOR list is
+ * full). Either way we send at most one presence line every PRESENCE_LINE_INTERVAL, and poll each contact at most once every
+ * PRESENCE_POLL_INTERVAL; tracking more contacts than fit in that budget just makes a full round of polls take longer.
+ */
+#define PRESENCE_LINE_INTERVAL 5 /* sec */
+#define PRESENCE_POLL_INTERVAL 60 /* sec */
+
+/* How many contacts we track at once; asking about one more stops us tracking whoever was asked about least recently */
+#define PRESENCE_MAX_TRACKED 500
+
+/* Makes the intervals above milliseconds rather than seconds, so the test suite runs in finite time. */
+static gboolean presence_faster = FALSE;
+
+enum {
+	IDLE_PRESENCE_AVAILABLE,
+	IDLE_PRESENCE_AWAY,
+	IDLE_PRESENCE_OFFLINE,
+	IDLE_PRESENCE_UNKNOWN,
+	IDLE_PRESENCE_LAST
+};
+
+static const TpPresenceStatusOptionalArgumentSpec away_arguments[] = {
+	{"message", "s"},
+	{NULL}
+};
+
+static const TpPresenceStatusSpec presence_statuses[] = {
+	{"available", TP_CONNECTION_PRESENCE_TYPE_AVAILABLE, TRUE, NULL},
+	{"away", TP_CONNECTION_PRESENCE_TYPE_AWAY, TRUE, away_arguments},
+	{"offline", TP_CONNECTION_PRESENCE_TYPE_OFFLINE, FALSE, NULL},
+	{"unknown", TP_CONNECTION_PRESENCE_TYPE_UNKNOWN, FALSE, NULL},
+	{NULL}
+};
+
+typedef struct _PresenceEntry PresenceEntry;
+
+struct _PresenceEntry {
+	guint status;
+	gchar *message;
+	/* TRUE if the server is watching this contact for us with MONITOR, FALSE if we have to poll it */
+	gboolean monitored;
+	GList *lru_link;
+};
+
+struct _IdlePresenceTracker {
+	/* TpHandle -> PresenceEntry, for every contact somebody has asked about */
+	GHashTable *contacts;
+	/* The same TpHandles, least recently asked about first */
+	GQueue *lru;
+	/* TpHandles we have started tracking but not yet MONITORed or scheduled for polling */
+	GQueue *pending;
+	/* TpHandles we poll with ISON, the next one to poll first */
+	GQueue *polled;
+	/* A GArray of TpHandle for each ISON we are waiting for a reply to, oldest first */
+	GQueue *ison_batches;
+
+	/* Whether the server supports MONITOR, decided when we send our first presence line, by which time RPL_ISUPPORT is in */
+	gboolean mode_decided;
+	gboolean use_monitor;
+	/* How many contacts the server lets us MONITOR, or 0 for no limit */
+	guint monitor_limit;
+	guint n_monitored;
+
+	/* How many contacts are left to poll in the current round */
+	guint round_remaining;
+	/* Monotonic times before which we won't start another round of polls, or send another line */
+	gint64 next_poll;
+	gint64 next_line;
+	guint timeout_id;
+
+	guint self_status;
+	gchar *self_message;
+};
+
+static gint64 _interval(guint seconds) {
+	return (gint64) seconds * (presence_faster ? 1000 : G_USEC_PER_SEC);
+}
+
+static void _entry_free(gpointer data) {
+	PresenceEntry *entry = data;
+
+	g_free(entry->message);
+	g_slice_free(PresenceEntry, entry);
+}
+
+static void _ison_batch_free(gpointer data, gpointer user_data) {
+	g_array_free(data, TRUE);
+}
+
+static TpPresenceStatus *_make_status(guint status, const gchar *message) {
+	TpPresenceStatus *presence;
+	GHashTable *arguments = NULL;
+
+	if (!tp_str_empty(message))
+		arguments = tp_asv_new("message", G_TYPE_STRING, message, NULL);
+
+	presence = tp_presence_status_new(status, arguments);
+
+	if (arguments != NULL)
+		g_hash_table_unref(arguments);
+
+	return presence;
+}
+
+static void _emit_presence_update(IdleConnection *conn, TpHandle handle, guint status, const gchar *message) {
+	TpPresenceStatus *presence = _make_status(status, message);
+
+	tp_presence_mixin_emit_one_presence_update((GObject *) conn, handle, presence);
+	tp_presence_status_free(presence);
+}
+
+static void _set_presence(IdleConnection *conn, TpHandle handle, guint status, const gchar *message) {
+	PresenceEntry *entry = g_hash_table_lookup(conn->presence_tracker->contacts, GUINT_TO_POINTER(handle));
+
+	if (entry == NULL)
+		return;
+
+	if (entry->status == status && !tp_strdiff(entry->message, message))
+		return;
+
+	entry->status = status;
+	g_free(entry->message);
+	entry->message = g_strdup(message);
+
+	_emit_presence_update(conn, handle, status, message);
+}
+
+/* For when we learn that a contact is online, but not whether they are away */
+static void _set_online(IdleConnection *conn, TpHandle handle) {
+	PresenceEntry *entry = g_hash_table_lookup(conn->presence_tracker->contacts, GUINT_TO_POINTER(handle));
+
+	if (entry == NULL || entry->status == IDLE_PRESENCE_AWAY)
+		return;
+
+	_set_presence(conn, handle, IDLE_PRESENCE_AVAILABLE, NULL);
+}
+
+static gboolean _send_monitor(IdleConnection *conn) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT);
+	GString *cmd = g_string_new("MONITOR +");
+	GArray *targets = g_array_new(FALSE, FALSE, sizeof(TpHandle));
+	guint n_targets = 0;
+
+	while (!g_queue_is_empty(tracker->pending)) {
+		TpHandle handle = GPOINTER_TO_UINT(g_queue_peek_head(tracker->pending));
+		PresenceEntry *entry = g_hash_table_lookup(tracker->contacts, GUINT_TO_POINTER(handle));
+		const gchar *nick = tp_handle_inspect(contact_handles, handle);
+
+		if (tracker->monitor_limit != 0 && tracker->n_monitored >= tracker->monitor_limit) {
+			g_queue_push_tail(tracker->polled, g_queue_pop_head(tracker->pending));
+			continue;
+		}
+
+		if (cmd->len + 1 + strlen(nick) > IRC_MSG_MAXLEN)
+			break;
+
+		g_string_append_c(cmd, (n_targets == 0) ? ' ' : ',');
+		g_string_append(cmd, nick);
+		n_targets++;
+
+		g_queue_pop_head(tracker->pending);
+		g_array_append_val(targets, handle);
+		entry->monitored = TRUE;
+		tracker->n_monitored++;
+	}
+
+	/* with no room to send it, they wait to be MONITORed with the next line */
+	if (n_targets > 0 && !idle_connection_send_low_priority(conn, cmd->str)) {
+		guint i;
+
+		for (i = targets->len; i > 0; i--) {
+			TpHandle handle = g_array_index(targets, TpHandle, i - 1);
+			PresenceEntry *entry = g_hash_table_lookup(tracker->contacts, GUINT_TO_POINTER(handle));
+
+			entry->monitored = FALSE;
+			tracker->n_monitored--;
+			g_queue_push_head(tracker->pending, GUINT_TO_POINTER(handle));
+		}
+	}
+
+	g_array_free(targets, TRUE);
+	g_string_free(cmd, TRUE);
+
+	return (n_targets > 0);
+}
+
+static gboolean _send_ison(IdleConnection *conn) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT);
+	GString *cmd = g_string_new("ISON");
+	GArray *batch = g_array_new(FALSE, FALSE, sizeof(TpHandle));
+
+	while (tracker->round_remaining > 0 && !g_queue_is_empty(tracker->polled)) {
+		TpHandle handle = GPOINTER_TO_UINT(g_queue_peek_head(tracker->polled));
+		const gchar *nick = tp_handle_inspect(contact_handles, handle);
+
+		if (cmd->len + 1 + strlen(nick) > IRC_MSG_MAXLEN)
+			break;
+
+		g_string_append_c(cmd, ' ');
+		g_string_append(cmd, nick);
+		g_array_append_val(batch, handle);
+
+		/* Round-robin, so that with more contacts than fit in one line, each of them still gets its turn */
+		g_queue_push_tail(tracker->polled, g_queue_pop_head(tracker->polled));
+		tracker->round_remaining--;
+	}
+
+	if (batch->len == 0) {
+		g_string_free(cmd, TRUE);
+		g_array_free(batch, TRUE);
+		return FALSE;
+	}
+
+	/* replies are matched to batches in order, so only one that went out gets a batch; with no room, its contacts wait for the next round */
+	if (idle_connection_send_low_priority(conn, cmd->str))
+		g_queue_push_tail(tracker->ison_batches, batch);
+	else
+		g_array_free(batch, TRUE);
+
+	g_string_free(cmd, TRUE);
+
+	return TRUE;
+}
+
+static gboolean _send_next_line(IdleConnection *conn) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+
+	if (!tracker->mode_decided) {
+		const gchar *monitor = idle_connection_get_isupport(conn, "MONITOR");
+
+		tracker->use_monitor = (monitor != NULL);
+		tracker->monitor_limit = (monitor != NULL) ? strtoul(monitor, NULL, 10) : 0;
+		tracker->mode_decided = TRUE;
+
+		IDLE_DEBUG("tracking presence with %s", tracker->use_monitor ? "MONITOR" : "ISON");
+	}
+
+	if (!g_queue_is_empty(tracker->pending)) {
+		if (tracker->use_monitor) {
+			if (_send_monitor(conn))
+				return TRUE;
+		} else {
+			while (!g_queue_is_empty(tracker->pending))
+				g_queue_push_tail(tracker->polled, g_queue_pop_head(tracker->pending));
+		}
+	}
+
+	if (g_queue_is_empty(tracker->polled))
+		return FALSE;
+
+	if (tracker->round_remaining == 0) {
+		gint64 now = g_get_monotonic_time();
+
+		if (now < tracker->next_poll)
+			return FALSE;
+
+		tracker->round_remaining = g_queue_get_length(tracker->polled);
+		tracker->next_poll = now + _interval(PRESENCE_POLL_INTERVAL);
+	}
+
+	return _send_ison(conn);
+}
+
+static void _schedule(IdleConnection *conn);
+
+static gboolean _presence_timeout_cb(gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+
+	tracker->timeout_id = 0;
+
+	if (_send_next_line(conn))
+		tracker->next_line = g_get_monotonic_time() + _interval(PRESENCE_LINE_INTERVAL);
+
+	_schedule(conn);
+
+	return FALSE;
+}
+
+static void _schedule(IdleConnection *conn) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	gint64 now = g_get_monotonic_time();
+	gint64 due;
+
+	if (tracker->timeout_id != 0)
+		return;
+
+	if (!g_queue_is_empty(tracker->pending))
+		due = tracker->next_line;
+	else if (!g_queue_is_empty(tracker->polled))
+		due = MAX(tracker->next_line, (tracker->round_remaining > 0) ? 0 : tracker->next_poll);
+	else
+		return;
+
+	tracker->timeout_id = g_timeout_add((due > now) ? (due - now + 999) / 1000 : 0, _presence_timeout_cb, conn);
+}
+
+static void _untrack(IdleConnection *conn, TpHandle handle) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	PresenceEntry *entry = g_hash_table_lookup(tracker->contacts, GUINT_TO_POINTER(handle));
+
+	if (entry == NULL)
+		return;
+
+	g_queue_remove(tracker->pending, GUINT_TO_POINTER(handle));
+	g_queue_remove(tracker->polled, GUINT_TO_POINTER(handle));
+	tracker->round_remaining = MIN(tracker->round_remaining, g_queue_get_length(tracker->polled));
+
+	if (entry->monitored) {
+		TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT);
+		gchar cmd[IRC_MSG_MAXLEN + 1];
+
+		g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "MONITOR - %s", tp_handle_inspect(contact_handles, handle));
+		idle_connection_send_low_priority(conn, cmd);
+		tracker->n_monitored--;
+	}
+
+	g_queue_delete_link(tracker->lru, entry->lru_link);
+	g_hash_table_remove(tracker->contacts, GUINT_TO_POINTER(handle));
+
+	/* ISON replies still on their way just find nobody to update */
+	_emit_presence_update(conn, handle, IDLE_PRESENCE_UNKNOWN, NULL);
+}
+
+static void _track(IdleConnection *conn, TpHandle handle) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	PresenceEntry *entry;
+
+	while (g_queue_get_length(tracker->lru) >= PRESENCE_MAX_TRACKED)
+		_untrack(conn, GPOINTER_TO_UINT(g_queue_peek_head(tracker->lru)));
+
+	entry = g_slice_new0(PresenceEntry);
+	entry->status = IDLE_PRESENCE_UNKNOWN;
+	entry->message = NULL;
+	entry->monitored = FALSE;
+
+	g_queue_push_tail(tracker->lru, GUINT_TO_POINTER(handle));
+	entry->lru_link = g_queue_peek_tail_link(tracker->lru);
+
+	g_hash_table_insert(tracker->contacts, GUINT_TO_POINTER(handle), entry);
+	g_queue_push_tail(tracker->pending, GUINT_TO_POINTER(handle));
+}
+
+static gboolean _status_available(GObject *object, guint which) {
+	return TRUE;
+}
+
+static GHashTable *_get_contact_statuses(GObject *object, const GArray *contacts, GError **error) {
+	IdleConnection *conn = IDLE_CONNECTION(object);
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	TpHandle self_handle = tp_base_connection_get_self_handle(TP_BASE_CONNECTION(conn));
+	GHashTable *ret = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify) tp_presence_status_free);
+	gboolean tracking_more = FALSE;
+	guint i;
+
+	for (i = 0; i < contacts->len; i++) {
+		TpHandle handle = g_array_index(contacts, TpHandle, i);
+		PresenceEntry *entry;
+		TpPresenceStatus *presence;
+
+		if (handle == self_handle) {
+			presence = _make_status(tracker->self_status, tracker->self_message);
+		} else {
+			/* Asking about a contact is what makes us start tracking them */
+			entry = g_hash_table_lookup(tracker->contacts, GUINT_TO_POINTER(handle));
+			if (entry == NULL) {
+				_track(conn, handle);
+				tracking_more = TRUE;
+				presence = _make_status(IDLE_PRESENCE_UNKNOWN, NULL);
+			} else {
+				g_queue_unlink(tracker->lru, entry->lru_link);
+				g_queue_push_tail_link(tracker->lru, entry->lru_link);
+				presence = _make_status(entry->status, entry->message);
+			}
+		}
+
+		g_hash_table_insert(ret, GUINT_TO_POINTER(handle), presence);
+	}
+
+	if (tracking_more)
+		_schedule(conn);
+
+	return ret;
+}
+
+static gboolean _set_own_status(GObject *object, const TpPresenceStatus *status, GError **error) {
+	IdleConnection *conn = IDLE_CONNECTION(object);
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	TpHandle self_handle = tp_base_connection_get_self_handle(TP_BASE_CONNECTION(conn));
+	const gchar *message = NULL;
+	gchar cmd[IRC_MSG_MAXLEN + 1] = "AWAY";
+
+	if (status->optional_arguments != NULL)
+		message = tp_asv_get_string(status->optional_arguments, "message");
+
+	/* IRC has no way to be away without a message, so make one up */
+	if (status->index == IDLE_PRESENCE_AWAY)
+		g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "AWAY :%s", tp_str_empty(message) ? "Away" : message);
+	else
+		message = NULL;
+
+	idle_connection_send(conn, cmd);
+
+	tracker->self_status = status->index;
+	g_free(tracker->self_message);
+	tracker->self_message = g_strdup(message);
+
+	_emit_presence_update(conn, self_handle, tracker->self_status, tracker->self_message);
+
+	return TRUE;
+}
+
+static IdleParserHandlerResult _ison_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT);
+	GArray *batch = g_queue_pop_head(tracker->ison_batches);
+	TpIntset *online = tp_intset_new();
+	guint i;
+
+	if (batch == NULL) {
+		tp_intset_destroy(online);
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+	}
+
+	if (args->n_values > 0) {
+		gchar **nicks = g_strsplit(g_value_get_string(g_value_array_get_nth(args, 0)), " ", -1);
+		gchar **nick;
+
+		for (nick = nicks; *nick != NULL; nick++) {
+			TpHandle handle = tp_handle_lookup(contact_handles, *nick, NULL, NULL);
+
+			if (handle != 0)
+				tp_intset_add(online, handle);
+		}
+
+		g_strfreev(nicks);
+	}
+
+	/* ISON only lists the contacts that are online, so everybody else we asked about isn't */
+	for (i = 0; i < batch->len; i++) {
+		TpHandle handle = g_array_index(batch, TpHandle, i);
+
+		if (tp_intset_is_member(online, handle))
+			_set_online(conn, handle);
+		else
+			_set_presence(conn, handle, IDLE_PRESENCE_OFFLINE, NULL);
+	}
+
+	tp_intset_destroy(online);
+	g_array_free(batch, TRUE);
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+static IdleParserHandlerResult _monitor_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT);
+	gchar **targets = g_strsplit(g_value_get_string(g_value_array_get_nth(args, 0)), ",", -1);
+	gchar **target;
+
+	for (target = targets; *target != NULL; target++) {
+		/* RPL_MONONLINE gives nick!user@host, RPL_MONOFFLINE just the nick */
+		gchar *nick = g_strndup(*target, strcspn(*target, "!"));
+		TpHandle handle = tp_handle_lookup(contact_handles, nick, NULL, NULL);
+
+		g_free(nick);
+
+		if (handle == 0)
+			continue;
+
+		if (code == IDLE_PARSER_NUMERIC_MONONLINE)
+			_set_online(conn, handle);
+		else
+			_set_presence(conn, handle, IDLE_PRESENCE_OFFLINE, NULL);
+	}
+
+	g_strfreev(targets);
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+static IdleParserHandlerResult _monitor_list_full_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	TpHandleRepoIface *contact_handles = tp_base_connection_get_handles(TP_BASE_CONNECTION(conn), TP_HANDLE_TYPE_CONTACT);
+	gchar **targets = g_strsplit(g_value_get_string(g_value_array_get_nth(args, 1)), ",", -1);
+	gchar **target;
+
+	/* Poll the contacts that didn't fit, and don't try to MONITOR anybody else */
+	for (target = targets; *target != NULL; target++) {
+		TpHandle handle = tp_handle_lookup(contact_handles, *target, NULL, NULL);
+		PresenceEntry *entry = (handle != 0) ? g_hash_table_lookup(tracker->contacts, GUINT_TO_POINTER(handle)) : NULL;
+
+		if (entry == NULL || !entry->monitored)
+			continue;
+
+		entry->monitored = FALSE;
+		tracker->n_monitored--;
+		g_queue_push_tail(tracker->polled, GUINT_TO_POINTER(handle));
+	}
+
+	g_strfreev(targets);
+
+	tracker->monitor_limit = MAX(tracker->n_monitored, 1);
+	_schedule(conn);
+
+	return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+}
+
+static IdleParserHandlerResult _away_numeric_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	const gchar *message = g_value_get_string(g_value_array_get_nth(args, 1));
+
+	_set_presence(conn, handle, IDLE_PRESENCE_AWAY, message);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _away_notify_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+
+	if (args->n_values > 1)
+		_set_presence(conn, handle, IDLE_PRESENCE_AWAY, g_value_get_string(g_value_array_get_nth(args, 1)));
+	else
+		_set_presence(conn, handle, IDLE_PRESENCE_AVAILABLE, NULL);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _join_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+
+	_set_online(conn, handle);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _nick_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle old_handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+	TpHandle new_handle = g_value_get_uint(g_value_array_get_nth(args, 1));
+
+	if (old_handle == new_handle)
+		return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+
+	_set_presence(conn, old_handle, IDLE_PRESENCE_OFFLINE, NULL);
+	_set_online(conn, new_handle);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+static IdleParserHandlerResult _offline_handler(IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+	TpHandle handle = g_value_get_uint(g_value_array_get_nth(args, 0));
+
+	_set_presence(conn, handle, IDLE_PRESENCE_OFFLINE, NULL);
+
+	return IDLE_PARSER_HANDLER_RESULT_NOT_HANDLED;
+}
+
+void idle_presence_disconnected (IdleConnection *conn) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+
+	if (tracker->timeout_id != 0) {
+		g_source_remove(tracker->timeout_id);
+		tracker->timeout_id = 0;
+	}
+
+	g_queue_foreach(tracker->ison_batches, _ison_batch_free, NULL);
+	g_queue_clear(tracker->ison_batches);
+}
+
+/* The new server session knows nothing of our MONITOR list or away message, so start tracking everybody again from scratch */
+void idle_presence_reconnected (IdleConnection *conn) {
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+	GHashTableIter iter;
+	gpointer key, value;
+	gchar cmd[IRC_MSG_MAXLEN + 1];
+
+	g_queue_clear(tracker->pending);
+	g_queue_clear(tracker->polled);
+
+	g_hash_table_iter_init(&iter, tracker->contacts);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		PresenceEntry *entry = value;
+
+		entry->monitored = FALSE;
+		g_queue_push_tail(tracker->pending, key);
+	}
+
+	tracker->mode_decided = FALSE;
+	tracker->n_monitored = 0;
+	tracker->round_remaining = 0;
+	tracker->next_poll = 0;
+	tracker->next_line = g_get_monotonic_time() + _interval(PRESENCE_LINE_INTERVAL);
+
+	if (tracker->self_status == IDLE_PRESENCE_AWAY) {
+		g_snprintf(cmd, IRC_MSG_MAXLEN + 1, "AWAY :%s", tp_str_empty(tracker->self_message) ? "Away" : tracker->self_message);
+		idle_connection_send(conn, cmd);
+	}
+
+	_schedule(conn);
+}
+
+void idle_presence_finalize (GObject *object) {
+	IdleConnection *conn = IDLE_CONNECTION(object);
+	IdlePresenceTracker *tracker = conn->presence_tracker;
+
+	idle_presence_disconnected(conn);
+
+	g_hash_table_unref(tracker->contacts);
+	g_queue_free(tracker->lru);
+	g_queue_free(tracker->pending);
+	g_queue_free(tracker->polled);
+	g_queue_free(tracker->ison_batches);
+	g_free(tracker->self_message);
+	g_slice_free(IdlePresenceTracker, tracker);
+
+	tp_presence_mixin_finalize(object);
+}
+
+void idle_presence_class_init (IdleConnectionClass *klass) {
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+	tp_presence_mixin_class_init(object_class, G_STRUCT_OFFSET(IdleConnectionClass, presence), _status_available, _get_contact_statuses, _set_own_status, presence_statuses);
+	tp_presence_mixin_simple_presence_init_dbus_properties(object_class);
+
+	if (!tp_str_empty(g_getenv("IDLE_HTFU")))
+		presence_faster = TRUE;
+}
+
+void idle_presence_init (IdleConnection *conn) {
+	IdlePresenceTracker *tracker = g_slice_new0(IdlePresenceTracker);
+
+	tracker->contacts = g_hash_table_new_full(NULL, NULL, NULL, _entry_free);
+	tracker->lru = g_queue_new();
+	tracker->pending = g_queue_new();
+	tracker->polled = g_queue_new();
+	tracker->ison_batches = g_queue_new();
+	tracker->self_status = IDLE_PRESENCE_AVAILABLE;
+	tracker->next_line = g_get_monotonic_time() + _interval(PRESENCE_LINE_INTERVAL);
+	conn->presence_tracker = tracker;
+
+	tp_presence_mixin_init((GObject *) conn, G_STRUCT_OFFSET(IdleConnection, presence));
+	tp_presence_mixin_simple_presence_register_with_contacts_mixin((GObject *) conn);
+
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_ISON, _ison_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_MONONLINE, _monitor_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_MONOFFLINE, _monitor_handler, conn);
+	idle_parser_add_handler(conn->parser, IDLE_PARSER_NUMERIC_MONLISTFULL, _monitor_list_full_handler, conn);
+
+	/* These only watch what goes past, so make sure they run before anybody who claims the message */
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_NUMERIC_AWAY, _away_numeric_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_NUMERIC_NOSUCHNICK, _offline_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_PREFIXCMD_AWAY, _away_notify_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_PREFIXCMD_JOIN, _join_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_PREFIXCMD_NICK, _nick_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+	idle_parser_add_handler_with_priority(conn->parser, IDLE_PARSER_PREFIXCMD_QUIT, _offline_handler, conn, IDLE_PARSER_HANDLER_PRIORITY_FIRST);
+}
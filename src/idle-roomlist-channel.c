@@ -23,6 +23,7 @@
 #include "config.h"
 #include "idle-roomlist-channel.h"
 
+#include <string.h>
 #include <time.h>
 
 #include <dbus/dbus-glib.h>
@@ -33,28 +34,83 @@
 #include "idle-debug.h"
 #include "idle-text.h"
 
+#include "extensions/extensions.h"
+
+/* While LIST streams in, rooms are passed on in GotRooms batches of at most this many, and at least this often (ms) */
+#define ROOMLIST_BATCH_SIZE 250
+#define ROOMLIST_BATCH_INTERVAL 1000
+/* the most listings we keep, so that many different filters don't each keep a network's worth of rooms */
+#define ROOMLIST_CACHE_MAX_ENTRIES 8
+
+/* A room as the server listed it: by name rather than by handle, so that keeping a whole network's worth costs no more than the
+ * strings */
+typedef struct {
+  gchar *name;
+  guint members;
+  gchar *topic;
+} RoomlistEntry;
+
+/* The rooms listed in answer to one LIST */
+typedef struct {
+  GPtrArray *rooms;
+  gint64 expires;
+} RoomlistCacheEntry;
+
+struct _IdleRoomlistCache {
+  /* LIST parameters, "" if none -> RoomlistCacheEntry */
+  GHashTable *entries;
+  guint ttl;
+};
+
+typedef struct {
+  guint min_members;
+  /* 0 for no maximum */
+  guint max_members;
+  /* lower-case; NULL to match any name */
+  gchar *name;
+  GPatternSpec *name_spec;
+} RoomlistFilter;
+
 static void idle_roomlist_channel_close (TpBaseChannel *channel);
 static void _roomlist_iface_init (gpointer, gpointer);
+static void _roomlist_filter_iface_init (gpointer, gpointer);
 static void connection_status_changed_cb (IdleConnection* conn, guint status, guint reason, IdleRoomlistChannel *self);
+static void connection_reconnected_cb (IdleConnection *conn, IdleRoomlistChannel *self);
 static IdleParserHandlerResult _rpl_list_handler (IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 static IdleParserHandlerResult _rpl_listend_handler (IdleParser *parser, IdleParserMessageCode code, GValueArray *args, gpointer user_data);
 
 G_DEFINE_TYPE_WITH_CODE (IdleRoomlistChannel, idle_roomlist_channel,
     TP_TYPE_BASE_CHANNEL,
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_TYPE_ROOM_LIST, _roomlist_iface_init);
+    G_IMPLEMENT_INTERFACE (IDLE_TYPE_SVC_CHANNEL_INTERFACE_ROOM_LIST_FILTER1,
+      _roomlist_filter_iface_init);
     )
 
+static const gchar *roomlist_channel_interfaces[] = {
+  IDLE_IFACE_CHANNEL_INTERFACE_ROOM_LIST_FILTER1,
+  NULL
+};
+
 /* private structure */
 struct _IdleRoomlistChannelPrivate
 {
   IdleConnection *connection;
 
+  /* TP_STRUCT_TYPE_ROOM_INFO, waiting to be passed on */
   GPtrArray *rooms;
-  TpHandleSet *handles;
+  RoomlistFilter filter;
 
   gboolean listing;
+  /* the parameters of the LIST in progress, and the rooms it has listed so far, to be cached once it is complete; NULL if they
+   * won't be */
+  gchar *query;
+  GPtrArray *listed;
+  guint batch_timer;
+  /* LISTs whose replies are to be ignored, after StopListing */
+  guint lists_to_discard;
   gboolean closed;
   int status_changed_id;
+  gulong reconnected_id;
 
   gboolean dispose_has_run;
 };
@@ -68,6 +124,183 @@ idle_roomlist_channel_init (IdleRoomlistChannel *self)
 
 static void idle_roomlist_channel_dispose (GObject *object);
 static void idle_roomlist_channel_finalize (GObject *object);
+static void start_listing (IdleRoomlistChannel *self);
+static void stop_listing (IdleRoomlistChannel *self);
+static gboolean emit_room_signal (IdleRoomlistChannel *self);
+
+static void
+_room_info_free (gpointer room)
+{
+  g_boxed_free (TP_STRUCT_TYPE_ROOM_INFO, room);
+}
+
+static void
+_entry_free (gpointer data)
+{
+  RoomlistEntry *entry = data;
+
+  g_free (entry->name);
+  g_free (entry->topic);
+  g_slice_free (RoomlistEntry, entry);
+}
+
+static void
+_cache_entry_free (gpointer data)
+{
+  RoomlistCacheEntry *entry = data;
+
+  g_ptr_array_unref (entry->rooms);
+  g_slice_free (RoomlistCacheEntry, entry);
+}
+
+void
+idle_roomlist_cache_init (IdleConnection *conn)
+{
+  conn->roomlist_cache = g_slice_new0 (IdleRoomlistCache);
+  conn->roomlist_cache->entries = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, _cache_entry_free);
+  g_object_get (conn, "room-list-ttl", &conn->roomlist_cache->ttl, NULL);
+}
+
+void
+idle_roomlist_cache_finalize (GObject *object)
+{
+  IdleConnection *conn = IDLE_CONNECTION (object);
+
+  g_hash_table_unref (conn->roomlist_cache->entries);
+  g_slice_free (IdleRoomlistCache, conn->roomlist_cache);
+}
+
+/* Returns the rooms listed in answer to LIST @query, unless they are too old to go by */
+static GPtrArray *
+_cache_lookup (IdleRoomlistCache *cache,
+               const gchar *query)
+{
+  RoomlistCacheEntry *entry = g_hash_table_lookup (cache->entries, query);
+
+  if (entry == NULL)
+    return NULL;
+
+  if (g_get_monotonic_time () >= entry->expires)
+    {
+      g_hash_table_remove (cache->entries, query);
+      return NULL;
+    }
+
+  return entry->rooms;
+}
+
+/* Keeps @rooms, listed in answer to LIST @query, taking ownership of both. Listings which have expired go, as does the one due to expire
+ * soonest if there are too many. A complete listing answers any query, so it replaces all the others. */
+static void
+_cache_insert (IdleRoomlistCache *cache,
+               gchar *query,
+               GPtrArray *rooms)
+{
+  RoomlistCacheEntry *entry = g_slice_new (RoomlistCacheEntry);
+  gint64 now = g_get_monotonic_time ();
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, cache->entries);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      RoomlistCacheEntry *cached = value;
+
+      if (query[0] == '\0' || now >= cached->expires)
+        g_hash_table_iter_remove (&iter);
+    }
+
+  g_hash_table_remove (cache->entries, query);
+
+  if (g_hash_table_size (cache->entries) >= ROOMLIST_CACHE_MAX_ENTRIES)
+    {
+      gpointer key, soonest = NULL;
+      gint64 soonest_expires = G_MAXINT64;
+
+      g_hash_table_iter_init (&iter, cache->entries);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          RoomlistCacheEntry *cached = value;
+
+          if (cached->expires < soonest_expires)
+            {
+              soonest = key;
+              soonest_expires = cached->expires;
+            }
+        }
+
+      g_hash_table_remove (cache->entries, soonest);
+    }
+
+  entry->rooms = rooms;
+  entry->expires = now + (gint64) cache->ttl * G_USEC_PER_SEC;
+  g_hash_table_insert (cache->entries, query, entry);
+}
+
+static void
+_filter_clear (RoomlistFilter *filter)
+{
+  tp_clear_pointer (&filter->name, g_free);
+  tp_clear_pointer (&filter->name_spec, g_pattern_spec_free);
+  filter->min_members = 0;
+  filter->max_members = 0;
+}
+
+static gboolean
+_filter_matches (RoomlistFilter *filter,
+                 const gchar *name,
+                 guint members)
+{
+  gboolean matches;
+  gchar *lower;
+
+  if (members < filter->min_members)
+    return FALSE;
+
+  if (filter->max_members != 0 && members > filter->max_members)
+    return FALSE;
+
+  if (filter->name_spec == NULL)
+    return TRUE;
+
+  lower = g_ascii_strdown (name, -1);
+  matches = g_pattern_match_string (filter->name_spec, lower);
+  g_free (lower);
+
+  return matches;
+}
+
+/* The parameters to give LIST for the server to apply as much of the filter as it can, going by the ELIST extensions it supports:
+ * M for masks, U for user counts. Whatever it can't do, we do as the rooms come in. */
+static gchar *
+_list_query (IdleRoomlistChannel *self)
+{
+  IdleRoomlistChannelPrivate *priv = self->priv;
+  RoomlistFilter *filter = &priv->filter;
+  const gchar *elist = idle_connection_get_isupport (priv->connection, "ELIST");
+  GString *query = g_string_new ("");
+
+  if (elist == NULL)
+    return g_string_free (query, FALSE);
+
+  if (filter->name != NULL && strpbrk (elist, "Mm") != NULL &&
+      strpbrk (filter->name, " ,") == NULL)
+    g_string_append (query, filter->name);
+
+  if (strpbrk (elist, "Uu") != NULL)
+    {
+      if (filter->min_members > 0)
+        g_string_append_printf (query, "%s>%u", query->len > 0 ? "," : "",
+            filter->min_members - 1);
+
+      if (filter->max_members > 0 && filter->max_members < G_MAXUINT)
+        g_string_append_printf (query, "%s<%u", query->len > 0 ? "," : "",
+            filter->max_members + 1);
+    }
+
+  return g_string_free (query, FALSE);
+}
 
 static void
 idle_roomlist_channel_constructed (GObject *obj)
@@ -85,14 +318,14 @@ idle_roomlist_channel_constructed (GObject *obj)
   priv->status_changed_id = g_signal_connect (priv->connection,
       "status-changed", (GCallback) connection_status_changed_cb,
       obj);
+  priv->reconnected_id = g_signal_connect (priv->connection,
+      "reconnected", (GCallback) connection_reconnected_cb, obj);
   idle_parser_add_handler (priv->connection->parser, IDLE_PARSER_NUMERIC_LIST,
       _rpl_list_handler, obj);
   idle_parser_add_handler (priv->connection->parser,
       IDLE_PARSER_NUMERIC_LISTEND, _rpl_listend_handler, obj);
 
-  priv->rooms = g_ptr_array_new ();
-  priv->handles = tp_handle_set_new(tp_base_connection_get_handles (
-     TP_BASE_CONNECTION(priv->connection), TP_HANDLE_TYPE_ROOM));
+  priv->rooms = g_ptr_array_new_with_free_func (_room_info_free);
 }
 
 static gchar *
@@ -131,6 +364,20 @@ idle_roomlist_channel_fill_properties (
       NULL);
 }
 
+static GPtrArray *
+idle_roomlist_channel_get_interfaces (TpBaseChannel *self)
+{
+  TpBaseChannelClass *parent_class =
+      TP_BASE_CHANNEL_CLASS (idle_roomlist_channel_parent_class);
+  GPtrArray *interfaces = parent_class->get_interfaces (self);
+  const gchar **interface;
+
+  for (interface = roomlist_channel_interfaces; *interface != NULL; interface++)
+    g_ptr_array_add (interfaces, (gchar *) *interface);
+
+  return interfaces;
+}
+
 static void
 idle_roomlist_channel_class_init (IdleRoomlistChannelClass *idle_roomlist_channel_class)
 {
@@ -153,6 +400,7 @@ idle_roomlist_channel_class_init (IdleRoomlistChannelClass *idle_roomlist_channe
   base_channel_class->close = idle_roomlist_channel_close;
   base_channel_class->fill_immutable_properties = idle_roomlist_channel_fill_properties;
   base_channel_class->get_object_path_suffix = idle_roomlist_channel_get_path_suffix;
+  base_channel_class->get_interfaces = idle_roomlist_channel_get_interfaces;
 
   tp_dbus_properties_mixin_implement_interface (object_class,
       TP_IFACE_QUARK_CHANNEL_TYPE_ROOM_LIST,
@@ -175,18 +423,32 @@ idle_roomlist_channel_dispose (GObject *object)
 
   priv->dispose_has_run = TRUE;
 
+  if (priv->batch_timer != 0)
+    {
+      g_source_remove (priv->batch_timer);
+      priv->batch_timer = 0;
+    }
+
   if (priv->status_changed_id != 0)
     {
       g_signal_handler_disconnect (priv->connection, priv->status_changed_id);
       priv->status_changed_id = 0;
     }
 
+  if (priv->reconnected_id != 0)
+    {
+      g_signal_handler_disconnect (priv->connection, priv->reconnected_id);
+      priv->reconnected_id = 0;
+    }
+
   if (priv->rooms)
     {
       g_ptr_array_free (priv->rooms, TRUE);
       priv->rooms = NULL;
     }
 
+  tp_clear_pointer (&priv->listed, g_ptr_array_unref);
+
   if (G_OBJECT_CLASS (idle_roomlist_channel_parent_class)->dispose)
     G_OBJECT_CLASS (idle_roomlist_channel_parent_class)->dispose (object);
 }
@@ -198,10 +460,8 @@ idle_roomlist_channel_finalize (GObject *object)
   IdleRoomlistChannel *self = IDLE_ROOMLIST_CHANNEL (object);
   IdleRoomlistChannelPrivate *priv = self->priv;
 
-  if (priv->handles)
-    {
-      tp_handle_set_destroy (priv->handles);
-    }
+  _filter_clear (&priv->filter);
+  g_free (priv->query);
 
   G_OBJECT_CLASS (idle_roomlist_channel_parent_class)->finalize (object);
 }
@@ -213,6 +473,9 @@ idle_roomlist_channel_close (TpBaseChannel *channel)
   IdleRoomlistChannel *self = IDLE_ROOMLIST_CHANNEL (channel);
   IdleRoomlistChannelPrivate *priv = self->priv;
 
+  if (priv->listing)
+    stop_listing (self);
+
   idle_parser_remove_handlers_by_data (priv->connection->parser, channel);
   tp_base_channel_destroyed (channel);
 }
@@ -249,12 +512,75 @@ idle_roomlist_channel_list_rooms (TpSvcChannelTypeRoomList *iface,
   IdleRoomlistChannel *self = IDLE_ROOMLIST_CHANNEL (iface);
   IdleRoomlistChannelPrivate *priv = self->priv;
 
-  priv->listing = TRUE;
-  tp_svc_channel_type_room_list_emit_listing_rooms (iface, TRUE);
+  tp_svc_channel_type_room_list_return_from_list_rooms (context);
 
-  idle_connection_send(priv->connection, "LIST");
+  /* the rooms are already on their way */
+  if (priv->listing)
+    return;
 
-  tp_svc_channel_type_room_list_return_from_list_rooms (context);
+  _filter_clear (&priv->filter);
+  start_listing (self);
+}
+
+/**
+ * idle_roomlist_channel_list_filtered_rooms
+ *
+ * Implements D-Bus method ListFilteredRooms
+ * on interface org.freedesktop.Telepathy.Channel.Interface.RoomListFilter1
+ */
+static void
+idle_roomlist_channel_list_filtered_rooms (IdleSvcChannelInterfaceRoomListFilter1 *iface,
+                                           GHashTable *filter,
+                                           DBusGMethodInvocation *context)
+{
+  IdleRoomlistChannel *self = IDLE_ROOMLIST_CHANNEL (iface);
+  IdleRoomlistChannelPrivate *priv = self->priv;
+  gboolean valid = TRUE;
+  guint min_members = 0, max_members = 0;
+  const gchar *name = NULL;
+
+  if (tp_asv_lookup (filter, "min-members") != NULL)
+    min_members = tp_asv_get_uint32 (filter, "min-members", &valid);
+
+  if (valid && tp_asv_lookup (filter, "max-members") != NULL)
+    max_members = tp_asv_get_uint32 (filter, "max-members", &valid);
+
+  if (valid && tp_asv_lookup (filter, "name") != NULL)
+    valid = (name = tp_asv_get_string (filter, "name")) != NULL;
+
+  if (!valid)
+    {
+      GError error = { TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "min-members and max-members must be unsigned integers, and name a string" };
+
+      dbus_g_method_return_error (context, &error);
+      return;
+    }
+
+  /* the rooms on their way are being filtered for somebody else */
+  if (priv->listing)
+    {
+      GError error = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "A listing is already in progress" };
+
+      dbus_g_method_return_error (context, &error);
+      return;
+    }
+
+  idle_svc_channel_interface_room_list_filter1_return_from_list_filtered_rooms (
+      context);
+
+  _filter_clear (&priv->filter);
+  priv->filter.min_members = min_members;
+  priv->filter.max_members = max_members;
+
+  if (!tp_str_empty (name) && tp_strdiff (name, "*"))
+    {
+      priv->filter.name = g_ascii_strdown (name, -1);
+      priv->filter.name_spec = g_pattern_spec_new (priv->filter.name);
+    }
+
+  start_listing (self);
 }
 
 /**
@@ -268,20 +594,154 @@ idle_roomlist_channel_stop_listing (TpSvcChannelTypeRoomList *iface,
                                     DBusGMethodInvocation *context)
 {
   IdleRoomlistChannel *self = IDLE_ROOMLIST_CHANNEL (iface);
-  GError error = { TP_ERROR, TP_ERROR_NOT_IMPLEMENTED, "Can't stop listing!" };
+  IdleRoomlistChannelPrivate *priv = self->priv;
 
   g_assert (IDLE_IS_ROOMLIST_CHANNEL (self));
 
-  dbus_g_method_return_error (context, &error);
+  if (priv->listing)
+    {
+      /* IRC has no way to call off a LIST, so we ignore what is left of it */
+      priv->lists_to_discard++;
+      stop_listing (self);
+    }
 
-  /*
-  priv->listing = FALSE;
-  tp_svc_channel_type_room_list_emit_listing_rooms (iface, FALSE);
+  tp_svc_channel_type_room_list_return_from_stop_listing (context);
+}
 
-  stop_listing (self);
 
-  tp_svc_channel_type_room_list_return_from_stop_listing (context);
-  */
+/* Queues the room for the next GotRooms, if it passes the filter */
+static void
+add_room (IdleRoomlistChannel *self,
+          const gchar *name,
+          guint members,
+          const gchar *topic)
+{
+  IdleRoomlistChannelPrivate *priv = self->priv;
+  TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
+      TP_BASE_CONNECTION (priv->connection), TP_HANDLE_TYPE_ROOM);
+  TpHandle room_handle;
+  GValue room = {0,};
+  GHashTable *keys;
+
+  if (!_filter_matches (&priv->filter, name, members))
+    return;
+
+  /* only rooms which are passed on get a handle */
+  room_handle = tp_handle_ensure (room_repo, name, NULL, NULL);
+  if (room_handle == 0)
+    {
+      IDLE_DEBUG ("ignoring invalid room name %s", name);
+      return;
+    }
+
+  name = tp_handle_inspect (room_repo, room_handle);
+  keys = tp_asv_new (
+      "handle-name", G_TYPE_STRING, name,
+      "name", G_TYPE_STRING, name,
+      "members", G_TYPE_UINT, members,
+      "subject", G_TYPE_STRING, topic,
+      NULL);
+
+  g_value_init (&room, TP_STRUCT_TYPE_ROOM_INFO);
+  g_value_take_boxed (&room,
+      dbus_g_type_specialized_construct (TP_STRUCT_TYPE_ROOM_INFO));
+
+  dbus_g_type_struct_set (&room,
+      0, room_handle,
+      1, TP_IFACE_CHANNEL_TYPE_TEXT,
+      2, keys,
+      G_MAXUINT);
+
+  g_ptr_array_add (priv->rooms, g_value_get_boxed (&room));
+  g_hash_table_destroy (keys);
+
+  if (priv->rooms->len >= ROOMLIST_BATCH_SIZE)
+    emit_room_signal (self);
+}
+
+/* Answers from the cache if we can, and asks the server otherwise */
+static void
+start_listing (IdleRoomlistChannel *self)
+{
+  IdleRoomlistChannelPrivate *priv = self->priv;
+  IdleRoomlistCache *cache = priv->connection->roomlist_cache;
+  gchar *query = _list_query (self);
+  GPtrArray *cached;
+
+  priv->listing = TRUE;
+  tp_svc_channel_type_room_list_emit_listing_rooms (
+      (TpSvcChannelTypeRoomList *) self, TRUE);
+
+  /* a complete listing will do for a filtered one, as we filter it ourselves */
+  cached = _cache_lookup (cache, query);
+  if (cached == NULL && query[0] != '\0')
+    cached = _cache_lookup (cache, "");
+
+  if (cached != NULL)
+    {
+      guint i;
+
+      IDLE_DEBUG ("answering from the %u rooms cached", cached->len);
+
+      for (i = 0; i < cached->len; i++)
+        {
+          RoomlistEntry *entry = g_ptr_array_index (cached, i);
+
+          add_room (self, entry->name, entry->members, entry->topic);
+        }
+
+      g_free (query);
+      stop_listing (self);
+      return;
+    }
+
+  if (query[0] != '\0')
+    {
+      gchar *cmd = g_strdup_printf ("LIST %s", query);
+
+      idle_connection_send (priv->connection, cmd);
+      g_free (cmd);
+    }
+  else
+    {
+      idle_connection_send (priv->connection, "LIST");
+    }
+
+  if (cache->ttl > 0)
+    {
+      priv->query = query;
+      priv->listed = g_ptr_array_new_with_free_func (_entry_free);
+    }
+  else
+    {
+      g_free (query);
+    }
+
+  priv->batch_timer = g_timeout_add (ROOMLIST_BATCH_INTERVAL,
+      (GSourceFunc) emit_room_signal, self);
+}
+
+/* Passes on the rooms received so far, and tells the client there are no more to come */
+static void
+stop_listing (IdleRoomlistChannel *self)
+{
+  IdleRoomlistChannelPrivate *priv = self->priv;
+
+  emit_room_signal (self);
+
+  if (priv->batch_timer != 0)
+    {
+      g_source_remove (priv->batch_timer);
+      priv->batch_timer = 0;
+    }
+
+  /* whatever is cached must be complete */
+  tp_clear_pointer (&priv->listed, g_ptr_array_unref);
+  tp_clear_pointer (&priv->query, g_free);
+
+  priv->listing = FALSE;
+  tp_svc_channel_type_room_list_emit_listing_rooms (
+      (TpSvcChannelTypeRoomList *) self, FALSE);
 }
 
 
@@ -301,6 +761,20 @@ _roomlist_iface_init (gpointer g_iface,
 }
 
 
+static void
+_roomlist_filter_iface_init (gpointer g_iface,
+                             gpointer iface_data)
+{
+  IdleSvcChannelInterfaceRoomListFilter1Class *klass =
+    (IdleSvcChannelInterfaceRoomListFilter1Class *)(g_iface);
+
+#define IMPLEMENT(x) idle_svc_channel_interface_room_list_filter1_implement_##x (\
+    klass, idle_roomlist_channel_##x)
+  IMPLEMENT (list_filtered_rooms);
+#undef IMPLEMENT
+}
+
+
 static IdleParserHandlerResult
 _rpl_list_handler (IdleParser *parser,
                    IdleParserMessageCode code,
@@ -309,44 +783,31 @@ _rpl_list_handler (IdleParser *parser,
 {
   IdleRoomlistChannel* self = IDLE_ROOMLIST_CHANNEL (user_data);
   IdleRoomlistChannelPrivate *priv = self->priv;
-  GValue room = {0,};
-  GHashTable *keys;
-
-  TpHandle room_handle = g_value_get_uint (g_value_array_get_nth (args, 0));
-  TpHandleRepoIface *handl_repo =
-    tp_base_connection_get_handles(TP_BASE_CONNECTION(priv->connection),
-        TP_HANDLE_TYPE_ROOM);
-  const gchar *room_name = tp_handle_inspect(handl_repo, room_handle);
+  const gchar *room_name = g_value_get_string (g_value_array_get_nth (args, 0));
   guint num_users = g_value_get_uint (g_value_array_get_nth (args, 1));
   /* topic is optional */
   const gchar *topic = "";
+
+  /* nobody asked, or they have stopped listening */
+  if (!priv->listing || priv->lists_to_discard > 0)
+    return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+
   if (args->n_values > 2)
     {
       topic = g_value_get_string (g_value_array_get_nth (args, 2));
     }
 
-  keys = tp_asv_new (
-      "handle-name", G_TYPE_STRING, room_name,
-      "name", G_TYPE_STRING, room_name,
-      "members", G_TYPE_UINT, num_users,
-      "subject", G_TYPE_STRING, topic,
-      NULL);
-
-  g_value_init (&room, TP_STRUCT_TYPE_ROOM_INFO);
-  g_value_take_boxed (&room,
-      dbus_g_type_specialized_construct (TP_STRUCT_TYPE_ROOM_INFO));
+  if (priv->listed != NULL)
+    {
+      RoomlistEntry *entry = g_slice_new (RoomlistEntry);
 
-  dbus_g_type_struct_set (&room,
-      0, room_handle,
-      1, TP_IFACE_CHANNEL_TYPE_TEXT,
-      2, keys,
-      G_MAXUINT);
+      entry->name = g_strdup (room_name);
+      entry->members = num_users;
+      entry->topic = g_strdup (topic);
+      g_ptr_array_add (priv->listed, entry);
+    }
 
-  IDLE_DEBUG ("adding new room signal data to pending: %s", room_name);
-  g_ptr_array_add (priv->rooms, g_value_get_boxed (&room));
-  /* retain a ref to the room handle */
-  tp_handle_set_add (priv->handles, room_handle);
-  g_hash_table_destroy (keys);
+  add_room (self, room_name, num_users, topic);
 
   return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
@@ -358,7 +819,10 @@ emit_room_signal (IdleRoomlistChannel *self)
   IdleRoomlistChannelPrivate *priv = self->priv;
 
   if (!priv->listing)
+    {
+      priv->batch_timer = 0;
       return FALSE;
+    }
 
   if (priv->rooms->len == 0)
       return TRUE;
@@ -366,12 +830,7 @@ emit_room_signal (IdleRoomlistChannel *self)
   tp_svc_channel_type_room_list_emit_got_rooms (
       (TpSvcChannelTypeRoomList *) self, priv->rooms);
 
-  while (priv->rooms->len != 0)
-    {
-      gpointer boxed = g_ptr_array_index (priv->rooms, 0);
-      g_boxed_free (TP_STRUCT_TYPE_ROOM_INFO, boxed);
-      g_ptr_array_remove_index_fast (priv->rooms, 0);
-    }
+  g_ptr_array_set_size (priv->rooms, 0);
 
   return TRUE;
 }
@@ -384,21 +843,42 @@ _rpl_listend_handler (IdleParser *parser,
 {
   IdleRoomlistChannel* self = IDLE_ROOMLIST_CHANNEL (user_data);
   IdleRoomlistChannelPrivate *priv = self->priv;
-  emit_room_signal (self);
 
-  priv->listing = FALSE;
-  tp_svc_channel_type_room_list_emit_listing_rooms (
-      (TpSvcChannelTypeRoomList *) self, FALSE);
+  if (priv->lists_to_discard > 0)
+    {
+      priv->lists_to_discard--;
+      return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+    }
 
-  /*
-  g_source_remove (priv->timer_source_id);
-  priv->timer_source_id = 0;
-  */
+  if (!priv->listing)
+    return IDLE_PARSER_HANDLER_RESULT_HANDLED;
+
+  if (priv->listed != NULL)
+    {
+      _cache_insert (priv->connection->roomlist_cache, priv->query,
+          priv->listed);
+      priv->listed = NULL;
+      priv->query = NULL;
+    }
+
+  stop_listing (self);
 
   return IDLE_PARSER_HANDLER_RESULT_HANDLED;
 }
 
 
+/* The LISTs we sent went with the connection, so no more replies to them are coming */
+static void
+forget_lists (IdleRoomlistChannel *self)
+{
+  IdleRoomlistChannelPrivate *priv = self->priv;
+
+  priv->lists_to_discard = 0;
+
+  if (priv->listing)
+    stop_listing (self);
+}
+
 static void
 connection_status_changed_cb (IdleConnection* conn,
                               guint status,
@@ -409,13 +889,26 @@ connection_status_changed_cb (IdleConnection* conn,
 
   if (status == TP_CONNECTION_STATUS_DISCONNECTED)
     {
+      forget_lists (self);
       idle_parser_remove_handlers_by_data (conn->parser, self);
       if (priv->status_changed_id != 0)
         {
           g_signal_handler_disconnect (conn, priv->status_changed_id);
           priv->status_changed_id = 0;
         }
+      if (priv->reconnected_id != 0)
+        {
+          g_signal_handler_disconnect (conn, priv->reconnected_id);
+          priv->reconnected_id = 0;
+        }
     }
 }
 
+static void
+connection_reconnected_cb (IdleConnection *conn,
+                           IdleRoomlistChannel *self)
+{
+  forget_lists (self);
+}
+
 
@@ -27,6 +27,8 @@
 #include <glib-object.h>
 #include <telepathy-glib/telepathy-glib.h>
 
+#include "idle-connection.h"
+
 G_BEGIN_DECLS
 
 typedef struct _IdleRoomlistChannel IdleRoomlistChannel;
@@ -58,6 +60,10 @@ GType idle_roomlist_channel_get_type(void);
 #define IDLE_ROOMLIST_CHANNEL_GET_CLASS(obj) \
     (G_TYPE_INSTANCE_GET_CLASS ((obj), IDLE_TYPE_ROOMLIST_CHANNEL, IdleRoomlistChannelClass))
 
+/* The rooms listed by the server, kept for the connection's room-list-ttl to answer later listings with */
+void idle_roomlist_cache_init (IdleConnection *conn);
+void idle_roomlist_cache_finalize (GObject *object);
+
 G_END_DECLS
 
 #endif /* #ifndef __IDLE_ROOMLIST_CHANNEL_H__*/
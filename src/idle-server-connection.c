@@ -31,6 +31,7 @@
 
 #define IDLE_DEBUG_FLAG IDLE_DEBUG_NETWORK
 #include "idle-connection.h"
+#include "idle-dns-cache.h"
 #include "server-tls-manager.h"
 #include "idle-debug.h"
 
@@ -49,6 +50,7 @@ enum {
 enum {
 	PROP_HOST = 1,
 	PROP_PORT,
+	PROP_FALLBACK_SERVERS,
 	PROP_TLS_MANAGER
 };
 
@@ -61,22 +63,30 @@ typedef enum {
 struct _IdleServerConnectionPrivate {
 	gchar *host;
 	guint16 port;
+	/* "host" or "host:port", tried alongside host if it is slow to answer */
+	gchar **fallback_servers;
+	gboolean use_tls;
 
 	gchar input_buffer[IRC_MSG_MAXLEN + 3];
-	gchar output_buffer[IRC_MSG_MAXLEN + 2]; /* No need for a trailing '\0' */
-	gsize count;
-	gsize nwritten;
 
 	guint reason;
 
 	GSocketClient *socket_client;
 	GIOStream *io_stream;
 	GCancellable *read_cancellable;
-	GCancellable *cancellable;
+
+	/* whether we have been asked to stop reading, and whether the read loop has stopped for it */
+	gboolean read_paused;
+	gboolean read_stopped;
 
 	IdleServerConnectionState state;
 	IdleServerTLSManager *tls_manager;
-	GAsyncQueue *certificate_queue;
+
+	/* for statistics */
+	guint64 bytes_received;
+	guint64 bytes_sent;
+	gint64 connect_started;
+	gint64 connect_time;
 };
 
 static GObject *idle_server_connection_constructor(GType type, guint n_props, GObjectConstructParam *props);
@@ -92,7 +102,6 @@ static void idle_server_connection_init(IdleServerConnection *conn) {
 	priv->socket_client = g_socket_client_new();
 
 	priv->state = SERVER_CONNECTION_STATE_NOT_CONNECTED;
-	priv->certificate_queue = g_async_queue_new ();
 }
 
 static GObject *idle_server_connection_constructor(GType type, guint n_props, GObjectConstructParam *props) {
@@ -117,8 +126,8 @@ static void idle_server_connection_finalize(GObject *obj) {
 	IdleServerConnection *conn = IDLE_SERVER_CONNECTION(obj);
 	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
 
-	g_async_queue_unref (priv->certificate_queue);
 	g_free(priv->host);
+	g_strfreev(priv->fallback_servers);
 }
 
 static void idle_server_connection_get_property(GObject 	*obj, guint prop_id, GValue *value, GParamSpec *pspec) {
@@ -134,6 +143,10 @@ static void idle_server_connection_get_property(GObject 	*obj, guint prop_id, GV
 			g_value_set_uint(value, priv->port);
 			break;
 
+		case PROP_FALLBACK_SERVERS:
+			g_value_set_boxed(value, priv->fallback_servers);
+			break;
+
 		case PROP_TLS_MANAGER:
 			g_value_set_object(value, priv->tls_manager);
 			break;
@@ -161,6 +174,11 @@ static void idle_server_connection_set_property(GObject 	*obj,
 			priv->port = (guint16) g_value_get_uint(value);
 			break;
 
+		case PROP_FALLBACK_SERVERS:
+			g_strfreev(priv->fallback_servers);
+			priv->fallback_servers = g_value_dup_boxed(value);
+			break;
+
 		case PROP_TLS_MANAGER:
 			priv->tls_manager = g_value_dup_object(value);
 			break;
@@ -204,6 +222,14 @@ static void idle_server_connection_class_init(IdleServerConnectionClass *klass)
 
 	g_object_class_install_property(object_class, PROP_PORT, pspec);
 
+	pspec = g_param_spec_boxed("fallback-servers", "Fallback servers",
+							  "Other servers of the same network, as \"host\" or \"host:port\", to try if host is slow to answer.",
+							  G_TYPE_STRV,
+							  G_PARAM_READWRITE|
+							  G_PARAM_STATIC_STRINGS);
+
+	g_object_class_install_property(object_class, PROP_FALLBACK_SERVERS, pspec);
+
 	pspec = g_param_spec_object("tls-manager", "TLS Manager",
 							  "TLS manager for interactive certificate checking",
 							  IDLE_TYPE_SERVER_TLS_MANAGER,
@@ -275,8 +301,15 @@ static void _input_stream_read_ready(GObject *source_object, GAsyncResult *res,
 		goto disconnect;
 	}
 
+	priv->bytes_received += ret;
 	g_signal_emit(conn, signals[RECEIVED], 0, priv->input_buffer);
 
+	if (priv->read_paused) {
+		IDLE_DEBUG("reading paused");
+		priv->read_stopped = TRUE;
+		goto cleanup;
+	}
+
 	_input_stream_read(conn, input_stream, _input_stream_read_ready);
 	return;
 
@@ -287,28 +320,276 @@ cleanup:
 	g_object_unref(conn);
 }
 
-static void _connect_to_host_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
-	GSimpleAsyncResult *task = G_SIMPLE_ASYNC_RESULT (res);
-	GSimpleAsyncResult *result = G_SIMPLE_ASYNC_RESULT(user_data);
-	IdleServerConnection *conn = IDLE_SERVER_CONNECTION(g_async_result_get_source_object(G_ASYNC_RESULT(result)));
+/* Happy Eyeballs (RFC 8305): rather than waiting for each address to time out in turn, start on the next one if the last has not connected
+ * after this long, and keep whichever connects first */
+#define CONNECT_ATTEMPT_DELAY 250 /* ms */
+
+/* GIO has no API for resuming a TLS session ourselves, but glib-networking keeps the sessions it can resume by the peer's address and port,
+ * so a reconnect only gets the chance if it lands on the same address as before. This maps "host:port" to the address we last completed a handshake with, which is then tried first. */
+static GHashTable *tls_session_peers = NULL;
+
+static gchar *_tls_session_key(GNetworkAddress *address) {
+	gchar *host = g_ascii_strdown(g_network_address_get_hostname(address), -1);
+	gchar *key = g_strdup_printf("%s:%u", host, g_network_address_get_port(address));
+
+	g_free(host);
+	return key;
+}
+
+static void _remember_tls_session_peer(GNetworkAddress *address, const gchar *peer) {
+	gchar *key = _tls_session_key(address);
+
+	if (tls_session_peers == NULL)
+		tls_session_peers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (peer != NULL) {
+		g_hash_table_insert(tls_session_peers, key, g_strdup(peer));
+	} else {
+		g_hash_table_remove(tls_session_peers, key);
+		g_free(key);
+	}
+}
+
+/* Moves the address holding our last session with @address, if it is among @addresses, to the front */
+static GList *_prefer_tls_session_peer(GNetworkAddress *address, GList *addresses) {
+	const gchar *peer;
+	gchar *key;
+	GList *l;
+
+	if (tls_session_peers == NULL)
+		return addresses;
+
+	key = _tls_session_key(address);
+	peer = g_hash_table_lookup(tls_session_peers, key);
+	g_free(key);
+
+	if (peer == NULL)
+		return addresses;
+
+	for (l = addresses; l != NULL; l = l->next) {
+		gchar *address_str = g_inet_address_to_string(l->data);
+		gboolean found = !strcmp(address_str, peer);
+
+		g_free(address_str);
+
+		if (found) {
+			addresses = g_list_remove_link(addresses, l);
+			return g_list_concat(l, addresses);
+		}
+	}
+
+	return addresses;
+}
+
+typedef struct _ConnectData ConnectData;
+
+typedef struct {
+	ConnectData *data;
+	GNetworkAddress *address;
+	/* owned GInetAddresses we have yet to try, alternating between families */
+	GList *untried;
+} ConnectServer;
+
+struct _ConnectData {
+	guint refcount;
+	IdleServerConnection *conn;
+	GSimpleAsyncResult *result;
+	GCancellable *cancellable;
+	gulong cancelled_id;
+
+	/* cancels the lookups still running once we have given up or succeeded */
+	GCancellable *lookups_cancellable;
+	/* cancels the attempts still running once one of them has connected; replaced if its TLS handshake then fails */
+	GCancellable *attempts_cancellable;
+	/* lookups, attempts, handshakes and verifications still running */
+	guint pending;
+	guint attempt_timeout;
+
+	/* the main server first, then the fallbacks */
+	ConnectServer *servers;
+	guint n_servers;
+	/* the server whose next address gets the next attempt; they take turns, so a fallback gets its go while the main server is slow */
+	guint next_server;
+
+	ConnectServer *winner;
+	/* the winner's address, once we are talking TLS to it */
+	gchar *tls_peer;
+	GIOStream *tls_stream;
+	GTlsCertificateFlags certificate_errors;
+	GError *last_error;
+	gboolean completed;
+};
+
+static ConnectData *_connect_data_ref(ConnectData *data) {
+	data->refcount++;
+	return data;
+}
+
+static void _connect_data_unref(ConnectData *data) {
+	guint i;
+
+	if (--data->refcount > 0)
+		return;
+
+	if (data->cancelled_id != 0)
+		g_cancellable_disconnect(data->cancellable, data->cancelled_id);
+
+	for (i = 0; i < data->n_servers; i++) {
+		g_object_unref(data->servers[i].address);
+		g_list_free_full(data->servers[i].untried, g_object_unref);
+	}
+
+	g_free(data->servers);
+	g_free(data->tls_peer);
+	tp_clear_object(&data->cancellable);
+	g_object_unref(data->lookups_cancellable);
+	g_object_unref(data->attempts_cancellable);
+	g_object_unref(data->result);
+	g_object_unref(data->conn);
+	g_clear_error(&data->last_error);
+	g_slice_free(ConnectData, data);
+}
+
+static void _connect_complete(ConnectData *data, GIOStream *io_stream, const GError *error) {
+	IdleServerConnection *conn = data->conn;
 	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
-	GInputStream *input_stream;
+
+	data->completed = TRUE;
+	g_cancellable_cancel(data->lookups_cancellable);
+	g_cancellable_cancel(data->attempts_cancellable);
+
+	if (data->attempt_timeout != 0) {
+		g_source_remove(data->attempt_timeout);
+		data->attempt_timeout = 0;
+	}
+
+	if (data->tls_peer != NULL)
+		_remember_tls_session_peer(data->winner->address, error == NULL ? data->tls_peer : NULL);
+
+	if (error != NULL) {
+		IDLE_DEBUG("connecting failed: %s", error->message);
+
+		/* the addresses we have for them may be what is wrong */
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			guint i;
+
+			for (i = 0; i < data->n_servers; i++)
+				idle_dns_cache_invalidate(g_network_address_get_hostname(data->servers[i].address));
+		}
+
+		g_simple_async_result_set_error(data->result, TP_ERROR, TP_ERROR_NETWORK_ERROR, "%s", error->message);
+		change_state(conn, SERVER_CONNECTION_STATE_NOT_CONNECTED, SERVER_CONNECTION_STATE_REASON_ERROR);
+	} else {
+		priv->io_stream = g_object_ref(io_stream);
+		priv->connect_time = g_get_monotonic_time() - priv->connect_started;
+		priv->read_paused = FALSE;
+		priv->read_stopped = FALSE;
+
+		/* the read loop holds a reference until it stops */
+		g_object_ref(conn);
+		_input_stream_read(conn, g_io_stream_get_input_stream(priv->io_stream), _input_stream_read_ready);
+		change_state(conn, SERVER_CONNECTION_STATE_CONNECTED, SERVER_CONNECTION_STATE_REASON_REQUESTED);
+	}
+
+	g_simple_async_result_complete(data->result);
+
+	/* the operation's own reference */
+	_connect_data_unref(data);
+}
+
+static void _certificate_verified(GObject *source, GAsyncResult *res, gpointer user_data) {
+	ConnectData *data = user_data;
+	GError *error = NULL;
+
+	data->pending--;
+
+	if (idle_server_tls_manager_verify_finish(IDLE_SERVER_TLS_MANAGER(source), res, &error) &&
+	    !g_cancellable_set_error_if_cancelled(data->cancellable, &error))
+		_connect_complete(data, data->tls_stream, NULL);
+	else
+		_connect_complete(data, NULL, error);
+
+	g_clear_error(&error);
+	g_clear_object(&data->tls_stream);
+	_connect_data_unref(data);
+}
+
+/* The handshake cannot wait for the user, so let it finish and check the certificate afterwards; nothing is sent to the server before then */
+static gboolean _accept_certificate_cb(GTlsConnection *tls_connection, GTlsCertificate *peer_cert, GTlsCertificateFlags errors, gpointer user_data) {
+	ConnectData *data = user_data;
+
+	data->certificate_errors = errors;
+	return TRUE;
+}
+
+static void _connect_continue(ConnectData *data);
+
+/* A server that won't talk TLS to us is no better than one we couldn't reach, so go back to racing the others */
+static void _handshake_failed(ConnectData *data, const GError *error) {
+	IDLE_DEBUG("handshake with %s failed: %s", g_network_address_get_hostname(data->winner->address), error->message);
+
+	if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_clear_error(&data->last_error);
+		data->last_error = g_error_copy(error);
+	}
+
+	_remember_tls_session_peer(data->winner->address, NULL);
+	g_free(data->tls_peer);
+	data->tls_peer = NULL;
+	data->winner = NULL;
+
+	g_object_unref(data->attempts_cancellable);
+	data->attempts_cancellable = g_cancellable_new();
+
+	_connect_continue(data);
+}
+
+static void _handshake_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+	GTlsConnection *tls_connection = G_TLS_CONNECTION(source_object);
+	ConnectData *data = user_data;
+	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(data->conn);
+	GError *error = NULL;
+
+	data->pending--;
+	g_signal_handlers_disconnect_by_func(tls_connection, _accept_certificate_cb, data);
+
+	if (!g_tls_connection_handshake_finish(tls_connection, res, &error)) {
+		_handshake_failed(data, error);
+		g_error_free(error);
+	} else if (data->certificate_errors == 0) {
+		_connect_complete(data, G_IO_STREAM(tls_connection), NULL);
+	} else {
+		IDLE_DEBUG("certificate flags 0x%x; asking the user", data->certificate_errors);
+		data->pending++;
+		data->tls_stream = g_object_ref(tls_connection);
+		idle_server_tls_manager_verify_async(priv->tls_manager, g_tls_connection_get_peer_certificate(tls_connection),
+			g_network_address_get_hostname(data->winner->address), _certificate_verified, _connect_data_ref(data));
+	}
+
+	g_object_unref(tls_connection);
+	_connect_data_unref(data);
+}
+
+static void _connected(ConnectData *data, ConnectServer *server, GSocketConnection *socket_connection) {
+	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(data->conn);
 	GSocket *socket_;
-	GSocketConnection *socket_connection;
+	GSocketAddress *remote_address;
+	GIOStream *tls_connection;
 	gint nodelay = 1;
 	gint socket_fd;
 	GError *error = NULL;
 
-	if (g_simple_async_result_propagate_error (task, &error)) {
-		IDLE_DEBUG("g_socket_client_connect_to_host failed: %s", error->message);
-		g_simple_async_result_set_error(result, TP_ERROR, TP_ERROR_NETWORK_ERROR, "%s", error->message);
-		g_error_free(error);
-		change_state(conn, SERVER_CONNECTION_STATE_NOT_CONNECTED, SERVER_CONNECTION_STATE_REASON_ERROR);
-		g_object_unref(conn);
-		goto cleanup;
+	IDLE_DEBUG("connected to %s", g_network_address_get_hostname(server->address));
+
+	/* the other attempts can stop now; lookups carry on, in case this one's TLS handshake fails */
+	data->winner = server;
+	g_cancellable_cancel(data->attempts_cancellable);
+
+	if (data->attempt_timeout != 0) {
+		g_source_remove(data->attempt_timeout);
+		data->attempt_timeout = 0;
 	}
 
-	socket_connection = g_object_ref (g_simple_async_result_get_op_res_gpointer (task));
 	socket_ = g_socket_connection_get_socket(socket_connection);
 	g_socket_set_keepalive(socket_, TRUE);
 
@@ -317,96 +598,229 @@ static void _connect_to_host_ready(GObject *source_object, GAsyncResult *res, gp
 
 	g_tcp_connection_set_graceful_disconnect(G_TCP_CONNECTION(socket_connection), TRUE);
 
-	priv->io_stream = G_IO_STREAM(socket_connection);
+	if (!priv->use_tls) {
+		_connect_complete(data, G_IO_STREAM(socket_connection), NULL);
+		return;
+	}
+
+	/* the backend finds the session to resume from the socket connection's remote address */
+	tls_connection = g_tls_client_connection_new(G_IO_STREAM(socket_connection), G_SOCKET_CONNECTABLE(server->address), &error);
 
-	input_stream = g_io_stream_get_input_stream(priv->io_stream);
-	_input_stream_read(conn, input_stream, _input_stream_read_ready);
-	change_state(conn, SERVER_CONNECTION_STATE_CONNECTED, SERVER_CONNECTION_STATE_REASON_REQUESTED);
+	if (tls_connection == NULL) {
+		_connect_complete(data, NULL, error);
+		g_error_free(error);
+		return;
+	}
 
-cleanup:
-	g_simple_async_result_complete(result);
-	g_object_unref(result);
-	g_object_unref(task);
+	remote_address = g_socket_connection_get_remote_address(socket_connection, NULL);
+
+	if (G_IS_INET_SOCKET_ADDRESS(remote_address))
+		data->tls_peer = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote_address)));
+
+	tp_clear_object(&remote_address);
+
+	g_signal_connect(tls_connection, "accept-certificate", G_CALLBACK(_accept_certificate_cb), data);
+
+	data->pending++;
+	g_tls_connection_handshake_async(G_TLS_CONNECTION(tls_connection), G_PRIORITY_DEFAULT, data->cancellable, _handshake_ready, _connect_data_ref(data));
 }
 
+static void _attempt_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+	ConnectServer *server = user_data;
+	ConnectData *data = server->data;
+	GSocketConnection *socket_connection;
+	GError *error = NULL;
+
+	data->pending--;
+	socket_connection = g_socket_client_connect_finish(G_SOCKET_CLIENT(source_object), res, &error);
 
-#define CERT_ACCEPTED 1
-#define CERT_REJECTED 2
-struct CertData {
-	IdleServerConnection *self;
-	GTlsCertificate *certificate;
-};
+	if (socket_connection == NULL) {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			IDLE_DEBUG("attempt failed: %s", error->message);
+			g_clear_error(&data->last_error);
+			data->last_error = g_error_copy(error);
 
-static void _certificate_verified (GObject *source, GAsyncResult *res, gpointer user_data)
-{
-	IdleServerConnection *self = user_data;
-	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(self);
-	gboolean ret;
+			/* no need to wait before trying the next one */
+			if (data->attempt_timeout != 0) {
+				g_source_remove(data->attempt_timeout);
+				data->attempt_timeout = 0;
+			}
+		}
 
-	ret = idle_server_tls_manager_verify_finish (IDLE_SERVER_TLS_MANAGER (source), res, NULL);
-	g_async_queue_push (priv->certificate_queue, GINT_TO_POINTER (ret ?  CERT_ACCEPTED : CERT_REJECTED));
+		g_error_free(error);
+		_connect_continue(data);
+	} else if (data->completed || data->winner != NULL) {
+		IDLE_DEBUG("another attempt got there first");
+		g_object_unref(socket_connection);
+	} else {
+		_connected(data, server, socket_connection);
+		g_object_unref(socket_connection);
+	}
+
+	_connect_data_unref(data);
 }
 
-static gboolean
-_check_certificate_interactively (gpointer data) {
-	struct CertData *d = data;
-	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(d->self);
+static gboolean _attempt_timeout_cb(gpointer user_data) {
+	ConnectData *data = user_data;
+
+	data->attempt_timeout = 0;
+	_connect_continue(data);
 
-	idle_server_tls_manager_verify_async (priv->tls_manager, d->certificate, priv->host, _certificate_verified, d->self);
 	return FALSE;
 }
 
-static gboolean _accept_certificate_request (GTlsConnection *tls_connection, GTlsCertificate *peer_cert, GTlsCertificateFlags errors, IdleServerConnection *conn)
-{
-	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
-	struct CertData d;
-	gpointer result;
+/* Starts connecting to the next address of the next server in turn, starting with the main server. Returns FALSE if there is none left to
+ * try yet. */
+static gboolean _start_next_attempt(ConnectData *data) {
+	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(data->conn);
+	guint i;
+
+	for (i = 0; i < data->n_servers; i++) {
+		ConnectServer *server = &data->servers[(data->next_server + i) % data->n_servers];
+		GInetAddress *address;
+		GSocketAddress *socket_address;
+		gchar *address_str;
+
+		if (server->untried == NULL)
+			continue;
+
+		address = server->untried->data;
+		server->untried = g_list_delete_link(server->untried, server->untried);
+		data->next_server = (server - data->servers + 1) % data->n_servers;
+
+		address_str = g_inet_address_to_string(address);
+		IDLE_DEBUG("trying %s (%s) port %u", g_network_address_get_hostname(server->address), address_str, g_network_address_get_port(server->address));
+		g_free(address_str);
+
+		socket_address = g_inet_socket_address_new(address, g_network_address_get_port(server->address));
+		data->pending++;
+		_connect_data_ref(data);
+		g_socket_client_connect_async(priv->socket_client, G_SOCKET_CONNECTABLE(socket_address), data->attempts_cancellable, _attempt_ready, server);
+		g_object_unref(socket_address);
+		g_object_unref(address);
+
+		data->attempt_timeout = g_timeout_add(CONNECT_ATTEMPT_DELAY, _attempt_timeout_cb, data);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void _connect_continue(ConnectData *data) {
+	GError *error = NULL;
 
-	/* Requested to check the extra errors from an ssl certificate,
-	 * Need to bounce this back into the main thread so we can ask the UI
-	 * on dbus */
-	IDLE_DEBUG ("Requested to validate certificate");
+	if (data->completed || data->winner != NULL)
+		return;
 
-	d.self = conn;
-	d.certificate = peer_cert;
+	if (g_cancellable_set_error_if_cancelled(data->cancellable, &error)) {
+		_connect_complete(data, NULL, error);
+		g_error_free(error);
+		return;
+	}
+
+	if (data->attempt_timeout != 0 || _start_next_attempt(data))
+		return;
 
-	g_idle_add (_check_certificate_interactively, &d);
-	result = g_async_queue_pop (priv->certificate_queue);
+	/* Nothing left to try; give up once everything still running has failed too */
+	if (data->pending == 0) {
+		if (data->last_error == NULL)
+			data->last_error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_HOST_NOT_FOUND, "no addresses to connect to");
 
-	return GPOINTER_TO_INT (result) == CERT_ACCEPTED;
+		_connect_complete(data, NULL, data->last_error);
+	}
 }
 
-static void _connect_event_cb (GSocketClient *client, GSocketClientEvent event, GSocketConnectable *connectable, GIOStream *connection, gpointer user_data)
-{
-	if (event != G_SOCKET_CLIENT_TLS_HANDSHAKING)
-		return;
+/* Orders the addresses a lookup returned so the families alternate, starting with the one the resolver preferred. Steals @addresses. */
+static GList *_interleave_families(GList *addresses) {
+	GQueue preferred = G_QUEUE_INIT;
+	GQueue other = G_QUEUE_INIT;
+	GSocketFamily family;
+	GList *ret = NULL;
+	GList *l;
+
+	if (addresses == NULL)
+		return NULL;
+
+	family = g_inet_address_get_family(addresses->data);
+
+	for (l = addresses; l != NULL; l = l->next) {
+		if (g_inet_address_get_family(l->data) == family)
+			g_queue_push_tail(&preferred, l->data);
+		else
+			g_queue_push_tail(&other, l->data);
+	}
 
-	g_signal_connect (connection, "accept-certificate", G_CALLBACK (_accept_certificate_request), user_data);
+	g_list_free(addresses);
+
+	while (!g_queue_is_empty(&preferred) || !g_queue_is_empty(&other)) {
+		if (!g_queue_is_empty(&preferred))
+			ret = g_list_prepend(ret, g_queue_pop_head(&preferred));
+
+		if (!g_queue_is_empty(&other))
+			ret = g_list_prepend(ret, g_queue_pop_head(&other));
+	}
+
+	return g_list_reverse(ret);
 }
 
-static void _connect_in_thread (GSimpleAsyncResult *task, GObject *source_object, GCancellable *cancellable)
-{
-	IdleServerConnection *conn = IDLE_SERVER_CONNECTION (source_object);
-	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
+static void _lookup_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+	ConnectServer *server = user_data;
+	ConnectData *data = server->data;
+	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(data->conn);
+	GList *addresses;
 	GError *error = NULL;
-	GSocketConnection *socket_connection;
-	gulong event_id;
 
-	event_id = g_signal_connect (priv->socket_client, "event",
-		G_CALLBACK (_connect_event_cb), conn);
-	socket_connection = g_socket_client_connect_to_host (priv->socket_client, priv->host, priv->port, cancellable, &error);
-	g_signal_handler_disconnect (priv->socket_client, event_id);
+	data->pending--;
+	addresses = idle_dns_cache_lookup_finish(res, &error);
 
-	if (socket_connection != NULL)
-		g_simple_async_result_set_op_res_gpointer (task, socket_connection, g_object_unref);
-	else
-		g_simple_async_result_take_error (task, error);
+	if (addresses == NULL) {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			IDLE_DEBUG("looking up %s failed: %s", g_network_address_get_hostname(server->address), error->message);
+			g_clear_error(&data->last_error);
+			data->last_error = g_error_copy(error);
+		}
+
+		g_error_free(error);
+	} else {
+		server->untried = _interleave_families(addresses);
+
+		if (priv->use_tls)
+			server->untried = _prefer_tls_session_peer(server->address, server->untried);
+	}
+
+	_connect_continue(data);
+	_connect_data_unref(data);
+}
+
+static void _connect_cancelled_cb(GCancellable *cancellable, gpointer user_data) {
+	ConnectData *data = user_data;
+
+	/* the callbacks notice, and fail the connection */
+	g_cancellable_cancel(data->lookups_cancellable);
+	g_cancellable_cancel(data->attempts_cancellable);
+}
+
+static void _add_server(ConnectData *data, const gchar *host_and_port, guint16 default_port) {
+	GError *error = NULL;
+	GSocketConnectable *address = g_network_address_parse(host_and_port, default_port, &error);
+
+	if (address == NULL) {
+		IDLE_DEBUG("ignoring server %s: %s", host_and_port, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	data->servers[data->n_servers].data = data;
+	data->servers[data->n_servers].address = G_NETWORK_ADDRESS(address);
+	data->servers[data->n_servers].untried = NULL;
+	data->n_servers++;
 }
 
 void idle_server_connection_connect_async(IdleServerConnection *conn, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
 	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
-	GSimpleAsyncResult *result;
-	GSimpleAsyncResult *task;
+	ConnectData *data;
+	gchar **fallback;
+	guint i;
 
 	if (priv->state != SERVER_CONNECTION_STATE_NOT_CONNECTED) {
 		IDLE_DEBUG("already connecting or connected!");
@@ -435,12 +849,36 @@ void idle_server_connection_connect_async(IdleServerConnection *conn, GCancellab
 		return;
 	}
 
-	result = g_simple_async_result_new(G_OBJECT(conn), callback, user_data, idle_server_connection_connect_async);
+	data = g_slice_new0(ConnectData);
+	data->refcount = 1;
+	data->conn = g_object_ref(conn);
+	data->result = g_simple_async_result_new(G_OBJECT(conn), callback, user_data, idle_server_connection_connect_async);
+	data->lookups_cancellable = g_cancellable_new();
+	data->attempts_cancellable = g_cancellable_new();
+
+	data->servers = g_new0(ConnectServer, 1 + (priv->fallback_servers != NULL ? g_strv_length(priv->fallback_servers) : 0));
+	data->servers[0].data = data;
+	data->servers[0].address = G_NETWORK_ADDRESS(g_network_address_new(priv->host, priv->port));
+	data->n_servers = 1;
+
+	for (fallback = priv->fallback_servers; fallback != NULL && *fallback != NULL; fallback++)
+		_add_server(data, *fallback, priv->port);
 
-	task = g_simple_async_result_new (G_OBJECT (conn), _connect_to_host_ready, result, NULL);
-	g_simple_async_result_run_in_thread (task, _connect_in_thread, G_PRIORITY_DEFAULT, cancellable);
+	if (cancellable != NULL) {
+		data->cancellable = g_object_ref(cancellable);
+		data->cancelled_id = g_cancellable_connect(cancellable, G_CALLBACK(_connect_cancelled_cb), data, NULL);
+	}
 
 	change_state(conn, SERVER_CONNECTION_STATE_CONNECTING, SERVER_CONNECTION_STATE_REASON_REQUESTED);
+	priv->connect_started = g_get_monotonic_time();
+
+	/* look all the servers up at once, and start on whichever answers first */
+	for (i = 0; i < data->n_servers; i++) {
+		data->pending++;
+		_connect_data_ref(data);
+		idle_dns_cache_lookup_async(g_network_address_get_hostname(data->servers[i].address),
+			data->lookups_cancellable, _lookup_ready, &data->servers[i]);
+	}
 }
 
 gboolean idle_server_connection_connect_finish(IdleServerConnection *conn, GAsyncResult *result, GError **error) {
@@ -533,11 +971,45 @@ gboolean idle_server_connection_disconnect_finish(IdleServerConnection *conn, GA
 	return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT(result), error);
 }
 
+/* What one send is writing, and how far it has got. Each send has its own, as a write to a socket we have since given up on may still be
+ * running when the next send starts. */
+typedef struct {
+	gchar *buffer;
+	gsize count;
+	gsize nwritten;
+	GCancellable *cancellable;
+} SendData;
+
+static void _send_data_free(gpointer user_data) {
+	SendData *data = user_data;
+
+	g_free(data->buffer);
+	tp_clear_object(&data->cancellable);
+	g_slice_free(SendData, data);
+}
+
+/* Appends @line, of @len bytes not counting its CR/LF, to @buffer, cut down to the IRC_MSG_MAXLEN bytes servers take. The message tags
+ * on a line in a draft/multiline batch don't count towards that. */
+static void _append_line(GString *buffer, const gchar *line, gsize len) {
+	gsize tags_len = 0;
+
+	if (line[0] == '@') {
+		const gchar *space = memchr(line, ' ', len);
+
+		if (space != NULL)
+			tags_len = space + 1 - line;
+	}
+
+	g_string_append_len(buffer, line, MIN(len, tags_len + IRC_MSG_MAXLEN));
+	g_string_append(buffer, "\r\n");
+}
+
 static void _write_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
 	GOutputStream *output_stream = G_OUTPUT_STREAM(source_object);
 	GSimpleAsyncResult *result = G_SIMPLE_ASYNC_RESULT(user_data);
 	IdleServerConnection *conn = IDLE_SERVER_CONNECTION(g_async_result_get_source_object(G_ASYNC_RESULT(result)));
 	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
+	SendData *data = g_simple_async_result_get_op_res_gpointer(result);
 	gssize nwrite;
 	GError *error = NULL;
 
@@ -551,26 +1023,26 @@ static void _write_ready(GObject *source_object, GAsyncResult *res, gpointer use
 		goto cleanup;
 	}
 
-	priv->nwritten += nwrite;
-	if (priv->nwritten < priv->count) {
-		g_output_stream_write_async(output_stream, priv->output_buffer + priv->nwritten, priv->count - priv->nwritten, G_PRIORITY_DEFAULT, priv->cancellable, _write_ready, result);
+	data->nwritten += nwrite;
+	priv->bytes_sent += nwrite;
+	if (data->nwritten < data->count) {
+		g_output_stream_write_async(output_stream, data->buffer + data->nwritten, data->count - data->nwritten, G_PRIORITY_DEFAULT, data->cancellable, _write_ready, result);
 		return;
 	}
 
 cleanup:
-	if (priv->cancellable != NULL) {
-		g_object_unref(priv->cancellable);
-		priv->cancellable = NULL;
-	}
 	g_simple_async_result_complete(result);
 	g_object_unref(result);
 }
 
+/* Sends @cmd, which is one line or a draft/multiline batch of them, each ending in CR/LF */
 void idle_server_connection_send_async(IdleServerConnection *conn, const gchar *cmd, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
 	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
 	GOutputStream *output_stream;
 	GSimpleAsyncResult *result;
-	gsize output_buffer_size = sizeof(priv->output_buffer);
+	SendData *data;
+	GString *buffer;
+	const gchar *line;
 
 	if (priv->state != SERVER_CONNECTION_STATE_CONNECTED
             || priv->io_stream == NULL) {
@@ -582,28 +1054,29 @@ void idle_server_connection_send_async(IdleServerConnection *conn, const gchar *
 		return;
 	}
 
-	priv->count = strlen(cmd);
-	if (priv->count > output_buffer_size)
-		priv->count = output_buffer_size;
+	buffer = g_string_sized_new(strlen(cmd));
 
-	/* We only need to copy priv->count bytes, but padding the rest
-         * with null bytes gives us cleaner debug messages, without
-         * affecting the readability of the code.
-         */
-	strncpy(priv->output_buffer, cmd, output_buffer_size);
+	for (line = cmd; *line != '\0'; ) {
+		gsize len = strcspn(line, "\r\n");
 
-	priv->nwritten = 0;
-
-	if (cancellable != NULL) {
-		priv->cancellable = cancellable;
-		g_object_ref(priv->cancellable);
+		_append_line(buffer, line, len);
+		line += len;
+		line += strspn(line, "\r\n");
 	}
 
+	data = g_slice_new0(SendData);
+	data->count = buffer->len;
+	data->buffer = g_string_free(buffer, FALSE);
+
+	if (cancellable != NULL)
+		data->cancellable = g_object_ref(cancellable);
+
 	output_stream = g_io_stream_get_output_stream(priv->io_stream);
 	result = g_simple_async_result_new(G_OBJECT(conn), callback, user_data, idle_server_connection_send_async);
-	g_output_stream_write_async(output_stream, priv->output_buffer, priv->count, G_PRIORITY_DEFAULT, cancellable, _write_ready, result);
+	g_simple_async_result_set_op_res_gpointer(result, data, _send_data_free);
+	g_output_stream_write_async(output_stream, data->buffer, data->count, G_PRIORITY_DEFAULT, cancellable, _write_ready, result);
 
-	IDLE_DEBUG("sending \"%s\" to OutputStream %p", priv->output_buffer, output_stream);
+	IDLE_DEBUG("sending \"%s\" to OutputStream %p", data->buffer, output_stream);
 }
 
 gboolean idle_server_connection_send_finish(IdleServerConnection *conn, GAsyncResult *result, GError **error) {
@@ -621,5 +1094,41 @@ gboolean idle_server_connection_is_connected(IdleServerConnection *conn) {
 
 void idle_server_connection_set_tls(IdleServerConnection *conn, gboolean tls) {
 	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
-	g_socket_client_set_tls(priv->socket_client, tls);
+	priv->use_tls = tls;
+}
+
+/* While paused, whatever the server sends waits in the socket, so that TCP flow control pushes back on it. The chunk being read when
+ * reading is paused is still delivered. */
+void idle_server_connection_set_reading_paused(IdleServerConnection *conn, gboolean paused) {
+	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
+
+	priv->read_paused = paused;
+
+	if (paused || !priv->read_stopped)
+		return;
+
+	priv->read_stopped = FALSE;
+
+	if (priv->io_stream == NULL)
+		return;
+
+	IDLE_DEBUG("reading resumed");
+
+	/* the read loop holds a reference until it stops */
+	g_object_ref(conn);
+	_input_stream_read(conn, g_io_stream_get_input_stream(priv->io_stream), _input_stream_read_ready);
+}
+
+/* Any of the out parameters may be NULL. @connect_time is how long connecting took, in microseconds, or 0 if it has not succeeded. */
+void idle_server_connection_get_statistics(IdleServerConnection *conn, guint64 *bytes_received, guint64 *bytes_sent, gint64 *connect_time) {
+	IdleServerConnectionPrivate *priv = IDLE_SERVER_CONNECTION_GET_PRIVATE(conn);
+
+	if (bytes_received != NULL)
+		*bytes_received = priv->bytes_received;
+
+	if (bytes_sent != NULL)
+		*bytes_sent = priv->bytes_sent;
+
+	if (connect_time != NULL)
+		*connect_time = priv->connect_time;
 }
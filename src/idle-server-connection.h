@@ -73,6 +73,8 @@ void idle_server_connection_send_async(IdleServerConnection *conn, const gchar *
 gboolean idle_server_connection_send_finish(IdleServerConnection *conn, GAsyncResult *result, GError **error);
 gboolean idle_server_connection_is_connected(IdleServerConnection *conn);
 void idle_server_connection_set_tls(IdleServerConnection *conn, gboolean tls);
+void idle_server_connection_set_reading_paused(IdleServerConnection *conn, gboolean paused);
+void idle_server_connection_get_statistics(IdleServerConnection *conn, guint64 *bytes_received, guint64 *bytes_sent, gint64 *connect_time);
 
 G_END_DECLS
 
@@ -0,0 +1,439 @@
+/*
+ * This file is part of telepathy-idle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "idle-statistics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IDLE_DEBUG_FLAG IDLE_DEBUG_CONNECTION
+#include "idle-debug.h"
+#include "extensions/extensions.h"
+
+/* Upper bounds of the latency histograms' buckets, in milliseconds */
+static const guint histogram_bounds[] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, G_MAXUINT32 };
+#define HISTOGRAM_BUCKETS G_N_ELEMENTS(histogram_bounds)
+
+/* Lag percentiles are taken over this many of the latest samples */
+#define LAG_SAMPLES 64
+
+typedef enum {
+	STAT_BYTES_RECEIVED,
+	STAT_BYTES_SENT,
+	STAT_LINES_RECEIVED,
+	STAT_LINES_SENT,
+	STAT_QUEUE_LENGTH,
+	STAT_MAX_QUEUE_LENGTH,
+	STAT_FLOOD_CONTROL_STALLS,
+	STAT_DROPPED_LINES,
+	STAT_QUEUE_DELAY_HISTOGRAM,
+	STAT_READ_STALLS,
+	STAT_READ_STALL_TIME,
+	STAT_LAG,
+	STAT_LAG_HISTOGRAM,
+	STAT_SMOOTHED_LAG,
+	STAT_LAG_VARIATION,
+	STAT_LAG_PERCENTILES,
+	STAT_CONNECT_TIME,
+	STAT_RECONNECTS,
+	STAT_UPDATE_INTERVAL
+} IdleStatistic;
+
+struct _IdleStatistics {
+	/* the server connection in use, and what the ones before it carried */
+	IdleServerConnection *sconn;
+	guint64 old_bytes_received;
+	guint64 old_bytes_sent;
+
+	guint64 lines_received;
+	guint64 lines_sent;
+	guint max_queue_length;
+	guint64 flood_control_stalls;
+	guint64 dropped_lines;
+	guint queue_delays[HISTOGRAM_BUCKETS];
+	guint64 read_stalls;
+	gint64 read_stall_time; /* usec */
+	guint lag; /* ms */
+	guint lags[HISTOGRAM_BUCKETS];
+	/* smoothed round trip and its variation, as RFC 6298 has them, in usec; srtt is 0 until there is a sample */
+	gint64 srtt;
+	gint64 rttvar;
+	/* the latest samples, in ms, oldest overwritten first */
+	guint lag_samples[LAG_SAMPLES];
+	guint n_lag_samples;
+	guint connect_time; /* ms */
+	guint reconnects;
+
+	guint update_interval; /* sec */
+	guint update_timeout;
+};
+
+static TpDBusPropertiesMixinPropImpl statistics_props[] = {
+	{"BytesReceived", GUINT_TO_POINTER(STAT_BYTES_RECEIVED), NULL},
+	{"BytesSent", GUINT_TO_POINTER(STAT_BYTES_SENT), NULL},
+	{"LinesReceived", GUINT_TO_POINTER(STAT_LINES_RECEIVED), NULL},
+	{"LinesSent", GUINT_TO_POINTER(STAT_LINES_SENT), NULL},
+	{"QueueLength", GUINT_TO_POINTER(STAT_QUEUE_LENGTH), NULL},
+	{"MaxQueueLength", GUINT_TO_POINTER(STAT_MAX_QUEUE_LENGTH), NULL},
+	{"FloodControlStalls", GUINT_TO_POINTER(STAT_FLOOD_CONTROL_STALLS), NULL},
+	{"DroppedLines", GUINT_TO_POINTER(STAT_DROPPED_LINES), NULL},
+	{"QueueDelayHistogram", GUINT_TO_POINTER(STAT_QUEUE_DELAY_HISTOGRAM), NULL},
+	{"ReadStalls", GUINT_TO_POINTER(STAT_READ_STALLS), NULL},
+	{"ReadStallTime", GUINT_TO_POINTER(STAT_READ_STALL_TIME), NULL},
+	{"Lag", GUINT_TO_POINTER(STAT_LAG), NULL},
+	{"LagHistogram", GUINT_TO_POINTER(STAT_LAG_HISTOGRAM), NULL},
+	{"SmoothedLag", GUINT_TO_POINTER(STAT_SMOOTHED_LAG), NULL},
+	{"LagVariation", GUINT_TO_POINTER(STAT_LAG_VARIATION), NULL},
+	{"LagPercentiles", GUINT_TO_POINTER(STAT_LAG_PERCENTILES), NULL},
+	{"ConnectTime", GUINT_TO_POINTER(STAT_CONNECT_TIME), NULL},
+	{"Reconnects", GUINT_TO_POINTER(STAT_RECONNECTS), NULL},
+	{"UpdateInterval", GUINT_TO_POINTER(STAT_UPDATE_INTERVAL), GUINT_TO_POINTER(STAT_UPDATE_INTERVAL)},
+	{NULL}
+};
+
+static guint _usec_to_msec(gint64 usec) {
+	return (guint) CLAMP(usec / 1000, 0, G_MAXUINT32);
+}
+
+static void _histogram_add(guint *histogram, guint msec) {
+	guint i;
+
+	for (i = 0; msec > histogram_bounds[i]; i++)
+		;
+
+	histogram[i]++;
+}
+
+static GPtrArray *_histogram_to_dbus(const guint *histogram) {
+	GPtrArray *buckets = g_ptr_array_sized_new(HISTOGRAM_BUCKETS);
+	guint i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		g_ptr_array_add(buckets, tp_value_array_build(2, G_TYPE_UINT, histogram_bounds[i], G_TYPE_UINT, histogram[i], G_TYPE_INVALID));
+
+	return buckets;
+}
+
+static gint _compare_uint(gconstpointer a, gconstpointer b) {
+	guint x = *(const guint *) a, y = *(const guint *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static GHashTable *_lag_percentiles(IdleStatistics *stats) {
+	static const guint percentiles[] = { 50, 90, 99 };
+	GHashTable *ret = g_hash_table_new(NULL, NULL);
+	guint n = MIN(stats->n_lag_samples, LAG_SAMPLES);
+	guint sorted[LAG_SAMPLES];
+	guint i;
+
+	if (n == 0)
+		return ret;
+
+	memcpy(sorted, stats->lag_samples, n * sizeof(guint));
+	qsort(sorted, n, sizeof(guint), _compare_uint);
+
+	/* nearest rank */
+	for (i = 0; i < G_N_ELEMENTS(percentiles); i++)
+		g_hash_table_insert(ret, GUINT_TO_POINTER(percentiles[i]), GUINT_TO_POINTER(sorted[MAX((percentiles[i] * n + 99) / 100, 1) - 1]));
+
+	return ret;
+}
+
+static void _traffic(IdleStatistics *stats, guint64 *bytes_received, guint64 *bytes_sent) {
+	*bytes_received = stats->old_bytes_received;
+	*bytes_sent = stats->old_bytes_sent;
+
+	if (stats->sconn != NULL) {
+		guint64 received, sent;
+
+		idle_server_connection_get_statistics(stats->sconn, &received, &sent, NULL);
+		*bytes_received += received;
+		*bytes_sent += sent;
+	}
+}
+
+static void idle_statistics_getter(GObject *object, GQuark interface, GQuark name, GValue *value, gpointer getter_data) {
+	IdleStatistics *stats = IDLE_CONNECTION(object)->statistics;
+	guint64 bytes_received, bytes_sent;
+
+	switch (GPOINTER_TO_UINT(getter_data)) {
+		case STAT_BYTES_RECEIVED:
+			_traffic(stats, &bytes_received, &bytes_sent);
+			g_value_set_uint64(value, bytes_received);
+			break;
+
+		case STAT_BYTES_SENT:
+			_traffic(stats, &bytes_received, &bytes_sent);
+			g_value_set_uint64(value, bytes_sent);
+			break;
+
+		case STAT_LINES_RECEIVED:
+			g_value_set_uint64(value, stats->lines_received);
+			break;
+
+		case STAT_LINES_SENT:
+			g_value_set_uint64(value, stats->lines_sent);
+			break;
+
+		case STAT_QUEUE_LENGTH:
+			g_value_set_uint(value, idle_connection_get_queue_length(IDLE_CONNECTION(object)));
+			break;
+
+		case STAT_MAX_QUEUE_LENGTH:
+			g_value_set_uint(value, stats->max_queue_length);
+			break;
+
+		case STAT_FLOOD_CONTROL_STALLS:
+			g_value_set_uint64(value, stats->flood_control_stalls);
+			break;
+
+		case STAT_DROPPED_LINES:
+			g_value_set_uint64(value, stats->dropped_lines);
+			break;
+
+		case STAT_QUEUE_DELAY_HISTOGRAM:
+			g_value_take_boxed(value, _histogram_to_dbus(stats->queue_delays));
+			break;
+
+		case STAT_READ_STALLS:
+			g_value_set_uint64(value, stats->read_stalls);
+			break;
+
+		case STAT_READ_STALL_TIME:
+			g_value_set_uint64(value, stats->read_stall_time / 1000);
+			break;
+
+		case STAT_LAG:
+			g_value_set_uint(value, stats->lag);
+			break;
+
+		case STAT_LAG_HISTOGRAM:
+			g_value_take_boxed(value, _histogram_to_dbus(stats->lags));
+			break;
+
+		case STAT_SMOOTHED_LAG:
+			g_value_set_uint(value, _usec_to_msec(stats->srtt));
+			break;
+
+		case STAT_LAG_VARIATION:
+			g_value_set_uint(value, _usec_to_msec(stats->rttvar));
+			break;
+
+		case STAT_LAG_PERCENTILES:
+			g_value_take_boxed(value, _lag_percentiles(stats));
+			break;
+
+		case STAT_CONNECT_TIME:
+			g_value_set_uint(value, stats->connect_time);
+			break;
+
+		case STAT_RECONNECTS:
+			g_value_set_uint(value, stats->reconnects);
+			break;
+
+		case STAT_UPDATE_INTERVAL:
+			g_value_set_uint(value, stats->update_interval);
+			break;
+
+		default:
+			g_assert_not_reached();
+	}
+}
+
+static void _emit_statistics_changed(IdleConnection *conn) {
+	GHashTable *statistics = tp_asv_new(NULL, NULL);
+	const gchar *iface = IDLE_IFACE_CONNECTION_INTERFACE_STATISTICS1;
+	TpDBusPropertiesMixinPropImpl *prop;
+
+	for (prop = statistics_props; prop->name != NULL; prop++) {
+		GValue value = G_VALUE_INIT;
+
+		if (GPOINTER_TO_UINT(prop->getter_data) == STAT_UPDATE_INTERVAL)
+			continue;
+
+		if (tp_dbus_properties_mixin_get(G_OBJECT(conn), iface, prop->name, &value, NULL)) {
+			g_hash_table_insert(statistics, (gpointer) prop->name, tp_g_value_slice_dup(&value));
+			g_value_unset(&value);
+		}
+	}
+
+	idle_svc_connection_interface_statistics1_emit_statistics_changed(conn, statistics);
+	g_hash_table_unref(statistics);
+}
+
+static gboolean _update_timeout_cb(gpointer user_data) {
+	IdleConnection *conn = IDLE_CONNECTION(user_data);
+
+	if (tp_base_connection_get_status(TP_BASE_CONNECTION(conn)) == TP_CONNECTION_STATUS_CONNECTED)
+		_emit_statistics_changed(conn);
+
+	return TRUE;
+}
+
+static gboolean idle_statistics_setter(GObject *object, GQuark interface, GQuark name, const GValue *value, gpointer setter_data, GError **error) {
+	IdleConnection *conn = IDLE_CONNECTION(object);
+	IdleStatistics *stats = conn->statistics;
+
+	g_return_val_if_fail(GPOINTER_TO_UINT(setter_data) == STAT_UPDATE_INTERVAL, FALSE);
+
+	stats->update_interval = g_value_get_uint(value);
+
+	if (stats->update_timeout != 0) {
+		g_source_remove(stats->update_timeout);
+		stats->update_timeout = 0;
+	}
+
+	if (stats->update_interval != 0)
+		stats->update_timeout = g_timeout_add_seconds(stats->update_interval, _update_timeout_cb, conn);
+
+	IDLE_DEBUG("statistics every %u seconds", stats->update_interval);
+	return TRUE;
+}
+
+void idle_statistics_set_server_connection(IdleConnection *conn, IdleServerConnection *sconn) {
+	IdleStatistics *stats = conn->statistics;
+
+	if (stats->sconn != NULL) {
+		guint64 received, sent;
+
+		idle_server_connection_get_statistics(stats->sconn, &received, &sent, NULL);
+		stats->old_bytes_received += received;
+		stats->old_bytes_sent += sent;
+		g_object_unref(stats->sconn);
+	}
+
+	stats->sconn = sconn != NULL ? g_object_ref(sconn) : NULL;
+}
+
+void idle_statistics_connected(IdleConnection *conn, gboolean reconnected) {
+	IdleStatistics *stats = conn->statistics;
+	gint64 connect_time = 0;
+
+	if (stats->sconn != NULL)
+		idle_server_connection_get_statistics(stats->sconn, NULL, NULL, &connect_time);
+
+	stats->connect_time = _usec_to_msec(connect_time);
+
+	if (reconnected)
+		stats->reconnects++;
+}
+
+void idle_statistics_received(IdleConnection *conn, const gchar *data) {
+	IdleStatistics *stats = conn->statistics;
+	const gchar *p;
+
+	for (p = strchr(data, '\n'); p != NULL; p = strchr(p + 1, '\n'))
+		stats->lines_received++;
+}
+
+/* @stalled is whether the line just queued has to wait for flood control, rather than going out straight away */
+void idle_statistics_queued(IdleConnection *conn, guint queue_length, gboolean stalled) {
+	IdleStatistics *stats = conn->statistics;
+
+	stats->max_queue_length = MAX(stats->max_queue_length, queue_length);
+
+	if (stalled)
+		stats->flood_control_stalls++;
+}
+
+/* A line was refused or shed because the queue was full */
+void idle_statistics_dropped(IdleConnection *conn) {
+	conn->statistics->dropped_lines++;
+}
+
+/* @queued is the monotonic time the line was queued */
+void idle_statistics_sent(IdleConnection *conn, gint64 queued) {
+	IdleStatistics *stats = conn->statistics;
+
+	stats->lines_sent++;
+	_histogram_add(stats->queue_delays, _usec_to_msec(g_get_monotonic_time() - queued));
+}
+
+void idle_statistics_reading_paused(IdleConnection *conn) {
+	conn->statistics->read_stalls++;
+}
+
+/* @stalled is how long reading was paused for, in microseconds */
+void idle_statistics_reading_resumed(IdleConnection *conn, gint64 stalled) {
+	conn->statistics->read_stall_time += MAX(stalled, 0);
+}
+
+/* @lag is the time between sending a PING and getting its PONG, in microseconds */
+void idle_statistics_lag(IdleConnection *conn, gint64 lag) {
+	IdleStatistics *stats = conn->statistics;
+
+	lag = MAX(lag, 0);
+	stats->lag = _usec_to_msec(lag);
+	_histogram_add(stats->lags, stats->lag);
+
+	stats->lag_samples[stats->n_lag_samples % LAG_SAMPLES] = stats->lag;
+	stats->n_lag_samples++;
+
+	if (stats->srtt == 0) {
+		stats->srtt = MAX(lag, 1);
+		stats->rttvar = lag / 2;
+	} else {
+		stats->rttvar = (3 * stats->rttvar + ABS(stats->srtt - lag)) / 4;
+		stats->srtt = (7 * stats->srtt + lag) / 8;
+	}
+}
+
+/* Returns FALSE if no round trip has been measured yet */
+gboolean idle_statistics_get_smoothed_lag(IdleConnection *conn, gint64 *srtt, gint64 *rttvar) {
+	IdleStatistics *stats = conn->statistics;
+
+	if (stats->srtt == 0)
+		return FALSE;
+
+	*srtt = stats->srtt;
+	*rttvar = stats->rttvar;
+	return TRUE;
+}
+
+void idle_statistics_disconnected(IdleConnection *conn) {
+	IdleStatistics *stats = conn->statistics;
+
+	if (stats->update_timeout != 0) {
+		g_source_remove(stats->update_timeout);
+		stats->update_timeout = 0;
+	}
+}
+
+void idle_statistics_finalize(GObject *object) {
+	IdleConnection *conn = IDLE_CONNECTION(object);
+	IdleStatistics *stats = conn->statistics;
+
+	idle_statistics_disconnected(conn);
+	tp_clear_object(&stats->sconn);
+	g_slice_free(IdleStatistics, stats);
+}
+
+void idle_statistics_class_init(IdleConnectionClass *klass) {
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+	tp_dbus_properties_mixin_implement_interface(object_class,
+		g_quark_from_static_string(IDLE_IFACE_CONNECTION_INTERFACE_STATISTICS1),
+		idle_statistics_getter,
+		idle_statistics_setter,
+		statistics_props);
+}
+
+void idle_statistics_init(IdleConnection *conn) {
+	conn->statistics = g_slice_new0(IdleStatistics);
+}
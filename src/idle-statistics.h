@@ -0,0 +1,48 @@
+/*
+ * This file is part of telepathy-idle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __IDLE_STATISTICS_H__
+#define __IDLE_STATISTICS_H__
+
+#include <glib.h>
+#include <glib-object.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "idle-connection.h"
+#include "idle-server-connection.h"
+
+G_BEGIN_DECLS
+
+void idle_statistics_finalize (GObject *object);
+void idle_statistics_class_init (IdleConnectionClass *klass);
+void idle_statistics_init (IdleConnection *conn);
+void idle_statistics_disconnected (IdleConnection *conn);
+
+void idle_statistics_set_server_connection (IdleConnection *conn, IdleServerConnection *sconn);
+void idle_statistics_connected (IdleConnection *conn, gboolean reconnected);
+void idle_statistics_received (IdleConnection *conn, const gchar *data);
+void idle_statistics_queued (IdleConnection *conn, guint queue_length, gboolean stalled);
+void idle_statistics_dropped (IdleConnection *conn);
+void idle_statistics_sent (IdleConnection *conn, gint64 queued);
+void idle_statistics_reading_paused (IdleConnection *conn);
+void idle_statistics_reading_resumed (IdleConnection *conn, gint64 stalled);
+void idle_statistics_lag (IdleConnection *conn, gint64 lag);
+gboolean idle_statistics_get_smoothed_lag (IdleConnection *conn, gint64 *srtt, gint64 *rttvar);
+
+G_END_DECLS
+
+#endif /* #ifndef __IDLE_STATISTICS_H__ */
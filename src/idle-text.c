@@ -28,138 +28,408 @@
 #include "idle-ctcp.h"
 #include "idle-debug.h"
 
-gboolean idle_text_decode(const gchar *text, TpChannelTextMessageType *type, gchar **body) {
-	gchar *tmp = NULL;
+/* Returns @text without formatting, copied into *copy for the caller to free if there was any to remove; *copy is NULL otherwise. If @html
+ * is not NULL, *html is set to the formatting as HTML, or NULL if there was none. */
+const gchar *idle_text_strip_formatting(const gchar *text, gchar **copy, gchar **html) {
+	const gchar *body = idle_ctcp_kill_blingbling_borrow(text, copy);
 
+	/* only messages which had something to strip have anything to convert */
+	if (html != NULL)
+		*html = *copy != NULL ? idle_ctcp_blingbling_to_html(text) : NULL;
+
+	return body;
+}
+
+/* Sets *body to the text of the message as idle_text_strip_formatting() does */
+gboolean idle_text_decode(const gchar *text, TpChannelTextMessageType *type, const gchar **body, gchar **copy, gchar **html) {
 	if (text[0] != '\001') {
 		*type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL;
-		tmp = g_strdup(text);
+		*body = idle_text_strip_formatting(text, copy, html);
 	} else {
 		size_t actionlen = strlen("\001ACTION ");
 		if (!g_ascii_strncasecmp(text, "\001ACTION ", actionlen)) {
 			*type = TP_CHANNEL_TEXT_MESSAGE_TYPE_ACTION;
-			tmp = g_strndup(text + actionlen, strlen(text + actionlen) - 1);
+			*copy = g_strndup(text + actionlen, strlen(text + actionlen) - 1);
+
+			if (html != NULL)
+				*html = idle_ctcp_blingbling_to_html(*copy);
+
+			*body = idle_ctcp_kill_blingbling_in_place(*copy);
 		} else {
 			*body = NULL;
+			*copy = NULL;
+
+			if (html != NULL)
+				*html = NULL;
+
 			return FALSE;
 		}
 	}
 
-	*body = idle_ctcp_kill_blingbling(tmp);
-	g_free(tmp);
 	return TRUE;
 }
 
-/**
- * idle_text_encode_and_split:
- * @type: The type of message as per Telepathy
- * @recipient: The target user or channel
- * @text: The message body
- * @max_msg_len: The maximum length of the message on this server (see also
- *               idle_connection_get_max_message_length())
- * @bodies_out: Location at which to return the human-readable bodies of each
- *              part
- * @error: Location at which to store an error
- *
- * Splits @text as necessary to be able to send it over IRC. IRC messages
- * cannot contain newlines, and have a (server-determined) maximum length.
- *
- * Returns: A list of IRC protocol commands representing @text as best possible.
- */
-GStrv
-idle_text_encode_and_split(TpChannelTextMessageType type,
-		const gchar *recipient,
-		const gchar *text,
-		gsize max_msg_len,
-		GStrv *bodies_out,
-		GError **error) {
-	GPtrArray *messages;
-	GPtrArray *bodies;
-	const gchar *remaining_text = text;
-	const gchar * const text_end =  text + strlen(text);
-	gchar *header;
-	const gchar *footer = "";
-	gsize max_bytes;
+static gchar *_message_header(TpChannelTextMessageType type, const gchar *recipient, const gchar **footer, GError **error) {
+	*footer = "";
 
 	switch (type) {
 		case TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL:
-			header = g_strdup_printf("PRIVMSG %s :", recipient);
-			break;
+			return g_strdup_printf("PRIVMSG %s :", recipient);
 		case TP_CHANNEL_TEXT_MESSAGE_TYPE_ACTION:
-			header = g_strdup_printf("PRIVMSG %s :\001ACTION ", recipient);
-			footer = "\001";
-			break;
+			*footer = "\001";
+			return g_strdup_printf("PRIVMSG %s :\001ACTION ", recipient);
 		case TP_CHANNEL_TEXT_MESSAGE_TYPE_NOTICE:
-			header = g_strdup_printf("NOTICE %s :", recipient);
-			break;
+			return g_strdup_printf("NOTICE %s :", recipient);
 		default:
 			IDLE_DEBUG("unsupported message type %u", type);
 			g_set_error(error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED, "unsupported message type %u", type);
 			return NULL;
 	}
+}
 
-	messages = g_ptr_array_new();
-	bodies = g_ptr_array_new();
-	max_bytes = max_msg_len - (strlen(header) + strlen(footer));
+/* Where a line cut short at @end had better end instead: just after the last space before it, if there is one */
+static const gchar *_word_end(const gchar *start, const gchar *end) {
+	const gchar *p = end;
+
+	while (p > start && p[-1] != ' ')
+		p--;
+
+	return p > start ? p : end;
+}
+
+typedef struct {
+	gsize offset;      /* of the line in the buffer */
+	gsize body_offset; /* of the message itself in the buffer */
+	gsize body_len;    /* bytes of the message itself in the line, once converted */
+	gboolean concat;   /* whether the line carries on from the one before, rather than starting after a newline */
+} IdleTextLine;
+
+/* Splits @text as necessary to be able to send it over IRC, where messages can't contain newlines and have a (server-determined) maximum
+ * length, straight into the form the server wants: each line is converted to the connection's charset and ends in <CR><LF>, and the
+ * lines follow one another in a single buffer, each NUL-terminated. Lines are measured once converted, so that
+ * a charset which takes more bytes than UTF-8 doesn't get them clipped, and one which takes fewer needs fewer lines. If @lines_out is
+ * not NULL, an IdleTextLine is appended to it for each line. */
+static GBytes *_encode_lines(IdleConnection *conn, const gchar *header, const gchar *footer, const gchar *text, gsize max_msg_len, GArray *lines_out) {
+	const gchar *remaining_text = text;
+	gboolean concat = FALSE;
+	const gchar * const text_end = text + strlen(text);
+	gsize overhead = strlen(header) + strlen(footer);
+	gsize header_len, footer_len, max_bytes;
+	GString *buf;
+	gsize len;
+
+	/* exact, unless the charset takes more bytes per character than UTF-8 does */
+	buf = g_string_sized_new((text_end - text) + ((text_end - text) / MAX(max_msg_len - overhead, 1) + 1) * (overhead + 3));
+
+	/* the header is the same on every line, so we only convert it once */
+	if (!idle_connection_hton_append(conn, header, strlen(header), buf))
+		g_string_append(buf, header);
+
+	header_len = buf->len;
+
+	if (!idle_connection_hton_append(conn, footer, strlen(footer), buf))
+		g_string_append(buf, footer);
+
+	footer_len = buf->len - header_len;
+	g_string_truncate(buf, header_len);
+
+	max_bytes = max_msg_len > header_len + footer_len ? max_msg_len - (header_len + footer_len) : 1;
 
 	while (remaining_text < text_end) {
-		char *newline = strchr(remaining_text, '\n');
-		const char *end_iter;
-		char *message;
-		int len;
-
-		if (newline != NULL && ((unsigned) (newline - remaining_text)) < max_bytes) {
-			/* String up to the next newline is short enough. */
-			end_iter = newline;
-
-		} else if ((text_end - remaining_text) > (gint) max_bytes) {
-			/* Remaining string is too long; take as many bytes as possible */
-			end_iter = remaining_text + max_bytes;
-			/* make sure we don't break a UTF-8 code point in half */
-			end_iter = g_utf8_find_prev_char (remaining_text, end_iter);
-		} else {
-			/* Just take it all. */
-			end_iter = text_end;
+		/* no character takes less than a byte once converted, nor more than four in UTF-8 */
+		gsize available = MIN((gsize) (text_end - remaining_text), 4 * max_bytes);
+		const gchar *newline = memchr(remaining_text, '\n', available);
+		gsize wanted = newline != NULL ? (gsize) (newline - remaining_text) : available;
+		gboolean cut = newline == NULL && remaining_text + wanted < text_end;
+		/* the first line's header is already there */
+		gsize start = remaining_text != text ? buf->len : 0;
+		gsize body_start;
+		gsize taken;
+		gchar *p;
+
+		if (start > 0) {
+			g_string_set_size(buf, start + header_len);
+			memcpy(buf->str + start, buf->str, header_len);
+		}
+
+		body_start = buf->len;
+		taken = idle_connection_hton_append_max(conn, remaining_text, wanted, max_bytes, buf);
+
+		if (taken == 0 && wanted > 0) {
+			/* not even one character fits; send it anyway rather than nothing at all */
+			taken = g_utf8_next_char(remaining_text) - remaining_text;
+
+			if (!idle_connection_hton_append(conn, remaining_text, taken, buf))
+				g_string_append_len(buf, remaining_text, taken);
+		} else if (cut || taken < wanted) {
+			/* split between words if we can */
+			const gchar *word_end = _word_end(remaining_text, remaining_text + taken);
+
+			if (word_end != remaining_text + taken) {
+				g_string_truncate(buf, body_start);
+				taken = idle_connection_hton_append_max(conn, remaining_text, word_end - remaining_text, max_bytes, buf);
+			}
+		}
+
+		/* Strip out any <CR> which has crept in */
+		for (p = buf->str + body_start; p < buf->str + buf->len; p++) {
+			if (*p == '\r')
+				*p = ' ';
+		}
+
+		if (lines_out != NULL) {
+			IdleTextLine line = { start, body_start, buf->len - body_start, concat };
+
+			g_array_append_val(lines_out, line);
 		}
 
-		len = (int)(end_iter - remaining_text);
-		message = g_strdup_printf("%s%.*s%s", header, len, remaining_text, footer);
-		g_ptr_array_add(messages, message);
-		g_ptr_array_add(bodies, g_strndup(remaining_text, len));
+		if (!idle_connection_hton_append(conn, footer, strlen(footer), buf))
+			g_string_append(buf, footer);
 
-		remaining_text = end_iter;
-		if (*end_iter == '\n') {
+		g_string_append_len(buf, "\r\n", 3);
+
+		remaining_text += taken;
+		concat = remaining_text != newline;
+		if (!concat) {
 				/* advance over a newline */
 				remaining_text++;
 		}
 	}
 
-	g_assert (remaining_text == text_end);
+	len = buf->len;
+	return g_bytes_new_take(g_string_free(buf, FALSE), len);
+}
+
+/* The lines idle_text_send() would send @text to @recipient as, without their <CR><LF>, and the part of the message in each of them in
+ * @bodies_out. @conn may be NULL, as in the unit tests, to leave the text in UTF-8. */
+GStrv idle_text_encode(IdleConnection *conn, TpChannelTextMessageType type, const gchar *recipient, const gchar *text, gsize max_msg_len, GStrv *bodies_out, GError **error) {
+	GPtrArray *messages;
+	GPtrArray *bodies;
+	GArray *line_info;
+	GBytes *lines;
+	gchar *header;
+	const gchar *footer;
+	const gchar *data;
+	guint i;
+
+	header = _message_header(type, recipient, &footer, error);
+	if (header == NULL)
+		return NULL;
+
+	line_info = g_array_new(FALSE, FALSE, sizeof(IdleTextLine));
+	lines = _encode_lines(conn, header, footer, text, max_msg_len, line_info);
+	data = g_bytes_get_data(lines, NULL);
+	g_free(header);
+
+	messages = g_ptr_array_new();
+	bodies = g_ptr_array_new();
+
+	for (i = 0; i < line_info->len; i++) {
+		IdleTextLine *line = &g_array_index(line_info, IdleTextLine, i);
+
+		g_ptr_array_add(messages, g_strndup(data + line->offset, strlen(data + line->offset) - strlen("\r\n")));
+		g_ptr_array_add(bodies, g_strndup(data + line->body_offset, line->body_len));
+	}
 
 	g_ptr_array_add(messages, NULL);
 	g_ptr_array_add(bodies, NULL);
 
-	if (bodies_out != NULL) {
+	if (bodies_out != NULL)
 		*bodies_out = (GStrv) g_ptr_array_free(bodies, FALSE);
-	} else {
-		g_ptr_array_free(bodies, TRUE);
-	}
+	else
+		g_strfreev((GStrv) g_ptr_array_free(bodies, FALSE));
 
-	g_free(header);
+	g_array_free(line_info, TRUE);
+	g_bytes_unref(lines);
 	return (GStrv) g_ptr_array_free(messages, FALSE);
 }
 
+/* The limits the server puts on a draft/multiline batch, from the capability's value, "max-bytes=4096,max-lines=24"; max-bytes must be
+ * given, but max-lines may not be, in which case it is 0 */
+static gboolean _multiline_limits(const gchar *value, gsize *max_bytes, guint *max_lines) {
+	gchar **params;
+	gchar **param;
+
+	*max_bytes = 0;
+	*max_lines = 0;
+
+	if (value == NULL)
+		return FALSE;
+
+	params = g_strsplit(value, ",", -1);
+
+	for (param = params; *param != NULL; param++) {
+		if (g_str_has_prefix(*param, "max-bytes="))
+			*max_bytes = g_ascii_strtoull(*param + strlen("max-bytes="), NULL, 10);
+		else if (g_str_has_prefix(*param, "max-lines="))
+			*max_lines = g_ascii_strtoull(*param + strlen("max-lines="), NULL, 10);
+	}
+
+	g_strfreev(params);
+	return *max_bytes > 0;
+}
+
+/* Wraps the lines from _encode_lines() in as few draft/multiline batches as the server's limits allow, so that the message arrives as
+ * it was written rather than as so many separate ones. Each batch goes in the buffer as one NUL-terminated string, so that it is queued,
+ * held, dropped and written to the server whole. */
+static GBytes *_encode_batches(IdleConnection *conn, GBytes *lines, GArray *line_info, const gchar *recipient, gsize max_bytes, guint max_lines) {
+	static guint last_batch = 0;
+	const gchar *data = g_bytes_get_data(lines, NULL);
+	gsize batch_bytes = 0;
+	guint batch_lines = 0;
+	gchar ref[16];
+	GString *buf;
+	gsize len;
+	guint i;
+
+	buf = g_string_sized_new(g_bytes_get_size(lines) + line_info->len * (sizeof(ref) + 32));
+
+	for (i = 0; i < line_info->len; i++) {
+		IdleTextLine *line = &g_array_index(line_info, IdleTextLine, i);
+		/* lines which don't carry on from the one before are joined by a newline */
+		gsize bytes = line->body_len + (line->concat ? 0 : 1);
+
+		if (batch_lines > 0 && (batch_bytes + bytes > max_bytes || (max_lines > 0 && batch_lines >= max_lines))) {
+			g_string_append_printf(buf, "BATCH -%s\r\n", ref);
+			g_string_append_c(buf, '\0');
+			batch_lines = 0;
+		}
+
+		if (batch_lines == 0) {
+			g_snprintf(ref, sizeof(ref), "idle%u", ++last_batch);
+			g_string_append_printf(buf, "BATCH +%s draft/multiline ", ref);
+
+			if (!idle_connection_hton_append(conn, recipient, strlen(recipient), buf))
+				g_string_append(buf, recipient);
+
+			g_string_append(buf, "\r\n");
+			batch_bytes = 0;
+			bytes = line->body_len;
+		}
+
+		g_string_append_printf(buf, "@batch=%s%s ", ref, (line->concat && batch_lines > 0) ? ";draft/multiline-concat" : "");
+		g_string_append(buf, data + line->offset);
+		batch_bytes += bytes;
+		batch_lines++;
+	}
+
+	g_string_append_printf(buf, "BATCH -%s\r\n", ref);
+	g_string_append_c(buf, '\0');
+
+	len = buf->len;
+	return g_bytes_new_take(g_string_free(buf, FALSE), len);
+}
+
+/* Received messages are counted until acknowledged, so that we can stop reading from the server when clients fall behind. Each channel
+ * keeps its own count too, to give back whatever is left unacknowledged when it goes. */
+static GQuark _pending_count_quark(void) {
+	return g_quark_from_static_string("idle-text-pending-count");
+}
+
+static guint _pending_count(GObject *chan) {
+	return GPOINTER_TO_UINT(g_object_get_qdata(chan, _pending_count_quark()));
+}
+
+static void _take_received(GObject *chan, TpMessage *msg) {
+	TpBaseConnection *base_conn = tp_base_channel_get_connection(TP_BASE_CHANNEL(chan));
+
+	g_object_set_qdata(chan, _pending_count_quark(), GUINT_TO_POINTER(_pending_count(chan) + 1));
+	idle_connection_pending_messages_added(IDLE_CONNECTION(base_conn), 1);
+	tp_message_mixin_take_received(chan, msg);
+}
+
+static void _pending_messages_removed_cb(GObject *chan, const GArray *ids, gpointer user_data) {
+	TpBaseConnection *base_conn = tp_base_channel_get_connection(TP_BASE_CHANNEL(chan));
+	guint count = MIN(ids->len, _pending_count(chan));
+
+	g_object_set_qdata(chan, _pending_count_quark(), GUINT_TO_POINTER(_pending_count(chan) - count));
+	idle_connection_pending_messages_removed(IDLE_CONNECTION(base_conn), count);
+}
+
+void idle_text_watch_pending(GObject *chan) {
+	g_signal_connect(chan, "pending-messages-removed", G_CALLBACK(_pending_messages_removed_cb), NULL);
+}
+
+/* For when @chan is destroyed or disposed of without its pending messages being acknowledged */
+void idle_text_forget_pending(GObject *chan) {
+	TpBaseConnection *base_conn = tp_base_channel_get_connection(TP_BASE_CHANNEL(chan));
+	guint count = _pending_count(chan);
+
+	if (count == 0)
+		return;
+
+	g_object_set_qdata(chan, _pending_count_quark(), NULL);
+	idle_connection_pending_messages_removed(IDLE_CONNECTION(base_conn), count);
+}
+
+/* Shared by the lines a message was split into, so that it is reported as failed once however many of them are dropped */
+typedef struct {
+	guint refcount;
+	GObject *chan;
+	gchar *token;
+	TpChannelTextMessageType type;
+	gchar *text;
+	gboolean failed;
+} IdleTextPending;
+
+static void _pending_unref(gpointer user_data) {
+	IdleTextPending *pending = user_data;
+
+	if (--pending->refcount > 0)
+		return;
+
+	g_object_unref(pending->chan);
+	g_free(pending->token);
+	g_free(pending->text);
+	g_slice_free(IdleTextPending, pending);
+}
+
+static void _pending_dropped(IdleConnection *conn, gpointer user_data) {
+	IdleTextPending *pending = user_data;
+	TpBaseConnection *base_conn = TP_BASE_CONNECTION(conn);
+	TpBaseChannel *base = TP_BASE_CHANNEL(pending->chan);
+	TpMessage *report, *echo;
+
+	if (pending->failed)
+		return;
+
+	pending->failed = TRUE;
+
+	report = tp_cm_message_new(base_conn, 1);
+
+	if (TP_BASE_CHANNEL_GET_CLASS(base)->target_handle_type == TP_HANDLE_TYPE_CONTACT)
+		tp_cm_message_set_sender(report, tp_base_channel_get_target_handle(base));
+
+	tp_message_set_uint32(report, 0, "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_DELIVERY_REPORT);
+	tp_message_set_uint32(report, 0, "delivery-status", TP_DELIVERY_STATUS_PERMANENTLY_FAILED);
+	tp_message_set_uint32(report, 0, "delivery-error", TP_CHANNEL_TEXT_SEND_ERROR_OFFLINE);
+	tp_message_set_string(report, 0, "delivery-token", pending->token);
+	tp_message_set_int64(report, 0, "message-received", time(NULL));
+
+	echo = tp_cm_message_new_text(base_conn, tp_base_connection_get_self_handle(base_conn), pending->type, pending->text);
+	tp_cm_message_set_message(report, 0, "delivery-echo", echo);
+	g_object_unref(echo);
+
+	_take_received(pending->chan, report);
+}
+
 void idle_text_send(GObject *obj, TpMessage *message, TpMessageSendingFlags flags, const gchar *recipient, IdleConnection *conn) {
+	static guint last_token = 0;
+	IdleTextPending *pending;
 	GError *error = NULL;
 	const GHashTable *part;
 	TpChannelTextMessageType type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL;
 	gboolean result = TRUE;
 	const gchar *content_type, *text;
 	guint n_parts;
-	GStrv messages;
-	GStrv bodies;
-	gsize msg_len;
-	guint i;
+	gchar *header;
+	const gchar *footer;
+	GBytes *lines;
+	GArray *line_info = NULL;
+	gsize max_bytes;
+	guint max_lines;
+	const gchar *data;
+	gsize lines_len, offset;
 
 	#define INVALID_ARGUMENT(msg, ...) \
 	G_STMT_START { \
@@ -199,20 +469,50 @@ void idle_text_send(GObject *obj, TpMessage *message, TpMessageSendingFlags flag
 
 	/* Okay, it's valid. Let's send it. */
 
-	msg_len = idle_connection_get_max_message_length(conn);
-	messages = idle_text_encode_and_split(type, recipient, text, msg_len, &bodies, &error);
-	if (messages == NULL)
+	header = _message_header(type, recipient, &footer, &error);
+	if (header == NULL)
 		goto failed;
 
-	for(i = 0; messages[i] != NULL; i++) {
-		g_assert(bodies[i] != NULL);
-		idle_connection_send(conn, messages[i]);
+	/* servers which take draft/multiline get the message in one piece, if it is more than a line; /me can't be, as it is a CTCP */
+	if (type != TP_CHANNEL_TEXT_MESSAGE_TYPE_ACTION &&
+			idle_connection_has_capability(conn, "batch") &&
+			idle_connection_has_capability(conn, "draft/multiline") &&
+			_multiline_limits(idle_connection_get_capability_value(conn, "draft/multiline"), &max_bytes, &max_lines))
+		line_info = g_array_new(FALSE, FALSE, sizeof(IdleTextLine));
+
+	lines = _encode_lines(conn, header, footer, text, idle_connection_get_max_message_length(conn), line_info);
+	g_free(header);
+
+	if (line_info != NULL) {
+		if (line_info->len > 1) {
+			GBytes *batches = _encode_batches(conn, lines, line_info, recipient, max_bytes, max_lines);
+
+			g_bytes_unref(lines);
+			lines = batches;
+		}
+
+		g_array_free(line_info, TRUE);
+	}
+
+	pending = g_slice_new0(IdleTextPending);
+	pending->refcount = 1;
+	pending->chan = g_object_ref(obj);
+	pending->token = g_strdup_printf("%u", ++last_token);
+	pending->type = type;
+	pending->text = g_strdup(text);
+
+	/* every line is sent straight from the one buffer */
+	data = g_bytes_get_data(lines, &lines_len);
+
+	for (offset = 0; offset < lines_len; offset += strlen(data + offset) + 1) {
+		pending->refcount++;
+		idle_connection_send_user_line(conn, lines, offset, _pending_dropped, pending, _pending_unref);
 	}
 
-	g_strfreev(messages);
-	g_strfreev(bodies);
+	g_bytes_unref(lines);
 
-	tp_message_mixin_sent (obj, message, flags, "", NULL);
+	tp_message_mixin_sent (obj, message, flags, pending->token, NULL);
+	_pending_unref(pending);
 	return;
 
 failed:
@@ -226,14 +526,37 @@ idle_text_received (GObject *chan,
 	TpBaseConnection *base_conn,
 	TpChannelTextMessageType type,
 	const gchar *text,
+	const gchar *html,
 	TpHandle sender)
 {
 	TpMessage *msg;
+	guint part;
+
+	if (html == NULL) {
+		msg = tp_cm_message_new_text (base_conn, sender, type, text);
+	} else {
+		/* the same text two ways, the richer first */
+		msg = tp_cm_message_new (base_conn, 2);
 
-	msg = tp_cm_message_new_text (base_conn, sender, type, text);
+		if (sender != 0)
+			tp_cm_message_set_sender (msg, sender);
+
+		if (type != TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL)
+			tp_message_set_uint32 (msg, 0, "message-type", type);
+
+		part = tp_message_append_part (msg);
+		tp_message_set_string (msg, part, "content-type", "text/html");
+		tp_message_set_string (msg, part, "alternative", "main");
+		tp_message_set_string (msg, part, "content", html);
+
+		part = tp_message_append_part (msg);
+		tp_message_set_string (msg, part, "content-type", "text/plain");
+		tp_message_set_string (msg, part, "alternative", "main");
+		tp_message_set_string (msg, part, "content", text);
+	}
 
 	tp_message_set_int64 (msg, 0, "message-received", time (NULL));
 
-	tp_message_mixin_take_received (chan, msg);
+	_take_received (chan, msg);
 	return TRUE;
 }
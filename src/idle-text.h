@@ -31,14 +31,18 @@
 
 G_BEGIN_DECLS
 
-gboolean idle_text_decode(const gchar *text, TpChannelTextMessageType *type, gchar **body);
-GStrv idle_text_encode_and_split(TpChannelTextMessageType type, const gchar *recipient, const gchar *text, gsize max_msg_len, GStrv *bodies_out, GError **error);
+const gchar *idle_text_strip_formatting(const gchar *text, gchar **copy, gchar **html);
+gboolean idle_text_decode(const gchar *text, TpChannelTextMessageType *type, const gchar **body, gchar **copy, gchar **html);
+GStrv idle_text_encode(IdleConnection *conn, TpChannelTextMessageType type, const gchar *recipient, const gchar *text, gsize max_msg_len, GStrv *bodies_out, GError **error);
 void idle_text_send(GObject *obj, TpMessage *message, TpMessageSendingFlags flags, const gchar *recipient, IdleConnection *conn);
+void idle_text_watch_pending(GObject *chan);
+void idle_text_forget_pending(GObject *chan);
 
 gboolean idle_text_received (GObject *chan,
 	TpBaseConnection *base_conn,
 	TpChannelTextMessageType type,
 	const gchar *text,
+	const gchar *html,
 	TpHandle sender);
 
 G_END_DECLS
@@ -36,6 +36,11 @@
 #define VCARD_FIELD_NAME "x-" PROTOCOL_NAME
 #define DEFAULT_PORT 6667
 #define DEFAULT_KEEPALIVE_INTERVAL 30 /* sec */
+#define DEFAULT_CONTACT_INFO_TTL 300 /* sec */
+#define DEFAULT_ROOM_LIST_TTL 300 /* sec */
+#define DEFAULT_CONTACT_INFO_CACHE_SIZE 500
+#define DEFAULT_MAX_QUEUED_MESSAGES 1000
+#define DEFAULT_MAX_QUEUED_BYTES (256 * 1024)
 
 G_DEFINE_TYPE (IdleProtocol, idle_protocol, TP_TYPE_BASE_PROTOCOL)
 
@@ -109,6 +114,32 @@ static const TpCMParamSpec idle_params[] = {
       TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE) },
     { "password-prompt", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
       TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE) },
+    { "contact-info-ttl", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT,
+      GUINT_TO_POINTER (DEFAULT_CONTACT_INFO_TTL) },
+    { "contact-info-cache-size", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT,
+      GUINT_TO_POINTER (DEFAULT_CONTACT_INFO_CACHE_SIZE) },
+    { "auto-join", DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+      G_TYPE_STRV, 0 },
+    { "auto-reconnect", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE) },
+    { "fallback-servers", DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+      G_TYPE_STRV, 0 },
+    { "certificate-store", DBUS_TYPE_STRING_AS_STRING, G_TYPE_STRING, 0 },
+    { "max-pending-messages", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (0) },
+    { "max-queued-messages", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT,
+      GUINT_TO_POINTER (DEFAULT_MAX_QUEUED_MESSAGES) },
+    { "max-queued-bytes", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT,
+      GUINT_TO_POINTER (DEFAULT_MAX_QUEUED_BYTES) },
+    { "formatted-messages", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE) },
+    { "room-list-ttl", DBUS_TYPE_UINT32_AS_STRING, G_TYPE_UINT,
+      TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT,
+      GUINT_TO_POINTER (DEFAULT_ROOM_LIST_TTL) },
     { NULL, NULL, 0, 0, NULL, 0 }
 };
 
@@ -147,6 +178,22 @@ new_connection (TpBaseProtocol *protocol G_GNUC_UNUSED,
       "use-ssl", tp_asv_get_boolean (params, "use-ssl", NULL),
       "password-prompt", tp_asv_get_boolean (params, "password-prompt",
           NULL),
+      "contact-info-ttl", tp_asv_get_uint32 (params, "contact-info-ttl", NULL),
+      "contact-info-cache-size", tp_asv_get_uint32 (params,
+          "contact-info-cache-size", NULL),
+      "auto-join", tp_asv_get_strv (params, "auto-join"),
+      "auto-reconnect", tp_asv_get_boolean (params, "auto-reconnect", NULL),
+      "fallback-servers", tp_asv_get_strv (params, "fallback-servers"),
+      "certificate-store", tp_asv_get_string (params, "certificate-store"),
+      "max-pending-messages", tp_asv_get_uint32 (params,
+          "max-pending-messages", NULL),
+      "max-queued-messages", tp_asv_get_uint32 (params,
+          "max-queued-messages", NULL),
+      "max-queued-bytes", tp_asv_get_uint32 (params,
+          "max-queued-bytes", NULL),
+      "formatted-messages", tp_asv_get_boolean (params, "formatted-messages",
+          NULL),
+      "room-list-ttl", tp_asv_get_uint32 (params, "room-list-ttl", NULL),
       NULL);
 }
 
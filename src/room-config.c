@@ -126,7 +126,7 @@ send_mode (IdleRoomConfig *self,
 {
   TpBaseChannel *channel;
   TpBaseConnection *connection;
-  gchar *s, *target_id;
+  gchar *s, *key, *target_id;
 
   channel = tp_base_room_config_dup_channel ((TpBaseRoomConfig *) self);
   g_object_get (channel,
@@ -135,8 +135,13 @@ send_mode (IdleRoomConfig *self,
 
   connection = tp_base_channel_get_connection (channel);
 
+  /* cmd is "+x" or "-x", maybe with an argument: a later change to the
+   * same mode replaces this one if it has not gone out yet */
   s = g_strdup_printf ("MODE %s %s", target_id, cmd);
-  idle_connection_send (IDLE_CONNECTION (connection), s);
+  key = g_strdup_printf ("MODE %s %c", target_id, cmd[1]);
+  idle_connection_send_user_message (IDLE_CONNECTION (connection), s, key,
+      NULL, NULL, NULL);
+  g_free (key);
   g_free (s);
 
   g_free (target_id);
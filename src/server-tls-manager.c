@@ -50,6 +50,14 @@ struct _IdleServerTLSManagerPrivate {
   /* Current operation data */
   IdleServerTLSChannel *channel;
   GSimpleAsyncResult *async_result;
+  /* what to remember if the user accepts the certificate */
+  gchar *certificate_entry;
+  gchar *certificate_store;
+
+  /* Certificates the user has accepted on this connection, as "hostname
+   * fingerprint" strings, for when the account has no certificate store;
+   * kept across reconnects, so they don't ask again */
+  GHashTable *accepted_certificates;
 
   /* List of owned TpBaseChannel not yet closed by the client */
   GList *completed_channels;
@@ -152,6 +160,8 @@ complete_verify (IdleServerTLSManager *self)
   /* Reset to initial state */
   g_clear_object (&self->priv->channel);
   g_clear_object (&self->priv->async_result);
+  tp_clear_pointer (&self->priv->certificate_entry, g_free);
+  tp_clear_pointer (&self->priv->certificate_store, g_free);
 }
 
 static void
@@ -188,6 +198,218 @@ server_tls_channel_closed_cb (IdleServerTLSChannel *channel,
   g_object_unref (channel);
 }
 
+typedef struct {
+  gchar *path;
+  /* "hostname fingerprint" strings */
+  GHashTable *entries;
+  /* whether a write to the file is running, and whether the entries changed
+   * since it started, so writes to one file never overlap */
+  gboolean saving;
+  gboolean dirty;
+} CertificateStore;
+
+/* Each certificate store file we have read, by path, so that accounts sharing
+ * one see each other's certificates */
+static GHashTable *certificate_stores = NULL;
+
+static void
+certificate_store_free (CertificateStore *store)
+{
+  g_free (store->path);
+  g_hash_table_unref (store->entries);
+  g_slice_free (CertificateStore, store);
+}
+
+static gchar *
+certificate_entry_new (GTlsCertificate *certificate,
+    const gchar *peername)
+{
+  GByteArray *der = NULL;
+  gchar *fingerprint;
+  gchar *hostname;
+  gchar *entry;
+
+  g_object_get (certificate, "certificate", &der, NULL);
+
+  if (der == NULL)
+    return NULL;
+
+  fingerprint = g_compute_checksum_for_data (G_CHECKSUM_SHA256, der->data,
+      der->len);
+  hostname = g_ascii_strdown (peername, -1);
+  entry = g_strdup_printf ("%s %s", hostname, fingerprint);
+
+  g_byte_array_unref (der);
+  g_free (fingerprint);
+  g_free (hostname);
+  return entry;
+}
+
+static CertificateStore *
+certificate_store_load (const gchar *path)
+{
+  CertificateStore *store;
+  GHashTable *entries;
+  gchar *contents = NULL;
+  GError *error = NULL;
+
+  if (certificate_stores == NULL)
+    certificate_stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) certificate_store_free);
+
+  store = g_hash_table_lookup (certificate_stores, path);
+
+  if (store != NULL)
+    return store;
+
+  entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  store = g_slice_new0 (CertificateStore);
+  store->path = g_strdup (path);
+  store->entries = entries;
+  g_hash_table_insert (certificate_stores, store->path, store);
+
+  if (g_file_get_contents (path, &contents, NULL, &error))
+    {
+      gchar **lines = g_strsplit (contents, "\n", -1);
+      gchar **line;
+
+      for (line = lines; *line != NULL; line++)
+        {
+          g_strstrip (*line);
+
+          if (**line == '\0' || **line == '#')
+            continue;
+
+          g_hash_table_add (entries, g_strdup (*line));
+        }
+
+      IDLE_DEBUG ("%u certificates remembered in %s",
+          g_hash_table_size (entries), path);
+
+      g_strfreev (lines);
+      g_free (contents);
+    }
+  else
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        IDLE_DEBUG ("couldn't read %s: %s", path, error->message);
+
+      g_error_free (error);
+    }
+
+  return store;
+}
+
+static void certificate_store_save (CertificateStore *store);
+
+typedef struct {
+  CertificateStore *store;
+  gchar *contents;
+} CertificateStoreSave;
+
+static void
+certificate_store_saved_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  CertificateStoreSave *save = user_data;
+  CertificateStore *store = save->store;
+  GError *error = NULL;
+
+  if (!g_file_replace_contents_finish (G_FILE (source), result, NULL,
+        &error))
+    {
+      IDLE_DEBUG ("couldn't save accepted certificates: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_free (save->contents);
+  g_slice_free (CertificateStoreSave, save);
+
+  store->saving = FALSE;
+
+  /* somebody accepted another certificate while we were writing */
+  if (store->dirty)
+    certificate_store_save (store);
+}
+
+static void
+certificate_store_save (CertificateStore *store)
+{
+  GString *contents;
+  CertificateStoreSave *save;
+  GHashTableIter iter;
+  gpointer entry;
+  GFile *file;
+  gchar *dir;
+  gsize length;
+
+  if (store->saving)
+    {
+      store->dirty = TRUE;
+      return;
+    }
+
+  store->saving = TRUE;
+  store->dirty = FALSE;
+
+  contents = g_string_new (NULL);
+  g_hash_table_iter_init (&iter, store->entries);
+
+  while (g_hash_table_iter_next (&iter, &entry, NULL))
+    g_string_append_printf (contents, "%s\n", (const gchar *) entry);
+
+  dir = g_path_get_dirname (store->path);
+  g_mkdir_with_parents (dir, 0700);
+  g_free (dir);
+
+  length = contents->len;
+  save = g_slice_new0 (CertificateStoreSave);
+  save->store = store;
+  save->contents = g_string_free (contents, FALSE);
+
+  file = g_file_new_for_path (store->path);
+  g_file_replace_contents_async (file, save->contents, length, NULL, FALSE,
+      G_FILE_CREATE_PRIVATE, NULL, certificate_store_saved_cb, save);
+  g_object_unref (file);
+}
+
+static void
+remember_certificate (IdleServerTLSManager *self)
+{
+  const gchar *entry = self->priv->certificate_entry;
+
+  if (self->priv->certificate_store != NULL)
+    {
+      CertificateStore *store =
+          certificate_store_load (self->priv->certificate_store);
+
+      g_hash_table_add (store->entries, g_strdup (entry));
+      certificate_store_save (store);
+    }
+  else
+    {
+      g_hash_table_add (self->priv->accepted_certificates, g_strdup (entry));
+    }
+}
+
+/* Whether the user has accepted @entry before, on this account */
+static gboolean
+certificate_was_accepted (IdleServerTLSManager *self,
+    const gchar *entry)
+{
+  if (self->priv->certificate_store != NULL)
+    {
+      CertificateStore *store =
+          certificate_store_load (self->priv->certificate_store);
+
+      if (g_hash_table_contains (store->entries, entry))
+        return TRUE;
+    }
+
+  return g_hash_table_contains (self->priv->accepted_certificates, entry);
+}
+
 GQuark
 idle_server_tls_error_quark (void)
 {
@@ -207,6 +429,9 @@ tls_certificate_accepted_cb (IdleTLSCertificate *certificate,
 
   IDLE_DEBUG ("TLS certificate accepted");
 
+  if (self->priv->certificate_entry != NULL)
+    remember_certificate (self);
+
   complete_verify (self);
 }
 
@@ -254,6 +479,28 @@ idle_server_tls_manager_verify_async (IdleServerTLSManager *self,
       return;
     }
 
+  g_object_get (self->priv->connection,
+      "certificate-store", &self->priv->certificate_store,
+      NULL);
+
+  if (tp_str_empty (self->priv->certificate_store))
+    tp_clear_pointer (&self->priv->certificate_store, g_free);
+
+  self->priv->certificate_entry = certificate_entry_new (certificate,
+      peername);
+
+  if (self->priv->certificate_entry != NULL &&
+      certificate_was_accepted (self, self->priv->certificate_entry))
+    {
+      IDLE_DEBUG ("certificate was accepted before: %s",
+          self->priv->certificate_entry);
+      tp_clear_pointer (&self->priv->certificate_entry, g_free);
+      tp_clear_pointer (&self->priv->certificate_store, g_free);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
   self->priv->async_result = result;
 
   self->priv->channel = g_object_new (IDLE_TYPE_SERVER_TLS_CHANNEL,
@@ -297,6 +544,8 @@ idle_server_tls_manager_init (IdleServerTLSManager *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
       IDLE_TYPE_SERVER_TLS_MANAGER, IdleServerTLSManagerPrivate);
+  self->priv->accepted_certificates = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, NULL);
 }
 
 static void
@@ -312,6 +561,8 @@ idle_server_tls_manager_dispose (GObject *object)
   self->priv->dispose_has_run = TRUE;
 
   tp_clear_object (&self->priv->connection);
+  tp_clear_pointer (&self->priv->certificate_entry, g_free);
+  tp_clear_pointer (&self->priv->certificate_store, g_free);
 
   G_OBJECT_CLASS (idle_server_tls_manager_parent_class)->dispose (object);
 }
@@ -324,6 +575,7 @@ idle_server_tls_manager_finalize (GObject *object)
   IDLE_DEBUG ("%p", self);
 
   close_all (self);
+  g_hash_table_unref (self->priv->accepted_certificates);
 
   G_OBJECT_CLASS (idle_server_tls_manager_parent_class)->finalize (object);
 }
@@ -5,31 +5,97 @@
 #include <stdio.h>
 #include <string.h>
 
+#define BENCHMARK_ITERATIONS 200000
+
+static gboolean
+check (const gchar *msg, const gchar *expected)
+{
+	gboolean ok = TRUE;
+	gchar *killed = idle_ctcp_kill_blingbling(msg);
+	gchar *in_place = g_strdup(msg);
+	gchar *copy;
+	const gchar *borrowed = idle_ctcp_kill_blingbling_borrow(msg, &copy);
+
+	if (strcmp(killed, expected)) {
+		fprintf(stderr, "\"%s\" -> \"%s\", should be \"%s\"\n", msg, killed, expected);
+		ok = FALSE;
+	}
+
+	if (idle_ctcp_kill_blingbling_in_place(in_place) != in_place || strcmp(in_place, expected)) {
+		fprintf(stderr, "\"%s\" -> \"%s\" in place, should be \"%s\"\n", msg, in_place, expected);
+		ok = FALSE;
+	}
+
+	if (strcmp(borrowed, expected) || (borrowed == msg) != !strcmp(msg, expected) || (copy != NULL) == (borrowed == msg)) {
+		fprintf(stderr, "\"%s\" -> \"%s\" borrowed, should be \"%s\"\n", msg, borrowed, expected);
+		ok = FALSE;
+	}
+
+	g_free(killed);
+	g_free(in_place);
+	g_free(copy);
+	return ok;
+}
+
+/* Not a pass/fail test: just so that changes to the scanner can be compared */
+static void
+benchmark (const gchar *name, const gchar *msg)
+{
+	gsize len = strlen(msg);
+	gint64 start = g_get_monotonic_time();
+	gint64 elapsed;
+
+	for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+		gchar *copy;
+
+		idle_ctcp_kill_blingbling_borrow(msg, &copy);
+		g_free(copy);
+	}
+
+	elapsed = MAX(g_get_monotonic_time() - start, 1);
+	fprintf(stderr, "%s: %d messages of %" G_GSIZE_FORMAT " bytes in %" G_GINT64_FORMAT " us, %.1f MB/s\n", name,
+		BENCHMARK_ITERATIONS, len, elapsed, (gdouble) len * BENCHMARK_ITERATIONS / elapsed);
+}
+
 int
 main (void)
 {
 	gboolean fail = FALSE;
+	GString *plain = g_string_new(NULL);
+	GString *fancy = g_string_new(NULL);
 
 	const gchar *test_strings[] = {
 		"foobar", "foobar",
+		"", "",
 		"foo \x03\x31\x33<3", "foo <3",
+		"\x03\x34,\x31\x32red on blue\x0f", "red on blue",
+		"\x03" "123", "3",
+		"\x02\x0f\x11\x12\x16\x1d\x1f", "",
+		"bold\x02 and \x1funderlined\x1f, \x1ditalic", "bold and underlined, italic",
+		"\001ACTION waves\001 \ttab", "\001ACTION waves\001 \ttab",
+		"a long message without any formatting in it at all", "a long message without any formatting in it at all",
+		"a long message with its formatting right at the end\x03", "a long message with its formatting right at the end",
 		NULL, NULL
 	};
 
 	for (int i = 0; test_strings[i] != NULL; i += 2) {
-		gchar *killed = idle_ctcp_kill_blingbling(test_strings[i]);
-
-		if (strcmp(killed, test_strings[i + 1])) {
-			fprintf(stderr, "\"%s\" -> \"%s\", should be \"%s\"", test_strings[i], killed, test_strings[i + 1]);
+		if (!check(test_strings[i], test_strings[i + 1]))
 			fail = TRUE;
-		}
+	}
 
-		g_free(killed);
+	while (plain->len < 400) {
+		g_string_append(plain, "the quick brown fox jumps over the lazy dog ");
+		g_string_append(fancy, "the \x02quick\x02 \x03" "05brown\x03 fox jumps over the lazy dog ");
 	}
 
+	benchmark("plain", plain->str);
+	benchmark("formatted", fancy->str);
+
+	g_string_free(plain, TRUE);
+	g_string_free(fancy, TRUE);
+
 	if (fail)
 		return 1;
 	else
 		return 0;
 }
-
@@ -0,0 +1,179 @@
+#include "config.h"
+
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include <idle-dns-cache.h>
+
+/* A resolver that answers from memory, counting how often it is asked */
+
+typedef struct {
+	GResolver parent;
+	guint lookups;
+} StubResolver;
+
+typedef struct {
+	GResolverClass parent_class;
+} StubResolverClass;
+
+GType stub_resolver_get_type(void);
+
+G_DEFINE_TYPE(StubResolver, stub_resolver, G_TYPE_RESOLVER)
+
+static void stub_resolver_init(StubResolver *self) {
+}
+
+static void stub_lookup_by_name_async(GResolver *resolver, const gchar *hostname, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	StubResolver *self = (StubResolver *) resolver;
+	GSimpleAsyncResult *result = g_simple_async_result_new(G_OBJECT(resolver), callback, user_data, stub_lookup_by_name_async);
+
+	self->lookups++;
+
+	if (g_str_has_suffix(hostname, ".invalid")) {
+		g_simple_async_result_set_error(result, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND, "no such host %s", hostname);
+	} else if (!strcmp(hostname, "flaky.test")) {
+		g_simple_async_result_set_error(result, G_RESOLVER_ERROR, G_RESOLVER_ERROR_TEMPORARY_FAILURE, "try again");
+	} else {
+		GList *addresses = NULL;
+
+		addresses = g_list_append(addresses, g_inet_address_new_from_string("::1"));
+		addresses = g_list_append(addresses, g_inet_address_new_from_string("127.0.0.1"));
+		g_simple_async_result_set_op_res_gpointer(result, addresses, (GDestroyNotify) g_resolver_free_addresses);
+	}
+
+	g_simple_async_result_complete_in_idle(result);
+	g_object_unref(result);
+}
+
+static GList *stub_lookup_by_name_finish(GResolver *resolver, GAsyncResult *result, GError **error) {
+	GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT(result);
+	GList *addresses;
+
+	if (g_simple_async_result_propagate_error(simple, error))
+		return NULL;
+
+	addresses = g_list_copy(g_simple_async_result_get_op_res_gpointer(simple));
+	g_list_foreach(addresses, (GFunc) g_object_ref, NULL);
+	return addresses;
+}
+
+static void stub_resolver_class_init(StubResolverClass *klass) {
+	GResolverClass *resolver_class = G_RESOLVER_CLASS(klass);
+
+	resolver_class->lookup_by_name_async = stub_lookup_by_name_async;
+	resolver_class->lookup_by_name_finish = stub_lookup_by_name_finish;
+}
+
+typedef struct {
+	GList *addresses;
+	GError *error;
+} Answer;
+
+static GMainLoop *loop;
+static guint outstanding = 0;
+
+static void _lookup_done(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+	Answer *answer = user_data;
+
+	answer->addresses = idle_dns_cache_lookup_finish(res, &answer->error);
+
+	if (--outstanding == 0)
+		g_main_loop_quit(loop);
+}
+
+static void lookup(const gchar *hostname, GCancellable *cancellable, Answer *answer) {
+	memset(answer, 0, sizeof(*answer));
+	outstanding++;
+	idle_dns_cache_lookup_async(hostname, cancellable, _lookup_done, answer);
+}
+
+static void wait_for_answers(void) {
+	if (outstanding > 0)
+		g_main_loop_run(loop);
+}
+
+static void answer_clear(Answer *answer) {
+	g_resolver_free_addresses(answer->addresses);
+	g_clear_error(&answer->error);
+}
+
+int
+main (void)
+{
+	StubResolver *stub;
+	GCancellable *cancellable;
+	Answer a, b, c;
+
+	g_type_init();
+	loop = g_main_loop_new(NULL, FALSE);
+	stub = g_object_new(stub_resolver_get_type(), NULL);
+	g_resolver_set_default(G_RESOLVER(stub));
+
+	/* Lookups for the same host at the same time share one query */
+	lookup("irc.example.net", NULL, &a);
+	lookup("IRC.example.net", NULL, &b);
+	wait_for_answers();
+	g_assert_cmpuint(stub->lookups, ==, 1);
+	g_assert_cmpuint(g_list_length(a.addresses), ==, 2);
+	g_assert_cmpuint(g_list_length(b.addresses), ==, 2);
+	answer_clear(&a);
+	answer_clear(&b);
+
+	/* and later ones are answered from the cache */
+	lookup("irc.example.net", NULL, &a);
+	wait_for_answers();
+	g_assert_cmpuint(stub->lookups, ==, 1);
+	g_assert_cmpuint(g_list_length(a.addresses), ==, 2);
+	answer_clear(&a);
+
+	/* until the addresses are found wanting */
+	idle_dns_cache_invalidate("irc.example.net");
+	lookup("irc.example.net", NULL, &a);
+	wait_for_answers();
+	g_assert_cmpuint(stub->lookups, ==, 2);
+	answer_clear(&a);
+
+	/* Hosts that do not exist are remembered too */
+	lookup("nowhere.invalid", NULL, &a);
+	wait_for_answers();
+	lookup("nowhere.invalid", NULL, &b);
+	wait_for_answers();
+	g_assert_cmpuint(stub->lookups, ==, 3);
+	g_assert_error(a.error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND);
+	g_assert_error(b.error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND);
+	answer_clear(&a);
+	answer_clear(&b);
+
+	/* but temporary failures are not */
+	lookup("flaky.test", NULL, &a);
+	wait_for_answers();
+	lookup("flaky.test", NULL, &b);
+	wait_for_answers();
+	g_assert_cmpuint(stub->lookups, ==, 5);
+	g_assert_error(b.error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_TEMPORARY_FAILURE);
+	answer_clear(&a);
+	answer_clear(&b);
+
+	/* One caller giving up does not spoil the lookup for the others */
+	cancellable = g_cancellable_new();
+	lookup("other.example.net", cancellable, &a);
+	lookup("other.example.net", NULL, &b);
+	g_cancellable_cancel(cancellable);
+	wait_for_answers();
+	g_assert_error(a.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+	g_assert_cmpuint(g_list_length(b.addresses), ==, 2);
+	answer_clear(&a);
+	answer_clear(&b);
+
+	lookup("other.example.net", NULL, &c);
+	wait_for_answers();
+	g_assert_cmpuint(stub->lookups, ==, 6);
+	answer_clear(&c);
+
+	g_object_unref(cancellable);
+	g_object_unref(stub);
+	g_main_loop_unref(loop);
+
+	return 0;
+}
@@ -27,7 +27,7 @@ test (TpChannelTextMessageType type,
 {
   gchar *recipient = "ircuser";
   gchar **bodies;
-  gchar **output = idle_text_encode_and_split (type, recipient, msg, 510, &bodies, NULL);
+  gchar **output = idle_text_encode (NULL, type, recipient, msg, 510, &bodies, NULL);
   GString *reconstituted_msg = g_string_sized_new (strlen (msg));
   int i = -1;
   char *line = NULL, *c = NULL;
@@ -52,7 +52,7 @@ test (TpChannelTextMessageType type,
 
   if (output == NULL)
     {
-      fail ("total reality failure, idle_text_encode_and_split returned NULL");
+      fail ("total reality failure, idle_text_encode returned NULL");
     }
 
   for (i = 0; output[i] != NULL; i++)
@@ -91,6 +91,11 @@ test (TpChannelTextMessageType type,
               g_strescape (expected_suffixes[type], ""));
         }
 
+      if (!g_utf8_validate (bodies[i], -1, NULL))
+        {
+          fail ("body '%s' is not valid UTF-8", bodies[i]);
+        }
+
       if (strncmp (c, bodies[i], strlen (c) - strlen (expected_suffixes[type])))
         {
           fail ("body of '%s' doesn't match alleged body '%s'", c, bodies[i]);
@@ -123,6 +128,10 @@ test (TpChannelTextMessageType type,
 }
 
 
+#define E30 "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9" \
+  "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9" \
+  "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9"
+
 int
 main (int argc,
       char **argv)
@@ -132,6 +141,8 @@ main (int argc,
       "This message\ncontains newlines.",
       "one two three four five six seven eight nine ten eleven twelve thirteen fourteen fifteen sixteen seventeen eighteen nineteen twenty twenty-one twenty-two twenty-three twenty-four twenty-five twenty-six twenty-seven twenty-eight twenty-nine thirty thirty-one thirty-two thirty-three thirty-four thirty-five thirty-six thirty-seven thirty-eight thirty-nine forty forty-one forty-two forty-three forty-four forty-five forty-six forty-seven forty-eight forty-nine fifty fifty-one fifty-two fifty-three fifty-four fifty-five fifty-six fifty-seven fifty-eight fifty-nine sixty sixty-one sixty-two sixty-three sixty-four sixty-five sixty-six sixty-seven sixty-eight sixty-nine",
       "one two three four\nfive six seven eight nine ten eleven twelve thirteen fourteen fifteen sixteen seventeen eighteen nineteen twenty twenty-one twenty-two twenty-three twenty-four twenty-five twenty-six twenty-seven twenty-eight twenty-nine thirty thirty-one thirty-two thirty-three thirty-four thirty-five thirty-six thirty-seven thirty-eight thirty-nine forty forty-one forty-two forty-three forty-four forty-five forty-six forty-seven forty-eight forty-nine fifty fifty-one fifty-two fifty-three fifty-four fifty-five fifty-six fifty-seven fifty-eight fifty-nine sixty sixty-one sixty-two sixty-three sixty-four sixty-five sixty-six sixty-seven sixty-eight sixty-nine",
+      /* no spaces to split at, and characters which must not be cut in half */
+      E30 E30 E30 E30 E30 E30 E30 E30 E30 E30,
       NULL
   };
   gboolean sad_face = FALSE;
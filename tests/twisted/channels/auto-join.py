@@ -0,0 +1,67 @@
+"""
+Test that the auto-join parameter joins every listed channel after
+connecting, packing the JOINs into as few lines as the server allows.
+"""
+
+import time
+
+from idletest import exec_test, BaseIRCServer, connect, disconnect
+from servicetest import assertEquals
+from constants import *
+import dbus
+
+CHANNELS = ['#chan%02d' % i for i in range(60)]
+
+class TargmaxServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.join_lines = []
+
+    def sendWelcome(self):
+        BaseIRCServer.sendWelcome(self)
+        self.sendMessage('005', self.nick, 'TARGMAX=PRIVMSG:4,JOIN:25',
+            ':are supported by this server', prefix='idle.test.server')
+
+    def handleJOIN(self, args, prefix):
+        self.join_lines.append(args)
+        for room in args[0].split(','):
+            self.rooms.append(room)
+            self.sendJoin(room, [])
+
+def test(q, bus, conn, stream):
+    start = time.time()
+    connect(q, conn)
+
+    joined = set()
+    while len(joined) < len(CHANNELS) + 1:
+        event = q.expect('dbus-signal', signal='NewChannels')
+        for path, props in event.args[0]:
+            if props[TARGET_HANDLE_TYPE] == HT_ROOM:
+                joined.add(props[TARGET_ID])
+
+    elapsed = time.time() - start
+    print "joined %d channels in %.3fs with %d JOIN lines" % (
+        len(joined), elapsed, len(stream.join_lines))
+
+    assertEquals(set(CHANNELS + ['#keyed']), joined)
+
+    # 61 channels at no more than 25 per line, rather than one line each;
+    # with the real 2-second flood spacing this is what makes the difference
+    assertEquals(3, len(stream.join_lines))
+    for line in stream.join_lines:
+        assert len(line[0].split(',')) <= 25
+        assert len('JOIN ' + ' '.join(line)) <= 510
+
+    # The channel with a key goes first, so that its key lines up with it
+    assertEquals('#keyed', stream.join_lines[0][0].split(',')[0])
+    assertEquals(['secret'], stream.join_lines[0][1:])
+    for line in stream.join_lines[1:]:
+        assertEquals(1, len(line))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=TargmaxServer, params={
+        'auto-join': dbus.Array(CHANNELS + ['#keyed secret'], signature='s'),
+    })
@@ -0,0 +1,75 @@
+"""
+Test that with auto-reconnect on, losing the server keeps the connection and
+its channels, rejoins them, and only signals who came and went meanwhile.
+"""
+
+import time
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect, join_room
+from servicetest import EventPattern, assertEquals, call_async
+from constants import *
+import dbus
+
+class ReconnectServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.members = {'#idletest': ['alice', 'bob']}
+
+    def handleJOIN(self, args, prefix):
+        for room in args[0].split(','):
+            self.rooms.append(room)
+            # sendJoin adds us to the list it is given
+            self.sendJoin(room, list(self.members.get(room, [])))
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    alice, bob, carol = conn.get_contact_handles_sync(['alice', 'bob', 'carol'])
+
+    path = join_room(q, conn, '#idletest')
+    q.expect('dbus-signal', signal='MembersChanged', path=path,
+        predicate=lambda e: alice in e.args[1] and bob in e.args[1])
+
+    # While we are away, alice leaves and carol arrives
+    stream.members['#idletest'] = ['bob', 'carol']
+
+    q.forbid_events([
+        EventPattern('dbus-signal', signal='StatusChanged'),
+        EventPattern('dbus-signal', signal='Closed'),
+        EventPattern('dbus-signal', signal='ChannelClosed'),
+        ])
+
+    start = time.time()
+    stream.transport.loseConnection()
+    q.expect('irc-disconnected')
+    q.expect('irc-connected')
+    q.expect_many(
+        EventPattern('stream-NICK'),
+        EventPattern('stream-USER'))
+    q.expect('stream-JOIN', data=['#idletest'])
+
+    # A single change with just the difference, rather than everybody
+    # leaving and coming back
+    event = q.expect('dbus-signal', signal='MembersChanged', path=path)
+    assertEquals([carol], event.args[1])
+    assertEquals([alice], event.args[2])
+    print "back in the channel after %.3fs" % (time.time() - start)
+
+    q.forbid_events([EventPattern('dbus-signal', signal='MembersChanged')])
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    # The channel still works
+    text = dbus.Interface(bus.get_object(conn.bus_name, path),
+        CHANNEL_IFACE_MESSAGES)
+    call_async(q, text, 'SendMessage', [{}, {'content-type': 'text/plain',
+        'content': 'still here'}], 0)
+    q.expect('stream-PRIVMSG', data=['#idletest', 'still here'])
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=ReconnectServer, params={
+        'auto-reconnect': dbus.Boolean(True),
+    })
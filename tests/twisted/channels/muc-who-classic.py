@@ -0,0 +1,58 @@
+"""
+Test that joining a channel on a server without WHOX falls back to a plain
+WHO query, and that its replies end up in the contact info cache.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect, get_field, join_room
+from servicetest import assertEquals
+from constants import *
+import dbus
+
+class WhoServer(BaseIRCServer):
+    def handleJOIN(self, args, prefix):
+        room = args[0]
+        self.rooms.append(room)
+        self.sendJoin(room, ['alice'])
+
+    def handleWHO(self, args, prefix):
+        room = args[0]
+        self.sendMessage('352', self.nick, room, 'alice', 'alice.host',
+            'idle.test.server', 'alice', 'G', ':0 Alice Alison',
+            prefix='idle.test.server')
+        self.sendMessage('315', self.nick, room, ':End of /WHO list.',
+            prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    # Replies to a WHO we didn't send are left alone
+    stream.sendMessage('352', stream.nick, '#elsewhere', 'bob', 'bob.host',
+        'idle.test.server', 'bob', 'H', ':0 Bob Bobson',
+        prefix='idle.test.server')
+    stream.sendMessage('315', stream.nick, '#elsewhere', ':End of /WHO list.',
+        prefix='idle.test.server')
+    sync_stream(q, stream)
+
+    bob = conn.get_contact_handle_sync('bob')
+    contact_info = dbus.Interface(conn, CONN_IFACE_CONTACT_INFO)
+    assertEquals({}, contact_info.GetContactInfo([bob]))
+
+    join_room(q, conn, '#idletest')
+
+    q.expect('stream-WHO', data=['#idletest'])
+    sync_stream(q, stream)
+
+    alice = conn.get_contact_handle_sync('alice')
+    info = contact_info.GetContactInfo([alice])
+    assertEquals('Alice Alison', get_field(info[alice], 'fn'))
+    # WHO doesn't tell us everything WHOIS would
+    assertEquals('true', get_field(info[alice], 'x-partial'))
+    assertEquals('away', get_field(info[alice], 'x-presence-status-identifier'))
+    # Plain WHO doesn't tell us about accounts
+    assertEquals(None, get_field(info[alice], 'nickname'))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=WhoServer)
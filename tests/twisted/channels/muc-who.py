@@ -0,0 +1,57 @@
+"""
+Test that joining a channel fetches everybody's details with a single WHOX
+query, and that the replies end up in the contact info cache.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect, get_field, join_room
+from servicetest import assertEquals
+from constants import *
+import dbus
+
+class WhoxServer(BaseIRCServer):
+    def sendWelcome(self):
+        BaseIRCServer.sendWelcome(self)
+        self.sendMessage('005', self.nick, 'CHANTYPES=#', 'WHOX',
+            ':are supported by this server', prefix='idle.test.server')
+
+    def handleJOIN(self, args, prefix):
+        room = args[0]
+        self.rooms.append(room)
+        self.sendJoin(room, ['alice'])
+
+    def handleWHO(self, args, prefix):
+        room = args[0]
+        self.sendMessage('354', self.nick, '152', 'alice', 'alice.host',
+            'alice', 'H@', 'alice_account', ':Alice Alison',
+            prefix='idle.test.server')
+        self.sendMessage('354', self.nick, '152', self.user, 'idle.test.client',
+            self.nick, 'H', '0', ':%s' % self.real_name,
+            prefix='idle.test.server')
+        self.sendMessage('315', self.nick, room, ':End of /WHO list.',
+            prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    join_room(q, conn, '#idletest')
+
+    # One query for the whole channel, asking for exactly what we use
+    q.expect('stream-WHO', data=['#idletest', '%tnuhraf,152'])
+    sync_stream(q, stream)
+
+    alice = conn.get_contact_handle_sync('alice')
+    contact_info = dbus.Interface(conn, CONN_IFACE_CONTACT_INFO)
+    info = contact_info.GetContactInfo([alice])
+    assertEquals('Alice Alison', get_field(info[alice], 'fn'))
+    # WHO doesn't tell us everything WHOIS would
+    assertEquals('true', get_field(info[alice], 'x-partial'))
+    assertEquals('alice_account', get_field(info[alice], 'nickname'))
+    assertEquals('true', get_field(info[alice], 'x-irc-registered-nick'))
+    assertEquals('available',
+        get_field(info[alice], 'x-presence-status-identifier'))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=WhoxServer)
@@ -0,0 +1,122 @@
+"""
+Test that filtered room listings are passed on to servers supporting ELIST,
+and that listings are answered from the cache while it is fresh.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect
+from servicetest import EventPattern, call_async, assertEquals
+import dbus
+import constants as cs
+
+ROOM_LIST_FILTER = 'org.freedesktop.Telepathy.Channel.Interface.RoomListFilter1'
+
+ROOMS = [
+    ('#rust', 120),
+    ('#Rustaceans', 8),
+    ('#trust', 2),
+    ('#python', 300),
+    ]
+
+class ElistServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.hold = False
+
+    def sendWelcome(self):
+        BaseIRCServer.sendWelcome(self)
+        self.sendMessage('005', self.nick, 'ELIST=MU',
+            ':are supported by this server', prefix='idle.test.server')
+
+    def handleLIST(self, args, prefix):
+        if not self.hold:
+            self.sendRooms()
+
+    def sendRooms(self):
+        # Ignore the filter, so that we can see Idle apply it too
+        for name, members in ROOMS:
+            self.sendMessage('322', self.nick, name, str(members), ':topic',
+                prefix='idle.test.server')
+        self.sendMessage('323', self.nick, ':End of /LIST',
+            prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+    sync_stream(q, stream)
+
+    call_async(q, conn, 'CreateChannel',
+        { cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST },
+        dbus_interface=cs.CONN_IFACE_REQUESTS)
+    path, properties = q.expect('dbus-return', method='CreateChannel').value
+    chan = bus.get_object(conn.bus_name, path)
+    list_chan = dbus.Interface(chan, cs.CHANNEL_TYPE_ROOM_LIST)
+    filter_chan = dbus.Interface(chan, ROOM_LIST_FILTER)
+    assert ROOM_LIST_FILTER in properties[cs.INTERFACES]
+
+    def collect_rooms():
+        names = []
+        while True:
+            e = q.expect('dbus-signal', path=path,
+                predicate=lambda e: e.signal == 'GotRooms' or
+                    (e.signal == 'ListingRooms' and not e.args[0]))
+            if e.signal == 'ListingRooms':
+                return sorted(names)
+            names += [room[2]['name'] for room in e.args[0]]
+
+    # A listing in progress can't be given a different filter
+    stream.hold = True
+    filter_chan.ListFilteredRooms({ 'name': '*python*' })
+    q.expect('stream-LIST', data=['*python*'])
+    call_async(q, filter_chan, 'ListFilteredRooms',
+        { 'min-members': dbus.UInt32(5) })
+    q.expect('dbus-error', method='ListFilteredRooms',
+        name=cs.NOT_AVAILABLE)
+
+    stream.hold = False
+    stream.sendRooms()
+    assertEquals(['#python'], collect_rooms())
+
+    # The filter goes to the server, and what it doesn't apply we do
+    filter_chan.ListFilteredRooms({ 'min-members': dbus.UInt32(5),
+        'name': '*RUST*' })
+    q.expect('stream-LIST', data=['*rust*,>4'])
+    assertEquals(['#rust', '#rustaceans'], collect_rooms())
+
+    # Asking again is answered from the cache
+    q.forbid_events([EventPattern('stream-LIST')])
+    filter_chan.ListFilteredRooms({ 'min-members': dbus.UInt32(5),
+        'name': '*RUST*' })
+    assertEquals(['#rust', '#rustaceans'], collect_rooms())
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    # Only so many listings are kept, the oldest going first
+    for i in range(8):
+        filter_chan.ListFilteredRooms({ 'name': '*room%d*' % i })
+        q.expect('stream-LIST', data=['*room%d*' % i])
+        collect_rooms()
+
+    filter_chan.ListFilteredRooms({ 'min-members': dbus.UInt32(5),
+        'name': '*RUST*' })
+    q.expect('stream-LIST', data=['*rust*,>4'])
+    assertEquals(['#rust', '#rustaceans'], collect_rooms())
+
+    # A complete listing answers any filter after it
+    list_chan.ListRooms()
+    q.expect('stream-LIST', data=[])
+    assertEquals(['#python', '#rust', '#rustaceans', '#trust'], collect_rooms())
+
+    q.forbid_events([EventPattern('stream-LIST')])
+    filter_chan.ListFilteredRooms({ 'max-members': dbus.UInt32(10) })
+    assertEquals(['#rustaceans', '#trust'], collect_rooms())
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    call_async(q, filter_chan, 'ListFilteredRooms', { 'name': 42 })
+    q.expect('dbus-error', method='ListFilteredRooms',
+        name=cs.INVALID_ARGUMENT)
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=ElistServer)
@@ -0,0 +1,71 @@
+"""
+Test that LISTs lost along with the server don't hold up listings after
+reconnecting.
+"""
+
+from idletest import exec_test, BaseIRCServer, connect, disconnect
+from servicetest import EventPattern, call_async, assertEquals
+import dbus
+import constants as cs
+
+N_ROOMS = 20
+
+class RoomListServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.hold = False
+
+    def handleLIST(self, args, prefix):
+        if self.hold:
+            return
+
+        for i in range(N_ROOMS):
+            self.sendMessage('322', self.nick, '#room%d' % i, '%d' % i,
+                ':topic %d' % i, prefix='idle.test.server')
+
+        self.sendMessage('323', self.nick, ':End of /LIST',
+            prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    call_async(q, conn, 'CreateChannel',
+        { cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST },
+        dbus_interface=cs.CONN_IFACE_REQUESTS)
+    path, properties = q.expect('dbus-return', method='CreateChannel').value
+    chan = bus.get_object(conn.bus_name, path)
+    list_chan = dbus.Interface(chan, cs.CHANNEL_TYPE_ROOM_LIST)
+
+    # The server never finishes this one, and we give up on it...
+    stream.hold = True
+    list_chan.ListRooms()
+    q.expect('stream-LIST')
+    list_chan.StopListing()
+    q.expect('dbus-signal', signal='ListingRooms', path=path, args=[False])
+
+    # ...while this one is still going when we lose the server
+    list_chan.ListRooms()
+    q.expect('stream-LIST')
+
+    stream.transport.loseConnection()
+    q.expect('irc-disconnected')
+    q.expect('irc-connected')
+    q.expect_many(
+        EventPattern('stream-NICK'),
+        EventPattern('stream-USER'))
+    q.expect('dbus-signal', signal='ListingRooms', path=path, args=[False])
+
+    # Neither of them is waited for by the next listing
+    stream.hold = False
+    list_chan.ListRooms()
+    e = q.expect('dbus-signal', signal='GotRooms', path=path)
+    assertEquals(N_ROOMS, len(e.args[0]))
+    q.expect('dbus-signal', signal='ListingRooms', path=path, args=[False])
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=RoomListServer, params={
+        'auto-reconnect': dbus.Boolean(True),
+    })
@@ -0,0 +1,93 @@
+"""
+Test that rooms are passed on in batches while LIST streams in, and that
+StopListing stops them.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect
+from servicetest import EventPattern, call_async, assertEquals
+import dbus
+import constants as cs
+
+N_ROOMS = 600
+
+class RoomListServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.hold = False
+
+    def sendRooms(self, first, last):
+        for i in range(first, last):
+            self.sendMessage('322', self.nick, '#room%d' % i, '%d' % i,
+                ':topic %d' % i, prefix='idle.test.server')
+
+    def sendEnd(self):
+        self.sendMessage('323', self.nick, ':End of /LIST',
+            prefix='idle.test.server')
+
+    def handleLIST(self, args, prefix):
+        if self.hold:
+            self.sendRooms(0, 10)
+        else:
+            self.sendRooms(0, N_ROOMS)
+            self.sendEnd()
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    call_async(q, conn, 'CreateChannel',
+        { cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST },
+        dbus_interface=cs.CONN_IFACE_REQUESTS)
+    path, properties = q.expect('dbus-return', method='CreateChannel').value
+    chan = bus.get_object(conn.bus_name, path)
+    list_chan = dbus.Interface(chan, cs.CHANNEL_TYPE_ROOM_LIST)
+
+    def got_rooms_or_done(e):
+        return e.signal == 'GotRooms' or \
+            (e.signal == 'ListingRooms' and e.args == [False])
+
+    def collect_rooms():
+        names = []
+        batches = 0
+        while True:
+            e = q.expect('dbus-signal', path=path, predicate=got_rooms_or_done)
+            if e.signal == 'ListingRooms':
+                return names, batches
+            rooms, = e.args
+            assert len(rooms) > 0
+            names += [room[2]['name'] for room in rooms]
+            batches += 1
+
+    # The rooms come in several batches rather than one huge one
+    list_chan.ListRooms()
+    names, batches = collect_rooms()
+    assertEquals(['#room%d' % i for i in range(N_ROOMS)], names)
+    assert batches >= 3, batches
+    assert not list_chan.GetListingRooms()
+
+    # Stopping passes on what has come so far, and no more
+    stream.hold = True
+    list_chan.ListRooms()
+    q.expect('stream-LIST')
+    sync_stream(q, stream)
+    list_chan.StopListing()
+    names, batches = collect_rooms()
+    assertEquals(['#room%d' % i for i in range(10)], names)
+
+    q.forbid_events([EventPattern('dbus-signal', signal='GotRooms'),
+        EventPattern('dbus-signal', signal='ListingRooms')])
+    stream.sendRooms(10, N_ROOMS)
+    stream.sendEnd()
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    # The rest of the abandoned LIST doesn't get mixed up with the next one
+    stream.hold = False
+    list_chan.ListRooms()
+    names, batches = collect_rooms()
+    assertEquals(N_ROOMS, len(names))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=RoomListServer)
@@ -0,0 +1,67 @@
+"""
+Benchmark how long it takes to connect to a SSL server, first from cold and
+then again once a session can be resumed; set IDLE_BENCHMARK_ROUNDS to run
+more rounds. This only reports timings, so it is not part of the test suite:
+run it with "make check-twisted TWISTED_TESTS=connect/connect-latency-ssl.py".
+"""
+
+import os
+import time
+import dbus
+import constants as cs
+from idletest import exec_test, make_connection, SSLIRCServer
+from servicetest import EventPattern, call_async
+
+PARAMS = {'use-ssl': dbus.Boolean(True)}
+
+def session_reused(stream):
+    handle = stream.transport.getHandle()
+    if hasattr(handle, 'session_reused'):
+        return bool(handle.session_reused())
+    return None
+
+def connect_once(q, bus, conn, stream, first):
+    start = time.time()
+    conn.Connect()
+    q.expect('irc-connected')
+
+    if first:
+        # the certificate is offered to the user once the handshake is done;
+        # after that it is remembered
+        e = q.expect('dbus-signal', signal='NewChannels')
+        path, props = e.args[0][0]
+        cert = bus.get_object(conn.bus_name, props[cs.TLS_CERT_PATH])
+        cert.Accept()
+
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 1])
+    total = time.time() - start
+    reused = session_reused(stream)
+
+    call_async(q, conn, 'Disconnect')
+    q.expect_many(
+            EventPattern('dbus-signal', signal='StatusChanged', args=[2, 1]),
+            EventPattern('irc-disconnected'),
+            EventPattern('dbus-return', method='Disconnect'))
+    return (total, reused)
+
+def test(q, bus, conn, stream):
+    rounds = int(os.environ.get('IDLE_BENCHMARK_ROUNDS', '5'))
+    results = [connect_once(q, bus, conn, stream, True)]
+
+    for i in range(rounds - 1):
+        conn = make_connection(bus, q.append, PARAMS)
+        results.append(connect_once(q, bus, conn, stream, False))
+
+    for (i, (total, reused)) in enumerate(results):
+        print 'round %d: ready after %.1f ms%s' % (i, total * 1000,
+            { True: ', session resumed', False: '', None: '' }[reused])
+
+    warm = sorted([total for (total, reused) in results[1:]])
+    if warm:
+        print 'cold: %.1f ms, warm median: %.1f ms' % (
+            results[0][0] * 1000, warm[len(warm) / 2] * 1000)
+
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, PARAMS, protocol=SSLIRCServer)
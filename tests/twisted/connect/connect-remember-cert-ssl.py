@@ -0,0 +1,97 @@
+"""
+Test that certificates the user has accepted are saved to the account's
+certificate store, for the server they were accepted for, and only trusted
+again by accounts using that store.
+"""
+
+import base64
+import hashlib
+import os
+import shutil
+import tempfile
+import time
+import dbus
+import constants as cs
+from idletest import exec_test, make_connection, SSLIRCServer
+from servicetest import EventPattern, call_async
+
+def fingerprint():
+    pem = open(os.environ.get('IDLE_SSL_CERT', 'tools/idletest.cert')).read()
+    body = pem.split('-----BEGIN CERTIFICATE-----')[1]
+    body = body.split('-----END CERTIFICATE-----')[0]
+    return hashlib.sha256(base64.b64decode(body)).hexdigest()
+
+def connect(q, bus, conn, accept):
+    conn.Connect()
+    q.expect('irc-connected')
+
+    if accept:
+        e = q.expect('dbus-signal', signal='NewChannels')
+        path, props = e.args[0][0]
+        cert = bus.get_object(conn.bus_name, props[cs.TLS_CERT_PATH])
+        cert.Accept()
+
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 1])
+
+def disconnect(q, conn):
+    call_async(q, conn, 'Disconnect')
+    q.expect_many(
+            EventPattern('dbus-signal', signal='StatusChanged', args=[2, 1]),
+            EventPattern('irc-disconnected'),
+            EventPattern('dbus-return', method='Disconnect'))
+
+store_dir = tempfile.mkdtemp()
+store = os.path.join(store_dir, 'certificates')
+
+def test(q, bus, conn, stream):
+    asked = [EventPattern('dbus-signal', signal='NewChannels')]
+
+    # What was accepted in an earlier session is read back from the store
+    q.forbid_events(asked)
+    connect(q, bus, conn, False)
+    disconnect(q, conn)
+    q.unforbid_events(asked)
+
+    # but only for the server it was accepted for
+    conn = make_connection(bus, q.append, {
+        'use-ssl': dbus.Boolean(True),
+        'certificate-store': store,
+        })
+    connect(q, bus, conn, True)
+    disconnect(q, conn)
+
+    for i in range(50):
+        if '127.0.0.1 %s\n' % fingerprint() in open(store).read():
+            break
+        time.sleep(0.1)
+    else:
+        assert False, open(store).read()
+
+    assert 'localhost %s\n' % fingerprint() in open(store).read()
+
+    # Another account using the same store is not asked again
+    q.forbid_events(asked)
+    conn = make_connection(bus, q.append, {
+        'use-ssl': dbus.Boolean(True),
+        'certificate-store': store,
+        })
+    connect(q, bus, conn, False)
+    disconnect(q, conn)
+    q.unforbid_events(asked)
+
+    # but one without a store is: what other accounts accepted is none of its
+    # business
+    conn = make_connection(bus, q.append, {'use-ssl': dbus.Boolean(True)})
+    connect(q, bus, conn, True)
+    disconnect(q, conn)
+
+    shutil.rmtree(store_dir)
+    return True
+
+if __name__ == '__main__':
+    open(store, 'w').write('localhost %s\n' % fingerprint())
+    exec_test(test, {
+        'use-ssl': dbus.Boolean(True),
+        'server': 'localhost',
+        'certificate-store': store,
+        }, protocol=SSLIRCServer)
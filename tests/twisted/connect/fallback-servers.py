@@ -0,0 +1,24 @@
+"""
+Test that if the main server cannot be reached, a fallback server is used.
+"""
+
+import dbus
+from idletest import exec_test, disconnect
+from servicetest import EventPattern
+
+def test(q, bus, conn, stream):
+    conn.Connect()
+    q.expect_many(
+            EventPattern('dbus-signal', signal='StatusChanged', args=[1, 1]),
+            EventPattern('irc-connected'))
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 1])
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    # nothing listens on the main server's port
+    exec_test(test, {
+        'port': dbus.UInt32(5600),
+        'fallback-servers': ['no-such-host.invalid', '127.0.0.1:6900'],
+    })
@@ -24,7 +24,9 @@ def test(q, bus, conn, stream):
 
     q.expect('stream-PING')
     # If we don't answer Idle's ping, after some period of time Idle should
-    # give up and close the connection.
+    # give up and close the connection, without sending another PING while
+    # it waits.
+    q.forbid_events([EventPattern('stream-PING')])
     q.expect_many(
         EventPattern('irc-disconnected'),
         EventPattern('dbus-signal', signal='StatusChanged',
@@ -32,9 +34,9 @@ def test(q, bus, conn, stream):
         )
 
 if __name__ == '__main__':
-    # We expect Idle to blow up the connection after three intervals without a
-    # reply. So the default 5-second test timeout *should* just be enough, but
-    # let's not risk it.
+    # We expect Idle to blow up the connection within an interval of an
+    # unanswered ping, but each ping only goes out after an interval of
+    # silence, so let's not risk the default 5-second test timeout.
     exec_test(test, timeout=10, params={
         'keepalive-interval': 1,
     })
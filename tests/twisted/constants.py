@@ -237,6 +237,7 @@ ERROR = PREFIX + '.Error'
 INVALID_ARGUMENT = ERROR + '.InvalidArgument'
 NOT_IMPLEMENTED = ERROR + '.NotImplemented'
 NOT_AVAILABLE = ERROR + '.NotAvailable'
+DOES_NOT_EXIST = ERROR + '.DoesNotExist'
 PERMISSION_DENIED = ERROR + '.PermissionDenied'
 OFFLINE = ERROR + '.Offline'
 NOT_CAPABLE = ERROR + '.NotCapable'
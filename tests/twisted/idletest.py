@@ -8,6 +8,7 @@ import sys
 import dbus
 import servicetest
 from servicetest import (unwrap, Event)
+import constants as cs
 import twisted
 from twisted.words.protocols import irc
 from twisted.internet import reactor, ssl
@@ -168,6 +169,41 @@ def sync_stream(q, stream):
     stream.sendMessage('PING', 'sup')
     q.expect('stream-PONG')
 
+def connect(q, conn):
+    conn.Connect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 1])
+
+def disconnect(q, conn):
+    servicetest.call_async(q, conn, 'Disconnect')
+    q.expect_many(
+            servicetest.EventPattern('dbus-return', method='Disconnect'),
+            servicetest.EventPattern('dbus-signal', signal='StatusChanged',
+                args=[2, 1]))
+
+def join_room(q, conn, room):
+    """Requests a text channel for room and returns its object path."""
+    servicetest.call_async(q, conn.Requests, 'CreateChannel',
+            { cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_TEXT,
+              cs.TARGET_HANDLE_TYPE: cs.HT_ROOM,
+              cs.TARGET_ID: room })
+    q.expect('stream-JOIN', data=[room])
+    return q.expect('dbus-return', method='CreateChannel').value[0]
+
+def open_im(q, conn, nick):
+    """Requests a text channel to nick and returns its object path."""
+    servicetest.call_async(q, conn.Requests, 'CreateChannel',
+            { cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_TEXT,
+              cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+              cs.TARGET_ID: nick })
+    return q.expect('dbus-return', method='CreateChannel').value[0]
+
+def get_field(vcard, field):
+    """Returns the first value of field in a ContactInfo list, or None."""
+    for (name, parameters, value) in vcard:
+        if name == field:
+            return value[0]
+    return None
+
 def install_colourer():
     def red(s):
         return '\x1b[31m%s\x1b[0m' % s
@@ -2,8 +2,8 @@
 Test Messages interface implementation
 """
 
-from idletest import exec_test
-from servicetest import call_async
+from idletest import exec_test, sync_stream
+from servicetest import EventPattern, call_async, assertEquals
 import constants as cs
 import dbus
 
@@ -25,6 +25,48 @@ def test(q, bus, conn, stream):
 
     q.expect('dbus-error', method='Send', name=cs.INVALID_ARGUMENT)
 
+    # Idle matches ISON replies to its own queries, so clients can't send one
+    call_async(q, irc_cmd, 'Send', 'ISON badger')
+    q.expect('dbus-error', method='Send', name=cs.INVALID_ARGUMENT)
+
+    # Several at once, with those which can't be sent reported by position
+    call_async(q, irc_cmd, 'SendMany', ['badger one', 'part #badgers',
+        'badger two'])
+    q.expect('stream-BADGER', data=['one'])
+    q.expect('stream-BADGER', data=['two'])
+    e = q.expect('dbus-return', method='SendMany')
+    errors, = e.value
+    assertEquals(1, len(errors))
+    assertEquals(1, errors[0][0])
+    assertEquals(cs.INVALID_ARGUMENT, errors[0][1])
+
+    # Lines can be subscribed to, whether or not Idle handles them itself
+    irc_cmd.Subscribe(['wallops', '716'])
+    stream.sendMessage('716', stream.nick, 'alice', ':is in +g mode',
+        prefix='idle.test.server')
+    e = q.expect('dbus-signal', signal='Received')
+    assertEquals(['716', ':idle.test.server 716 %s alice :is in +g mode'
+        % stream.nick], e.args)
+    stream.sendMessage('WALLOPS', ':badgers', prefix='oper')
+    q.expect('dbus-signal', signal='Received',
+        args=['WALLOPS', ':oper WALLOPS :badgers'])
+
+    # ...and only those
+    received = EventPattern('dbus-signal', signal='Received')
+    q.forbid_events([received])
+    stream.sendMessage('717', stream.nick, 'alice', ':has been informed',
+        prefix='idle.test.server')
+    sync_stream(q, stream)
+
+    irc_cmd.Subscribe([])
+    stream.sendMessage('716', stream.nick, 'bob', ':is in +g mode',
+        prefix='idle.test.server')
+    sync_stream(q, stream)
+    q.unforbid_events([received])
+
+    call_async(q, irc_cmd, 'Subscribe', ['who is'])
+    q.expect('dbus-error', method='Subscribe', name=cs.INVALID_ARGUMENT)
+
     call_async(q, conn, 'Disconnect')
 
 if __name__ == '__main__':
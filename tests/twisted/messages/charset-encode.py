@@ -0,0 +1,44 @@
+"""
+Test that what the user sends is converted to the connection's charset, that
+a message with several lines goes out as one line each, and that long messages
+are split according to their length once converted, between words.
+"""
+
+from idletest import exec_test, sync_stream, connect, disconnect, open_im
+from servicetest import assertEquals
+from constants import *
+import dbus
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    path = open_im(q, conn, 'bob')
+    text = dbus.Interface(bus.get_object(conn.bus_name, path),
+        CHANNEL_TYPE_TEXT)
+    sync_stream(q, stream)
+
+    text.Send(0, u'caf\xe9\nna\xefve\rly')
+    q.expect('stream-PRIVMSG', data=['bob', u'caf\xe9'.encode('latin-1')])
+    q.expect('stream-PRIVMSG', data=['bob', u'na\xefve ly'.encode('latin-1')])
+
+    text.Send(1, u'\xe9t\xe9')
+    q.expect('stream-PRIVMSG',
+        data=['bob', u'\x01ACTION \xe9t\xe9\x01'.encode('latin-1')])
+
+    # Too long for one line in UTF-8, but not in ISO-8859-1
+    text.Send(0, u'\xe9' * 300)
+    q.expect('stream-PRIVMSG', data=['bob', '\xe9' * 300])
+
+    # Split after the last word that fits
+    message = 'word ' * 100
+    text.Send(0, message)
+    part1 = q.expect('stream-PRIVMSG').data[1]
+    part2 = q.expect('stream-PRIVMSG').data[1]
+    assert part1.endswith('word '), part1
+    assertEquals(message, part1 + part2)
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, params={'charset': 'ISO-8859-1'})
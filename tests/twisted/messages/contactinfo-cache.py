@@ -0,0 +1,98 @@
+"""
+Test that WHOIS results are cached and served through RequestContactInfo,
+GetContactInfo and the contact attributes, that away-notify updates them, that
+what we only learn in passing is marked as partial, and that QUIT invalidates
+the cache.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect, get_field
+from servicetest import EventPattern, assertEquals, call_async
+from constants import *
+import dbus
+
+class WhoisServer(BaseIRCServer):
+    def handleWHOIS(self, args, prefix):
+        # BaseIRCServer.handleWHOIS toggles this and answers RPL_TRYAGAIN when
+        # it ends up True; start from True so our own WHOIS is answered
+        self.busy = True
+        if args[0] == self.nick:
+            BaseIRCServer.handleWHOIS(self, args, prefix)
+            return
+
+        nick = args[0]
+        self.sendMessage('311', self.nick, nick, nick, 'idle.test.client', '*',
+            ':%s' % nick.capitalize(), prefix='idle.test.server')
+        self.sendMessage('318', self.nick, nick, ':End of /WHOIS list.',
+            prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    alice, bob = conn.get_contact_handles_sync(['alice', 'bob'])
+    contact_info = dbus.Interface(conn, CONN_IFACE_CONTACT_INFO)
+
+    # Nothing is known yet
+    assertEquals({}, contact_info.GetContactInfo([alice, bob]))
+
+    call_async(q, contact_info, 'RequestContactInfo', alice)
+    q.expect('stream-WHOIS', data=['alice', 'alice'])
+    event = q.expect('dbus-return', method='RequestContactInfo')
+    assertEquals('Alice', get_field(event.value[0], 'fn'))
+
+    # Asking again is answered from the cache
+    q.forbid_events([EventPattern('stream-WHOIS')])
+    call_async(q, contact_info, 'RequestContactInfo', alice)
+    event = q.expect('dbus-return', method='RequestContactInfo')
+    assertEquals('Alice', get_field(event.value[0], 'fn'))
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    info = contact_info.GetContactInfo([alice, bob])
+    assertEquals([alice], info.keys())
+    assertEquals('Alice', get_field(info[alice], 'fn'))
+    assertEquals(None, get_field(info[alice], 'x-partial'))
+
+    attrs = conn.Contacts.GetContactAttributes([alice, bob],
+        [CONN_IFACE_CONTACT_INFO], False)
+    assertEquals('Alice', get_field(attrs[alice][ATTR_CONTACT_INFO], 'fn'))
+    assert ATTR_CONTACT_INFO not in attrs[bob]
+
+    # away-notify updates the cached entry
+    stream.sendMessage('AWAY', ':gone fishing', prefix='alice')
+    event = q.expect('dbus-signal', signal='ContactInfoChanged')
+    assertEquals(alice, event.args[0])
+    assertEquals('gone fishing',
+        get_field(event.args[1], 'x-presence-status-message'))
+    info = contact_info.GetContactInfo([alice])
+    assertEquals('gone fishing',
+        get_field(info[alice], 'x-presence-status-message'))
+
+    # bob has never been WHOISed, so what away-notify tells us about him is
+    # served marked as partial, and not signalled
+    q.forbid_events([EventPattern('dbus-signal', signal='ContactInfoChanged')])
+    stream.sendMessage('AWAY', ':lunch', prefix='bob')
+    sync_stream(q, stream)
+    q.unforbid_all()
+    info = contact_info.GetContactInfo([bob])
+    assertEquals('true', get_field(info[bob], 'x-partial'))
+    assertEquals('lunch', get_field(info[bob], 'x-presence-status-message'))
+    attrs = conn.Contacts.GetContactAttributes([bob],
+        [CONN_IFACE_CONTACT_INFO], False)
+    assertEquals('true', get_field(attrs[bob][ATTR_CONTACT_INFO], 'x-partial'))
+
+    # ...and RequestContactInfo still asks the server
+    call_async(q, contact_info, 'RequestContactInfo', bob)
+    q.expect('stream-WHOIS', data=['bob', 'bob'])
+    event = q.expect('dbus-return', method='RequestContactInfo')
+    assertEquals(None, get_field(event.value[0], 'x-partial'))
+
+    # Quitting invalidates it
+    stream.sendMessage('QUIT', ':bye', prefix='alice')
+    sync_stream(q, stream)
+    assertEquals({}, contact_info.GetContactInfo([alice]))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=WhoisServer)
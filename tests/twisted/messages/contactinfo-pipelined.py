@@ -0,0 +1,66 @@
+"""
+Test that several RequestContactInfo calls can be outstanding at once, and
+that WHOIS replies are matched to them by nick rather than by arrival order.
+"""
+
+from idletest import exec_test, BaseIRCServer, connect, disconnect
+from servicetest import EventPattern, assertEquals, call_async
+from constants import *
+import dbus
+
+class DeferredWhoisServer(BaseIRCServer):
+    def handleWHOIS(self, args, prefix):
+        # Answer the handshake's WHOIS for ourself; leave the rest to the test
+        if args[0] == self.nick:
+            BaseIRCServer.handleWHOIS(self, args, prefix)
+
+def send_whois_reply(stream, nick, real_name):
+    stream.sendMessage('311', stream.nick, nick, nick, 'idle.test.client', '*',
+        ':%s' % real_name, prefix='idle.test.server')
+    stream.sendMessage('312', stream.nick, nick, 'idle.test.server',
+        ':Idle Test Server', prefix='idle.test.server')
+    stream.sendMessage('318', stream.nick, nick, ':End of /WHOIS list.',
+        prefix='idle.test.server')
+
+def get_fn(vcard):
+    for (name, parameters, value) in vcard:
+        if name == 'fn':
+            return value[0]
+    return None
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    alice, bob, carol = conn.get_contact_handles_sync(['alice', 'bob', 'carol'])
+    contact_info = dbus.Interface(conn, CONN_IFACE_CONTACT_INFO)
+
+    call_async(q, contact_info, 'RequestContactInfo', alice)
+    call_async(q, contact_info, 'RequestContactInfo', bob)
+    call_async(q, contact_info, 'RequestContactInfo', carol)
+
+    # All three queries go out without waiting for each other
+    q.expect_many(
+            EventPattern('stream-WHOIS', data=['alice', 'alice']),
+            EventPattern('stream-WHOIS', data=['bob', 'bob']),
+            EventPattern('stream-WHOIS', data=['carol', 'carol']))
+
+    # Replies arrive in a different order from the requests
+    send_whois_reply(stream, 'bob', 'Bob Bobson')
+    event = q.expect('dbus-return', method='RequestContactInfo')
+    assertEquals('Bob Bobson', get_fn(event.value[0]))
+
+    # A failed query does not hold up the others
+    stream.sendMessage('402', stream.nick, 'carol', ':No such server',
+        prefix='idle.test.server')
+    event = q.expect('dbus-error', method='RequestContactInfo')
+    assertEquals(DOES_NOT_EXIST, event.name)
+
+    send_whois_reply(stream, 'alice', 'Alice Alison')
+    event = q.expect('dbus-return', method='RequestContactInfo')
+    assertEquals('Alice Alison', get_fn(event.value[0]))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=DeferredWhoisServer)
@@ -0,0 +1,63 @@
+"""
+Test that CTCP queries are answered, and that a flood of them is not.
+"""
+
+from idletest import exec_test, sync_stream, connect, disconnect
+from servicetest import EventPattern, assertEquals
+from constants import *
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    # Queries are not messages
+    q.forbid_events([EventPattern('dbus-signal', signal='MessageReceived')])
+
+    # The queries all arrive at once, so that which of them get answered
+    # doesn't depend on how long the test takes to run: the shared bucket
+    # only refills every couple of seconds.
+    queries = [
+        ('alice', 'PING 1234'),
+        ('alice', 'CLIENTINFO'),
+        ('bob', 'TIME'),
+        ('bob', 'VERSION'),
+        # Each sender only gets a couple of answers in quick succession...
+        ('alice', 'VERSION'),
+        # ...and everybody together only a few more
+        ('carol', 'VERSION'),
+        ('dave', 'VERSION'),
+        ('eve', 'VERSION'),
+        ('mallory', 'VERSION'),
+        ]
+
+    for nick, query in queries:
+        stream.sendMessage('PRIVMSG', stream.nick, ':\x01%s\x01' % query,
+            prefix=nick)
+
+    # The answers go out in the order the queries came in
+    q.expect('stream-NOTICE', data=['alice', '\x01PING 1234\x01'])
+
+    e = q.expect('stream-NOTICE')
+    assertEquals('alice', e.data[0])
+    assertEquals('\x01CLIENTINFO ACTION CLIENTINFO PING TIME VERSION\x01',
+        e.data[1])
+
+    e = q.expect('stream-NOTICE')
+    assertEquals('bob', e.data[0])
+    assert e.data[1].startswith('\x01TIME '), e.data
+
+    e = q.expect('stream-NOTICE')
+    assertEquals('bob', e.data[0])
+    assert e.data[1].startswith('\x01VERSION telepathy-idle '), e.data
+
+    e = q.expect('stream-NOTICE')
+    assertEquals('carol', e.data[0])
+
+    # Nobody else gets an answer before we disconnect
+    q.forbid_events([EventPattern('stream-NOTICE')])
+    sync_stream(q, stream)
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test)
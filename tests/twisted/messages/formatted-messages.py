@@ -0,0 +1,46 @@
+"""
+Test that with formatted-messages on, received messages with mIRC formatting
+also come as HTML, and those without it are left alone.
+"""
+
+from idletest import exec_test, connect, disconnect
+from servicetest import assertEquals
+from constants import *
+import dbus
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    stream.sendMessage('PRIVMSG', stream.nick,
+        ':\x02bold\x02 and \x0304red\x03 <3', prefix='alice')
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    header, html, plain = e.args[0]
+    assertEquals('text/html', html['content-type'])
+    assertEquals('<span style="font-weight: bold">bold</span> and '
+        '<span style="color: #ff0000">red</span> &lt;3', html['content'])
+    assertEquals('text/plain', plain['content-type'])
+    assertEquals('bold and red <3', plain['content'])
+    assertEquals(html['alternative'], plain['alternative'])
+
+    stream.sendMessage('PRIVMSG', stream.nick,
+        ':\x01ACTION is \x1ditalic\x1d\x01', prefix='alice')
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    header, html, plain = e.args[0]
+    assertEquals(MT_ACTION, header['message-type'])
+    assertEquals('is <span style="font-style: italic">italic</span>',
+        html['content'])
+    assertEquals('is italic', plain['content'])
+
+    stream.sendMessage('PRIVMSG', stream.nick, ':just text', prefix='alice')
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    header, plain = e.args[0]
+    assertEquals('text/plain', plain['content-type'])
+    assertEquals('just text', plain['content'])
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, params={
+        'formatted-messages': dbus.Boolean(True),
+    })
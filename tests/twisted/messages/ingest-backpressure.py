@@ -0,0 +1,72 @@
+"""
+Test that Idle stops reading from the server while too many received
+messages are unacknowledged, and carries on once they are acknowledged.
+"""
+
+from idletest import exec_test, sync_stream, connect, disconnect
+from servicetest import EventPattern, assertEquals
+from constants import *
+import dbus
+
+STATISTICS = CONN + '.Interface.Statistics1'
+MAX_PENDING = 8
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+    sync_stream(q, stream)
+
+    ids = []
+    for i in range(MAX_PENDING):
+        stream.sendMessage('PRIVMSG', stream.nick, ':%d' % i, prefix='alice')
+        e = q.expect('dbus-signal', signal='MessageReceived')
+        assertEquals(str(i), e.args[0][1]['content'])
+        ids.append(e.args[0][0]['pending-message-id'])
+
+    chan = bus.get_object(conn.bus_name, e.path)
+    text = dbus.Interface(chan, CHANNEL_TYPE_TEXT)
+
+    # Idle has stopped listening, so this waits in the socket
+    held = EventPattern('dbus-signal', signal='MessageReceived')
+    q.forbid_events([held])
+    stream.sendMessage('PRIVMSG', stream.nick, ':held', prefix='alice')
+
+    # D-Bus is still answered meanwhile
+    stats = conn.Properties.GetAll(STATISTICS)
+    assertEquals(1, stats['ReadStalls'])
+    assertEquals(0, stats['ReadStallTime'])
+
+    # Acknowledging one is not enough to get below the low watermark...
+    text.AcknowledgePendingMessages(ids[:1])
+    conn.Properties.Get(STATISTICS, 'ReadStalls')
+    q.unforbid_events([held])
+
+    # ...but acknowledging the rest is
+    text.AcknowledgePendingMessages(ids[1:])
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    assertEquals('held', e.args[0][1]['content'])
+
+    sync_stream(q, stream)
+    stats = conn.Properties.GetAll(STATISTICS)
+    assertEquals(1, stats['ReadStalls'])
+
+    # Destroying a channel gives back what was left unacknowledged in it
+    for i in range(MAX_PENDING - 1):
+        stream.sendMessage('PRIVMSG', stream.nick, ':%d' % i, prefix='alice')
+        q.expect('dbus-signal', signal='MessageReceived')
+
+    q.forbid_events([held])
+    stream.sendMessage('PRIVMSG', stream.nick, ':held again', prefix='alice')
+    assertEquals(2, conn.Properties.Get(STATISTICS, 'ReadStalls'))
+    q.unforbid_events([held])
+
+    dbus.Interface(chan, CHANNEL_IFACE_DESTROYABLE).Destroy()
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    assertEquals('held again', e.args[0][1]['content'])
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, params={
+        'max-pending-messages': dbus.UInt32(MAX_PENDING),
+    })
@@ -0,0 +1,104 @@
+"""
+Test that messages of more than one line are sent as draft/multiline batches
+when the server offers them, within the limits it gives.
+"""
+
+from idletest import exec_test, BaseIRCServer, make_irc_event, sync_stream, disconnect, open_im
+from servicetest import EventPattern, assertEquals, call_async
+from constants import *
+import dbus
+
+class MultilineServer(BaseIRCServer):
+    def handleCAP(self, args, prefix):
+        if args[0] == 'LS':
+            assertEquals(['LS', '302'], args)
+            self.sendMessage('CAP', '*', 'LS', '*', ':away-notify batch',
+                prefix='idle.test.server')
+            self.sendMessage('CAP', '*', 'LS',
+                ':draft/multiline=max-bytes=1000,max-lines=3',
+                prefix='idle.test.server')
+        elif args[0] == 'REQ':
+            self.sendMessage('CAP', '*', 'ACK', ':%s' % args[1],
+                prefix='idle.test.server')
+
+    def handleCommand(self, command, prefix, params):
+        # Twisted knows nothing of tags, and takes them for the command
+        if command.startswith('@'):
+            tags = command[1:]
+            command = params.pop(0)
+            self.event_func(make_irc_event('tagged-%s' % command,
+                [tags] + params))
+        else:
+            BaseIRCServer.handleCommand(self, command, prefix, params)
+
+def send_message(q, chan, text, type=MT_NORMAL):
+    call_async(q, chan, 'SendMessage', [{'message-type': type},
+        {'content-type': 'text/plain', 'content': text}], 0)
+    q.expect('dbus-return', method='SendMessage')
+
+def expect_batch(q, target):
+    e = q.expect('stream-BATCH')
+    ref = e.data[0]
+    assert ref.startswith('+'), e.data
+    assertEquals(['draft/multiline', target], e.data[1:])
+    return ref[1:]
+
+def test(q, bus, conn, stream):
+    conn.Connect()
+    q.expect_many(
+        EventPattern('stream-CAP', data=['REQ',
+            'away-notify batch draft/multiline']),
+        EventPattern('stream-CAP', data=['END']),
+        EventPattern('dbus-signal', signal='StatusChanged', args=[0, 1]))
+
+    path = open_im(q, conn, 'bob')
+    messages = dbus.Interface(bus.get_object(conn.bus_name, path),
+        CHANNEL_IFACE_MESSAGES)
+    sync_stream(q, stream)
+
+    # No more than three lines to a batch
+    send_message(q, messages, 'one\ntwo\nthree\nfour')
+    ref = expect_batch(q, 'bob')
+    for line in ['one', 'two', 'three']:
+        q.expect('tagged-PRIVMSG', data=['batch=' + ref, 'bob', line])
+    q.expect('stream-BATCH', data=['-' + ref])
+    next_ref = expect_batch(q, 'bob')
+    assert next_ref != ref
+    q.expect('tagged-PRIVMSG', data=['batch=' + next_ref, 'bob', 'four'])
+    q.expect('stream-BATCH', data=['-' + next_ref])
+
+    # A line too long for IRC goes in two, the second carrying on from the first
+    text = 'word ' * 100
+    send_message(q, messages, text)
+    ref = expect_batch(q, 'bob')
+    first = q.expect('tagged-PRIVMSG')
+    assertEquals(['batch=' + ref, 'bob'], first.data[:2])
+    second = q.expect('tagged-PRIVMSG')
+    assertEquals(['batch=%s;draft/multiline-concat' % ref, 'bob'],
+        second.data[:2])
+    assertEquals(text.rstrip(), first.data[2] + second.data[2].rstrip())
+    q.expect('stream-BATCH', data=['-' + ref])
+
+    # A batch longer than any one IRC line still goes out whole
+    lines = [c * 200 for c in 'xyz']
+    send_message(q, messages, '\n'.join(lines))
+    ref = expect_batch(q, 'bob')
+    for line in lines:
+        q.expect('tagged-PRIVMSG', data=['batch=' + ref, 'bob', line])
+    q.expect('stream-BATCH', data=['-' + ref])
+
+    # One line needs no batch, and nor can /me be put in one
+    q.forbid_events([EventPattern('stream-BATCH')])
+    send_message(q, messages, 'hello')
+    q.expect('stream-PRIVMSG', data=['bob', 'hello'])
+    send_message(q, messages, 'waves\nagain', MT_ACTION)
+    q.expect('stream-PRIVMSG', data=['bob', '\x01ACTION waves\x01'])
+    q.expect('stream-PRIVMSG', data=['bob', '\x01ACTION again\x01'])
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=MultilineServer)
@@ -0,0 +1,97 @@
+"""
+Test that the outgoing queue is bounded: raw commands are refused once their
+share is used up, automatic CTCP replies are shed to make room for what the
+user says, and what the user says is reported as failed once there is no more
+room.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, disconnect, open_im
+from servicetest import EventPattern, assertEquals, call_async
+from constants import *
+import dbus
+
+STATISTICS = CONN + '.Interface.Statistics1'
+
+class HoldingServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.hold_welcome = False
+
+    def sendWelcome(self):
+        # Keep Idle registering, so that everything else it sends waits
+        if not self.hold_welcome:
+            BaseIRCServer.sendWelcome(self)
+
+def send_message(q, chan, text):
+    call_async(q, chan, 'SendMessage', [{}, {'content-type': 'text/plain',
+        'content': text}], 0)
+    return q.expect('dbus-return', method='SendMessage').value[0]
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    im_path = open_im(q, conn, 'bob')
+    im_messages = dbus.Interface(bus.get_object(conn.bus_name, im_path),
+        CHANNEL_IFACE_MESSAGES)
+    irc_cmd = dbus.Interface(conn, CONN + '.Interface.IRCCommand1')
+    sync_stream(q, stream)
+
+    stream.hold_welcome = True
+    stream.transport.loseConnection()
+    q.expect('irc-disconnected')
+    q.expect('irc-connected')
+    q.expect_many(
+        EventPattern('stream-NICK'),
+        EventPattern('stream-USER'))
+
+    # Raw commands may take half the queue, and a quarter for any one target
+    call_async(q, irc_cmd, 'Send', 'BADGER a')
+    q.expect('dbus-return', method='Send')
+    call_async(q, irc_cmd, 'Send', 'BADGER a')
+    q.expect('dbus-error', method='Send', name=SERVICE_BUSY)
+    call_async(q, irc_cmd, 'Send', 'BADGER b')
+    q.expect('dbus-return', method='Send')
+    call_async(q, irc_cmd, 'Send', 'BADGER c')
+    q.expect('dbus-error', method='Send', name=SERVICE_BUSY)
+
+    # This reply fills the queue...
+    stream.sendMessage('PRIVMSG', stream.nick, ':\x01VERSION\x01',
+        prefix='alice')
+    sync_stream(q, stream)
+
+    # ...and makes way for what the user says, until there is no more room
+    send_message(q, im_messages, 'one')
+    send_message(q, im_messages, 'two')
+    token = send_message(q, im_messages, 'three')
+    event = q.expect('dbus-signal', signal='MessageReceived', path=im_path)
+    header = event.args[0][0]
+    assertEquals(MT_DELIVERY_REPORT, header['message-type'])
+    assertEquals(DELIVERY_STATUS_PERMANENTLY_FAILED, header['delivery-status'])
+    assertEquals(token, header['delivery-token'])
+
+    q.forbid_events([
+        EventPattern('stream-NOTICE'),
+        EventPattern('stream-BADGER', data=['c']),
+        EventPattern('stream-PRIVMSG', data=['bob', 'three']),
+        ])
+
+    stream.hold_welcome = False
+    stream.sendWelcome()
+
+    q.expect_many(
+        EventPattern('stream-BADGER', data=['a']),
+        EventPattern('stream-BADGER', data=['b']),
+        EventPattern('stream-PRIVMSG', data=['bob', 'one']),
+        EventPattern('stream-PRIVMSG', data=['bob', 'two']))
+    sync_stream(q, stream)
+
+    assertEquals(4, conn.Properties.Get(STATISTICS, 'DroppedLines'))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=HoldingServer, params={
+        'auto-reconnect': dbus.Boolean(True),
+        'max-queued-messages': dbus.UInt32(4),
+    })
@@ -0,0 +1,97 @@
+"""
+Test that with auto-reconnect on, what the user sends while we are away from
+the server is held, sent once we are back in our channels, and reported as
+failed if we never get back.
+"""
+
+from idletest import exec_test, BaseIRCServer, sync_stream, connect, join_room, open_im
+from servicetest import EventPattern, assertEquals, call_async
+from constants import *
+import dbus
+
+class HoldingServer(BaseIRCServer):
+    def __init__(self, event_func):
+        BaseIRCServer.__init__(self, event_func)
+        self.hold_welcome = False
+        self.refuse = False
+
+    def connectionMade(self):
+        BaseIRCServer.connectionMade(self)
+        if self.refuse:
+            self.transport.loseConnection()
+
+    def sendWelcome(self):
+        # Keep Idle registering, so that anything it is asked to send waits
+        if not self.hold_welcome:
+            BaseIRCServer.sendWelcome(self)
+
+def send_message(q, chan, text):
+    call_async(q, chan, 'SendMessage', [{}, {'content-type': 'text/plain',
+        'content': text}], 0)
+    return q.expect('dbus-return', method='SendMessage').value[0]
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    muc = bus.get_object(conn.bus_name, join_room(q, conn, '#idletest'))
+    muc_messages = dbus.Interface(muc, CHANNEL_IFACE_MESSAGES)
+    subject = dbus.Interface(muc, CHANNEL_IFACE_SUBJECT)
+
+    im_path = open_im(q, conn, 'bob')
+    im_messages = dbus.Interface(bus.get_object(conn.bus_name, im_path),
+        CHANNEL_IFACE_MESSAGES)
+    sync_stream(q, stream)
+
+    held = [EventPattern('stream-PRIVMSG'), EventPattern('stream-TOPIC')]
+    q.forbid_events([EventPattern('dbus-signal', signal='StatusChanged')])
+    q.forbid_events(held)
+
+    stream.hold_welcome = True
+    stream.transport.loseConnection()
+    q.expect('irc-disconnected')
+    q.expect('irc-connected')
+    q.expect_many(
+        EventPattern('stream-NICK'),
+        EventPattern('stream-USER'))
+
+    send_message(q, muc_messages, 'one')
+    send_message(q, muc_messages, 'two')
+    subject.SetSubject('first')
+    subject.SetSubject('second')
+    sync_stream(q, stream)
+
+    q.unforbid_events(held)
+    # the second topic replaces the first before it goes out
+    q.forbid_events([EventPattern('stream-TOPIC', data=['#idletest', 'first'])])
+
+    stream.hold_welcome = False
+    stream.sendWelcome()
+
+    # Back in the channel before anything is said in it, and in order
+    q.expect('stream-JOIN', data=['#idletest'])
+    q.expect('stream-PRIVMSG', data=['#idletest', 'one'])
+    q.expect('stream-PRIVMSG', data=['#idletest', 'two'])
+    q.expect('stream-TOPIC', data=['#idletest', 'second'])
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    # This time the server never comes back
+    stream.refuse = True
+    stream.transport.loseConnection()
+    q.expect('irc-disconnected')
+
+    token = send_message(q, im_messages, 'anyone there?')
+    event = q.expect('dbus-signal', signal='MessageReceived', path=im_path)
+    header = event.args[0][0]
+    assertEquals(MT_DELIVERY_REPORT, header['message-type'])
+    assertEquals(DELIVERY_STATUS_PERMANENTLY_FAILED, header['delivery-status'])
+    assertEquals(token, header['delivery-token'])
+    assertEquals('anyone there?', header['delivery-echo'][1]['content'])
+
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 2])
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=HoldingServer, params={
+        'auto-reconnect': dbus.Boolean(True),
+    })
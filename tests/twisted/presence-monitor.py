@@ -0,0 +1,63 @@
+"""
+Test that contacts' presence is tracked with MONITOR on servers that support
+it, falling back to ISON for contacts that don't fit in the MONITOR list, and
+that only so many contacts are tracked at once.
+"""
+
+from idletest import exec_test, BaseIRCServer, connect, disconnect
+import constants as cs
+
+class MonitorServer(BaseIRCServer):
+    def sendWelcome(self):
+        BaseIRCServer.sendWelcome(self)
+        self.sendMessage('005', self.nick, 'MONITOR=1',
+            ':are supported by this server', prefix='idle.test.server')
+
+    def handleMONITOR(self, args, prefix):
+        if args[0] == '-':
+            return
+        assert args[0] == '+'
+        for nick in args[1].split(','):
+            self.sendMessage('730', self.nick,
+                ':%s!%s@idle.test.client' % (nick, nick),
+                prefix='idle.test.server')
+
+    def handleISON(self, args, prefix):
+        self.sendMessage('303', self.nick, ':', prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    alice, bob = conn.get_contact_handles_sync(['alice', 'bob'])
+
+    conn.SimplePresence.GetPresences([alice, bob])
+
+    # Only one contact fits in the server's MONITOR list
+    q.expect('stream-MONITOR', data=['+', 'alice'])
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{alice: (cs.PRESENCE_AVAILABLE, 'available', '')}])
+
+    # The other one gets polled
+    q.expect('stream-ISON', data=['bob'])
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{bob: (cs.PRESENCE_OFFLINE, 'offline', '')}])
+
+    # The server tells us when a monitored contact goes away
+    stream.sendMessage('731', stream.nick, ':alice', prefix='idle.test.server')
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{alice: (cs.PRESENCE_OFFLINE, 'offline', '')}])
+
+    # Asking about 499 more contacts stops us tracking alice, who was asked
+    # about least recently, and frees her MONITOR slot
+    others = conn.get_contact_handles_sync(['c%d' % i for i in range(499)])
+    conn.SimplePresence.GetPresences(others)
+    q.expect('stream-MONITOR', data=['-', 'alice'])
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{alice: (cs.PRESENCE_UNKNOWN, 'unknown', '')}])
+    q.expect('stream-MONITOR', data=['+', 'c0'])
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=MonitorServer)
@@ -0,0 +1,67 @@
+"""
+Test that contacts' presence is tracked by polling with ISON on servers that
+don't support MONITOR, and that we can set our own presence.
+"""
+
+from idletest import exec_test, BaseIRCServer, connect, disconnect
+from servicetest import EventPattern, assertEquals, call_async
+import constants as cs
+
+class IsonServer(BaseIRCServer):
+    online = ['alice']
+
+    def handleISON(self, args, prefix):
+        self.sendMessage('303', self.nick,
+            ':%s' % ' '.join([n for n in args if n in self.online]),
+            prefix='idle.test.server')
+
+def test(q, bus, conn, stream):
+    connect(q, conn)
+
+    alice, bob = conn.get_contact_handles_sync(['alice', 'bob'])
+
+    # Nothing is known until somebody asks
+    presences = conn.SimplePresence.GetPresences([alice, bob])
+    assertEquals(cs.PRESENCE_UNKNOWN, presences[alice][0])
+    assertEquals(cs.PRESENCE_UNKNOWN, presences[bob][0])
+
+    # Both contacts are polled with a single line
+    q.expect('stream-ISON', data=['alice', 'bob'])
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{alice: (cs.PRESENCE_AVAILABLE, 'available', '')}])
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{bob: (cs.PRESENCE_OFFLINE, 'offline', '')}])
+
+    attrs = conn.Contacts.GetContactAttributes([alice, bob],
+        [cs.CONN_IFACE_SIMPLE_PRESENCE], False)
+    assertEquals((cs.PRESENCE_AVAILABLE, 'available', ''),
+        attrs[alice][cs.ATTR_PRESENCE])
+    assertEquals((cs.PRESENCE_OFFLINE, 'offline', ''),
+        attrs[bob][cs.ATTR_PRESENCE])
+
+    # away-notify tells us about away messages between polls
+    stream.sendMessage('AWAY', ':gone fishing', prefix='alice')
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{alice: (cs.PRESENCE_AWAY, 'away', 'gone fishing')}])
+
+    # Bob turns up, and the next round of polling notices
+    stream.online.append('bob')
+    q.expect('dbus-signal', signal='PresencesChanged',
+        args=[{bob: (cs.PRESENCE_AVAILABLE, 'available', '')}])
+
+    # Setting our own presence sends AWAY
+    call_async(q, conn.SimplePresence, 'SetPresence', 'away', 'lunch')
+    q.expect_many(
+            EventPattern('stream-AWAY', data=['lunch']),
+            EventPattern('dbus-return', method='SetPresence'))
+
+    call_async(q, conn.SimplePresence, 'SetPresence', 'available', '')
+    q.expect_many(
+            EventPattern('stream-AWAY', data=[]),
+            EventPattern('dbus-return', method='SetPresence'))
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, protocol=IsonServer)
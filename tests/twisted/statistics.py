@@ -0,0 +1,77 @@
+"""
+Test the Statistics1 connection interface.
+"""
+
+from idletest import exec_test, sync_stream, disconnect
+from servicetest import EventPattern, assertEquals, assertContains
+import constants as cs
+import dbus
+
+STATISTICS = cs.CONN + '.Interface.Statistics1'
+
+def histogram_total(histogram):
+    return sum([count for (bound, count) in histogram])
+
+def test(q, bus, conn, stream):
+    # Nothing is emitted until asked for
+    changes = [EventPattern('dbus-signal', signal='StatisticsChanged')]
+    q.forbid_events(changes)
+
+    conn.Connect()
+    q.expect('dbus-signal', signal='StatusChanged',
+        args=[cs.CONN_STATUS_CONNECTED, cs.CSR_REQUESTED])
+
+    assertContains(STATISTICS, conn.Properties.Get(cs.CONN, 'Interfaces'))
+
+    sync_stream(q, stream)
+    stats = conn.Properties.GetAll(STATISTICS)
+    assert stats['BytesReceived'] > 0, stats
+    assert stats['BytesSent'] > 0, stats
+    # at least the welcome and sync_stream()'s PING, and our NICK and USER
+    assert stats['LinesReceived'] >= 2, stats
+    assert stats['LinesSent'] >= 2, stats
+    assertEquals(stats['LinesSent'], histogram_total(stats['QueueDelayHistogram']))
+    assertEquals(0, stats['Reconnects'])
+    assertEquals(0, stats['Lag'])
+    assertEquals(0, histogram_total(stats['LagHistogram']))
+    assertEquals(0, stats['SmoothedLag'])
+    assertEquals({}, stats['LagPercentiles'])
+    assertEquals(0xFFFFFFFF, stats['LagHistogram'][-1][0])
+
+    # Answering a keepalive measures the lag
+    e = q.expect('stream-PING')
+    stream.sendMessage('PONG', 'idle.test.server', ':%s' % e.data[0],
+        prefix='idle.test.server')
+    sync_stream(q, stream)
+    stats = conn.Properties.GetAll(STATISTICS)
+    assertEquals(1, histogram_total(stats['LagHistogram']))
+    assertEquals(stats['Lag'], stats['SmoothedLag'])
+    assertEquals([50, 90, 99], sorted(stats['LagPercentiles'].keys()))
+    assertEquals(set([stats['Lag']]), set(stats['LagPercentiles'].values()))
+
+    # By now a keepalive interval has gone by, and nothing was emitted; once
+    # asked for, changes are
+    q.unforbid_events(changes)
+    conn.Properties.Set(STATISTICS, 'UpdateInterval', dbus.UInt32(1))
+    assertEquals(1, conn.Properties.Get(STATISTICS, 'UpdateInterval'))
+    e = q.expect('dbus-signal', signal='StatisticsChanged')
+    changed = e.args[0]
+    assert changed['LinesReceived'] >= stats['LinesReceived'], changed
+    assert 'UpdateInterval' not in changed, changed
+
+    # and then they stop again
+    conn.Properties.Set(STATISTICS, 'UpdateInterval', dbus.UInt32(0))
+    q.forbid_events(changes)
+    e = q.expect('stream-PING')
+    stream.sendMessage('PONG', 'idle.test.server', ':%s' % e.data[0],
+        prefix='idle.test.server')
+    sync_stream(q, stream)
+    q.unforbid_events(changes)
+
+    disconnect(q, conn)
+    return True
+
+if __name__ == '__main__':
+    exec_test(test, params={
+        'keepalive-interval': dbus.UInt32(1),
+    })